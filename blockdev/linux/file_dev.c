@@ -28,24 +28,77 @@
 
 #define _LARGEFILE64_SOURCE
 #define _FILE_OFFSET_BITS 64
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
 
 #include <ext4_config.h>
 #include <ext4_blockdev.h>
 #include <ext4_errno.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdbool.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "file_dev.h"
+
+#if defined(_WIN32)
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+#if defined(__linux__)
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <linux/fs.h>
+#include <linux/falloc.h>
+#endif
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
 
-/**@brief   Default filename.*/
-static const char *fname = "ext2";
+#ifndef O_DIRECT
+#define O_DIRECT 0
+#endif
 
-/**@brief   Image block size.*/
+/**@brief   Default image block size.*/
 #define EXT4_FILEDEV_BSIZE 512
 
-/**@brief   Image file descriptor.*/
-static FILE *dev_file;
+/**@brief   Memory alignment of O_DIRECT transfers.*/
+#define EXT4_FILEDEV_ALIGN 4096
+
+/**@brief   Bounce buffer size of O_DIRECT transfers.*/
+#define EXT4_FILEDEV_BOUNCE (64 * 1024)
+
+/**@brief   Segments passed to a single preadv/pwritev call.*/
+#define EXT4_FILEDEV_IOV_MAX 64
 
-#define DROP_LINUXCACHE_BUFFERS 0
+/**@brief   File block device instance.*/
+struct file_dev {
+	struct ext4_blockdev bdev;
+	struct ext4_blockdev_iface bdif;
+
+	/**@brief   Image file name*/
+	const char *name;
+
+	/**@brief   FILE_DEV_* flags*/
+	uint32_t flags;
+
+	/**@brief   Image file descriptor*/
+	int fd;
+
+	/**@brief   Buffer alignment required for transfers (1 - none)*/
+	uint32_t align;
+
+	/**@brief   Block device node (not an image file)*/
+	bool blkdev;
+};
 
 /**********************BLOCKDEV INTERFACE**************************************/
 static int file_dev_open(struct ext4_blockdev *bdev);
@@ -54,89 +107,397 @@ static int file_dev_bread(struct ext4_blockdev *bdev, void *buf, uint64_t blk_id
 static int file_dev_bwrite(struct ext4_blockdev *bdev, const void *buf,
 			  uint64_t blk_id, uint32_t blk_cnt);
 static int file_dev_close(struct ext4_blockdev *bdev);
+static int file_dev_flush(struct ext4_blockdev *bdev);
+#if defined(__linux__)
+static int file_dev_breadv(struct ext4_blockdev *bdev,
+			   const struct ext4_blockdev_iovec *iov,
+			   uint32_t iov_cnt);
+static int file_dev_bwritev(struct ext4_blockdev *bdev,
+			    const struct ext4_blockdev_iovec *iov,
+			    uint32_t iov_cnt);
+static int file_dev_discard(struct ext4_blockdev *bdev, uint64_t blk_id,
+			    uint64_t blk_cnt);
+#endif
+
+/**@brief   Default instance (file_dev_get).*/
+static struct file_dev file_dev = {
+	.name = "ext2",
+	.fd = -1,
+};
 
 /******************************************************************************/
-EXT4_BLOCKDEV_STATIC_INSTANCE(file_dev, EXT4_FILEDEV_BSIZE, 0, file_dev_open,
-		file_dev_bread, file_dev_bwrite, file_dev_close, 0, 0);
+static void file_dev_setup(struct file_dev *f)
+{
+	f->bdev.bdif = &f->bdif;
+	f->bdif.open = file_dev_open;
+	f->bdif.bread = file_dev_bread;
+	f->bdif.bwrite = file_dev_bwrite;
+	f->bdif.close = file_dev_close;
+	f->bdif.flush = file_dev_flush;
+#if defined(__linux__)
+	f->bdif.breadv = file_dev_breadv;
+	f->bdif.bwritev = file_dev_bwritev;
+	f->bdif.discard = file_dev_discard;
+#endif
+#if !defined(_WIN32)
+	/* pread/preadv do not share a file position. */
+	f->bdif.flags = EXT4_BDIF_LOCKLESS_READ;
+#endif
+	f->bdif.ph_bsize = EXT4_FILEDEV_BSIZE;
+	f->bdif.p_user = f;
+}
+
+static void *file_dev_balloc(size_t size, size_t align)
+{
+#if defined(_WIN32)
+	(void)align;
+	return malloc(size);
+#else
+	void *p;
+	return posix_memalign(&p, align, size) ? NULL : p;
+#endif
+}
+
+#if defined(_WIN32)
+static ssize_t file_dev_pio(int fd, void *buf, size_t len, off_t off,
+			    bool write)
+{
+	if (_lseeki64(fd, off, SEEK_SET) < 0)
+		return -1;
+	return write ? _write(fd, buf, len) : _read(fd, buf, len);
+}
+#else
+static ssize_t file_dev_pio(int fd, void *buf, size_t len, off_t off,
+			    bool write)
+{
+	return write ? pwrite(fd, buf, len, off) : pread(fd, buf, len, off);
+}
+#endif
+
+/**@brief   Logical sector size of the image.*/
+static uint32_t file_dev_sector_size(struct file_dev *f, const struct stat *st)
+{
+#if defined(__linux__)
+	int ssz;
+	if (S_ISBLK(st->st_mode) && !ioctl(f->fd, BLKSSZGET, &ssz) &&
+	    ssz >= EXT4_FILEDEV_BSIZE)
+		return ssz;
+
+#if defined(STATX_DIOALIGN)
+	struct statx stx;
+	if ((f->flags & FILE_DEV_DIRECT) &&
+	    !statx(f->fd, "", AT_EMPTY_PATH, STATX_DIOALIGN, &stx) &&
+	    (stx.stx_mask & STATX_DIOALIGN) &&
+	    stx.stx_dio_offset_align > EXT4_FILEDEV_BSIZE)
+		return stx.stx_dio_offset_align;
+#endif
+#endif
+	(void)f;
+	(void)st;
+	return EXT4_FILEDEV_BSIZE;
+}
 
 /******************************************************************************/
 static int file_dev_open(struct ext4_blockdev *bdev)
 {
-	dev_file = fopen(fname, "r+b");
+	struct file_dev *f = bdev->bdif->p_user;
+	int oflags = O_RDWR | O_BINARY;
+	struct stat st;
+	uint32_t bsize;
+	off_t size;
+
+	if (f->flags & FILE_DEV_DIRECT) {
+		if (!O_DIRECT)
+			return ENOTSUP;
+		oflags |= O_DIRECT;
+	}
 
-	if (!dev_file)
+	f->fd = open(f->name, oflags);
+	if (f->fd < 0)
 		return EIO;
 
-	/*No buffering at file.*/
-	setbuf(dev_file, 0);
+	if (fstat(f->fd, &st))
+		goto fail;
 
-	if (fseeko(dev_file, 0, SEEK_END))
-		return EFAULT;
+	f->blkdev = S_ISBLK(st.st_mode);
 
-	file_dev.part_offset = 0;
-	file_dev.part_size = ftello(dev_file);
-	file_dev.bdif->ph_bcnt = file_dev.part_size / file_dev.bdif->ph_bsize;
+	size = lseek(f->fd, 0, SEEK_END);
+	if (size < 0)
+		goto fail;
 
+	bsize = file_dev_sector_size(f, &st);
+	f->align = (f->flags & FILE_DEV_DIRECT) ? EXT4_FILEDEV_ALIGN : 1;
+	if (f->align < bsize)
+		f->align = bsize;
+
+	f->bdif.ph_bbuf = file_dev_balloc(bsize, f->align);
+	if (!f->bdif.ph_bbuf)
+		goto fail;
+
+	f->bdif.ph_bsize = bsize;
+	f->bdif.ph_bcnt = size / bsize;
+	f->bdev.part_offset = 0;
+	f->bdev.part_size = size;
 	return EOK;
+
+fail:
+	close(f->fd);
+	f->fd = -1;
+	return EFAULT;
 }
 
 /******************************************************************************/
+/**@brief   Transfer len bytes at off, restarted after short transfers.*/
+static int file_dev_io(struct file_dev *f, uint8_t *buf, size_t len,
+		       off_t off, bool write)
+{
+	while (len) {
+		ssize_t r = file_dev_pio(f->fd, buf, len, off, write);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return EIO;
+
+		buf += r;
+		len -= r;
+		off += r;
+	}
+	return EOK;
+}
+
+/**@brief   Transfer through an aligned bounce buffer when the caller
+ *          buffer does not meet O_DIRECT alignment.*/
+static int file_dev_rw(struct file_dev *f, uint8_t *buf, size_t len,
+		       off_t off, bool write)
+{
+	uint8_t *bounce;
+	size_t chunk;
+	int r = EOK;
+
+	if (!((uintptr_t)buf & (f->align - 1)))
+		return file_dev_io(f, buf, len, off, write);
+
+	chunk = len < EXT4_FILEDEV_BOUNCE ? len : EXT4_FILEDEV_BOUNCE;
+	bounce = file_dev_balloc(chunk, f->align);
+	if (!bounce)
+		return ENOMEM;
+
+	while (len && r == EOK) {
+		size_t n = len < chunk ? len : chunk;
+		if (write)
+			memcpy(bounce, buf, n);
+
+		r = file_dev_io(f, bounce, n, off, write);
+		if (r == EOK && !write)
+			memcpy(buf, bounce, n);
+
+		buf += n;
+		off += n;
+		len -= n;
+	}
+
+	free(bounce);
+	return r;
+}
 
 static int file_dev_bread(struct ext4_blockdev *bdev, void *buf, uint64_t blk_id,
 			 uint32_t blk_cnt)
 {
-	if (fseeko(dev_file, blk_id * bdev->bdif->ph_bsize, SEEK_SET))
-		return EIO;
-	if (!blk_cnt)
-		return EOK;
-	if (!fread(buf, bdev->bdif->ph_bsize * blk_cnt, 1, dev_file))
-		return EIO;
+	struct file_dev *f = bdev->bdif->p_user;
+	uint32_t bsize = bdev->bdif->ph_bsize;
+
+	return file_dev_rw(f, buf, (size_t)blk_cnt * bsize,
+			   (off_t)(blk_id * bsize), false);
+}
+
+/******************************************************************************/
+static int file_dev_bwrite(struct ext4_blockdev *bdev, const void *buf,
+			  uint64_t blk_id, uint32_t blk_cnt)
+{
+	struct file_dev *f = bdev->bdif->p_user;
+	uint32_t bsize = bdev->bdif->ph_bsize;
+
+	return file_dev_rw(f, (uint8_t *)buf, (size_t)blk_cnt * bsize,
+			   (off_t)(blk_id * bsize), true);
+}
+
+#if defined(__linux__)
+/******************************************************************************/
+/**@brief   Transfer segments, adjacent ones in a single system call.*/
+static int file_dev_xferv(struct ext4_blockdev *bdev,
+			  const struct ext4_blockdev_iovec *iov,
+			  uint32_t iov_cnt, bool write)
+{
+	struct file_dev *f = bdev->bdif->p_user;
+	struct iovec vec[EXT4_FILEDEV_IOV_MAX];
+	uint32_t bsize = bdev->bdif->ph_bsize;
+	uint32_t i = 0;
+
+	while (i < iov_cnt) {
+		uint64_t blk_id = iov[i].blk_id;
+		bool aligned = true;
+		size_t len = 0;
+		int n = 0;
+
+		/* Gather segments which continue each other on the disk.*/
+		do {
+			vec[n].iov_base = iov[i].buf;
+			vec[n].iov_len = (size_t)iov[i].blk_cnt * bsize;
+			if ((uintptr_t)iov[i].buf & (f->align - 1))
+				aligned = false;
+			len += vec[n].iov_len;
+			blk_id += iov[i].blk_cnt;
+			n++;
+			i++;
+		} while (i < iov_cnt && n < EXT4_FILEDEV_IOV_MAX &&
+			 iov[i].blk_id == blk_id);
+
+		off_t off = (off_t)(blk_id * bsize - len);
+
+		/* O_DIRECT: unaligned buffers go one by one via bounce.*/
+		if (!aligned) {
+			for (int k = 0; k < n; k++) {
+				int r = file_dev_rw(f, vec[k].iov_base,
+						    vec[k].iov_len, off, write);
+				if (r != EOK)
+					return r;
+				off += vec[k].iov_len;
+			}
+			continue;
+		}
+
+		struct iovec *v = vec;
+		while (len) {
+			ssize_t r = write ? pwritev(f->fd, v, n, off) :
+					    preadv(f->fd, v, n, off);
+			if (r < 0 && errno == EINTR)
+				continue;
+			if (r <= 0)
+				return EIO;
+
+			/* Short transfer: skip what is done and go on.*/
+			len -= r;
+			off += r;
+			while (n && (size_t)r >= v->iov_len) {
+				r -= v->iov_len;
+				v++;
+				n--;
+			}
+			if (n) {
+				v->iov_base = (char *)v->iov_base + r;
+				v->iov_len -= r;
+			}
+		}
+	}
 
 	return EOK;
 }
 
-static void drop_cache(void)
+static int file_dev_breadv(struct ext4_blockdev *bdev,
+			   const struct ext4_blockdev_iovec *iov,
+			   uint32_t iov_cnt)
 {
-#if defined(__linux__) && DROP_LINUXCACHE_BUFFERS
-	int fd;
-	char *data = "3";
+	return file_dev_xferv(bdev, iov, iov_cnt, false);
+}
 
-	sync();
-	fd = open("/proc/sys/vm/drop_caches", O_WRONLY);
-	write(fd, data, sizeof(char));
-	close(fd);
-#endif
+static int file_dev_bwritev(struct ext4_blockdev *bdev,
+			    const struct ext4_blockdev_iovec *iov,
+			    uint32_t iov_cnt)
+{
+	return file_dev_xferv(bdev, iov, iov_cnt, true);
 }
 
 /******************************************************************************/
-static int file_dev_bwrite(struct ext4_blockdev *bdev, const void *buf,
-			  uint64_t blk_id, uint32_t blk_cnt)
+static int file_dev_discard(struct ext4_blockdev *bdev, uint64_t blk_id,
+			    uint64_t blk_cnt)
 {
-	if (fseeko(dev_file, blk_id * bdev->bdif->ph_bsize, SEEK_SET))
-		return EIO;
-	if (!blk_cnt)
-		return EOK;
-	if (!fwrite(buf, bdev->bdif->ph_bsize * blk_cnt, 1, dev_file))
-		return EIO;
+	struct file_dev *f = bdev->bdif->p_user;
+	uint64_t range[2] = {blk_id * bdev->bdif->ph_bsize,
+			     blk_cnt * bdev->bdif->ph_bsize};
+	int r;
+
+	/*Block device: pass the range to the drive (TRIM/UNMAP), image file:
+	 * punch a hole, so the image gets sparse again.*/
+	if (f->blkdev)
+		r = ioctl(f->fd, BLKDISCARD, range);
+	else
+		r = fallocate(f->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+			      range[0], range[1]);
+	if (r < 0)
+		return (errno == EOPNOTSUPP || errno == ENOTTY) ? ENOTSUP : EIO;
 
-	drop_cache();
 	return EOK;
 }
+#endif
+
+/******************************************************************************/
+static int file_dev_flush(struct ext4_blockdev *bdev)
+{
+	struct file_dev *f = bdev->bdif->p_user;
+
+#if defined(_WIN32)
+	return _commit(f->fd) ? EIO : EOK;
+#elif defined(__linux__)
+	return fdatasync(f->fd) ? EIO : EOK;
+#else
+	return fsync(f->fd) ? EIO : EOK;
+#endif
+}
+
 /******************************************************************************/
 static int file_dev_close(struct ext4_blockdev *bdev)
 {
-	fclose(dev_file);
+	struct file_dev *f = bdev->bdif->p_user;
+
+	close(f->fd);
+	f->fd = -1;
+	free(f->bdif.ph_bbuf);
+	f->bdif.ph_bbuf = NULL;
 	return EOK;
 }
 
 /******************************************************************************/
 struct ext4_blockdev *file_dev_get(void)
 {
-	return &file_dev;
+	if (file_dev.fd < 0)
+		file_dev_setup(&file_dev);
+	return &file_dev.bdev;
 }
 /******************************************************************************/
 void file_dev_name_set(const char *n)
 {
-	fname = n;
+	file_dev.name = n;
+}
+/******************************************************************************/
+void file_dev_flags_set(uint32_t flags)
+{
+	file_dev.flags = flags;
+}
+/******************************************************************************/
+struct ext4_blockdev *file_dev_create(const char *name, uint32_t flags)
+{
+	size_t len = strlen(name) + 1;
+	struct file_dev *f = calloc(1, sizeof(struct file_dev) + len);
+	if (!f)
+		return NULL;
+
+	memcpy(f + 1, name, len);
+	f->name = (const char *)(f + 1);
+	f->flags = flags;
+	f->fd = -1;
+	file_dev_setup(f);
+	return &f->bdev;
+}
+/******************************************************************************/
+void file_dev_destroy(struct ext4_blockdev *bdev)
+{
+	struct file_dev *f = bdev->bdif->p_user;
+
+	if (f == &file_dev)
+		return;
+
+	if (f->fd >= 0)
+		file_dev_close(bdev);
+	free(f);
 }
 /******************************************************************************/
@@ -34,10 +34,27 @@
 #include <stdint.h>
 #include <stdbool.h>
 
-/**@brief   File blockdev get.*/
+/**@brief   Open the image with O_DIRECT (bypass the host page cache).
+ *          Unaligned buffers are transferred through bounce buffers.*/
+#define FILE_DEV_DIRECT (1 << 0)
+
+/**@brief   File blockdev get (default instance).*/
 struct ext4_blockdev *file_dev_get(void);
 
-/**@brief   Set filename to open.*/
+/**@brief   Set filename to open (default instance).*/
 void file_dev_name_set(const char *n);
 
+/**@brief   Set FILE_DEV_* flags (default instance).*/
+void file_dev_flags_set(uint32_t flags);
+
+/**@brief   Create a file blockdev instance. Physical block size is the
+ *          logical sector size of the image, known after open.
+ * @param   name image file name (copied)
+ * @param   flags FILE_DEV_* flags
+ * @return  block device, NULL when out of memory*/
+struct ext4_blockdev *file_dev_create(const char *name, uint32_t flags);
+
+/**@brief   Destroy a file blockdev instance made by file_dev_create.*/
+void file_dev_destroy(struct ext4_blockdev *bdev);
+
 #endif /* FILE_DEV_H_ */
@@ -0,0 +1,340 @@
+/*
+ * Copyright (c) 2013 Grzegorz Kostka (kostka.grzegorz@gmail.com)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * - Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * - The name of the author may not be used to endorse or promote products
+ *   derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _LARGEFILE64_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <ext4_config.h>
+#include <ext4_blockdev.h>
+#include <ext4_errno.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "mmap_dev.h"
+
+#if !defined(_WIN32)
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/**@brief   Image block size.*/
+#define EXT4_MMAPDEV_BSIZE 512
+
+/**@brief   Sequential reads in a row which enable read-ahead.*/
+#define EXT4_MMAPDEV_SEQ_MIN 2
+
+/**@brief   Read-ahead window (bytes).*/
+#define EXT4_MMAPDEV_RA_WINDOW (1024 * 1024)
+
+/**@brief   Memory mapped block device instance.*/
+struct mmap_dev {
+	struct ext4_blockdev bdev;
+	struct ext4_blockdev_iface bdif;
+
+	/**@brief   Image file name*/
+	const char *name;
+
+	/**@brief   MMAP_DEV_* flags*/
+	uint32_t flags;
+
+	/**@brief   Image file descriptor*/
+	int fd;
+
+	/**@brief   Image mapping*/
+	uint8_t *map;
+
+	/**@brief   Mapping size*/
+	size_t size;
+
+	/**@brief   Host page size*/
+	size_t page;
+
+	/**@brief   End of the last read*/
+	uint64_t next_off;
+
+	/**@brief   Sequential reads in a row*/
+	uint32_t seq_cnt;
+
+	/**@brief   End of the range advised for read-ahead*/
+	uint64_t ra_end;
+};
+
+/**********************BLOCKDEV INTERFACE**************************************/
+static int mmap_dev_open(struct ext4_blockdev *bdev);
+static int mmap_dev_bread(struct ext4_blockdev *bdev, void *buf,
+			  uint64_t blk_id, uint32_t blk_cnt);
+static int mmap_dev_bwrite(struct ext4_blockdev *bdev, const void *buf,
+			   uint64_t blk_id, uint32_t blk_cnt);
+static int mmap_dev_close(struct ext4_blockdev *bdev);
+static int mmap_dev_flush(struct ext4_blockdev *bdev);
+static int mmap_dev_breadv(struct ext4_blockdev *bdev,
+			   const struct ext4_blockdev_iovec *iov,
+			   uint32_t iov_cnt);
+static int mmap_dev_bwritev(struct ext4_blockdev *bdev,
+			    const struct ext4_blockdev_iovec *iov,
+			    uint32_t iov_cnt);
+
+/******************************************************************************/
+static int mmap_dev_open(struct ext4_blockdev *bdev)
+{
+	struct mmap_dev *m = bdev->bdif->p_user;
+	bool rdonly = m->flags & MMAP_DEV_RDONLY;
+	struct stat st;
+
+	m->fd = open(m->name, rdonly ? O_RDONLY : O_RDWR);
+	if (m->fd < 0)
+		return EIO;
+
+	if (fstat(m->fd, &st) || st.st_size <= 0 ||
+	    (uint64_t)st.st_size > SIZE_MAX)
+		goto fail;
+
+	m->size = st.st_size;
+	m->map = mmap(NULL, m->size,
+		      rdonly ? PROT_READ : PROT_READ | PROT_WRITE,
+		      MAP_SHARED, m->fd, 0);
+	if (m->map == MAP_FAILED) {
+		m->map = NULL;
+		goto fail;
+	}
+
+	/* Metadata lookups dominate until reads turn sequential. */
+#ifdef MADV_RANDOM
+	madvise(m->map, m->size, MADV_RANDOM);
+#endif
+	m->page = sysconf(_SC_PAGESIZE);
+	m->next_off = 0;
+	m->seq_cnt = 0;
+	m->ra_end = 0;
+
+	m->bdif.ph_bcnt = m->size / m->bdif.ph_bsize;
+	m->bdev.part_offset = 0;
+	m->bdev.part_size = m->size;
+	return EOK;
+
+fail:
+	close(m->fd);
+	m->fd = -1;
+	return EFAULT;
+}
+
+/**@brief   Range lies inside the mapping.*/
+static bool mmap_dev_range_ok(struct mmap_dev *m, uint64_t off, size_t len)
+{
+	return off <= m->size && len <= m->size - off;
+}
+
+/**@brief   Track the read pattern, advise read-ahead for sequential
+ *          reads.*/
+static void mmap_dev_read_hint(struct mmap_dev *m, uint64_t off, size_t len)
+{
+	uint64_t end = off + len;
+
+	m->seq_cnt = off == m->next_off ? m->seq_cnt + 1 : 0;
+	m->next_off = end;
+
+#ifdef MADV_WILLNEED
+	/* Keep the advised range a half window ahead of the reader. */
+	if (m->seq_cnt < EXT4_MMAPDEV_SEQ_MIN ||
+	    end + EXT4_MMAPDEV_RA_WINDOW / 2 < m->ra_end)
+		return;
+
+	uint64_t from = end > m->ra_end ? end : m->ra_end;
+	uint64_t to = from + EXT4_MMAPDEV_RA_WINDOW;
+
+	from &= ~(uint64_t)(m->page - 1);
+	if (to > m->size)
+		to = m->size;
+	if (from >= to)
+		return;
+
+	madvise(m->map + from, to - from, MADV_WILLNEED);
+	m->ra_end = to;
+#endif
+}
+
+/**@brief   Schedule write-back of a written range.*/
+static void mmap_dev_write_hint(struct mmap_dev *m, uint64_t off, size_t len)
+{
+	uint64_t from = off & ~(uint64_t)(m->page - 1);
+	msync(m->map + from, off + len - from, MS_ASYNC);
+}
+
+/******************************************************************************/
+static int mmap_dev_bread(struct ext4_blockdev *bdev, void *buf,
+			  uint64_t blk_id, uint32_t blk_cnt)
+{
+	struct mmap_dev *m = bdev->bdif->p_user;
+	uint64_t off = blk_id * bdev->bdif->ph_bsize;
+	size_t len = (size_t)blk_cnt * bdev->bdif->ph_bsize;
+
+	if (!mmap_dev_range_ok(m, off, len))
+		return EIO;
+
+	mmap_dev_read_hint(m, off, len);
+	memcpy(buf, m->map + off, len);
+	return EOK;
+}
+
+/******************************************************************************/
+static int mmap_dev_bwrite(struct ext4_blockdev *bdev, const void *buf,
+			   uint64_t blk_id, uint32_t blk_cnt)
+{
+	struct mmap_dev *m = bdev->bdif->p_user;
+	uint64_t off = blk_id * bdev->bdif->ph_bsize;
+	size_t len = (size_t)blk_cnt * bdev->bdif->ph_bsize;
+
+	if (m->flags & MMAP_DEV_RDONLY)
+		return EROFS;
+	if (!mmap_dev_range_ok(m, off, len))
+		return EIO;
+
+	memcpy(m->map + off, buf, len);
+	mmap_dev_write_hint(m, off, len);
+	return EOK;
+}
+
+/******************************************************************************/
+static int mmap_dev_breadv(struct ext4_blockdev *bdev,
+			   const struct ext4_blockdev_iovec *iov,
+			   uint32_t iov_cnt)
+{
+	for (uint32_t i = 0; i < iov_cnt; i++) {
+		int r = mmap_dev_bread(bdev, iov[i].buf, iov[i].blk_id,
+				       iov[i].blk_cnt);
+		if (r != EOK)
+			return r;
+	}
+	return EOK;
+}
+
+/******************************************************************************/
+static int mmap_dev_bwritev(struct ext4_blockdev *bdev,
+			    const struct ext4_blockdev_iovec *iov,
+			    uint32_t iov_cnt)
+{
+	for (uint32_t i = 0; i < iov_cnt; i++) {
+		int r = mmap_dev_bwrite(bdev, iov[i].buf, iov[i].blk_id,
+					iov[i].blk_cnt);
+		if (r != EOK)
+			return r;
+	}
+	return EOK;
+}
+
+/******************************************************************************/
+static int mmap_dev_flush(struct ext4_blockdev *bdev)
+{
+	struct mmap_dev *m = bdev->bdif->p_user;
+
+	if (m->flags & MMAP_DEV_RDONLY)
+		return EOK;
+
+	return msync(m->map, m->size, MS_SYNC) ? EIO : EOK;
+}
+
+/******************************************************************************/
+static int mmap_dev_close(struct ext4_blockdev *bdev)
+{
+	struct mmap_dev *m = bdev->bdif->p_user;
+	int r = EOK;
+
+	if (!(m->flags & MMAP_DEV_RDONLY) && msync(m->map, m->size, MS_SYNC))
+		r = EIO;
+
+	munmap(m->map, m->size);
+	m->map = NULL;
+	close(m->fd);
+	m->fd = -1;
+	return r;
+}
+
+/******************************************************************************/
+struct ext4_blockdev *mmap_dev_create(const char *name, uint32_t flags)
+{
+	size_t len = strlen(name) + 1;
+	struct mmap_dev *m = calloc(1, sizeof(struct mmap_dev) + len);
+	if (!m)
+		return NULL;
+
+	m->bdif.ph_bbuf = malloc(EXT4_MMAPDEV_BSIZE);
+	if (!m->bdif.ph_bbuf) {
+		free(m);
+		return NULL;
+	}
+
+	memcpy(m + 1, name, len);
+	m->name = (const char *)(m + 1);
+	m->flags = flags;
+	m->fd = -1;
+
+	m->bdev.bdif = &m->bdif;
+	m->bdif.open = mmap_dev_open;
+	m->bdif.bread = mmap_dev_bread;
+	m->bdif.bwrite = mmap_dev_bwrite;
+	m->bdif.close = mmap_dev_close;
+	m->bdif.flush = mmap_dev_flush;
+	m->bdif.breadv = mmap_dev_breadv;
+	m->bdif.bwritev = mmap_dev_bwritev;
+	/* Read pattern tracking is a hint only, racing readers are fine. */
+	m->bdif.flags = EXT4_BDIF_LOCKLESS_READ;
+	m->bdif.ph_bsize = EXT4_MMAPDEV_BSIZE;
+	m->bdif.p_user = m;
+	return &m->bdev;
+}
+
+/******************************************************************************/
+void mmap_dev_destroy(struct ext4_blockdev *bdev)
+{
+	struct mmap_dev *m = bdev->bdif->p_user;
+
+	if (m->fd >= 0)
+		mmap_dev_close(bdev);
+	free(m->bdif.ph_bbuf);
+	free(m);
+}
+/******************************************************************************/
+
+#else
+
+struct ext4_blockdev *mmap_dev_create(const char *name, uint32_t flags)
+{
+	(void)name;
+	(void)flags;
+	return NULL;
+}
+
+void mmap_dev_destroy(struct ext4_blockdev *bdev)
+{
+	(void)bdev;
+}
+
+#endif
@@ -0,0 +1,484 @@
+/*
+ * Copyright (c) 2013 Grzegorz Kostka (kostka.grzegorz@gmail.com)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * - Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * - The name of the author may not be used to endorse or promote products
+ *   derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _LARGEFILE64_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <ext4_config.h>
+#include <ext4_blockdev.h>
+#include <ext4_errno.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "ram_dev.h"
+
+#if !defined(_WIN32)
+
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/**@brief   Device block size.*/
+#define EXT4_RAMDEV_BSIZE 512
+
+/**@brief   Snapshot/restore chunk: all-zero chunks stay holes.*/
+#define EXT4_RAMDEV_CHUNK (64 * 1024)
+
+/**@brief   RAM block device instance.*/
+struct ram_dev {
+	struct ext4_blockdev bdev;
+	struct ext4_blockdev_iface bdif;
+
+	/**@brief   Device memory (anonymous mapping)*/
+	uint8_t *map;
+
+	/**@brief   Device size*/
+	size_t size;
+
+	/**@brief   Host page size*/
+	size_t page;
+
+	/**@brief   Device is open*/
+	bool open;
+
+	/**@brief   Emulated request latency (us)*/
+	uint32_t lat_us;
+
+	/**@brief   Emulated bandwidth (bytes/s, 0 - unlimited)*/
+	uint64_t bw;
+};
+
+/**********************BLOCKDEV INTERFACE**************************************/
+static int ram_dev_open(struct ext4_blockdev *bdev);
+static int ram_dev_bread(struct ext4_blockdev *bdev, void *buf,
+			 uint64_t blk_id, uint32_t blk_cnt);
+static int ram_dev_bwrite(struct ext4_blockdev *bdev, const void *buf,
+			  uint64_t blk_id, uint32_t blk_cnt);
+static int ram_dev_close(struct ext4_blockdev *bdev);
+static int ram_dev_breadv(struct ext4_blockdev *bdev,
+			  const struct ext4_blockdev_iovec *iov,
+			  uint32_t iov_cnt);
+static int ram_dev_bwritev(struct ext4_blockdev *bdev,
+			   const struct ext4_blockdev_iovec *iov,
+			   uint32_t iov_cnt);
+static int ram_dev_discard(struct ext4_blockdev *bdev, uint64_t blk_id,
+			   uint64_t blk_cnt);
+
+/******************************************************************************/
+static int ram_dev_open(struct ext4_blockdev *bdev)
+{
+	struct ram_dev *m = bdev->bdif->p_user;
+
+	m->bdif.ph_bcnt = m->size / m->bdif.ph_bsize;
+	m->bdev.part_offset = 0;
+	m->bdev.part_size = m->size;
+	m->open = true;
+	return EOK;
+}
+
+/**@brief   Range lies inside the device.*/
+static bool ram_dev_range_ok(struct ram_dev *m, uint64_t off, size_t len)
+{
+	return off <= m->size && len <= m->size - off;
+}
+
+/**@brief   Zero a range, whole pages are given back to the host.*/
+static void ram_dev_zero(struct ram_dev *m, size_t off, size_t len)
+{
+	size_t from = (off + m->page - 1) & ~(m->page - 1);
+	size_t to = (off + len) & ~(m->page - 1);
+
+	if (from >= to) {
+		memset(m->map + off, 0, len);
+		return;
+	}
+
+	memset(m->map + off, 0, from - off);
+	memset(m->map + to, 0, off + len - to);
+	if (madvise(m->map + from, to - from, MADV_DONTNEED))
+		memset(m->map + from, 0, to - from);
+}
+
+/**@brief   Request start time for the emulation (0 - emulation off).*/
+static uint64_t ram_dev_emu_start(struct ram_dev *m)
+{
+	struct timespec ts;
+
+	if (!m->lat_us && !m->bw)
+		return 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/**@brief   Wait until the emulated request of len bytes completes.*/
+static void ram_dev_emu_end(struct ram_dev *m, uint64_t start, size_t len)
+{
+	struct timespec ts;
+	uint64_t end;
+
+	if (!start)
+		return;
+
+	end = start + (uint64_t)m->lat_us * 1000;
+	if (m->bw)
+		end += (uint64_t)len * 1000000000ull / m->bw;
+
+	ts.tv_sec = end / 1000000000ull;
+	ts.tv_nsec = end % 1000000000ull;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) ==
+	       EINTR)
+		;
+}
+
+/******************************************************************************/
+static int ram_dev_bread(struct ext4_blockdev *bdev, void *buf,
+			 uint64_t blk_id, uint32_t blk_cnt)
+{
+	struct ext4_blockdev_iovec iov = {
+	    .blk_id = blk_id, .blk_cnt = blk_cnt, .buf = buf};
+
+	return ram_dev_breadv(bdev, &iov, 1);
+}
+
+/******************************************************************************/
+static int ram_dev_bwrite(struct ext4_blockdev *bdev, const void *buf,
+			  uint64_t blk_id, uint32_t blk_cnt)
+{
+	struct ext4_blockdev_iovec iov = {
+	    .blk_id = blk_id, .blk_cnt = blk_cnt, .buf = (void *)buf};
+
+	return ram_dev_bwritev(bdev, &iov, 1);
+}
+
+/******************************************************************************/
+static int ram_dev_breadv(struct ext4_blockdev *bdev,
+			  const struct ext4_blockdev_iovec *iov,
+			  uint32_t iov_cnt)
+{
+	struct ram_dev *m = bdev->bdif->p_user;
+	uint64_t start = ram_dev_emu_start(m);
+	size_t total = 0;
+
+	for (uint32_t i = 0; i < iov_cnt; i++) {
+		uint64_t off = iov[i].blk_id * bdev->bdif->ph_bsize;
+		size_t len = (size_t)iov[i].blk_cnt * bdev->bdif->ph_bsize;
+
+		if (!ram_dev_range_ok(m, off, len))
+			return EIO;
+
+		memcpy(iov[i].buf, m->map + off, len);
+		total += len;
+	}
+
+	ram_dev_emu_end(m, start, total);
+	return EOK;
+}
+
+/******************************************************************************/
+static int ram_dev_bwritev(struct ext4_blockdev *bdev,
+			   const struct ext4_blockdev_iovec *iov,
+			   uint32_t iov_cnt)
+{
+	struct ram_dev *m = bdev->bdif->p_user;
+	uint64_t start = ram_dev_emu_start(m);
+	size_t total = 0;
+
+	for (uint32_t i = 0; i < iov_cnt; i++) {
+		uint64_t off = iov[i].blk_id * bdev->bdif->ph_bsize;
+		size_t len = (size_t)iov[i].blk_cnt * bdev->bdif->ph_bsize;
+
+		if (!ram_dev_range_ok(m, off, len))
+			return EIO;
+
+		memcpy(m->map + off, iov[i].buf, len);
+		total += len;
+	}
+
+	ram_dev_emu_end(m, start, total);
+	return EOK;
+}
+
+/******************************************************************************/
+static int ram_dev_discard(struct ext4_blockdev *bdev, uint64_t blk_id,
+			   uint64_t blk_cnt)
+{
+	struct ram_dev *m = bdev->bdif->p_user;
+	uint64_t off = blk_id * bdev->bdif->ph_bsize;
+	uint64_t len = blk_cnt * bdev->bdif->ph_bsize;
+
+	if (!ram_dev_range_ok(m, off, len))
+		return EIO;
+
+	ram_dev_zero(m, off, len);
+	return EOK;
+}
+
+/******************************************************************************/
+static int ram_dev_close(struct ext4_blockdev *bdev)
+{
+	struct ram_dev *m = bdev->bdif->p_user;
+
+	m->open = false;
+	return EOK;
+}
+
+/******************************************************************************/
+struct ext4_blockdev *ram_dev_create(uint64_t size)
+{
+	struct ram_dev *m;
+
+	size -= size % EXT4_RAMDEV_BSIZE;
+	if (!size || size > SIZE_MAX)
+		return NULL;
+
+	m = calloc(1, sizeof(struct ram_dev));
+	if (!m)
+		return NULL;
+
+	m->bdif.ph_bbuf = malloc(EXT4_RAMDEV_BSIZE);
+	if (!m->bdif.ph_bbuf)
+		goto fail;
+
+	/* Pages are reserved on the first write. */
+	m->map = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (m->map == MAP_FAILED)
+		goto fail;
+
+	m->size = size;
+	m->page = sysconf(_SC_PAGESIZE);
+
+	m->bdev.bdif = &m->bdif;
+	m->bdif.open = ram_dev_open;
+	m->bdif.bread = ram_dev_bread;
+	m->bdif.bwrite = ram_dev_bwrite;
+	m->bdif.close = ram_dev_close;
+	m->bdif.breadv = ram_dev_breadv;
+	m->bdif.bwritev = ram_dev_bwritev;
+	m->bdif.discard = ram_dev_discard;
+	m->bdif.flags = EXT4_BDIF_LOCKLESS_READ;
+	m->bdif.ph_bsize = EXT4_RAMDEV_BSIZE;
+	m->bdif.ph_bcnt = size / EXT4_RAMDEV_BSIZE;
+	m->bdif.p_user = m;
+	m->bdev.part_size = size;
+	return &m->bdev;
+
+fail:
+	free(m->bdif.ph_bbuf);
+	free(m);
+	return NULL;
+}
+
+/******************************************************************************/
+void ram_dev_destroy(struct ext4_blockdev *bdev)
+{
+	struct ram_dev *m = bdev->bdif->p_user;
+
+	munmap(m->map, m->size);
+	free(m->bdif.ph_bbuf);
+	free(m);
+}
+
+/******************************************************************************/
+void ram_dev_emulate(struct ext4_blockdev *bdev, uint32_t lat_us,
+		     uint64_t bw)
+{
+	struct ram_dev *m = bdev->bdif->p_user;
+
+	m->lat_us = lat_us;
+	m->bw = bw;
+}
+
+/******************************************************************************/
+void *ram_dev_data(struct ext4_blockdev *bdev, uint64_t *size)
+{
+	struct ram_dev *m = bdev->bdif->p_user;
+
+	if (size)
+		*size = m->size;
+	return m->map;
+}
+
+/**@brief   Chunk contains zeros only.*/
+static bool ram_dev_chunk_zero(const uint8_t *p, size_t len)
+{
+	return !p[0] && !memcmp(p, p + 1, len - 1);
+}
+
+/******************************************************************************/
+int ram_dev_snapshot(struct ext4_blockdev *bdev, const char *name)
+{
+	struct ram_dev *m = bdev->bdif->p_user;
+	size_t off, len;
+	int fd, r = EOK;
+
+	fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return EIO;
+
+	/* Zero chunks are left as holes of a sparse image. */
+	for (off = 0; off < m->size && r == EOK; off += len) {
+		len = m->size - off;
+		if (len > EXT4_RAMDEV_CHUNK)
+			len = EXT4_RAMDEV_CHUNK;
+
+		if (ram_dev_chunk_zero(m->map + off, len))
+			continue;
+
+		for (size_t done = 0; done < len;) {
+			ssize_t n = pwrite(fd, m->map + off + done, len - done,
+					   off + done);
+			if (n <= 0 && errno != EINTR) {
+				r = EIO;
+				break;
+			}
+			if (n > 0)
+				done += n;
+		}
+	}
+
+	if (r == EOK && ftruncate(fd, m->size))
+		r = EIO;
+	if (close(fd))
+		r = EIO;
+	return r;
+}
+
+/******************************************************************************/
+int ram_dev_restore(struct ext4_blockdev *bdev, const char *name)
+{
+	struct ram_dev *m = bdev->bdif->p_user;
+	uint8_t *buf;
+	struct stat st;
+	size_t off, len;
+	int fd, r = EOK;
+
+	if (m->open)
+		return EBUSY;
+
+	fd = open(name, O_RDONLY);
+	if (fd < 0)
+		return ENOENT;
+
+	if (fstat(fd, &st) || st.st_size < 0) {
+		close(fd);
+		return EIO;
+	}
+
+	if ((uint64_t)st.st_size > m->size) {
+		close(fd);
+		return EFBIG;
+	}
+
+	buf = malloc(EXT4_RAMDEV_CHUNK);
+	if (!buf) {
+		close(fd);
+		return ENOMEM;
+	}
+
+	/* Zero chunks of the image do not take device memory. */
+	for (off = 0; off < (size_t)st.st_size; off += len) {
+		len = st.st_size - off;
+		if (len > EXT4_RAMDEV_CHUNK)
+			len = EXT4_RAMDEV_CHUNK;
+
+		ssize_t n = pread(fd, buf, len, off);
+		if (n < 0 && errno == EINTR) {
+			len = 0;
+			continue;
+		}
+		if (n <= 0) {
+			r = EIO;
+			break;
+		}
+
+		len = n;
+		if (ram_dev_chunk_zero(buf, len))
+			ram_dev_zero(m, off, len);
+		else
+			memcpy(m->map + off, buf, len);
+	}
+
+	if (r == EOK && off < m->size)
+		ram_dev_zero(m, off, m->size - off);
+
+	free(buf);
+	close(fd);
+	return r;
+}
+/******************************************************************************/
+
+#else
+
+struct ext4_blockdev *ram_dev_create(uint64_t size)
+{
+	(void)size;
+	return NULL;
+}
+
+void ram_dev_destroy(struct ext4_blockdev *bdev)
+{
+	(void)bdev;
+}
+
+void ram_dev_emulate(struct ext4_blockdev *bdev, uint32_t lat_us,
+		     uint64_t bw)
+{
+	(void)bdev;
+	(void)lat_us;
+	(void)bw;
+}
+
+void *ram_dev_data(struct ext4_blockdev *bdev, uint64_t *size)
+{
+	(void)bdev;
+	if (size)
+		*size = 0;
+	return NULL;
+}
+
+int ram_dev_snapshot(struct ext4_blockdev *bdev, const char *name)
+{
+	(void)bdev;
+	(void)name;
+	return ENOTSUP;
+}
+
+int ram_dev_restore(struct ext4_blockdev *bdev, const char *name)
+{
+	(void)bdev;
+	(void)name;
+	return ENOTSUP;
+}
+
+#endif
@@ -0,0 +1,78 @@
+/*
+ * Copyright (c) 2013 Grzegorz Kostka (kostka.grzegorz@gmail.com)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * - Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * - The name of the author may not be used to endorse or promote products
+ *   derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef RAM_DEV_H_
+#define RAM_DEV_H_
+
+#include <ext4_config.h>
+#include <ext4_blockdev.h>
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/**@brief   Create a RAM blockdev instance. Memory is zero filled,
+ *          reserved lazily and kept across open/close, so the device
+ *          may be mounted again. Discard releases memory of whole
+ *          pages back to the host.
+ * @param   size device size (bytes, rounded down to 512 byte blocks)
+ * @return  block device, NULL when out of memory or not supported*/
+struct ext4_blockdev *ram_dev_create(uint64_t size);
+
+/**@brief   Destroy a RAM blockdev instance (content is lost).*/
+void ram_dev_destroy(struct ext4_blockdev *bdev);
+
+/**@brief   Emulate a slower device: every request takes at least
+ *          lat_us plus its transfer time at bw bytes per second.
+ * @param   bdev RAM block device
+ * @param   lat_us per request latency (us), 0 - none
+ * @param   bw bandwidth (bytes/s), 0 - unlimited*/
+void ram_dev_emulate(struct ext4_blockdev *bdev, uint32_t lat_us,
+		     uint64_t bw);
+
+/**@brief   Direct access to the device content (zero-copy reads of
+ *          the image, e.g. to verify or checksum it without I/O).
+ *          Must not be written while the device is mounted.
+ * @param   bdev RAM block device
+ * @param   size device size (output, optional)
+ * @return  device memory*/
+void *ram_dev_data(struct ext4_blockdev *bdev, uint64_t *size);
+
+/**@brief   Save the device content to an image file. Consistent only
+ *          when the filesystem is not mounted (or after a cache flush).
+ * @param   bdev RAM block device
+ * @param   name image file name
+ * @return  standard error code*/
+int ram_dev_snapshot(struct ext4_blockdev *bdev, const char *name);
+
+/**@brief   Load the device content from an image file, the remainder
+ *          of a smaller image is zeroed. The device must not be open.
+ * @param   bdev RAM block device
+ * @param   name image file name
+ * @return  standard error code (EFBIG - image larger than the device)*/
+int ram_dev_restore(struct ext4_blockdev *bdev, const char *name);
+
+#endif /* RAM_DEV_H_ */
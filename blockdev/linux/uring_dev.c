@@ -0,0 +1,530 @@
+/*
+ * Copyright (c) 2013 Grzegorz Kostka (kostka.grzegorz@gmail.com)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * - Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * - The name of the author may not be used to endorse or promote products
+ *   derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _LARGEFILE64_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <ext4_config.h>
+#include <ext4_blockdev.h>
+#include <ext4_errno.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "uring_dev.h"
+
+#if defined(__linux__)
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+/**@brief   Image block size.*/
+#define EXT4_URINGDEV_BSIZE 512
+
+/**@brief   Submission queue entries (device operations in flight).*/
+#define EXT4_URINGDEV_DEPTH 64
+
+/**@brief   Segments passed to a single device operation.*/
+#define EXT4_URINGDEV_IOV_MAX 32
+
+/**@brief   Device operation: adjacent segments of a request.*/
+struct uring_slot {
+	struct ext4_blockdev_req *req;
+	struct iovec vec[EXT4_URINGDEV_IOV_MAX];
+	int n;
+	off_t off;
+	size_t len;
+	int next_free;
+};
+
+/**@brief   io_uring block device instance.*/
+struct uring_dev {
+	struct ext4_blockdev bdev;
+	struct ext4_blockdev_iface bdif;
+
+	/**@brief   Image file name*/
+	const char *name;
+
+	/**@brief   Image file descriptor*/
+	int fd;
+
+	/**@brief   io_uring instance (-1 - synchronous I/O only)*/
+	int ring_fd;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_ptr, *cq_ptr;
+	size_t sq_sz, cq_sz, sqes_sz;
+
+	struct uring_slot slots[EXT4_URINGDEV_DEPTH];
+	int free_slot;
+	uint32_t busy;
+
+	/**@brief   Completed requests, waiting for reap*/
+	struct ext4_blockdev_req *done[EXT4_URINGDEV_DEPTH];
+	uint32_t done_head, done_cnt;
+};
+
+/**********************BLOCKDEV INTERFACE**************************************/
+static int uring_dev_open(struct ext4_blockdev *bdev);
+static int uring_dev_bread(struct ext4_blockdev *bdev, void *buf,
+			   uint64_t blk_id, uint32_t blk_cnt);
+static int uring_dev_bwrite(struct ext4_blockdev *bdev, const void *buf,
+			    uint64_t blk_id, uint32_t blk_cnt);
+static int uring_dev_close(struct ext4_blockdev *bdev);
+static int uring_dev_flush(struct ext4_blockdev *bdev);
+static int uring_dev_submit(struct ext4_blockdev *bdev,
+			    struct ext4_blockdev_req *req);
+static int uring_dev_reap(struct ext4_blockdev *bdev,
+			  struct ext4_blockdev_req **done, uint32_t max,
+			  uint32_t min, uint32_t *cnt);
+
+/******************************************************************************/
+static int uring_setup(struct uring_dev *u)
+{
+	struct io_uring_params p;
+	int i;
+
+	memset(&p, 0, sizeof(p));
+	u->ring_fd = syscall(__NR_io_uring_setup, EXT4_URINGDEV_DEPTH, &p);
+	if (u->ring_fd < 0)
+		return EIO;
+
+	u->sq_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	u->cq_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (u->cq_sz > u->sq_sz)
+			u->sq_sz = u->cq_sz;
+		u->cq_sz = u->sq_sz;
+	}
+
+	u->sq_ptr = mmap(0, u->sq_sz, PROT_READ | PROT_WRITE,
+			 MAP_SHARED | MAP_POPULATE, u->ring_fd,
+			 IORING_OFF_SQ_RING);
+	if (u->sq_ptr == MAP_FAILED)
+		goto fail_sq;
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		u->cq_ptr = u->sq_ptr;
+	else
+		u->cq_ptr = mmap(0, u->cq_sz, PROT_READ | PROT_WRITE,
+				 MAP_SHARED | MAP_POPULATE, u->ring_fd,
+				 IORING_OFF_CQ_RING);
+	if (u->cq_ptr == MAP_FAILED)
+		goto fail_cq;
+
+	u->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+	u->sqes = mmap(0, u->sqes_sz, PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_POPULATE, u->ring_fd, IORING_OFF_SQES);
+	if (u->sqes == MAP_FAILED)
+		goto fail_sqes;
+
+	u->sq_head = (unsigned *)((char *)u->sq_ptr + p.sq_off.head);
+	u->sq_tail = (unsigned *)((char *)u->sq_ptr + p.sq_off.tail);
+	u->sq_mask = (unsigned *)((char *)u->sq_ptr + p.sq_off.ring_mask);
+	u->sq_array = (unsigned *)((char *)u->sq_ptr + p.sq_off.array);
+	u->cq_head = (unsigned *)((char *)u->cq_ptr + p.cq_off.head);
+	u->cq_tail = (unsigned *)((char *)u->cq_ptr + p.cq_off.tail);
+	u->cq_mask = (unsigned *)((char *)u->cq_ptr + p.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *)((char *)u->cq_ptr + p.cq_off.cqes);
+
+	/* Slots never outnumber submission queue entries, so the
+	 * completion queue can't overflow. */
+	for (i = 0; i < EXT4_URINGDEV_DEPTH; i++)
+		u->slots[i].next_free = i + 1;
+	u->slots[EXT4_URINGDEV_DEPTH - 1].next_free = -1;
+	u->free_slot = 0;
+	u->busy = 0;
+	u->done_head = 0;
+	u->done_cnt = 0;
+	return EOK;
+
+fail_sqes:
+	if (u->cq_ptr != u->sq_ptr)
+		munmap(u->cq_ptr, u->cq_sz);
+fail_cq:
+	munmap(u->sq_ptr, u->sq_sz);
+fail_sq:
+	close(u->ring_fd);
+	u->ring_fd = -1;
+	return EIO;
+}
+
+static void uring_release(struct uring_dev *u)
+{
+	if (u->ring_fd < 0)
+		return;
+
+	munmap(u->sqes, u->sqes_sz);
+	if (u->cq_ptr != u->sq_ptr)
+		munmap(u->cq_ptr, u->cq_sz);
+	munmap(u->sq_ptr, u->sq_sz);
+	close(u->ring_fd);
+	u->ring_fd = -1;
+}
+
+/******************************************************************************/
+/**@brief   Synchronous transfer, restarted after short transfers.*/
+static int uring_dev_xfer(struct uring_dev *u, struct iovec *v, int n,
+			  off_t off, size_t len, bool write)
+{
+	while (len) {
+		ssize_t r = write ? pwritev(u->fd, v, n, off) :
+				    preadv(u->fd, v, n, off);
+		if (r <= 0)
+			return EIO;
+
+		len -= r;
+		off += r;
+		while (n && (size_t)r >= v->iov_len) {
+			r -= v->iov_len;
+			v++;
+			n--;
+		}
+		if (n) {
+			v->iov_base = (char *)v->iov_base + r;
+			v->iov_len -= r;
+		}
+	}
+	return EOK;
+}
+
+static int uring_dev_open(struct ext4_blockdev *bdev)
+{
+	struct uring_dev *u = bdev->bdif->p_user;
+	off_t size;
+
+	u->fd = open(u->name, O_RDWR);
+	if (u->fd < 0)
+		return EIO;
+
+	size = lseek(u->fd, 0, SEEK_END);
+	if (size < 0) {
+		close(u->fd);
+		u->fd = -1;
+		return EFAULT;
+	}
+
+	u->bdev.part_offset = 0;
+	u->bdev.part_size = size;
+	u->bdif.ph_bcnt = u->bdev.part_size / u->bdif.ph_bsize;
+
+	/* Kernels without io_uring get synchronous I/O only. */
+	if (uring_setup(u) == EOK) {
+		u->bdif.submit = uring_dev_submit;
+		u->bdif.reap = uring_dev_reap;
+		u->bdif.queue_depth = EXT4_URINGDEV_DEPTH;
+	}
+
+	return EOK;
+}
+
+/******************************************************************************/
+static int uring_dev_bread(struct ext4_blockdev *bdev, void *buf,
+			   uint64_t blk_id, uint32_t blk_cnt)
+{
+	struct iovec v = {
+		.iov_base = buf,
+		.iov_len = (size_t)blk_cnt * bdev->bdif->ph_bsize,
+	};
+	return uring_dev_xfer(bdev->bdif->p_user, &v, 1,
+			      blk_id * bdev->bdif->ph_bsize, v.iov_len, false);
+}
+
+/******************************************************************************/
+static int uring_dev_bwrite(struct ext4_blockdev *bdev, const void *buf,
+			    uint64_t blk_id, uint32_t blk_cnt)
+{
+	struct iovec v = {
+		.iov_base = (void *)buf,
+		.iov_len = (size_t)blk_cnt * bdev->bdif->ph_bsize,
+	};
+	return uring_dev_xfer(bdev->bdif->p_user, &v, 1,
+			      blk_id * bdev->bdif->ph_bsize, v.iov_len, true);
+}
+
+/******************************************************************************/
+/**@brief   Drop a request operation reference, queue it for reap when
+ *          the last one is gone.*/
+static void uring_req_put(struct uring_dev *u, struct ext4_blockdev_req *req)
+{
+	if (--req->pending)
+		return;
+
+	u->done[(u->done_head + u->done_cnt) % EXT4_URINGDEV_DEPTH] = req;
+	u->done_cnt++;
+}
+
+/**@brief   Handle completion queue entries.*/
+static void uring_complete(struct uring_dev *u)
+{
+	unsigned head = *u->cq_head;
+	unsigned tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+
+	for (; head != tail; head++) {
+		struct io_uring_cqe *cqe = &u->cqes[head & *u->cq_mask];
+		struct uring_slot *slot = &u->slots[cqe->user_data];
+		struct ext4_blockdev_req *req = slot->req;
+		int res = cqe->res;
+
+		if (res < 0) {
+			req->res = EIO;
+		} else if ((size_t)res < slot->len) {
+			/* Short transfer: finish it synchronously. */
+			struct iovec *v = slot->vec;
+			int n = slot->n;
+			size_t r = res;
+			while (n && r >= v->iov_len) {
+				r -= v->iov_len;
+				v++;
+				n--;
+			}
+			v->iov_base = (char *)v->iov_base + r;
+			v->iov_len -= r;
+			if (uring_dev_xfer(u, v, n, slot->off + res,
+					   slot->len - res, req->write) != EOK)
+				req->res = EIO;
+		}
+
+		slot->next_free = u->free_slot;
+		u->free_slot = slot - u->slots;
+		u->busy--;
+		uring_req_put(u, req);
+	}
+
+	__atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+}
+
+/**@brief   Pass queued entries to the kernel, wait for min completions.*/
+static int uring_enter(struct uring_dev *u, unsigned min)
+{
+	unsigned to_submit = *u->sq_tail -
+			     __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+	int r;
+
+	for (;;) {
+		r = syscall(__NR_io_uring_enter, u->ring_fd, to_submit, min,
+			    min ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+		if (r >= 0 || errno != EINTR)
+			break;
+	}
+
+	if (r < 0)
+		return EIO;
+
+	uring_complete(u);
+	return EOK;
+}
+
+/**@brief   Queue a device operation.*/
+static void uring_queue(struct uring_dev *u, struct uring_slot *slot)
+{
+	unsigned tail = *u->sq_tail;
+	unsigned idx = tail & *u->sq_mask;
+	struct io_uring_sqe *sqe = &u->sqes[idx];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = slot->req->write ? IORING_OP_WRITEV : IORING_OP_READV;
+	sqe->fd = u->fd;
+	sqe->off = slot->off;
+	sqe->addr = (uint64_t)(uintptr_t)slot->vec;
+	sqe->len = slot->n;
+	sqe->user_data = slot - u->slots;
+
+	u->sq_array[idx] = idx;
+	__atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+static int uring_dev_submit(struct ext4_blockdev *bdev,
+			    struct ext4_blockdev_req *req)
+{
+	struct uring_dev *u = bdev->bdif->p_user;
+	uint32_t bsize = bdev->bdif->ph_bsize;
+	uint32_t i = 0;
+	int r = EOK;
+
+	req->res = EOK;
+	/* Submission reference: the request is not done before all of
+	 * its operations are queued. */
+	req->pending = 1;
+
+	while (i < req->iov_cnt) {
+		struct uring_slot *slot;
+		uint64_t blk_id = req->iov[i].blk_id;
+
+		/* Wait for a free slot. */
+		while (u->free_slot < 0) {
+			r = uring_enter(u, 1);
+			if (r != EOK)
+				break;
+		}
+		if (r != EOK)
+			break;
+
+		slot = &u->slots[u->free_slot];
+		u->free_slot = slot->next_free;
+		u->busy++;
+
+		slot->req = req;
+		slot->n = 0;
+		slot->len = 0;
+		slot->off = (off_t)(blk_id * bsize);
+		do {
+			struct iovec *v = &slot->vec[slot->n++];
+			v->iov_base = req->iov[i].buf;
+			v->iov_len = (size_t)req->iov[i].blk_cnt * bsize;
+			slot->len += v->iov_len;
+			blk_id += req->iov[i].blk_cnt;
+			i++;
+		} while (i < req->iov_cnt && slot->n < EXT4_URINGDEV_IOV_MAX &&
+			 req->iov[i].blk_id == blk_id);
+
+		req->pending++;
+		uring_queue(u, slot);
+	}
+
+	if (r == EOK)
+		r = uring_enter(u, 0);
+
+	/* Queued operations are done anyway. */
+	if (r != EOK)
+		req->res = r;
+
+	uring_req_put(u, req);
+	return EOK;
+}
+
+static int uring_dev_reap(struct ext4_blockdev *bdev,
+			  struct ext4_blockdev_req **done, uint32_t max,
+			  uint32_t min, uint32_t *cnt)
+{
+	struct uring_dev *u = bdev->bdif->p_user;
+	int r = EOK;
+
+	/* Pick up what has completed already. */
+	uring_complete(u);
+	while (u->done_cnt < min && u->busy) {
+		r = uring_enter(u, 1);
+		if (r != EOK)
+			break;
+	}
+
+	*cnt = 0;
+	while (u->done_cnt && *cnt < max) {
+		done[(*cnt)++] = u->done[u->done_head];
+		u->done_head = (u->done_head + 1) % EXT4_URINGDEV_DEPTH;
+		u->done_cnt--;
+	}
+
+	return r;
+}
+
+/******************************************************************************/
+static int uring_dev_flush(struct ext4_blockdev *bdev)
+{
+	struct uring_dev *u = bdev->bdif->p_user;
+	return fdatasync(u->fd) ? EIO : EOK;
+}
+
+/******************************************************************************/
+static int uring_dev_close(struct ext4_blockdev *bdev)
+{
+	struct uring_dev *u = bdev->bdif->p_user;
+
+	uring_release(u);
+	u->bdif.submit = NULL;
+	u->bdif.reap = NULL;
+	u->bdif.queue_depth = 0;
+
+	close(u->fd);
+	u->fd = -1;
+	return EOK;
+}
+
+/******************************************************************************/
+struct ext4_blockdev *uring_dev_create(const char *name)
+{
+	size_t len = strlen(name) + 1;
+	struct uring_dev *u = calloc(1, sizeof(struct uring_dev) + len);
+	if (!u)
+		return NULL;
+
+	u->bdif.ph_bbuf = malloc(EXT4_URINGDEV_BSIZE);
+	if (!u->bdif.ph_bbuf) {
+		free(u);
+		return NULL;
+	}
+
+	memcpy(u + 1, name, len);
+	u->name = (const char *)(u + 1);
+	u->fd = -1;
+	u->ring_fd = -1;
+
+	u->bdev.bdif = &u->bdif;
+	u->bdif.open = uring_dev_open;
+	u->bdif.bread = uring_dev_bread;
+	u->bdif.bwrite = uring_dev_bwrite;
+	u->bdif.close = uring_dev_close;
+	u->bdif.flush = uring_dev_flush;
+	u->bdif.ph_bsize = EXT4_URINGDEV_BSIZE;
+	u->bdif.p_user = u;
+	return &u->bdev;
+}
+
+/******************************************************************************/
+void uring_dev_destroy(struct ext4_blockdev *bdev)
+{
+	struct uring_dev *u = bdev->bdif->p_user;
+
+	if (u->fd >= 0)
+		uring_dev_close(bdev);
+	free(u->bdif.ph_bbuf);
+	free(u);
+}
+/******************************************************************************/
+
+#else
+
+struct ext4_blockdev *uring_dev_create(const char *name)
+{
+	(void)name;
+	return NULL;
+}
+
+void uring_dev_destroy(struct ext4_blockdev *bdev)
+{
+	(void)bdev;
+}
+
+#endif
@@ -31,6 +31,7 @@
 #include <ext4.h>
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <inttypes.h>
 #include <string.h>
 
@@ -41,6 +42,15 @@ static struct ext4_blockdev *bd;
 /**@brief   Block cache handle.*/
 static struct ext4_bcache *bc;
 
+/**@brief   Block cache items count (0 - default).*/
+static uint32_t bc_cnt;
+
+/**@brief   Block cache flags.*/
+static uint32_t bc_flags;
+
+/**@brief   Block cache metadata pool size.*/
+static uint32_t bc_meta;
+
 static char *entry_to_str(uint8_t type)
 {
 	switch (type) {
@@ -120,6 +130,36 @@ void test_lwext4_mp_stats(void)
 	printf("********************\n");
 }
 
+static void printf_io_dir(const char *name,
+			  const struct ext4_blockdev_io_dir *d)
+{
+	int i;
+
+	printf("io %s: reqs = %" PRIu64 ", seq = %" PRIu64 ", bytes = %" PRIu64
+	       " KB, errors = %" PRIu64 "\n", name, d->reqs, d->seq,
+	       d->bytes / 1024, d->errors);
+	if (!d->reqs)
+		return;
+
+	if (d->time_us)
+		printf("  latency: avg = %" PRIu64 " us, max = %" PRIu64
+		       " us, throughput = %" PRIu64 " KB/s\n",
+		       d->time_us / d->reqs, d->max_us,
+		       d->bytes * 1000000 / 1024 / d->time_us);
+
+	printf("  latency us:");
+	for (i = 0; i < EXT4_BLOCKDEV_LAT_BUCKETS; i++)
+		if (d->lat[i])
+			printf(" %lu:%" PRIu32, 1ul << i, d->lat[i]);
+	printf("\n");
+
+	printf("  size blocks:");
+	for (i = 0; i < EXT4_BLOCKDEV_SIZE_BUCKETS; i++)
+		if (d->size[i])
+			printf(" %lu:%" PRIu32, 1ul << i, d->size[i]);
+	printf("\n");
+}
+
 void test_lwext4_block_stats(void)
 {
 	if (!bd)
@@ -129,11 +169,52 @@ void test_lwext4_block_stats(void)
 	printf("ext4 blockdev stats\n");
 	printf("bdev->bread_ctr = %" PRIu32 "\n", bd->bdif->bread_ctr);
 	printf("bdev->bwrite_ctr = %" PRIu32 "\n", bd->bdif->bwrite_ctr);
+	printf("bdev->flush_ctr = %" PRIu32 "\n", bd->bdif->flush_ctr);
+
+	struct ext4_blockdev_elv_stats es;
+	if (ext4_block_elv_get_stats(bd, &es) == EOK)
+		printf("elevator: queued = %" PRIu64 ", merged = %" PRIu64
+		       ", dispatched = %" PRIu64 ", expired = %" PRIu64
+		       ", max_depth = %" PRIu32 "\n", es.queued, es.merged,
+		       es.dispatched, es.expired, es.max_depth);
+
+	struct ext4_blockdev_io_stats io;
+	if (ext4_block_io_stats_get(bd, &io) == EOK) {
+		printf_io_dir("read", &io.rd);
+		printf_io_dir("write", &io.wr);
+	}
 
 	printf("bcache->ref_blocks = %" PRIu32 "\n", bd->bc->ref_blocks);
 	printf("bcache->max_ref_blocks = %" PRIu32 "\n", bd->bc->max_ref_blocks);
 	printf("bcache->lru_ctr = %" PRIu32 "\n", bd->bc->lru_ctr);
 
+	struct ext4_bcache_stats st;
+	if (ext4_mount_point_cache_stats("/mp/", &st, false) == EOK) {
+		static const char *cls_name[EXT4_BCACHE_CLS_COUNT] = {
+			"other", "gdt", "bitmap", "itable",
+			"index", "dir", "xattr", "journal"
+		};
+
+		printf("bcache hits = %" PRIu64 "\n", st.hits);
+		printf("bcache misses = %" PRIu64 "\n", st.misses);
+		printf("bcache evictions = %" PRIu64 "\n", st.evictions);
+		printf("bcache dirty_evictions = %" PRIu64 "\n",
+		       st.dirty_evictions);
+		printf("bcache writes = %" PRIu64 "\n", st.writes);
+		printf("bcache readahead = %" PRIu64 " (hits %" PRIu64
+		       ", waste %" PRIu64 ")\n", st.ra_blocks, st.ra_hits,
+		       st.ra_waste);
+		printf("bcache pinned = %" PRIu32 " / %" PRIu32 "\n",
+		       st.pinned_blocks, st.meta_cnt);
+		printf("%-8s %10s %10s %10s %8s\n", "class", "hits", "misses",
+		       "evictions", "blocks");
+		for (int i = 0; i < EXT4_BCACHE_CLS_COUNT; i++)
+			printf("%-8s %10" PRIu64 " %10" PRIu64 " %10" PRIu64
+			       " %8" PRIu32 "\n", cls_name[i], st.cls[i].hits,
+			       st.cls[i].misses, st.cls[i].evictions,
+			       st.cls[i].blocks);
+	}
+
 	printf("\n");
 
 	printf("********************\n");
@@ -190,6 +271,120 @@ static int verify_buf(const unsigned char *b, size_t len, unsigned char c)
 	return 0;
 }
 
+static bool preadv_cmp(ext4_file *f, uint8_t *buf, uint8_t *ref,
+		       uint64_t off, const size_t *len, int cnt)
+{
+	struct ext4_iovec iov[48];
+	size_t rcnt, fcnt, sum = 0;
+	int i, r;
+
+	for (i = 0; i < cnt; i++) {
+		iov[i].base = buf + sum;
+		iov[i].len = len[i];
+		sum += len[i];
+	}
+
+	memset(buf, 0, sum);
+	r = ext4_preadv(f, iov, cnt, off, &rcnt);
+	if (r != EOK) {
+		printf("  preadv_test: ext4_preadv ERROR = %d\n", r);
+		return false;
+	}
+
+	r = ext4_fseek(f, off, SEEK_SET);
+	if (r == EOK)
+		r = ext4_fread(f, ref, sum, &fcnt);
+	if (r != EOK) {
+		printf("  preadv_test: ext4_fread ERROR = %d\n", r);
+		return false;
+	}
+
+	if (rcnt != fcnt || memcmp(buf, ref, rcnt)) {
+		printf("  preadv_test: mismatch at %" PRIu64 "\n", off);
+		return false;
+	}
+
+	return true;
+}
+
+/**@brief   Compare @ref ext4_preadv with @ref ext4_fread: unaligned
+ *          offsets, blocks split across buffers, many small buffers
+ *          and a range past the end of file.*/
+static bool test_lwext4_preadv_test(void)
+{
+	struct ext4_mount_stats stats;
+	ext4_file f;
+	uint8_t *buf, *ref;
+	size_t len[40], wcnt;
+	size_t bs, fsize, i;
+	bool ok = false;
+	int r;
+
+	if (ext4_mount_point_stats("/mp/", &stats) != EOK)
+		return false;
+
+	bs = stats.block_size;
+	fsize = 16 * bs + 333;
+	buf = malloc(fsize + bs);
+	ref = malloc(fsize + bs);
+	if (!buf || !ref)
+		goto Finish;
+
+	for (i = 0; i < fsize; i++)
+		ref[i] = (uint8_t)(i * 7 + (i >> 9));
+
+	r = ext4_fopen(&f, "/mp/test_preadv", "wb+");
+	if (r != EOK) {
+		printf("ext4_fopen ERROR = %d\n", r);
+		goto Finish;
+	}
+
+	r = ext4_fwrite(&f, ref, fsize, &wcnt);
+	if (r != EOK || wcnt != fsize) {
+		printf("  preadv_test: ext4_fwrite ERROR = %d\n", r);
+		ext4_fclose(&f);
+		goto Finish;
+	}
+
+	printf("ext4_preadv: block size %" PRIu32 " ...\n", (uint32_t)bs);
+
+	/*Block split across two buffers*/
+	len[0] = bs / 2;
+	len[1] = bs + bs / 2;
+	len[2] = bs;
+	if (!preadv_cmp(&f, buf, ref, 0, len, 3))
+		goto Close;
+
+	/*Unaligned offset and lengths*/
+	len[0] = bs - 100;
+	len[1] = 1;
+	len[2] = 2 * bs + 7;
+	len[3] = 300;
+	if (!preadv_cmp(&f, buf, ref, 123, len, 4))
+		goto Close;
+
+	/*More buffers than a single vectored request*/
+	for (i = 0; i < 40; i++)
+		len[i] = 77 + i * 13;
+	if (!preadv_cmp(&f, buf, ref, bs + 1, len, 40))
+		goto Close;
+
+	/*Past the end of file*/
+	len[0] = 50;
+	len[1] = 200;
+	if (!preadv_cmp(&f, buf, ref, fsize - 100, len, 2))
+		goto Close;
+
+	ok = true;
+Close:
+	ext4_fclose(&f);
+	ext4_fremove("/mp/test_preadv");
+Finish:
+	free(buf);
+	free(ref);
+	return ok;
+}
+
 bool test_lwext4_file_test(uint8_t *rw_buff, uint32_t rw_size, uint32_t rw_count)
 {
 	int r;
@@ -199,6 +394,7 @@ bool test_lwext4_file_test(uint8_t *rw_buff, uint32_t rw_size, uint32_t rw_count
 	long int stop;
 	long int diff;
 	uint32_t kbps;
+	uint32_t frag;
 	uint64_t size_bytes;
 
 	ext4_file f;
@@ -245,6 +441,8 @@ bool test_lwext4_file_test(uint8_t *rw_buff, uint32_t rw_size, uint32_t rw_count
 	printf("  write time: %d ms\n", (int)diff);
 	printf("  write speed: %" PRIu32 " KB/s\n", kbps);
 	printf_io_timings(diff);
+	if (ext4_ffrag(&f, &frag) == EOK)
+		printf("  write fragments: %" PRIu32 "\n", frag);
 	r = ext4_fclose(&f);
 
 	io_timings_clear();
@@ -282,7 +480,7 @@ bool test_lwext4_file_test(uint8_t *rw_buff, uint32_t rw_size, uint32_t rw_count
 	printf_io_timings(diff);
 
 	r = ext4_fclose(&f);
-	return true;
+	return test_lwext4_preadv_test();
 }
 void test_lwext4_cleanup(void)
 {
@@ -316,6 +514,13 @@ void test_lwext4_cleanup(void)
 	printf_io_timings(diff);
 }
 
+void test_lwext4_cache_setup(uint32_t cnt, uint32_t flags, uint32_t meta)
+{
+	bc_cnt = cnt;
+	bc_flags = flags;
+	bc_meta = meta;
+}
+
 bool test_lwext4_mount(struct ext4_blockdev *bdev, struct ext4_bcache *bcache)
 {
 	int r;
@@ -336,6 +541,18 @@ bool test_lwext4_mount(struct ext4_blockdev *bdev, struct ext4_bcache *bcache)
 		return false;
 	}
 
+	r = ext4_device_setup_cache("ext4_fs", bc_cnt, bc_flags);
+	if (r != EOK) {
+		printf("ext4_device_setup_cache: rc = %d\n", r);
+		return false;
+	}
+
+	r = ext4_device_setup_cache_pools("ext4_fs", bc_meta, 0);
+	if (r != EOK) {
+		printf("ext4_device_setup_cache_pools: rc = %d\n", r);
+		return false;
+	}
+
 	r = ext4_mount("ext4_fs", "/mp/", false);
 	if (r != EOK) {
 		printf("ext4_mount: rc = %d\n", r);
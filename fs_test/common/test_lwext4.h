@@ -40,6 +40,7 @@ bool test_lwext4_dir_test(int len);
 bool test_lwext4_file_test(uint8_t *rw_buff, uint32_t rw_size, uint32_t rw_count);
 void test_lwext4_cleanup(void);
 
+void test_lwext4_cache_setup(uint32_t cnt, uint32_t flags, uint32_t meta);
 bool test_lwext4_mount(struct ext4_blockdev *bdev, struct ext4_bcache *bcache);
 bool test_lwext4_umount(void);
 
@@ -0,0 +1,307 @@
+/*
+ * Copyright (c) 2013 Grzegorz Kostka (kostka.grzegorz@gmail.com)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * - Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * - The name of the author may not be used to endorse or promote products
+ *   derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <sys/time.h>
+
+#include <ext4.h>
+
+/**@brief   Logical block size used by the benchmark.*/
+#define BENCH_BSIZE 1024
+
+/**@brief   Operations per single measurement.*/
+static uint32_t op_count = 1000000;
+
+/**@brief   Largest cache size to measure.*/
+static uint32_t max_cnt = 65536;
+
+static const char *usage = "                                    \n\
+Welcome in lwext4 block cache benchmark.                        \n\
+Copyright (c) 2013 Grzegorz Kostka (kostka.grzegorz@gmail.com)  \n\
+Usage:                                                          \n\
+[-c] --count    - operations per measurement (default = 1000000)\n\
+[-m] --max      - largest cache size (default = 65536)          \n\
+\n";
+
+/**********************NULL BLOCKDEV INTERFACE*********************************/
+static int null_dev_open(struct ext4_blockdev *bdev)
+{
+	return EOK;
+}
+
+static int null_dev_bread(struct ext4_blockdev *bdev, void *buf,
+			  uint64_t blk_id, uint32_t blk_cnt)
+{
+	return EOK;
+}
+
+static int null_dev_bwrite(struct ext4_blockdev *bdev, const void *buf,
+			   uint64_t blk_id, uint32_t blk_cnt)
+{
+	return EOK;
+}
+
+static int null_dev_close(struct ext4_blockdev *bdev)
+{
+	return EOK;
+}
+
+EXT4_BLOCKDEV_STATIC_INSTANCE(null_dev, 512, 1ull << 32, null_dev_open,
+			      null_dev_bread, null_dev_bwrite, null_dev_close,
+			      0, 0);
+
+/******************************************************************************/
+static uint64_t tim_get_us(void)
+{
+	struct timeval t;
+	gettimeofday(&t, NULL);
+	return (t.tv_sec * 1000000ull) + (t.tv_usec);
+}
+
+static uint32_t xorshift32(uint32_t *state)
+{
+	uint32_t x = *state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return *state = x;
+}
+
+static bool bench_get(struct ext4_blockdev *bdev, uint64_t lba)
+{
+	struct ext4_block b;
+	if (ext4_block_get(bdev, &b, lba) != EOK)
+		return false;
+
+	return ext4_block_set(bdev, &b) == EOK;
+}
+
+/**@brief   Single measurement result.*/
+struct bench_result {
+	double lookup_ns;
+	double evict_ns;
+	double heap_calls;
+	uint64_t heap_bytes;
+};
+
+static bool bench_run(uint32_t cnt, uint32_t flags, struct bench_result *res)
+{
+	struct ext4_bcache bc;
+	struct ext4_blockdev *bdev = &null_dev;
+	uint32_t seed = 0x12345678;
+	uint64_t start;
+	uint32_t alloc_ctr;
+	uint32_t i;
+	bool ok = false;
+
+	if (ext4_bcache_init_dynamic2(&bc, cnt, BENCH_BSIZE, flags) != EOK)
+		return false;
+
+	ext4_block_bind_bcache(bdev, &bc);
+	ext4_block_set_lb_size(bdev, BENCH_BSIZE);
+	if (ext4_block_init(bdev) != EOK)
+		goto Finish;
+
+	/*Fill the cache: lba 1..cnt.*/
+	for (i = 1; i <= cnt; ++i)
+		if (!bench_get(bdev, i))
+			goto Finish;
+
+	/*Lookup: random hits over resident blocks.*/
+	start = tim_get_us();
+	for (i = 0; i < op_count; ++i)
+		if (!bench_get(bdev, 1 + xorshift32(&seed) % cnt))
+			goto Finish;
+
+	res->lookup_ns = (tim_get_us() - start) * 1000.0 / op_count;
+
+	/*Eviction: every get misses and drops the LRU victim.*/
+	alloc_ctr = bc.alloc_ctr;
+	start = tim_get_us();
+	for (i = 0; i < op_count; ++i)
+		if (!bench_get(bdev, cnt + 1 + i))
+			goto Finish;
+
+	res->evict_ns = (tim_get_us() - start) * 1000.0 / op_count;
+	res->heap_calls = (bc.alloc_ctr - alloc_ctr) * 1000000.0 / op_count;
+	res->heap_bytes = bc.alloc_bytes;
+	ok = true;
+Finish:
+	ext4_bcache_cleanup(&bc);
+	ext4_bcache_fini_dynamic(&bc);
+	ext4_block_fini(bdev);
+	return ok;
+}
+
+/**@brief   Mixed workload: hot metadata set (half of the cache) accessed
+ *          randomly, interleaved with streaming scans of cold blocks.*/
+static bool bench_mixed(uint32_t cnt, uint32_t flags, double *hit_ratio)
+{
+	struct ext4_bcache bc;
+	struct ext4_blockdev *bdev = &null_dev;
+	uint32_t seed = 0x12345678;
+	uint32_t hot_cnt = cnt / 2 ? cnt / 2 : 1;
+	uint64_t scan_lba = 1ull << 24;
+	uint64_t hits, misses;
+	uint32_t i, j;
+	bool ok = false;
+
+	if (ext4_bcache_init_dynamic2(&bc, cnt, BENCH_BSIZE, flags) != EOK)
+		return false;
+
+	ext4_block_bind_bcache(bdev, &bc);
+	ext4_block_set_lb_size(bdev, BENCH_BSIZE);
+	if (ext4_block_init(bdev) != EOK)
+		goto Finish;
+
+	/*Warm up the hot set.*/
+	for (i = 0; i < 4 * hot_cnt; ++i)
+		if (!bench_get(bdev, 1 + xorshift32(&seed) % hot_cnt))
+			goto Finish;
+
+	hits = bc.hit_ctr;
+	misses = bc.miss_ctr;
+	for (i = 0; i < op_count; i += 2 * cnt) {
+		/*Metadata traffic.*/
+		for (j = 0; j < cnt; ++j)
+			if (!bench_get(bdev, 1 + xorshift32(&seed) % hot_cnt))
+				goto Finish;
+
+		/*Streaming scan of cold blocks, cache size long.*/
+		for (j = 0; j < cnt; ++j)
+			if (!bench_get(bdev, scan_lba++))
+				goto Finish;
+	}
+
+	hits = bc.hit_ctr - hits;
+	misses = bc.miss_ctr - misses;
+	*hit_ratio = hits * 100.0 / (hits + misses);
+	ok = true;
+Finish:
+	ext4_bcache_cleanup(&bc);
+	ext4_bcache_fini_dynamic(&bc);
+	ext4_block_fini(bdev);
+	return ok;
+}
+
+static bool parse_opt(int argc, char **argv)
+{
+	int option_index = 0;
+	int c;
+
+	static struct option long_options[] = {
+	    {"count", required_argument, 0, 'c'},
+	    {"max", required_argument, 0, 'm'},
+	    {0, 0, 0, 0}};
+
+	while (-1 != (c = getopt_long(argc, argv, "c:m:",
+				      long_options, &option_index))) {
+
+		switch (c) {
+		case 'c':
+			op_count = atoi(optarg);
+			break;
+		case 'm':
+			max_cnt = atoi(optarg);
+			break;
+		default:
+			printf("%s", usage);
+			return false;
+		}
+	}
+	return op_count != 0;
+}
+
+int main(int argc, char **argv)
+{
+	static const struct {
+		const char *name;
+		uint32_t flags;
+	} modes[] = {
+		{"rbtree", 0},
+		{"hash", EXT4_BCACHE_HASH},
+		{"rbtree+arena", EXT4_BCACHE_ARENA},
+		{"hash+arena", EXT4_BCACHE_HASH | EXT4_BCACHE_ARENA},
+	};
+
+	if (!parse_opt(argc, argv))
+		return EXIT_FAILURE;
+
+	printf("%10s %13s %13s %13s %16s %14s\n", "cache_cnt", "mode",
+	       "lookup ns/op", "evict ns/op", "heap calls/1M", "heap bytes");
+
+	for (uint32_t cnt = 8; cnt <= max_cnt; cnt *= 2) {
+		for (size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); ++m) {
+			struct bench_result res;
+			if (!bench_run(cnt, modes[m].flags, &res)) {
+				printf("bench_run: fail (cnt = %" PRIu32 ")\n",
+				       cnt);
+				return EXIT_FAILURE;
+			}
+
+			printf("%10" PRIu32 " %13s %13.1f %13.1f %16.0f"
+			       " %14" PRIu64 "\n", cnt, modes[m].name,
+			       res.lookup_ns, res.evict_ns, res.heap_calls,
+			       res.heap_bytes);
+		}
+	}
+
+	static const struct {
+		const char *name;
+		uint32_t flags;
+	} policies[] = {
+		{"lru", EXT4_BCACHE_HASH | EXT4_BCACHE_LRU},
+		{"2q", EXT4_BCACHE_HASH | EXT4_BCACHE_2Q},
+		{"arc", EXT4_BCACHE_HASH | EXT4_BCACHE_ARC},
+	};
+
+	printf("\nmixed workload (hot metadata + streaming scan):\n");
+	printf("%10s %13s %13s\n", "cache_cnt", "policy", "hit ratio %");
+
+	for (uint32_t cnt = 8; cnt <= max_cnt; cnt *= 2) {
+		for (size_t p = 0; p < sizeof(policies) / sizeof(policies[0]);
+		     ++p) {
+			double hit_ratio;
+			if (!bench_mixed(cnt, policies[p].flags, &hit_ratio)) {
+				printf("bench_mixed: fail (cnt = %" PRIu32 ")\n",
+				       cnt);
+				return EXIT_FAILURE;
+			}
+
+			printf("%10" PRIu32 " %13s %13.1f\n", cnt,
+			       policies[p].name, hit_ratio);
+		}
+	}
+
+	return EXIT_SUCCESS;
+}
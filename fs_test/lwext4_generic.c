@@ -36,9 +36,13 @@
 #include <time.h>
 #include <unistd.h>
 #include <sys/time.h>
+#include <sys/stat.h>
 
 #include <ext4.h>
 #include "../blockdev/linux/file_dev.h"
+#include "../blockdev/linux/uring_dev.h"
+#include "../blockdev/linux/mmap_dev.h"
+#include "../blockdev/linux/ram_dev.h"
 #include "../blockdev/windows/file_windows.h"
 #include "common/test_lwext4.h"
 
@@ -70,9 +74,48 @@ static bool sbstat = false;
 /**@brief   Indicates that input is windows partition.*/
 static bool winpart = false;
 
+/**@brief   Bypass the host page cache (O_DIRECT).*/
+static bool direct = false;
+
+/**@brief   Memory mapped block device.*/
+static bool mapped = false;
+
+/**@brief   RAM block device loaded from (and saved to) the input image.*/
+static bool ram = false;
+
+/**@brief   RAM block device emulated request latency (us).*/
+static uint32_t ram_lat_us = 0;
+
+/**@brief   RAM block device emulated bandwidth (KB/s, 0 - unlimited).*/
+static uint32_t ram_bw = 0;
+
+/**@brief   Asynchronous io_uring block device.*/
+static bool uring = false;
+
+/**@brief   Online discard of freed blocks + fstrim before umount.*/
+static bool discard = false;
+
+/**@brief   Delayed allocation of file blocks.*/
+static bool delalloc = false;
+
+/**@brief   File data cache size (blocks, 0 - disabled).*/
+static uint32_t data_cache = 0;
+
+/**@brief   Block request scheduler policy.*/
+static uint8_t elevator = EXT4_ELV_NONE;
+
 /**@brief   Verbose mode*/
 static bool verbose = 0;
 
+/**@brief   Block cache items count (0 - default).*/
+static uint32_t cache_cnt = 0;
+
+/**@brief   Block cache flags.*/
+static uint32_t cache_flags = 0;
+
+/**@brief   Block cache metadata pool size (0 - none).*/
+static uint32_t cache_meta = 0;
+
 /**@brief   Block device handle.*/
 static struct ext4_blockdev *bd;
 
@@ -91,15 +134,51 @@ Usage:                                                          \n\
 [-b] --bstat  - block device stats                              \n\
 [-t] --sbstat - superblock stats                                \n\
 [-w] --wpart  - windows partition mode                          \n\
+[-C] --cache  - block cache size     (default = config)         \n\
+[-H] --hash   - hash indexed block cache                        \n\
+[-A] --arena  - preallocated block cache arena                  \n\
+[-P] --policy - block cache policy: lru, 2q, arc (default = lru)\n\
+[-M] --meta   - block cache metadata pool size (default = 0)    \n\
+[-U] --uring  - asynchronous io_uring block device (linux)      \n\
+[-D] --direct - bypass host page cache, O_DIRECT (linux)        \n\
+[-m] --mmap   - memory mapped block device                      \n\
+[-T] --discard - online discard of freed blocks + fstrim        \n\
+[-E] --elevator - request scheduler: none, noop, deadline       \n\
+[-R] --ram    - RAM block device, image loaded and saved back   \n\
+[-L] --ram_lat - RAM block device request latency (us)          \n\
+[-B] --ram_bw - RAM block device bandwidth (KB/s)               \n\
+[-a] --delalloc - delayed allocation of file blocks             \n\
+[-F] --data_cache - file data cache size (blocks, default = 0)  \n\
 \n";
 
+/**@brief   Device busy time (us) at io_timings_clear: read, write.*/
+static uint64_t io_busy_us[2];
+
 void io_timings_clear(void)
 {
+	struct ext4_blockdev_io_stats st;
+
+	if (!bd || ext4_block_io_stats_get(bd, &st) != EOK)
+		return;
+
+	io_busy_us[0] = st.rd.time_us;
+	io_busy_us[1] = st.wr.time_us;
 }
 
 const struct ext4_io_stats *io_timings_get(uint32_t time_sum_ms)
 {
-	return NULL;
+	static struct ext4_io_stats io;
+	struct ext4_blockdev_io_stats st;
+
+	if (!bd || !time_sum_ms || ext4_block_io_stats_get(bd, &st) != EOK)
+		return NULL;
+
+	io.io_read = (float)(st.rd.time_us - io_busy_us[0]) / 10.0f /
+		     (float)time_sum_ms;
+	io.io_write = (float)(st.wr.time_us - io_busy_us[1]) / 10.0f /
+		      (float)time_sum_ms;
+	io.cpu = 100.0f - io.io_read - io.io_write;
+	return &io;
 }
 
 uint32_t tim_get_ms(void)
@@ -118,8 +197,27 @@ uint64_t tim_get_us(void)
 
 static bool open_linux(void)
 {
-	file_dev_name_set(input_name);
-	bd = file_dev_get();
+	if (ram) {
+		struct stat st;
+		if (stat(input_name, &st) ||
+		    !(bd = ram_dev_create(st.st_size))) {
+			printf("open_filedev: fail\n");
+			return false;
+		}
+		if (ram_dev_restore(bd, input_name) != EOK) {
+			printf("ram_dev_restore: fail\n");
+			return false;
+		}
+		ram_dev_emulate(bd, ram_lat_us, (uint64_t)ram_bw * 1024);
+	} else if (mapped) {
+		bd = mmap_dev_create(input_name, 0);
+	} else if (uring) {
+		bd = uring_dev_create(input_name);
+	} else {
+		file_dev_name_set(input_name);
+		file_dev_flags_set(direct ? FILE_DEV_DIRECT : 0);
+		bd = file_dev_get();
+	}
 	if (!bd) {
 		printf("open_filedev: fail\n");
 		return false;
@@ -153,6 +251,7 @@ static bool parse_opt(int argc, char **argv)
 {
 	int option_index = 0;
 	int c;
+	uint32_t cnt;
 
 	static struct option long_options[] = {
 	    {"input", required_argument, 0, 'i'},
@@ -165,9 +264,24 @@ static bool parse_opt(int argc, char **argv)
 	    {"wpart", no_argument, 0, 'w'},
 	    {"verbose", no_argument, 0, 'v'},
 	    {"version", no_argument, 0, 'x'},
+	    {"cache", required_argument, 0, 'C'},
+	    {"hash", no_argument, 0, 'H'},
+	    {"arena", no_argument, 0, 'A'},
+	    {"policy", required_argument, 0, 'P'},
+	    {"meta", required_argument, 0, 'M'},
+	    {"uring", no_argument, 0, 'U'},
+	    {"direct", no_argument, 0, 'D'},
+	    {"mmap", no_argument, 0, 'm'},
+	    {"discard", no_argument, 0, 'T'},
+	    {"elevator", required_argument, 0, 'E'},
+	    {"ram", no_argument, 0, 'R'},
+	    {"ram_lat", required_argument, 0, 'L'},
+	    {"ram_bw", required_argument, 0, 'B'},
+	    {"delalloc", no_argument, 0, 'a'},
+	    {"data_cache", required_argument, 0, 'F'},
 	    {0, 0, 0, 0}};
 
-	while (-1 != (c = getopt_long(argc, argv, "i:s:c:q:d:lbtwvx",
+	while (-1 != (c = getopt_long(argc, argv, "i:s:c:q:d:lbtwvxC:HAP:M:UDmTE:RL:B:aF:",
 				      long_options, &option_index))) {
 
 		switch (c) {
@@ -202,11 +316,80 @@ static bool parse_opt(int argc, char **argv)
 			puts(VERSION);
 			exit(0);
 			break;
+		case 'C':
+			cache_cnt = atoi(optarg);
+			break;
+		case 'H':
+			cache_flags |= EXT4_BCACHE_HASH;
+			break;
+		case 'A':
+			cache_flags |= EXT4_BCACHE_ARENA;
+			break;
+		case 'P':
+			cache_flags &= ~EXT4_BCACHE_POLICY_MASK;
+			if (!strcmp(optarg, "2q"))
+				cache_flags |= EXT4_BCACHE_2Q;
+			else if (!strcmp(optarg, "arc"))
+				cache_flags |= EXT4_BCACHE_ARC;
+			else if (strcmp(optarg, "lru")) {
+				printf("%s", usage);
+				return false;
+			}
+			break;
+		case 'M':
+			cache_meta = atoi(optarg);
+			break;
+		case 'U':
+			uring = true;
+			break;
+		case 'D':
+			direct = true;
+			break;
+		case 'm':
+			mapped = true;
+			break;
+		case 'T':
+			discard = true;
+			break;
+		case 'E':
+			if (!strcmp(optarg, "noop"))
+				elevator = EXT4_ELV_NOOP;
+			else if (!strcmp(optarg, "deadline"))
+				elevator = EXT4_ELV_DEADLINE;
+			else if (strcmp(optarg, "none")) {
+				printf("%s", usage);
+				return false;
+			}
+			break;
+		case 'R':
+			ram = true;
+			break;
+		case 'L':
+			ram_lat_us = atoi(optarg);
+			break;
+		case 'B':
+			ram_bw = atoi(optarg);
+			break;
+		case 'a':
+			delalloc = true;
+			break;
+		case 'F':
+			data_cache = atoi(optarg);
+			break;
 		default:
 			printf("%s", usage);
 			return false;
 		}
 	}
+
+	/* The general pool must keep at least one block. */
+	cnt = cache_cnt ? cache_cnt : CONFIG_BLOCK_DEV_CACHE_SIZE;
+	if (cache_meta >= cnt) {
+		printf("metadata pool (-M %" PRIu32 ") must be smaller than the "
+		       "block cache (%" PRIu32 " blocks), raise it with -C\n",
+		       cache_meta, cnt);
+		return false;
+	}
 	return true;
 }
 
@@ -226,12 +409,28 @@ int main(int argc, char **argv)
 		return EXIT_FAILURE;
 	}
 
+	if (elevator != EXT4_ELV_NONE && ext4_block_elv_set(bd, elevator) != EOK)
+		printf("ext4_block_elv_set: not supported\n");
+
+	if (bstat && ext4_block_io_stats_enable(bd, true, tim_get_us) != EOK)
+		printf("ext4_block_io_stats_enable: not supported\n");
+
 	if (verbose)
 		ext4_dmask_set(DEBUG_ALL);
 
+	test_lwext4_cache_setup(cache_cnt, cache_flags, cache_meta);
 	if (!test_lwext4_mount(bd, bc))
 		return EXIT_FAILURE;
 
+	if (discard && ext4_online_discard("/mp/", true) != EOK)
+		printf("ext4_online_discard: not supported\n");
+
+	if (delalloc && ext4_delalloc("/mp/", true) != EOK)
+		printf("ext4_delalloc: not supported\n");
+
+	if (data_cache)
+		ext4_data_cache("/mp/", data_cache);
+
 	test_lwext4_cleanup();
 
 	if (sbstat)
@@ -267,9 +466,30 @@ int main(int argc, char **argv)
 	if (bstat)
 		test_lwext4_block_stats();
 
+	if (data_cache) {
+		struct ext4_dcache_stats st;
+		ext4_data_cache_stats("/mp/", &st, false);
+		printf("data cache: hits = %" PRIu64 ", misses = %" PRIu64
+		       ", evictions = %" PRIu64 ", invalidations = %" PRIu64
+		       "\n", st.hits, st.misses, st.evictions,
+		       st.invalidations);
+	}
+
+	if (discard) {
+		uint64_t trimmed = 0;
+		int r = ext4_fstrim("/mp/", 0, &trimmed);
+		printf("ext4_fstrim: rc = %d, trimmed = %" PRIu64 " KB\n", r,
+		       trimmed / 1024);
+	}
+
 	if (!test_lwext4_umount())
 		return EXIT_FAILURE;
 
+	if (ram && ram_dev_snapshot(bd, input_name) != EOK) {
+		printf("ram_dev_snapshot: fail\n");
+		return EXIT_FAILURE;
+	}
+
 	printf("\ntest finished\n");
 	return EXIT_SUCCESS;
 }
@@ -0,0 +1,370 @@
+/*
+ * Copyright (c) 2013 Grzegorz Kostka (kostka.grzegorz@gmail.com)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * - Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * - The name of the author may not be used to endorse or promote products
+ *   derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <inttypes.h>
+
+#include <ext4.h>
+#include <ext4_mkfs.h>
+#include "../blockdev/linux/ram_dev.h"
+
+/**@brief   Files written by the test.*/
+#define STRESS_FILES 8
+
+/**@brief   Largest file size.*/
+#define STRESS_FSIZE (192 * 1024)
+
+/**@brief   Largest single write.*/
+#define STRESS_WSIZE (64 * 1024)
+
+/**@brief   Device size.*/
+#define STRESS_DEV_SIZE (32 * 1024 * 1024)
+
+/**@brief   Block cache items count.*/
+static uint32_t cache_cnt = 24;
+
+/**@brief   Block cache flags.*/
+static uint32_t cache_flags = EXT4_BCACHE_ARC;
+
+/**@brief   First seed.*/
+static uint32_t seed = 1;
+
+/**@brief   Seeds (file systems) count.*/
+static uint32_t seed_cnt = 8;
+
+/**@brief   Operations per seed.*/
+static uint32_t op_cnt = 1000;
+
+/**@brief   File system block size.*/
+static uint32_t block_size = 1024;
+
+/**@brief   Journal blocks (small journal wraps often).*/
+static uint32_t journal_blocks = 1024;
+
+/**@brief   Expected content of the files.*/
+static struct {
+	uint8_t data[STRESS_FSIZE];
+	size_t size;
+} model[STRESS_FILES];
+
+static uint8_t wbuf[STRESS_WSIZE];
+static uint8_t rbuf[STRESS_FSIZE];
+
+static const char *usage = "                                    \n\
+Welcome in lwext4 journal stress test.                          \n\
+Copyright (c) 2013 Grzegorz Kostka (kostka.grzegorz@gmail.com)  \n\
+Usage:                                                          \n\
+[-C] --cache  - block cache size     (default = 24)             \n\
+[-H] --hash   - hash indexed block cache                        \n\
+[-A] --arena  - preallocated block cache arena                  \n\
+[-P] --policy - block cache policy: lru, 2q, arc (default = arc)\n\
+[-s] --seed   - first seed           (default = 1)              \n\
+[-n] --seeds  - seeds count          (default = 8)              \n\
+[-o] --ops    - operations per seed  (default = 1000)           \n\
+[-b] --bsize  - block size           (default = 1024)           \n\
+[-j] --journal - journal blocks      (default = 1024)           \n\
+\n";
+
+static bool parse_opt(int argc, char **argv)
+{
+	int option_index = 0;
+	int c;
+
+	static struct option long_options[] = {
+	    {"cache", required_argument, 0, 'C'},
+	    {"hash", no_argument, 0, 'H'},
+	    {"arena", no_argument, 0, 'A'},
+	    {"policy", required_argument, 0, 'P'},
+	    {"seed", required_argument, 0, 's'},
+	    {"seeds", required_argument, 0, 'n'},
+	    {"ops", required_argument, 0, 'o'},
+	    {"bsize", required_argument, 0, 'b'},
+	    {"journal", required_argument, 0, 'j'},
+	    {0, 0, 0, 0}};
+
+	while (-1 != (c = getopt_long(argc, argv, "C:HAP:s:n:o:b:j:",
+				      long_options, &option_index))) {
+
+		switch (c) {
+		case 'C':
+			cache_cnt = atoi(optarg);
+			break;
+		case 'H':
+			cache_flags |= EXT4_BCACHE_HASH;
+			break;
+		case 'A':
+			cache_flags |= EXT4_BCACHE_ARENA;
+			break;
+		case 'P':
+			cache_flags &= ~EXT4_BCACHE_POLICY_MASK;
+			if (!strcmp(optarg, "2q"))
+				cache_flags |= EXT4_BCACHE_2Q;
+			else if (!strcmp(optarg, "arc"))
+				cache_flags |= EXT4_BCACHE_ARC;
+			else if (strcmp(optarg, "lru")) {
+				printf("%s", usage);
+				return false;
+			}
+			break;
+		case 's':
+			seed = atoi(optarg);
+			break;
+		case 'n':
+			seed_cnt = atoi(optarg);
+			break;
+		case 'o':
+			op_cnt = atoi(optarg);
+			break;
+		case 'b':
+			block_size = atoi(optarg);
+			break;
+		case 'j':
+			journal_blocks = atoi(optarg);
+			break;
+		default:
+			printf("%s", usage);
+			return false;
+		}
+	}
+	return true;
+}
+
+/**@brief   Compare a file with its model.*/
+static bool stress_verify(uint32_t f)
+{
+	char path[32];
+	ext4_file file;
+	size_t rcnt = 0;
+	int r;
+
+	sprintf(path, "/mp/f%" PRIu32, f);
+	r = ext4_fopen(&file, path, "rb");
+	if (r == ENOENT && !model[f].size)
+		return true;
+	if (r != EOK) {
+		printf("ext4_fopen: %s rc = %d\n", path, r);
+		return false;
+	}
+
+	if (ext4_fsize(&file) != model[f].size) {
+		printf("%s: size %" PRIu64 ", expected %zu\n", path,
+		       ext4_fsize(&file), model[f].size);
+		ext4_fclose(&file);
+		return false;
+	}
+
+	r = ext4_fread(&file, rbuf, model[f].size, &rcnt);
+	ext4_fclose(&file);
+	if (r != EOK || rcnt != model[f].size ||
+	    memcmp(rbuf, model[f].data, model[f].size)) {
+		printf("%s: data mismatch (rc = %d)\n", path, r);
+		return false;
+	}
+
+	return true;
+}
+
+/**@brief   Single random operation: write, append, truncate, read or
+ *          directory create.*/
+static bool stress_op(uint32_t op)
+{
+	uint32_t f = rand() % STRESS_FILES;
+	size_t off, len, wcnt = 0, i;
+	char path[32];
+	ext4_file file;
+	int r;
+
+	sprintf(path, "/mp/f%" PRIu32, f);
+	switch (rand() % 5) {
+	case 0:
+	case 1:
+		/* Overwrite or extend at a random offset up to EOF. */
+		off = model[f].size ? rand() % (model[f].size + 1) : 0;
+		len = rand() % STRESS_WSIZE + 1;
+		if (off + len > STRESS_FSIZE)
+			len = STRESS_FSIZE - off;
+		for (i = 0; i < len; i++)
+			wbuf[i] = (uint8_t)(rand() >> 8);
+
+		r = ext4_fopen(&file, path, model[f].size ? "r+" : "wb");
+		if (r == EOK) {
+			r = ext4_fseek(&file, off, SEEK_SET);
+			if (r == EOK)
+				r = ext4_fwrite(&file, wbuf, len, &wcnt);
+			ext4_fclose(&file);
+		}
+		if (r != EOK || wcnt != len) {
+			printf("%s: write rc = %d\n", path, r);
+			return false;
+		}
+
+		memcpy(model[f].data + off, wbuf, len);
+		if (model[f].size < off + len)
+			model[f].size = off + len;
+		return true;
+	case 2:
+		if (!model[f].size)
+			return true;
+
+		len = rand() % (model[f].size + 1);
+		r = ext4_fopen(&file, path, "r+");
+		if (r == EOK) {
+			r = ext4_ftruncate(&file, len);
+			ext4_fclose(&file);
+		}
+		if (r != EOK) {
+			printf("%s: truncate rc = %d\n", path, r);
+			return false;
+		}
+
+		model[f].size = len;
+		return true;
+	case 3:
+		return stress_verify(f);
+	default:
+		sprintf(path, "/mp/d%" PRIu32, op);
+		r = ext4_dir_mk(path);
+		if (r != EOK) {
+			printf("%s: mkdir rc = %d\n", path, r);
+			return false;
+		}
+		return true;
+	}
+}
+
+static bool stress_mount(struct ext4_blockdev *bd)
+{
+	int r;
+
+	r = ext4_device_register(bd, "ext4_fs");
+	if (r == EOK)
+		r = ext4_device_setup_cache("ext4_fs", cache_cnt, cache_flags);
+	if (r == EOK)
+		r = ext4_mount("ext4_fs", "/mp/", false);
+	if (r == EOK)
+		r = ext4_recover("/mp/");
+	if (r == EOK || r == ENOTSUP)
+		r = ext4_journal_start("/mp/");
+	if (r != EOK) {
+		printf("stress_mount: rc = %d\n", r);
+		return false;
+	}
+
+	ext4_cache_write_back("/mp/", 1);
+	return true;
+}
+
+static bool stress_umount(void)
+{
+	int r;
+
+	ext4_cache_write_back("/mp/", 0);
+	r = ext4_journal_stop("/mp/");
+	if (r == EOK)
+		r = ext4_umount("/mp/");
+	ext4_device_unregister("ext4_fs");
+	if (r != EOK) {
+		printf("stress_umount: rc = %d\n", r);
+		return false;
+	}
+	return true;
+}
+
+static bool stress_run(uint32_t s)
+{
+	struct ext4_mkfs_info info = {
+		.block_size = block_size,
+		.journal_blocks = journal_blocks,
+		.journal = true,
+	};
+	struct ext4_blockdev *bd;
+	struct ext4_fs fs;
+	bool ok = false;
+	uint32_t i;
+
+	srand(s);
+	memset(model, 0, sizeof(model));
+
+	bd = ram_dev_create(STRESS_DEV_SIZE);
+	if (!bd) {
+		printf("ram_dev_create: fail\n");
+		return false;
+	}
+
+	if (ext4_mkfs(&fs, bd, &info, F_SET_EXT4) != EOK) {
+		printf("ext4_mkfs: fail\n");
+		goto Finish;
+	}
+
+	if (!stress_mount(bd))
+		goto Finish;
+
+	for (i = 0; i < op_cnt; i++)
+		if (!stress_op(i))
+			break;
+
+	if (!stress_umount() || i < op_cnt)
+		goto Finish;
+
+	/* Everything has to be on the device after a clean umount. */
+	if (!stress_mount(bd))
+		goto Finish;
+
+	for (i = 0; i < STRESS_FILES; i++)
+		if (!stress_verify(i))
+			break;
+
+	ok = stress_umount() && i == STRESS_FILES;
+
+Finish:
+	ram_dev_destroy(bd);
+	printf("seed %" PRIu32 ": %s\n", s, ok ? "ok" : "FAIL");
+	return ok;
+}
+
+int main(int argc, char **argv)
+{
+	uint32_t i;
+	bool ok = true;
+
+	if (!parse_opt(argc, argv))
+		return EXIT_FAILURE;
+
+	printf("journal stress: cache = %" PRIu32 ", flags = 0x%" PRIx32
+	       ", block size = %" PRIu32 ", journal = %" PRIu32 "\n",
+	       cache_cnt, cache_flags, block_size, journal_blocks);
+
+	for (i = 0; i < seed_cnt; i++)
+		ok &= stress_run(seed + i);
+
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
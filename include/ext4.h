@@ -52,6 +52,7 @@ extern "C" {
 #include <ext4_debug.h>
 
 #include <ext4_blockdev.h>
+#include <ext4_dcache.h>
 
 /********************************OS LOCK INFERFACE***************************/
 
@@ -86,6 +87,15 @@ typedef struct ext4_file {
 	uint64_t fpos;
 } ext4_file;
 
+/**@brief   File I/O buffer (@ref ext4_preadv, @ref ext4_pwritev).*/
+struct ext4_iovec {
+	/**@brief   Buffer.*/
+	void *base;
+
+	/**@brief   Buffer length.*/
+	size_t len;
+};
+
 /*****************************DIRECTORY DESCRIPTOR***************************/
 
 /**@brief   Directory entry descriptor. */
@@ -130,6 +140,55 @@ int ext4_device_unregister(const char *dev_name);
  * @return  Standard error code.*/
 int ext4_device_unregister_all(void);
 
+/**@brief   Setup block cache used when the block device gets mounted.
+ *          Has to be called before @ref ext4_mount.
+ *
+ * @param   dev_name Block device name.
+ * @param   cnt Block cache items count (0 - CONFIG_BLOCK_DEV_CACHE_SIZE).
+ * @param   flags Block cache flags:
+ *              @ref EXT4_BCACHE_HASH
+ *              @ref EXT4_BCACHE_ARENA
+ *              and one of replacement policies:
+ *              @ref EXT4_BCACHE_LRU
+ *              @ref EXT4_BCACHE_2Q
+ *              @ref EXT4_BCACHE_ARC
+ *
+ * @return  Standard error code.*/
+int ext4_device_setup_cache(const char *dev_name, uint32_t cnt,
+			    uint32_t flags);
+
+/**@brief   Split block cache into a metadata pool and a general pool
+ *          (@ref ext4_bcache_setup_pools). Metadata pool buffers are
+ *          pinned, they are never evicted by directory or extent scans.
+ *          Has to be called before @ref ext4_mount.
+ *
+ * @param   dev_name Block device name.
+ * @param   meta_cnt Metadata pool items count, less than cache items
+ *          count (0 - single pool).
+ * @param   meta_cls Buffer classes of the metadata pool, bit mask of
+ *          1 << EXT4_BCACHE_CLS_* (0 - @ref EXT4_BCACHE_META_DEFAULT:
+ *          group descriptors and bitmaps).
+ *
+ * @return  Standard error code.*/
+int ext4_device_setup_cache_pools(const char *dev_name, uint32_t meta_cnt,
+				  uint32_t meta_cls);
+
+/**@brief   Setup block cache warm-up of a block device.
+ *          @ref ext4_umount stores LBAs of the hottest cached blocks
+ *          (group descriptors, bitmaps, inode table, directories...) to
+ *          lba and their count to cnt. @ref ext4_mount prefetches them
+ *          back, in LBA-sorted batched reads, when cnt is not 0.
+ *          Caller owns the buffer and may persist it across restarts.
+ *
+ * @param   dev_name Block device name.
+ * @param   lba LBAs buffer (NULL - disable warm-up).
+ * @param   max LBAs buffer size (entries).
+ * @param   cnt LBAs count in buffer (in/out, 0 - nothing to prefetch).
+ *
+ * @return  Standard error code.*/
+int ext4_device_setup_warmup(const char *dev_name, uint64_t *lba,
+			     uint32_t max, uint32_t *cnt);
+
 /**@brief   Mount a block device with EXT4 partition to the mount point.
  *
  * @param   dev_name Block device name (@ref ext4_device_register).
@@ -206,6 +265,44 @@ struct ext4_mount_stats {
 int ext4_mount_point_stats(const char *mount_point,
 			   struct ext4_mount_stats *stats);
 
+/**@brief   Get block cache stats of a mount point: hit/miss ratio,
+ *          evictions, write-backs and counters per metadata class
+ *          (bitmaps, inode table, extent index, directories, journal).
+ *          Useful to size the block cache (see
+ *          @ref ext4_device_setup_cache).
+ *
+ * @param   mount_point Mount point.
+ * @param   stats Block cache stats.
+ * @param   clear Reset the counters after reading them.
+ *
+ * @return Standard error code. */
+int ext4_mount_point_cache_stats(const char *mount_point,
+				 struct ext4_bcache_stats *stats, bool clear);
+
+/**@brief   Setup file data cache of a mount point. Regular file blocks
+ *          read by @ref ext4_fread are kept (up to cnt blocks, least
+ *          recently used are evicted) and repeated reads are served
+ *          from memory. The cache is separate from the block cache, so
+ *          file data can't evict metadata. Writes and truncation
+ *          invalidate cached blocks. Disabled by default.
+ *
+ * @param   mount_point Mount point.
+ * @param   cnt Cache size in blocks (0 - disable). Cached blocks are
+ *          dropped.
+ *
+ * @return Standard error code. */
+int ext4_data_cache(const char *mount_point, uint32_t cnt);
+
+/**@brief   Get file data cache stats of a mount point.
+ *
+ * @param   mount_point Mount point.
+ * @param   stats Data cache stats.
+ * @param   clear Reset the counters after reading them.
+ *
+ * @return Standard error code. */
+int ext4_data_cache_stats(const char *mount_point,
+			  struct ext4_dcache_stats *stats, bool clear);
+
 /**@brief   Setup OS lock routines.
  *
  * @param   mount_point Mount point.
@@ -268,6 +365,128 @@ int ext4_cache_write_back(const char *path, bool on);
  * @return  Standard error code. */
 int ext4_cache_flush(const char *path);
 
+/**@brief   Setup background write-back (flusher) of a mount point.
+ *          Flusher lets dirty buffers reach the disk before the cache
+ *          has to evict them, so foreground operations rarely pay
+ *          for write-back. It is driven by the host: a thread or a timer
+ *          calls @ref ext4_cache_flusher_tick periodically (and when
+ *          kick() callback wakes it up):
+ *
+ *          static uint32_t time_ms(void) { ... }
+ *          static void kick(void *arg) { wake_up_flusher_thread(); }
+ *
+ *          struct ext4_bcache_wb wb = {
+ *              .time_ms = time_ms,
+ *              .kick = kick,
+ *              .dirty_age_ms = 5000,
+ *              .dirty_ratio = 50,
+ *          };
+ *          ext4_cache_flusher_setup("/mp/", &wb);
+ *
+ *          flusher thread:
+ *              while (running) {
+ *                  wait_for_kick_or_timeout(1000);
+ *                  ext4_cache_flusher_tick("/mp/");
+ *              }
+ *
+ *          Write back cache mode (@ref ext4_cache_write_back) has to be
+ *          enabled, otherwise there is nothing to do for the flusher.
+ *
+ * @param   path Mount point.
+ * @param   wb Flusher setup (NULL - disable).
+ *
+ * @return  Standard error code. */
+int ext4_cache_flusher_setup(const char *path,
+			     const struct ext4_bcache_wb *wb);
+
+/**@brief   Single flusher step: writes back dirty buffers exceeding
+ *          dirty ratio or age (@ref ext4_cache_flusher_setup).
+ *          Takes the mount point lock (@ref ext4_mount_setup_locks).
+ *
+ * @param   path Mount point.
+ *
+ * @return  Standard error code. */
+int ext4_cache_flusher_tick(const char *path);
+
+/**@brief   Resize block cache of a mount point online
+ *          (@ref ext4_bcache_resize). Lets the host rebalance memory
+ *          between mount points.
+ *
+ * @param   path Mount point.
+ * @param   cnt New block cache items count.
+ *
+ * @return  Standard error code. */
+int ext4_cache_resize(const char *path, uint32_t cnt);
+
+/**@brief   Memory pressure hook: drop clean, unreferenced buffers of a
+ *          mount point down to target buffers (@ref ext4_bcache_shed).
+ *          Nothing is written, so it is cheap enough for a host
+ *          low-memory notifier:
+ *
+ *          static void on_low_memory(void *arg)
+ *          {
+ *              ext4_cache_shed("/mp/", 16, NULL);
+ *          }
+ *          host_register_mem_pressure(on_low_memory, NULL);
+ *
+ *          Takes the mount point lock, so it must not be called from
+ *          allocations made by lwext4 itself.
+ *
+ * @param   path Mount point.
+ * @param   target Buffers count to shrink to.
+ * @param   freed Buffers dropped (optional).
+ *
+ * @return  Standard error code. */
+int ext4_cache_shed(const char *path, uint32_t target, uint32_t *freed);
+
+/**@brief   Enable/disable online discard. Blocks freed by a transaction
+ *          are queued and discarded on the block device after the
+ *          transaction is committed (@ref CONFIG_DISCARD_QUEUE).
+ *          Without a journal the block cache is written back first.
+ *          Ranges the queue can't hold are left for @ref ext4_fstrim.
+ *
+ * @param   path Mount point.
+ * @param   on Enable/disable online discard.
+ *
+ * @return  Standard error code, ENOTSUP when the block device has
+ *          no discard callback. */
+int ext4_online_discard(const char *path, bool on);
+
+/**@brief   Discard all free block runs of at least min_len bytes
+ *          (like FITRIM). Block groups never used (BLOCK_UNINIT)
+ *          are skipped.
+ *
+ * @param   path Mount point.
+ * @param   min_len Minimal free run length in bytes.
+ * @param   trimmed Bytes discarded (optional).
+ *
+ * @return  Standard error code. */
+int ext4_fstrim(const char *path, uint64_t min_len, uint64_t *trimmed);
+
+/**@brief   Enable/disable delayed allocation. Regular file data written
+ *          past the allocated blocks is held in memory, blocks are
+ *          allocated when it is flushed: by @ref ext4_cache_flush,
+ *          @ref ext4_journal_stop, @ref ext4_umount, when more than
+ *          CONFIG_DELALLOC_PAGES blocks are pending or when delayed
+ *          allocation is disabled. @ref ext4_fclose does not flush.
+ *          Allocation then knows the final file sizes, and data of
+ *          files removed or truncated before the flush never reaches
+ *          the allocator. Writes larger than the limit are not delayed.
+ *          Pending data is lost on power failure.
+ *
+ *          Free blocks for the held data (and its worst case mapping
+ *          blocks) are reserved by the write, which fails with ENOSPC
+ *          when they are not available. Flush errors are returned by
+ *          the call which flushed (including the write which needed
+ *          the room); the data which failed is dropped.
+ *
+ * @param   path Mount point.
+ * @param   on Enable/disable delayed allocation.
+ *
+ * @return  Standard error code, ENOTSUP when compiled out
+ *          (CONFIG_DELALLOC_PAGES = 0). */
+int ext4_delalloc(const char *path, bool on);
+
 /********************************FILE OPERATIONS*****************************/
 
 /**@brief   Remove file by path.
@@ -358,6 +577,67 @@ int ext4_fread(ext4_file *file, void *buf, size_t size, size_t *rcnt);
  * @return  Standard error code.*/
 int ext4_fwrite(ext4_file *file, const void *buf, size_t size, size_t *wcnt);
 
+/**@brief   Read data from file at an offset. File position is neither
+ *          used nor changed, so threads can share a file handle.
+ *
+ * @param   file File handle.
+ * @param   buf  Output buffer.
+ * @param   size Bytes to read.
+ * @param   offset File offset.
+ * @param   rcnt Bytes read (NULL allowed), 0 past the end of file.
+ *
+ * @return  Standard error code.*/
+int ext4_pread(ext4_file *file, void *buf, size_t size, uint64_t offset,
+	       size_t *rcnt);
+
+/**@brief   Write data to file at an offset. File position is neither
+ *          used nor changed.
+ *
+ * @param   file File handle.
+ * @param   buf  Data to write.
+ * @param   size Write length.
+ * @param   offset File offset, up to the file size (no holes).
+ * @param   wcnt Bytes written (NULL allowed).
+ *
+ * @return  Standard error code, EINVAL when offset is past the end
+ *          of file.*/
+int ext4_pwrite(ext4_file *file, const void *buf, size_t size,
+		uint64_t offset, size_t *wcnt);
+
+/**@brief   Read data from file at an offset into scattered buffers
+ *          (filled one after another, like preadv). The range is
+ *          mapped run by run and whole blocks go to the buffers with as
+ *          few vectored block device requests as possible. File position
+ *          is neither used nor changed.
+ *
+ * @param   file File handle.
+ * @param   iov  Buffers.
+ * @param   iovcnt Buffers count.
+ * @param   offset File offset.
+ * @param   rcnt Bytes read (NULL allowed).
+ *
+ * @return  Standard error code, EINVAL when the buffers length
+ *          overflows size_t.*/
+int ext4_preadv(ext4_file *file, const struct ext4_iovec *iov, int iovcnt,
+		uint64_t offset, size_t *rcnt);
+
+/**@brief   Write data from scattered buffers to file at an offset
+ *          (written one after another, like pwritev), under a single
+ *          mount point lock and journal transaction. Segments are
+ *          mapped and written one by one (device requests are not
+ *          batched). File position is neither used nor changed.
+ *
+ * @param   file File handle.
+ * @param   iov  Buffers.
+ * @param   iovcnt Buffers count.
+ * @param   offset File offset, up to the file size (no holes).
+ * @param   wcnt Bytes written (NULL allowed).
+ *
+ * @return  Standard error code, EINVAL when the buffers length
+ *          overflows size_t.*/
+int ext4_pwritev(ext4_file *file, const struct ext4_iovec *iov, int iovcnt,
+		 uint64_t offset, size_t *wcnt);
+
 /**@brief   File seek operation.
  *
  * @param   file File handle.
@@ -384,6 +664,14 @@ uint64_t ext4_ftell(ext4_file *file);
  * @return  File size. */
 uint64_t ext4_fsize(ext4_file *file);
 
+/**@brief   Count physically contiguous data block runs of a file.
+ *          Holes are not counted.
+ *
+ * @param   file    File handle.
+ * @param   extents Number of runs (1 for an unfragmented file).
+ *
+ * @return  Standard error code.*/
+int ext4_ffrag(ext4_file *file, uint32_t *extents);
 
 /**@brief Get inode of file/directory/link.
  *
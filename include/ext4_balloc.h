@@ -93,6 +93,12 @@ int ext4_balloc_free_block(struct ext4_inode_ref *inode_ref,
 int ext4_balloc_free_blocks(struct ext4_inode_ref *inode_ref,
 			    ext4_fsblk_t first, uint32_t count);
 
+/**@brief   Free blocks available to allocation: free blocks count less
+ *          the blocks reserved for delayed allocation.
+ * @param   fs filesystem
+ * @return  available blocks count*/
+uint64_t ext4_balloc_avail_blocks(struct ext4_fs *fs);
+
 /**@brief   Allocate block procedure.
  * @param   inode_ref inode reference
  * @param   baddr allocated block address
@@ -101,6 +107,17 @@ int ext4_balloc_alloc_block(struct ext4_inode_ref *inode_ref,
 			    ext4_fsblk_t goal,
 			    ext4_fsblk_t *baddr);
 
+/**@brief   Allocate a run of contiguous blocks: one bitmap and one
+ *          group descriptor update for the whole run.
+ * @param   inode_ref inode reference
+ * @param   goal preferred first block
+ * @param   count blocks wanted (input), allocated (output, >= 1)
+ * @param   baddr first allocated block address
+ * @return  standard error code*/
+int ext4_balloc_alloc_blocks(struct ext4_inode_ref *inode_ref,
+			     ext4_fsblk_t goal, uint32_t *count,
+			     ext4_fsblk_t *baddr);
+
 /**@brief   Try allocate selected block.
  * @param   inode_ref inode reference
  * @param   baddr block address to allocate
@@ -109,6 +126,25 @@ int ext4_balloc_alloc_block(struct ext4_inode_ref *inode_ref,
 int ext4_balloc_try_alloc_block(struct ext4_inode_ref *inode_ref,
 				ext4_fsblk_t baddr, bool *free);
 
+/**@brief   Discard freed blocks queued since the last call. Called once
+ *          frees are committed.
+ * @param   fs filesystem
+ * @return  standard error code*/
+int ext4_balloc_discard_flush(struct ext4_fs *fs);
+
+/**@brief   Drop queued discards (transaction aborted).
+ * @param   fs filesystem*/
+void ext4_balloc_discard_drop(struct ext4_fs *fs);
+
+/**@brief   Discard free block runs found in block bitmaps. Groups with
+ *          uninitialized block bitmap are skipped.
+ * @param   fs filesystem
+ * @param   min_cnt shortest run to discard (blocks)
+ * @param   trimmed discarded blocks count (output)
+ * @return  standard error code*/
+int ext4_balloc_trim(struct ext4_fs *fs, ext4_fsblk_t min_cnt,
+		     uint64_t *trimmed);
+
 #ifdef __cplusplus
 }
 #endif
@@ -44,6 +44,7 @@ extern "C" {
 #include <ext4_config.h>
 
 #include <stdint.h>
+#include <stddef.h>
 #include <stdbool.h>
 #include <misc/tree.h>
 #include <misc/queue.h>
@@ -65,6 +66,125 @@ struct ext4_block {
 
 struct ext4_bcache;
 
+/**@brief   Ghost entry: LBA of a recently evicted buffer.
+ *          Used by @ref EXT4_BCACHE_2Q and @ref EXT4_BCACHE_ARC.*/
+struct ext4_bghost {
+	/**@brief   Logical block address*/
+	uint64_t lba;
+
+	/**@brief   Replacement queue the buffer was evicted from*/
+	uint8_t queue;
+
+	/**@brief   LBA tree node*/
+	RB_ENTRY(ext4_bghost) lba_node;
+
+	/**@brief   Ghost list node*/
+	TAILQ_ENTRY(ext4_bghost) link;
+};
+
+/**@brief   Replacement queues count*/
+#define EXT4_BCACHE_QUEUES 2
+
+/**@brief   Buffer classes (statistics and metadata pool), passed with
+ *          the request (@ref ext4_bcache_alloc_cls, ext4_block_get_cls,
+ *          ext4_trans_block_get_cls...)
+ *
+ *  - EXT4_BCACHE_CLS_OTHER: untagged (superblock, mkfs, journal replay)
+ *  - EXT4_BCACHE_CLS_GDT: block group descriptors
+ *  - EXT4_BCACHE_CLS_BITMAP: block and inode bitmaps
+ *  - EXT4_BCACHE_CLS_ITABLE: inode table
+ *  - EXT4_BCACHE_CLS_INDEX: extent tree and indirect blocks
+ *  - EXT4_BCACHE_CLS_DIR: directory blocks (linear and htree)
+ *  - EXT4_BCACHE_CLS_XATTR: extended attribute blocks
+ *  - EXT4_BCACHE_CLS_JOURNAL: journal blocks
+ */
+#define EXT4_BCACHE_CLS_OTHER 0
+#define EXT4_BCACHE_CLS_GDT 1
+#define EXT4_BCACHE_CLS_BITMAP 2
+#define EXT4_BCACHE_CLS_ITABLE 3
+#define EXT4_BCACHE_CLS_INDEX 4
+#define EXT4_BCACHE_CLS_DIR 5
+#define EXT4_BCACHE_CLS_XATTR 6
+#define EXT4_BCACHE_CLS_JOURNAL 7
+#define EXT4_BCACHE_CLS_COUNT 8
+
+/**@brief   Buffer classes kept in the metadata pool by default
+ *          (@ref ext4_bcache_setup_pools): allocator metadata.*/
+#define EXT4_BCACHE_META_DEFAULT                                               \
+	((1 << EXT4_BCACHE_CLS_GDT) | (1 << EXT4_BCACHE_CLS_BITMAP))
+
+/**@brief   Per buffer class counters*/
+struct ext4_bcache_cls_stats {
+	/**@brief   Cache hits*/
+	uint64_t hits;
+
+	/**@brief   Cache misses*/
+	uint64_t misses;
+
+	/**@brief   Buffers evicted to make room for others or shed*/
+	uint64_t evictions;
+
+	/**@brief   Buffers currently in cache*/
+	uint32_t blocks;
+};
+
+/**@brief   Block cache statistics (@ref ext4_bcache_get_stats)*/
+struct ext4_bcache_stats {
+	/**@brief   Item count in block cache*/
+	uint32_t cnt;
+
+	/**@brief   Item size in block cache*/
+	uint32_t itemsize;
+
+	/**@brief   Currently referenced datablocks*/
+	uint32_t ref_blocks;
+
+	/**@brief   Maximum referenced datablocks*/
+	uint32_t max_ref_blocks;
+
+	/**@brief   Buffers on dirty list*/
+	uint32_t dirty_blocks;
+
+	/**@brief   Metadata pool size*/
+	uint32_t meta_cnt;
+
+	/**@brief   Pinned buffers*/
+	uint32_t pinned_blocks;
+
+	/**@brief   Cache hits*/
+	uint64_t hits;
+
+	/**@brief   Cache misses*/
+	uint64_t misses;
+
+	/**@brief   Buffers evicted to make room for others or shed*/
+	uint64_t evictions;
+
+	/**@brief   Evicted buffers that had to be written first*/
+	uint64_t dirty_evictions;
+
+	/**@brief   Buffers written back to the block device*/
+	uint64_t writes;
+
+	/**@brief   Buffers filled by readahead*/
+	uint64_t ra_blocks;
+
+	/**@brief   Readahead buffers requested later (hits)*/
+	uint64_t ra_hits;
+
+	/**@brief   Readahead buffers dropped without being requested*/
+	uint64_t ra_waste;
+
+	/**@brief   Heap allocations done by the block cache*/
+	uint32_t alloc_ctr;
+
+	/**@brief   Bytes requested from heap by the block cache*/
+	uint64_t alloc_bytes;
+
+	/**@brief   Counters per buffer class (EXT4_BCACHE_CLS_*)*/
+	struct ext4_bcache_cls_stats cls[EXT4_BCACHE_CLS_COUNT];
+};
+
 /**@brief   Single block descriptor*/
 struct ext4_buf {
 	/**@brief   Flags*/
@@ -97,8 +217,24 @@ struct ext4_buf {
 	/**@brief   LRU tree node*/
 	RB_ENTRY(ext4_buf) lru_node;
 
+	/**@brief   Replacement queue node (list based modes)*/
+	TAILQ_ENTRY(ext4_buf) lru_link;
+
+	/**@brief   Replacement queue this buffer belongs to*/
+	uint8_t lru_queue;
+
+	/**@brief   Buffer class (EXT4_BCACHE_CLS_*)*/
+	uint8_t cls;
+
+	/**@brief   Free list node (@ref EXT4_BCACHE_ARENA mode)*/
+	SLIST_ENTRY(ext4_buf) free_node;
+
 	/**@brief   Dirty list node*/
-	SLIST_ENTRY(ext4_buf) dirty_node;
+	TAILQ_ENTRY(ext4_buf) dirty_node;
+
+	/**@brief   Time (ms) the buffer got on dirty list first
+	 *          (0 - clean or no time source)*/
+	uint32_t dirty_time;
 
 	/**@brief   Callback routine after a disk-write operation.
 	 * @param   bc block cache descriptor
@@ -114,6 +250,29 @@ struct ext4_buf {
 	void *end_write_arg;
 };
 
+/**@brief   Background write-back (flusher) setup. Flusher is driven by
+ *          the host: a thread or timer calls
+ *          @ref ext4_block_cache_writeback periodically.*/
+struct ext4_bcache_wb {
+	/**@brief   Monotonic time source (milliseconds).*/
+	uint32_t (*time_ms)(void);
+
+	/**@brief   Wake up the flusher. Called (when set) as soon as dirty
+	 *          buffers exceed dirty_ratio.
+	 * @param   arg argument passed to this routine*/
+	void (*kick)(void *arg);
+
+	/**@brief   Argument passed to kick() callback.*/
+	void *kick_arg;
+
+	/**@brief   Write back buffers dirty for longer than this (0 - off).*/
+	uint32_t dirty_age_ms;
+
+	/**@brief   Write back when dirty buffers exceed this percentage of
+	 *          cache items count (0 - off).*/
+	uint32_t dirty_ratio;
+};
+
 /**@brief   Block cache descriptor*/
 struct ext4_bcache {
 
@@ -123,6 +282,9 @@ struct ext4_bcache {
 	/**@brief   Item size in block cache*/
 	uint32_t itemsize;
 
+	/**@brief   Block cache flags (EXT4_BCACHE_*)*/
+	uint32_t flags;
+
 	/**@brief   Last recently used counter*/
 	uint32_t lru_ctr;
 
@@ -132,6 +294,12 @@ struct ext4_bcache {
 	/**@brief   Maximum referenced datablocks*/
 	uint32_t max_ref_blocks;
 
+	/**@brief   Heap allocations done by the block cache*/
+	uint32_t alloc_ctr;
+
+	/**@brief   Bytes requested from heap by the block cache*/
+	uint64_t alloc_bytes;
+
 	/**@brief   The blockdev binded to this block cache*/
 	struct ext4_blockdev *bdev;
 
@@ -144,10 +312,133 @@ struct ext4_bcache {
 	/**@brief   A tree holding unreferenced bufs*/
 	RB_HEAD(ext4_buf_lru, ext4_buf) lru_root;
 
-	/**@brief   A singly-linked list holding dirty buffers*/
-	SLIST_HEAD(ext4_buf_dirty, ext4_buf) dirty_list;
+	/**@brief   Hash table holding all bufs (@ref EXT4_BCACHE_HASH mode)*/
+	struct ext4_buf **htab;
+
+	/**@brief   Hash table size: 1 << hbits slots*/
+	uint32_t hbits;
+
+	/**@brief   Replacement queues holding unreferenced bufs, least
+	 *          recently used first (list based modes)*/
+	TAILQ_HEAD(ext4_buf_lru_list, ext4_buf) lru_list[EXT4_BCACHE_QUEUES];
+
+	/**@brief   Buffers count (referenced or not) per replacement queue*/
+	uint32_t lru_qcnt[EXT4_BCACHE_QUEUES];
+
+	/**@brief   Ghost entries memory (cnt entries)*/
+	struct ext4_bghost *ghosts;
+
+	/**@brief   A tree holding ghost entries in use*/
+	RB_HEAD(ext4_bghost_lba, ext4_bghost) ghost_root;
+
+	/**@brief   Ghost lists, oldest entry first*/
+	TAILQ_HEAD(ext4_bghost_list, ext4_bghost) ghost_list[EXT4_BCACHE_QUEUES];
+
+	/**@brief   A list holding unused ghost entries*/
+	struct ext4_bghost_list ghost_free;
+
+	/**@brief   Ghost entries count per ghost list*/
+	uint32_t ghost_cnt[EXT4_BCACHE_QUEUES];
+
+	/**@brief   ARC target size of the recency queue*/
+	uint32_t arc_p;
+
+	/**@brief   Cache hits (@ref ext4_bcache_alloc)*/
+	uint64_t hit_ctr;
+
+	/**@brief   Cache misses (@ref ext4_bcache_alloc)*/
+	uint64_t miss_ctr;
+
+	/**@brief   Buffers evicted by @ref ext4_block_cache_shake and
+	 *          @ref ext4_bcache_shed*/
+	uint64_t evict_ctr;
+
+	/**@brief   Dirty buffers evicted by @ref ext4_block_cache_shake*/
+	uint64_t dirty_evict_ctr;
+
+	/**@brief   Buffers written back to the block device*/
+	uint64_t write_ctr;
+
+	/**@brief   Buffers filled by readahead*/
+	uint64_t ra_ctr;
+
+	/**@brief   Readahead buffers requested later*/
+	uint64_t ra_hit_ctr;
+
+	/**@brief   Readahead buffers dropped without being requested*/
+	uint64_t ra_waste_ctr;
+
+	/**@brief   Pinned buffers count*/
+	uint32_t pin_cnt;
+
+	/**@brief   Metadata pool size: items reserved for pinned buffers*/
+	uint32_t meta_cnt;
+
+	/**@brief   Buffer classes pinned to metadata pool
+	 *          (bit mask of 1 << EXT4_BCACHE_CLS_*)*/
+	uint32_t meta_cls;
+
+	/**@brief   Counters per buffer class*/
+	struct ext4_bcache_cls_stats cls_stats[EXT4_BCACHE_CLS_COUNT];
+
+	/**@brief   Single allocation backing cnt buffers
+	 *          (@ref EXT4_BCACHE_ARENA mode)*/
+	void *arena;
+
+	/**@brief   Buffer descriptors carved from the arena*/
+	struct ext4_buf *arena_bufs;
+
+	/**@brief   Buffer descriptors count in the arena*/
+	uint32_t arena_cnt;
+
+	/**@brief   A singly-linked list holding unused arena buffers*/
+	SLIST_HEAD(ext4_buf_free, ext4_buf) free_list;
+
+	/**@brief   Gather buffer for merged writes
+	 *          (CONFIG_BLOCK_DEV_FLUSH_MERGE items)*/
+	uint8_t *gather_buf;
+
+	/**@brief   A list holding dirty buffers*/
+	TAILQ_HEAD(ext4_buf_dirty, ext4_buf) dirty_list;
+
+	/**@brief   Buffers count on dirty list*/
+	uint32_t dirty_cnt;
+
+	/**@brief   Background write-back setup*/
+	struct ext4_bcache_wb wb;
 };
 
+/**@brief block cache flags
+ *
+ *  - EXT4_BCACHE_HASH: index buffers by an open-addressing hash table
+ *                      keyed by LBA and keep unreferenced buffers on
+ *                      an intrusive LRU list instead of the two RB-trees.
+ *                      Lookup and eviction become O(1).
+ *  - EXT4_BCACHE_ARENA: carve cnt buffer descriptors and cnt * itemsize
+ *                       bytes of page aligned data from one allocation
+ *                       made at init. Buffers are recycled through a
+ *                       free list, heap is used only when referenced
+ *                       buffers overcommit the cache.
+ */
+#define EXT4_BCACHE_HASH (1 << 0)
+#define EXT4_BCACHE_ARENA (1 << 1)
+
+/**@brief block cache replacement policy (one of, in flags)
+ *
+ *  - EXT4_BCACHE_LRU: evict least recently used buffer (default).
+ *  - EXT4_BCACHE_2Q: blocks seen once live in a small FIFO (A1in, 1/4 of
+ *                    the cache), blocks re-referenced after eviction
+ *                    (found in A1out ghost list) go to the main LRU (Am).
+ *                    A streaming scan only recycles A1in.
+ *  - EXT4_BCACHE_ARC: adaptive replacement cache. Balances recency (T1)
+ *                     and frequency (T2) queues using hits in the ghost
+ *                     lists of evicted blocks (B1/B2).
+ */
+#define EXT4_BCACHE_POLICY_MASK (3 << 2)
+#define EXT4_BCACHE_LRU (0 << 2)
+#define EXT4_BCACHE_2Q (1 << 2)
+#define EXT4_BCACHE_ARC (2 << 2)
+
 /**@brief buffer state bits
  *
  *  - BC♡UPTODATE: Buffer contains valid data.
@@ -156,12 +447,17 @@ struct ext4_bcache {
  *              when no one references it.
  *  - BC_TMP: Buffer will be dropped once its refctr
  *            reaches zero.
+ *  - BC_PINNED: Buffer is never evicted (kept off the
+ *               replacement queues), see @ref ext4_bcache_pin.
+ *  - BC_RA: Buffer filled by readahead, not requested yet.
  */
 enum bcache_state_bits {
 	BC_UPTODATE,
 	BC_DIRTY,
 	BC_FLUSH,
-	BC_TMP
+	BC_TMP,
+	BC_PINNED,
+	BC_RA
 };
 
 #define ext4_bcache_set_flag(buf, b)    \
@@ -195,8 +491,21 @@ static inline void ext4_bcache_clear_dirty(struct ext4_buf *buf) {
 static inline void
 ext4_bcache_insert_dirty_node(struct ext4_bcache *bc, struct ext4_buf *buf) {
 	if (!buf->on_dirty_list) {
-		SLIST_INSERT_HEAD(&bc->dirty_list, buf, dirty_node);
+		TAILQ_INSERT_TAIL(&bc->dirty_list, buf, dirty_node);
 		buf->on_dirty_list = true;
+		bc->dirty_cnt++;
+
+		/* Keep the first dirtying time (0 is reserved for clean). */
+		if (!buf->dirty_time && bc->wb.time_ms)
+			buf->dirty_time = bc->wb.time_ms() | 1;
+
+		/* Wake up the flusher once dirty_ratio gets crossed. */
+		if (bc->wb.kick && bc->wb.dirty_ratio &&
+		    (uint64_t)bc->dirty_cnt * 100 >
+		    (uint64_t)bc->cnt * bc->wb.dirty_ratio &&
+		    (uint64_t)(bc->dirty_cnt - 1) * 100 <=
+		    (uint64_t)bc->cnt * bc->wb.dirty_ratio)
+			bc->wb.kick(bc->wb.kick_arg);
 	}
 }
 
@@ -206,8 +515,9 @@ ext4_bcache_insert_dirty_node(struct ext4_bcache *bc, struct ext4_buf *buf) {
 static inline void
 ext4_bcache_remove_dirty_node(struct ext4_bcache *bc, struct ext4_buf *buf) {
 	if (buf->on_dirty_list) {
-		SLIST_REMOVE(&bc->dirty_list, buf, ext4_buf, dirty_node);
+		TAILQ_REMOVE(&bc->dirty_list, buf, dirty_node);
 		buf->on_dirty_list = false;
+		bc->dirty_cnt--;
 	}
 }
 
@@ -220,6 +530,15 @@ ext4_bcache_remove_dirty_node(struct ext4_bcache *bc, struct ext4_buf *buf) {
 int ext4_bcache_init_dynamic(struct ext4_bcache *bc, uint32_t cnt,
 			     uint32_t itemsize);
 
+/**@brief   Dynamic initialization of block cache with flags.
+ * @param   bc block cache descriptor
+ * @param   cnt items count in block cache
+ * @param   itemsize single item size (in bytes)
+ * @param   flags block cache flags (EXT4_BCACHE_*)
+ * @return  standard error code*/
+int ext4_bcache_init_dynamic2(struct ext4_bcache *bc, uint32_t cnt,
+			      uint32_t itemsize, uint32_t flags);
+
 /**@brief   Do cleanup works on block cache.
  * @param   bc block cache descriptor.*/
 void ext4_bcache_cleanup(struct ext4_bcache *bc);
@@ -229,11 +548,93 @@ void ext4_bcache_cleanup(struct ext4_bcache *bc);
  * @return  standard error code*/
 int ext4_bcache_fini_dynamic(struct ext4_bcache *bc);
 
+/**@brief   Resize block cache online. Shrinking writes back and evicts
+ *          unreferenced buffers over the new size, the hash index is
+ *          rehashed down once below a quarter full. Ghost history of
+ *          @ref EXT4_BCACHE_2Q and @ref EXT4_BCACHE_ARC is reset.
+ *          @ref EXT4_BCACHE_ARENA keeps its initial allocation: items
+ *          over the arena size come from heap, spare arena items stay
+ *          unused.
+ * @param   bc block cache descriptor
+ * @param   cnt new items count (greater than metadata pool size)
+ * @return  standard error code*/
+int ext4_bcache_resize(struct ext4_bcache *bc, uint32_t cnt);
+
+/**@brief   Drop clean, unreferenced buffers (least recently used first)
+ *          until at most target buffers are cached. Dirty, referenced
+ *          and pinned buffers are kept. Items count is not changed.
+ *          Meant for memory pressure handlers; arena buffers go back to
+ *          the arena, not to heap.
+ * @param   bc block cache descriptor
+ * @param   target buffers count to shrink to
+ * @return  buffers dropped*/
+uint32_t ext4_bcache_shed(struct ext4_bcache *bc, uint32_t target);
+
+/**@brief   Split block cache capacity into a metadata pool and a general
+ *          pool. Buffers of meta_cls classes get pinned while the
+ *          metadata pool has room, so they are never evicted by
+ *          buffers of the general pool (directory scans...).
+ * @param   bc block cache descriptor
+ * @param   meta_cnt metadata pool size (0 - no metadata pool)
+ * @param   meta_cls buffer classes of the metadata pool
+ *          (bit mask of 1 << EXT4_BCACHE_CLS_*,
+ *          0 - @ref EXT4_BCACHE_META_DEFAULT)
+ * @return  standard error code*/
+int ext4_bcache_setup_pools(struct ext4_bcache *bc, uint32_t meta_cnt,
+			    uint32_t meta_cls);
+
+/**@brief   Pin buffer: keep it in cache until @ref ext4_bcache_unpin
+ *          or invalidation. Pinned buffers take metadata pool items
+ *          first, then general ones.
+ * @param   bc block cache descriptor
+ * @param   buf buffer descriptor*/
+void ext4_bcache_pin(struct ext4_bcache *bc, struct ext4_buf *buf);
+
+/**@brief   Unpin buffer, it becomes an eviction candidate again.
+ * @param   bc block cache descriptor
+ * @param   buf buffer descriptor*/
+void ext4_bcache_unpin(struct ext4_bcache *bc, struct ext4_buf *buf);
+
+/**@brief   Get block cache statistics.
+ * @param   bc block cache descriptor
+ * @param   stats statistics (output)*/
+void ext4_bcache_get_stats(struct ext4_bcache *bc,
+			   struct ext4_bcache_stats *stats);
+
+/**@brief   Reset block cache counters (hits, misses, evictions, writes,
+ *          max_ref_blocks). Gauges (buffers in cache) are kept.
+ * @param   bc block cache descriptor*/
+void ext4_bcache_clear_stats(struct ext4_bcache *bc);
+
+/**@brief   Get LBAs of the hottest buffers in bcache: buffers of the
+ *          frequency queue (@ref EXT4_BCACHE_2Q, @ref EXT4_BCACHE_ARC)
+ *          first, then most recently used ones. Journal and temporary
+ *          buffers are skipped.
+ * @param   bc block cache descriptor
+ * @param   lba LBAs (output, hottest first)
+ * @param   max lba array size
+ * @return  LBAs count stored*/
+uint32_t ext4_bcache_hot_lbas(struct ext4_bcache *bc, uint64_t *lba,
+			      uint32_t max);
+
 /**@brief   Get a buffer with the lowest LRU counter in bcache.
  * @param   bc block cache descriptor
- * @return  buffer with the lowest LRU counter*/
+ * @return  buffer with the lowest LRU counter
+ *          (NULL if there are no unreferenced buffers)*/
 struct ext4_buf *ext4_buf_lowest_lru(struct ext4_bcache *bc);
 
+/**@brief   Find existing buffer in bcache (reference is not taken).
+ * @param   bc block cache descriptor
+ * @param   lba logical block address
+ * @return  buffer (NULL if not found)*/
+struct ext4_buf *ext4_bcache_lookup(struct ext4_bcache *bc, uint64_t lba);
+
+/**@brief   Get gather buffer used for merged writes. Allocated on first
+ *          use, its size is CONFIG_BLOCK_DEV_FLUSH_MERGE items.
+ * @param   bc block cache descriptor
+ * @return  gather buffer (NULL if allocation failed)*/
+uint8_t *ext4_bcache_gather_buf(struct ext4_bcache *bc);
+
 /**@brief   Drop unreferenced buffer from bcache.
  * @param   bc block cache descriptor
  * @param   buf buffer*/
@@ -274,6 +675,29 @@ ext4_bcache_find_get(struct ext4_bcache *bc, struct ext4_block *b,
 int ext4_bcache_alloc(struct ext4_bcache *bc, struct ext4_block *b,
 		      bool *is_new);
 
+/**@brief   Allocate block from block cache memory, the buffer is
+ *          accounted to a class (EXT4_BCACHE_CLS_OTHER for
+ *          @ref ext4_bcache_alloc). A cached buffer loaded by an
+ *          EXT4_BCACHE_CLS_OTHER request takes the class.
+ * @param   bc block cache descriptor
+ * @param   b block to alloc
+ * @param   cls buffer class (EXT4_BCACHE_CLS_*)
+ * @param   is_new block is new (needs to be read)
+ * @return  standard error code*/
+int ext4_bcache_alloc_cls(struct ext4_bcache *bc, struct ext4_block *b,
+			  uint8_t cls, bool *is_new);
+
+/**@brief   Allocate block for readahead. Neither a hit nor a miss (the
+ *          filled buffers are counted by ra_ctr), a cached buffer is
+ *          returned untouched.
+ * @param   bc block cache descriptor
+ * @param   b block to alloc
+ * @param   cls buffer class (EXT4_BCACHE_CLS_*)
+ * @param   is_new block is new (needs to be read)
+ * @return  standard error code*/
+int ext4_bcache_alloc_ra(struct ext4_bcache *bc, struct ext4_block *b,
+			 uint8_t cls, bool *is_new);
+
 /**@brief   Free block from cache memory (decrement reference counter).
  * @param   bc block cache descriptor
  * @param   b block to free
@@ -84,6 +84,12 @@ static inline bool ext4_bmap_is_bit_clr(uint8_t *bmap, uint32_t bit)
  * @param   bcnt bit count*/
 void ext4_bmap_bits_free(uint8_t *bmap, uint32_t sbit, uint32_t bcnt);
 
+/**@brief   Set range of bits in bitmap.
+ * @param   bmap bitmap buffer
+ * @param   sbit start bit
+ * @param   bcnt bit count*/
+void ext4_bmap_bits_set(uint8_t *bmap, uint32_t sbit, uint32_t bcnt);
+
 /**@brief   Find first clear bit in bitmap.
  * @param   sbit start bit of search
  * @param   ebit end bit of search
@@ -46,6 +46,63 @@ extern "C" {
 #include <stdbool.h>
 #include <stdint.h>
 
+/**@brief   Vectored I/O segment: blk_cnt blocks starting at blk_id.*/
+struct ext4_blockdev_iovec {
+	/**@brief   First block id*/
+	uint64_t blk_id;
+
+	/**@brief   Block count*/
+	uint32_t blk_cnt;
+
+	/**@brief   Data buffer (blk_cnt blocks)*/
+	void *buf;
+};
+
+struct ext4_blockdev;
+
+/**@brief   Asynchronous block request.*/
+struct ext4_blockdev_req {
+	/**@brief   Block device the request was submitted to*/
+	struct ext4_blockdev *bdev;
+
+	/**@brief   Write request (read otherwise)*/
+	bool write;
+
+	/**@brief   Segments, physical blocks once submitted. The array has
+	 *          to stay valid until completion (device submit may read
+	 *          it later), data buffers as well.*/
+	struct ext4_blockdev_iovec *iov;
+
+	/**@brief   Segments count*/
+	uint32_t iov_cnt;
+
+	/**@brief   Result: standard error code*/
+	int res;
+
+	/**@brief   Pending device operations (block device private)*/
+	uint32_t pending;
+
+	/**@brief   Completion callback, called out of the block device lock*/
+	void (*complete)(struct ext4_blockdev_req *req);
+
+	/**@brief   Completion callback argument*/
+	void *arg;
+
+#if CONFIG_BLOCK_DEV_ENABLE_STATS
+	/**@brief   Submit time (block device private)*/
+	uint64_t stamp;
+#endif
+};
+
+/**@brief   Block device interface flags (ext4_blockdev_iface::flags)
+ *
+ *  - EXT4_BDIF_LOCKLESS_READ: bread and breadv are positional and
+ *    reentrant, they may run concurrently with each other and with
+ *    writes to other blocks. Reads are then issued without the block
+ *    device lock, so partitions of one device read in parallel.
+ */
+#define EXT4_BDIF_LOCKLESS_READ (1 << 0)
+
 struct ext4_blockdev_iface {
 	/**@brief   Open device function
 	 * @param   bdev block device.*/
@@ -80,13 +137,72 @@ struct ext4_blockdev_iface {
 	 * @param   bdev block device.*/
 	int (*unlock)(struct ext4_blockdev *bdev);
 
+	/**@brief   Vectored block read function. Not mandatory field,
+	 *          bread is called for every segment when not set.
+	 * @param   bdev block device
+	 * @param   iov segments, sorted by block id
+	 * @param   iov_cnt segments count*/
+	int (*breadv)(struct ext4_blockdev *bdev,
+		      const struct ext4_blockdev_iovec *iov, uint32_t iov_cnt);
+
+	/**@brief   Vectored block write function. Not mandatory field,
+	 *          bwrite is called for every segment when not set.
+	 * @param   bdev block device
+	 * @param   iov segments, sorted by block id
+	 * @param   iov_cnt segments count*/
+	int (*bwritev)(struct ext4_blockdev *bdev,
+		       const struct ext4_blockdev_iovec *iov, uint32_t iov_cnt);
+
+	/**@brief   Asynchronous request submit function. Not mandatory
+	 *          field. The request is completed by reap only. Request
+	 *          segments (req->iov) stay valid until completion, the
+	 *          device does not have to copy them.
+	 * @param   bdev block device
+	 * @param   req request (segments in physical blocks)*/
+	int (*submit)(struct ext4_blockdev *bdev, struct ext4_blockdev_req *req);
+
+	/**@brief   Asynchronous request reap function. Mandatory with submit.
+	 * @param   bdev block device
+	 * @param   done completed requests (output)
+	 * @param   max done array size
+	 * @param   min wait for at least min completed requests
+	 * @param   cnt completed requests count (output)*/
+	int (*reap)(struct ext4_blockdev *bdev, struct ext4_blockdev_req **done,
+		    uint32_t max, uint32_t min, uint32_t *cnt);
+
+	/**@brief   Discard (trim) function. Not mandatory field. Discarded
+	 *          blocks content is undefined.
+	 * @param   bdev block device
+	 * @param   blk_id first block id
+	 * @param   blk_cnt block count*/
+	int (*discard)(struct ext4_blockdev *bdev, uint64_t blk_id,
+		       uint64_t blk_cnt);
+
+	/**@brief   Cache flush (write barrier) function. Not mandatory
+	 *          field. When present, completed writes may stay in a
+	 *          volatile device cache until flush returns, so they
+	 *          become durable in batches. The journal flushes only
+	 *          at commit and checkpoint points. Without it every
+	 *          completed write has to be durable.
+	 * @param   bdev block device*/
+	int (*flush)(struct ext4_blockdev *bdev);
+
+	/**@brief   EXT4_BDIF_* flags*/
+	uint32_t flags;
+
+	/**@brief   Maximum requests in flight (0 - no limit)*/
+	uint32_t queue_depth;
+
+	/**@brief   Requests in flight*/
+	uint32_t inflight;
+
 	/**@brief   Block size (bytes): physical*/
 	uint32_t ph_bsize;
 
 	/**@brief   Block count: physical*/
 	uint64_t ph_bcnt;
 
-	/**@brief   Block size buffer: physical*/
+	/**@brief   Block size buffer: physical (partition table I/O)*/
 	uint8_t *ph_bbuf;
 
 	/**@brief   Reference counter to block device interface*/
@@ -98,10 +214,110 @@ struct ext4_blockdev_iface {
 	/**@brief   Physical write counter*/
 	uint32_t bwrite_ctr;
 
+	/**@brief   Cache flush (barrier) counter*/
+	uint32_t flush_ctr;
+
 	/**@brief   User data pointer*/
 	void* p_user;
 };
 
+/**@brief   Request scheduling policies (@ref ext4_block_elv_set)
+ *
+ *  - EXT4_ELV_NONE: requests go to the device in submit order.
+ *  - EXT4_ELV_NOOP: requests are queued in submit order, a request
+ *                   continuing the previous one (same direction,
+ *                   adjacent LBA) is merged into it.
+ *  - EXT4_ELV_DEADLINE: requests are dispatched in ascending LBA sweeps,
+ *                       reads first, adjacent requests are merged.
+ *                       A request waiting for EXT4_ELV_EXPIRE dispatch
+ *                       rounds goes next regardless of its LBA. Requests
+ *                       overlapping an older one (not both reads) keep
+ *                       their submit order.
+ */
+#define EXT4_ELV_NONE 0
+#define EXT4_ELV_NOOP 1
+#define EXT4_ELV_DEADLINE 2
+
+/**@brief   Request scheduler statistics (@ref ext4_block_elv_get_stats)*/
+struct ext4_blockdev_elv_stats {
+	/**@brief   Requests queued*/
+	uint64_t queued;
+
+	/**@brief   Requests merged into an adjacent one*/
+	uint64_t merged;
+
+	/**@brief   Requests issued to the device*/
+	uint64_t dispatched;
+
+	/**@brief   Requests dispatched because their deadline expired*/
+	uint64_t expired;
+
+	/**@brief   Requests in queue now*/
+	uint32_t depth;
+
+	/**@brief   Maximum requests in queue*/
+	uint32_t max_depth;
+};
+
+struct ext4_blockdev_elv;
+
+/**@brief   Latency histogram buckets: bucket i counts requests completed
+ *          in [2^i, 2^(i+1)) us, the last one everything slower.*/
+#define EXT4_BLOCKDEV_LAT_BUCKETS 24
+
+/**@brief   Request size histogram buckets: bucket i counts requests of
+ *          [2^i, 2^(i+1)) physical blocks, the last one everything larger.*/
+#define EXT4_BLOCKDEV_SIZE_BUCKETS 16
+
+/**@brief   I/O statistics of a single direction.*/
+struct ext4_blockdev_io_dir {
+	/**@brief   Device requests*/
+	uint64_t reqs;
+
+	/**@brief   Bytes moved*/
+	uint64_t bytes;
+
+	/**@brief   Requests starting right after the previous one*/
+	uint64_t seq;
+
+	/**@brief   Failed requests*/
+	uint64_t errors;
+
+	/**@brief   Sum of request latencies (us)*/
+	uint64_t time_us;
+
+	/**@brief   Maximum request latency (us)*/
+	uint64_t max_us;
+
+	/**@brief   Latency histogram (log2 us)*/
+	uint32_t lat[EXT4_BLOCKDEV_LAT_BUCKETS];
+
+	/**@brief   Request size histogram (log2 physical blocks)*/
+	uint32_t size[EXT4_BLOCKDEV_SIZE_BUCKETS];
+};
+
+/**@brief   Block device I/O statistics (@ref ext4_block_io_stats_get).
+ *          Latencies are only recorded with a time source.*/
+struct ext4_blockdev_io_stats {
+	struct ext4_blockdev_io_dir rd;
+	struct ext4_blockdev_io_dir wr;
+};
+
+struct ext4_blockdev_iostat;
+
+/**@brief   Sequential stream state of a readahead context
+ *          (buffer class of the request, EXT4_BCACHE_CLS_*).*/
+struct ext4_block_ra {
+	/**@brief   LBA expected next in the stream*/
+	uint64_t next;
+
+	/**@brief   Sequential requests in a row*/
+	uint32_t seq;
+
+	/**@brief   Current readahead window (blocks)*/
+	uint32_t win;
+};
+
 /**@brief   Definition of the simple block device.*/
 struct ext4_blockdev {
 	/**@brief Block device interface*/
@@ -125,6 +341,21 @@ struct ext4_blockdev {
 	/**@brief   Cache write back mode reference counter*/
 	uint32_t cache_write_back;
 
+#if CONFIG_BLOCK_DEV_READAHEAD
+	/**@brief   Readahead state per request context*/
+	struct ext4_block_ra ra[EXT4_BCACHE_CLS_COUNT];
+#endif
+
+#if CONFIG_BLOCK_DEV_ELV_DEPTH
+	/**@brief   Request scheduler (NULL - none)*/
+	struct ext4_blockdev_elv *elv;
+#endif
+
+#if CONFIG_BLOCK_DEV_ENABLE_STATS
+	/**@brief   I/O statistics (NULL - disabled)*/
+	struct ext4_blockdev_iostat *iostat;
+#endif
+
 	/**@brief   The filesystem this block device belongs to. */
 	struct ext4_fs *fs;
 
@@ -174,6 +405,12 @@ int ext4_block_fini(struct ext4_blockdev *bdev);
  * @return  standard error code*/
 int ext4_block_flush_buf(struct ext4_blockdev *bdev, struct ext4_buf *buf);
 
+/**@brief   Evict unreferenced buffers (writing back dirty ones) until
+ *          block cache is not full.
+ * @param   bdev block device descriptor
+ * @return  standard error code*/
+int ext4_block_cache_shake(struct ext4_blockdev *bdev);
+
 /**@brief   Flush data in buffer of given lba to disk,
  *          if that buffer exists in block cache.
  * @param   bdev block device descriptor
@@ -202,6 +439,27 @@ int ext4_block_get_noread(struct ext4_blockdev *bdev, struct ext4_block *b,
 int ext4_block_get(struct ext4_blockdev *bdev, struct ext4_block *b,
 		   uint64_t lba);
 
+/**@brief   Block get function (through cache, don't read), the buffer
+ *          is accounted to a class.
+ * @param   bdev block device descriptor
+ * @param   b block descriptor
+ * @param   lba logical block address
+ * @param   cls buffer class (EXT4_BCACHE_CLS_*)
+ * @return  standard error code*/
+int ext4_block_get_noread_cls(struct ext4_blockdev *bdev,
+			      struct ext4_block *b, uint64_t lba, uint8_t cls);
+
+/**@brief   Block get function (through cache), the buffer is accounted
+ *          to a class. The class also tells readahead the stream the
+ *          request belongs to.
+ * @param   bdev block device descriptor
+ * @param   b block descriptor
+ * @param   lba logical block address
+ * @param   cls buffer class (EXT4_BCACHE_CLS_*)
+ * @return  standard error code*/
+int ext4_block_get_cls(struct ext4_blockdev *bdev, struct ext4_block *b,
+		       uint64_t lba, uint8_t cls);
+
 /**@brief   Block set procedure (through cache).
  * @param   bdev block device descriptor
  * @param   b block descriptor
@@ -224,6 +482,108 @@ int ext4_blocks_get_direct(struct ext4_blockdev *bdev, void *buf, uint64_t lba,
 int ext4_blocks_set_direct(struct ext4_blockdev *bdev, const void *buf,
 			   uint64_t lba, uint32_t cnt);
 
+/**@brief   Read blocks from block device into scattered buffers
+ *          (by direct address), with a single vectored request when the
+ *          device supports it.
+ * @param   bdev block device descriptor
+ * @param   iov segments in logical blocks, converted to physical
+ *          blocks in place
+ * @param   cnt segments count
+ * @return  standard error code*/
+int ext4_blocks_get_direct_v(struct ext4_blockdev *bdev,
+			     struct ext4_blockdev_iovec *iov, uint32_t cnt);
+
+/**@brief   Write blocks from scattered buffers to block device
+ *          (by direct address), with a single vectored request when the
+ *          device supports it.
+ * @param   bdev block device descriptor
+ * @param   iov segments in logical blocks, converted to physical
+ *          blocks in place
+ * @param   cnt segments count
+ * @return  standard error code*/
+int ext4_blocks_set_direct_v(struct ext4_blockdev *bdev,
+			     struct ext4_blockdev_iovec *iov, uint32_t cnt);
+
+/**@brief   Submit asynchronous request. With a request scheduler the
+ *          request is queued, to be merged and sorted with others, until
+ *          the queue fills up or someone reaps. Without device support
+ *          the request is done synchronously and completed when issued.
+ *          When queue depth is reached, completions are reaped first.
+ * @param   bdev block device descriptor
+ * @param   req request, segments in logical blocks (converted to
+ *          physical blocks in place)
+ * @return  standard error code (req->complete is not called on error)*/
+int ext4_blocks_submit_v(struct ext4_blockdev *bdev,
+			 struct ext4_blockdev_req *req);
+
+/**@brief   Reap completed asynchronous requests and run completion
+ *          callbacks.
+ * @param   bdev block device descriptor
+ * @param   wait wait for at least one request (if any is in flight)
+ * @return  standard error code*/
+int ext4_blocks_reap(struct ext4_blockdev *bdev, bool wait);
+
+/**@brief   Wait for all asynchronous requests of the device.
+ * @param   bdev block device descriptor
+ * @return  standard error code*/
+int ext4_blocks_drain(struct ext4_blockdev *bdev);
+
+/**@brief   Requests of @ref ext4_blocks_submit_v may complete after the
+ *          call (asynchronous device or request scheduler).
+ * @param   bdev block device descriptor
+ * @return  true if requests are deferred*/
+bool ext4_blocks_deferred(struct ext4_blockdev *bdev);
+
+/**@brief   Set request scheduling policy of a block device. Queued
+ *          requests are dispatched first. Scheduler memory is released
+ *          by EXT4_ELV_NONE only.
+ * @param   bdev block device descriptor
+ * @param   policy EXT4_ELV_* policy
+ * @return  standard error code*/
+int ext4_block_elv_set(struct ext4_blockdev *bdev, uint8_t policy);
+
+/**@brief   Get request scheduler statistics.
+ * @param   bdev block device descriptor
+ * @param   stats statistics (output)
+ * @return  standard error code (ENOENT - no scheduler)*/
+int ext4_block_elv_get_stats(struct ext4_blockdev *bdev,
+			     struct ext4_blockdev_elv_stats *stats);
+
+/**@brief   Enable or disable I/O statistics of the block device.
+ *          Every device request is accounted: size, bytes moved and
+ *          sequential/random pattern. Latencies need a time source.
+ * @param   bdev block device descriptor
+ * @param   on enable (statistics are cleared) or disable
+ * @param   time_us monotonic clock (us), NULL - no latencies
+ * @return  standard error code (ENOTSUP - statistics compiled out)*/
+int ext4_block_io_stats_enable(struct ext4_blockdev *bdev, bool on,
+			       uint64_t (*time_us)(void));
+
+/**@brief   Get I/O statistics of the block device.
+ * @param   bdev block device descriptor
+ * @param   stats output statistics
+ * @return  standard error code (ENOENT - statistics disabled)*/
+int ext4_block_io_stats_get(struct ext4_blockdev *bdev,
+			    struct ext4_blockdev_io_stats *stats);
+
+/**@brief   Clear I/O statistics of the block device.
+ * @param   bdev block device descriptor
+ * @return  standard error code (ENOENT - statistics disabled)*/
+int ext4_block_io_stats_clear(struct ext4_blockdev *bdev);
+
+/**@brief   Discard blocks (by direct address).
+ * @param   bdev block device descriptor
+ * @param   lba first logical block address
+ * @param   cnt block count
+ * @return  standard error code (ENOTSUP - device can't discard)*/
+int ext4_block_discard(struct ext4_blockdev *bdev, uint64_t lba, uint64_t cnt);
+
+/**@brief   Write barrier: make all completed writes durable
+ *          (flush callback of the interface, no-op without it).
+ * @param   bdev block device descriptor
+ * @return  standard error code*/
+int ext4_block_barrier(struct ext4_blockdev *bdev);
+
 /**@brief   Write to block device (by direct address).
  * @param   bdev block device descriptor
  * @param   off byte offset in block device
@@ -247,6 +607,25 @@ int ext4_block_readbytes(struct ext4_blockdev *bdev, uint64_t off, void *buf,
  * @return  standard error code*/
 int ext4_block_cache_flush(struct ext4_blockdev *bdev);
 
+/**@brief   Background write-back step (see @ref ext4_bcache_wb). Writes
+ *          back all dirty buffers when they exceed dirty_ratio, otherwise
+ *          buffers dirty for longer than dirty_age_ms.
+ * @param   bdev block device descriptor
+ * @return  standard error code*/
+int ext4_block_cache_writeback(struct ext4_blockdev *bdev);
+
+/**@brief   Prefetch blocks into the block cache (cache warm-up).
+ *          LBAs are sorted and read in runs of adjacent blocks
+ *          (up to CONFIG_BLOCK_DEV_FLUSH_MERGE blocks per request),
+ *          scattered ones too when the device has breadv. At most cache items count blocks are prefetched, the first
+ *          ones in the array win. Invalid LBAs are skipped.
+ * @param   bdev block device descriptor
+ * @param   lba LBAs to prefetch (array gets reordered)
+ * @param   cnt LBAs count
+ * @return  standard error code*/
+int ext4_block_cache_prefetch(struct ext4_blockdev *bdev, uint64_t *lba,
+			      uint32_t cnt);
+
 /**@brief   Enable/disable write back cache mode
  * @param   bdev block device descriptor
  * @param   on_off
@@ -128,6 +128,38 @@ extern "C" {
 #define CONFIG_BLOCK_DEV_CACHE_SIZE 8
 #endif
 
+/**@brief   Maximum number of dirty cache blocks with adjacent LBAs merged
+ *          into a single write (1 - no merging)*/
+#ifndef CONFIG_BLOCK_DEV_FLUSH_MERGE
+#define CONFIG_BLOCK_DEV_FLUSH_MERGE 32
+#endif
+
+/**@brief   Maximum readahead window (blocks) of sequential block streams
+ *          read through the cache (0 - no readahead). Can't exceed
+ *          CONFIG_BLOCK_DEV_FLUSH_MERGE.*/
+#ifndef CONFIG_BLOCK_DEV_READAHEAD
+#define CONFIG_BLOCK_DEV_READAHEAD 16
+#endif
+
+/**@brief   Requests queued by the block request scheduler
+ *          (0 - no scheduler, see @ref ext4_block_elv_set)*/
+#ifndef CONFIG_BLOCK_DEV_ELV_DEPTH
+#define CONFIG_BLOCK_DEV_ELV_DEPTH 32
+#endif
+
+/**@brief   Freed block ranges queued for discard until transaction
+ *          commit (0 - no online discard, ext4_fstrim only)*/
+#ifndef CONFIG_DISCARD_QUEUE
+#define CONFIG_DISCARD_QUEUE 16
+#endif
+
+/**@brief   Maximum file blocks held in memory by delayed allocation,
+ *          per mount point (0 - no delayed allocation,
+ *          see @ref ext4_delalloc)*/
+#ifndef CONFIG_DELALLOC_PAGES
+#define CONFIG_DELALLOC_PAGES 1024
+#endif
+
 
 /**@brief   Maximum block device name*/
 #ifndef CONFIG_EXT4_MAX_BLOCKDEV_NAME
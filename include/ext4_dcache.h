@@ -0,0 +1,168 @@
+/*
+ * Copyright (c) 2013 Grzegorz Kostka (kostka.grzegorz@gmail.com)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * - Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * - The name of the author may not be used to endorse or promote products
+ *   derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/** @addtogroup lwext4
+ * @{
+ */
+/**
+ * @file  ext4_dcache.h
+ * @brief File data cache, keyed by i-node and logical block.
+ */
+
+#ifndef EXT4_DCACHE_H_
+#define EXT4_DCACHE_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <ext4_config.h>
+#include <ext4_types.h>
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <misc/tree.h>
+#include <misc/queue.h>
+
+/**@brief   Data cache statistics.*/
+struct ext4_dcache_stats {
+	/**@brief   Blocks served from the cache.*/
+	uint64_t hits;
+
+	/**@brief   Blocks read from the device into the cache.*/
+	uint64_t misses;
+
+	/**@brief   Blocks evicted to make room.*/
+	uint64_t evictions;
+
+	/**@brief   Blocks dropped by writes and truncation.*/
+	uint64_t invalidations;
+
+	/**@brief   Blocks cached.*/
+	uint32_t cnt;
+
+	/**@brief   Cache capacity (blocks).*/
+	uint32_t max;
+};
+
+/**@brief   Cached file data block.*/
+struct ext4_dpage {
+	/**@brief   I-node index.*/
+	uint32_t ino;
+
+	/**@brief   Logical block.*/
+	ext4_lblk_t lblk;
+
+	/**@brief   Block data.*/
+	uint8_t *data;
+
+	/**@brief   Key tree node*/
+	RB_ENTRY(ext4_dpage) node;
+
+	/**@brief   LRU list node*/
+	TAILQ_ENTRY(ext4_dpage) lru;
+};
+
+/**@brief   File data cache. Separate from the block cache, so file data
+ *          never evicts metadata, and keyed by (i-node, logical block),
+ *          so entries stay valid when blocks are remapped. Writers have
+ *          to invalidate what they change.*/
+struct ext4_dcache {
+	/**@brief   Block size.*/
+	uint32_t bsize;
+
+	/**@brief   Statistics, cnt and max: current and maximum size.*/
+	struct ext4_dcache_stats stats;
+
+	/**@brief   Pages by key.*/
+	RB_HEAD(ext4_dpage_tree, ext4_dpage) root;
+
+	/**@brief   Pages, least recently used first.*/
+	TAILQ_HEAD(ext4_dpage_lru, ext4_dpage) lru;
+};
+
+/**@brief   Initialize data cache (empty).
+ * @param   dc data cache descriptor
+ * @param   max capacity in blocks (0 - disabled)
+ * @param   bsize block size*/
+void ext4_dcache_init(struct ext4_dcache *dc, uint32_t max, uint32_t bsize);
+
+/**@brief   Release all cached blocks.
+ * @param   dc data cache descriptor*/
+void ext4_dcache_fini(struct ext4_dcache *dc);
+
+/**@brief   Data cache enabled.
+ * @param   dc data cache descriptor
+ * @return  true when blocks can be cached*/
+static inline bool ext4_dcache_on(struct ext4_dcache *dc)
+{
+	return dc->stats.max != 0;
+}
+
+/**@brief   Look up a block (counted as hit).
+ * @param   dc data cache descriptor
+ * @param   ino i-node index
+ * @param   lblk logical block
+ * @return  block data, NULL when not cached*/
+const uint8_t *ext4_dcache_get(struct ext4_dcache *dc, uint32_t ino,
+			       ext4_lblk_t lblk);
+
+/**@brief   Check whether a block is cached (not counted, LRU untouched).
+ * @param   dc data cache descriptor
+ * @param   ino i-node index
+ * @param   lblk logical block
+ * @return  true when cached*/
+bool ext4_dcache_has(struct ext4_dcache *dc, uint32_t ino, ext4_lblk_t lblk);
+
+/**@brief   Insert a block (counted as miss), evicting the least recently
+ *          used one when the cache is full. The caller fills the data,
+ *          or drops the block when it fails to.
+ * @param   dc data cache descriptor
+ * @param   ino i-node index
+ * @param   lblk logical block
+ * @return  block data buffer, NULL when disabled or out of memory*/
+uint8_t *ext4_dcache_add(struct ext4_dcache *dc, uint32_t ino,
+			 ext4_lblk_t lblk);
+
+/**@brief   Drop cached blocks of an i-node.
+ * @param   dc data cache descriptor
+ * @param   ino i-node index
+ * @param   lblk first logical block
+ * @param   cnt blocks count (UINT32_MAX - up to the end of file)*/
+void ext4_dcache_drop(struct ext4_dcache *dc, uint32_t ino, ext4_lblk_t lblk,
+		      uint32_t cnt);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* EXT4_DCACHE_H_ */
+
+/**
+ * @}
+ */
@@ -50,7 +50,16 @@ extern "C" {
 
 void ext4_extent_tree_init(struct ext4_inode_ref *inode_ref);
 
-
+/**@brief Map a run of logical blocks to physical blocks.
+ * @param inode_ref    I-node to map blocks of
+ * @param iblock       First logical block
+ * @param max_blocks   Maximum run length
+ * @param result       First physical block (0 - hole or unwritten range
+ *                     when not creating)
+ * @param create       Allocate (initialize) the blocks
+ * @param blocks_count Run length, blocks of a hole up to the next extent
+ *                     when not creating
+ * @return Error code*/
 int ext4_extent_get_blocks(struct ext4_inode_ref *inode_ref, ext4_lblk_t iblock,
 			   uint32_t max_blocks, ext4_fsblk_t *result, bool create,
 			   uint32_t *blocks_count);
@@ -53,6 +53,12 @@ extern "C" {
 #include <stdint.h>
 #include <stdbool.h>
 
+/**@brief Freed block range waiting for discard.*/
+struct ext4_discard_range {
+	ext4_fsblk_t first;
+	ext4_fsblk_t cnt;
+};
+
 struct ext4_fs {
 	bool read_only;
 
@@ -67,6 +73,19 @@ struct ext4_fs {
 	struct jbd_fs *jbd_fs;
 	struct jbd_journal *jbd_journal;
 	struct jbd_trans *curr_trans;
+
+	/**@brief Online discard of freed blocks.*/
+	bool discard;
+#if CONFIG_DISCARD_QUEUE
+	/**@brief Freed ranges (sorted, merged) issued after commit.*/
+	struct ext4_discard_range discard_q[CONFIG_DISCARD_QUEUE];
+	uint32_t discard_cnt;
+#endif
+#if CONFIG_DELALLOC_PAGES
+	/**@brief Free blocks reserved for data held by delayed allocation,
+	 *        not available to other allocations.*/
+	uint64_t da_resv;
+#endif
 };
 
 struct ext4_block_group_ref {
@@ -158,6 +177,17 @@ int ext4_fs_check_features(struct ext4_fs *fs, bool *read_only);
 int ext4_fs_get_block_group_ref(struct ext4_fs *fs, uint32_t bgid,
 				struct ext4_block_group_ref *ref);
 
+/**@brief Get reference to block group specified by index, for read only
+ *        access: uninitialized bitmaps and inode table are left as
+ *        they are.
+ * @param fs   Filesystem to find block group on
+ * @param bgid Index of block group to load
+ * @param ref  Output pointer for reference
+ * @return Error code
+ */
+int ext4_fs_peek_block_group_ref(struct ext4_fs *fs, uint32_t bgid,
+				 struct ext4_block_group_ref *ref);
+
 /**@brief Put reference to block group.
  * @param ref Pointer for reference to be put back
  * @return Error code
@@ -240,6 +270,20 @@ int ext4_fs_get_inode_dblk_idx(struct ext4_inode_ref *inode_ref,
 				 ext4_lblk_t iblock, ext4_fsblk_t *fblock,
 				 bool support_unwritten);
 
+/**@brief Get physical address of a run of logical blocks: blocks which
+ *        continue each other on the disk or a hole (unwritten range).
+ *        Extent mapped i-nodes need a single extent tree walk.
+ * @param inode_ref I-node to read block addresses from
+ * @param iblock    First logical block
+ * @param max       Maximum run length
+ * @param fblock    First physical block of the run (0 - hole)
+ * @param count     Run length (output, 1..max)
+ * @return Error code
+ */
+int ext4_fs_get_inode_dblk_run(struct ext4_inode_ref *inode_ref,
+			       ext4_lblk_t iblock, uint32_t max,
+			       ext4_fsblk_t *fblock, uint32_t *count);
+
 /**@brief Initialize a part of unwritten range of the inode.
  * @param inode_ref I-node to proceed on.
  * @param iblock    Logical index of block
@@ -249,6 +293,18 @@ int ext4_fs_get_inode_dblk_idx(struct ext4_inode_ref *inode_ref,
 int ext4_fs_init_inode_dblk_idx(struct ext4_inode_ref *inode_ref,
 				  ext4_lblk_t iblock, ext4_fsblk_t *fblock);
 
+/**@brief Append a run of following logical blocks to the i-node, allocated
+ *        contiguously in a single allocator call.
+ * @param inode_ref I-node to append blocks to
+ * @param fblock    Output physical address of the first appended block
+ * @param iblock    Output logical number of the first appended block
+ * @param count     Blocks wanted (input), appended (output, >= 1)
+ * @return Error code
+ */
+int ext4_fs_append_inode_dblks(struct ext4_inode_ref *inode_ref,
+			       ext4_fsblk_t *fblock, ext4_lblk_t *iblock,
+			       uint32_t *count);
+
 /**@brief Append following logical block to the i-node.
  * @param inode_ref I-node to append block to
  * @param fblock    Output physical block address of newly allocated block
@@ -72,6 +72,28 @@ int ext4_trans_block_get(struct ext4_blockdev *bdev,
 		   struct ext4_block *b,
 		   uint64_t lba);
 
+/**@brief   Block get function (through cache, don't read), the buffer
+ *          is accounted to a class.
+ * @param   bdev block device descriptor
+ * @param   b block descriptor
+ * @param   lba logical block address
+ * @param   cls buffer class (EXT4_BCACHE_CLS_*)
+ * @return  standard error code*/
+int ext4_trans_block_get_noread_cls(struct ext4_blockdev *bdev,
+				    struct ext4_block *b,
+				    uint64_t lba, uint8_t cls);
+
+/**@brief   Block get function (through cache), the buffer is accounted
+ *          to a class.
+ * @param   bdev block device descriptor
+ * @param   b block descriptor
+ * @param   lba logical block address
+ * @param   cls buffer class (EXT4_BCACHE_CLS_*)
+ * @return  standard error code*/
+int ext4_trans_block_get_cls(struct ext4_blockdev *bdev,
+			     struct ext4_block *b,
+			     uint64_t lba, uint8_t cls);
+
 /**@brief  Try to add block to be revoked to the current transaction.
  * @param  bdev block device descriptor
  * @param  lba logical block address
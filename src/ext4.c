@@ -52,6 +52,8 @@
 #include <ext4_dir_idx.h>
 #include <ext4_xattr.h>
 #include <ext4_journal.h>
+#include <ext4_balloc.h>
+#include <ext4_dcache.h>
 
 
 #include <stdlib.h>
@@ -94,6 +96,24 @@ struct ext4_mountpoint {
 
 	/**@brief   Block cache.*/
 	struct ext4_bcache bc;
+
+	/**@brief   File data cache (@ref ext4_data_cache).*/
+	struct ext4_dcache dc;
+
+	/**@brief   Transaction stops are joined into the outer one
+	 *          (@ref ext4_pwritev).*/
+	bool trans_join;
+
+#if CONFIG_DELALLOC_PAGES
+	/**@brief   Delayed allocation enabled (@ref ext4_delalloc).*/
+	bool da_on;
+
+	/**@brief   Blocks held by delayed allocation.*/
+	uint32_t da_pages;
+
+	/**@brief   I-nodes with delayed allocation blocks.*/
+	SLIST_HEAD(ext4_da_list, ext4_da_inode) da_list;
+#endif
 };
 
 /**@brief   Block devices descriptor.*/
@@ -104,6 +124,27 @@ struct ext4_block_devices {
 
 	/**@brief   Block device handle.*/
 	struct ext4_blockdev *bd;
+
+	/**@brief   Block cache items count (0 - default).*/
+	uint32_t bc_cnt;
+
+	/**@brief   Block cache flags (EXT4_BCACHE_*).*/
+	uint32_t bc_flags;
+
+	/**@brief   Block cache metadata pool size (0 - none).*/
+	uint32_t bc_meta_cnt;
+
+	/**@brief   Block cache metadata pool classes.*/
+	uint32_t bc_meta_cls;
+
+	/**@brief   Warm-up LBAs (@ref ext4_device_setup_warmup).*/
+	uint64_t *wu_lba;
+
+	/**@brief   Warm-up LBAs array size.*/
+	uint32_t wu_max;
+
+	/**@brief   Warm-up LBAs count.*/
+	uint32_t *wu_cnt;
 };
 
 /**@brief   Block devices.*/
@@ -112,6 +153,10 @@ static struct ext4_block_devices s_bdevices[CONFIG_EXT4_BLOCKDEVS_COUNT];
 /**@brief   Mountpoints.*/
 static struct ext4_mountpoint s_mp[CONFIG_EXT4_MOUNTPOINTS_COUNT];
 
+#if CONFIG_DELALLOC_PAGES
+static int ext4_da_flush_all(struct ext4_mountpoint *mp);
+#endif
+
 int ext4_device_register(struct ext4_blockdev *bd,
 			 const char *dev_name)
 {
@@ -158,6 +203,61 @@ int ext4_device_unregister_all(void)
 	return EOK;
 }
 
+int ext4_device_setup_cache(const char *dev_name, uint32_t cnt,
+			    uint32_t flags)
+{
+	ext4_assert(dev_name);
+
+	for (size_t i = 0; i < CONFIG_EXT4_BLOCKDEVS_COUNT; ++i) {
+		if (strcmp(s_bdevices[i].name, dev_name))
+			continue;
+
+		s_bdevices[i].bc_cnt = cnt;
+		s_bdevices[i].bc_flags = flags;
+		return EOK;
+	}
+
+	return ENOENT;
+}
+
+int ext4_device_setup_cache_pools(const char *dev_name, uint32_t meta_cnt,
+				  uint32_t meta_cls)
+{
+	ext4_assert(dev_name);
+
+	for (size_t i = 0; i < CONFIG_EXT4_BLOCKDEVS_COUNT; ++i) {
+		if (strcmp(s_bdevices[i].name, dev_name))
+			continue;
+
+		s_bdevices[i].bc_meta_cnt = meta_cnt;
+		s_bdevices[i].bc_meta_cls = meta_cls;
+		return EOK;
+	}
+
+	return ENOENT;
+}
+
+int ext4_device_setup_warmup(const char *dev_name, uint64_t *lba,
+			     uint32_t max, uint32_t *cnt)
+{
+	ext4_assert(dev_name);
+
+	if (lba && (!max || !cnt))
+		return EINVAL;
+
+	for (size_t i = 0; i < CONFIG_EXT4_BLOCKDEVS_COUNT; ++i) {
+		if (strcmp(s_bdevices[i].name, dev_name))
+			continue;
+
+		s_bdevices[i].wu_lba = lba;
+		s_bdevices[i].wu_max = lba ? max : 0;
+		s_bdevices[i].wu_cnt = lba ? cnt : NULL;
+		return EOK;
+	}
+
+	return ENOENT;
+}
+
 /****************************************************************************/
 
 static bool ext4_is_dots(const uint8_t *name, size_t name_size)
@@ -365,8 +465,11 @@ int ext4_mount(const char *dev_name, const char *mount_point,
 {
 	int r;
 	uint32_t bsize;
+	uint32_t bc_cnt = CONFIG_BLOCK_DEV_CACHE_SIZE;
+	uint32_t bc_flags = 0;
 	struct ext4_bcache *bc;
 	struct ext4_blockdev *bd = 0;
+	struct ext4_block_devices *dev = 0;
 	struct ext4_mountpoint *mp = 0;
 
 	ext4_assert(mount_point && dev_name);
@@ -381,7 +484,11 @@ int ext4_mount(const char *dev_name, const char *mount_point,
 
 	for (size_t i = 0; i < CONFIG_EXT4_BLOCKDEVS_COUNT; ++i) {
 		if (!strcmp(dev_name, s_bdevices[i].name)) {
+			dev = &s_bdevices[i];
 			bd = s_bdevices[i].bd;
+			if (s_bdevices[i].bc_cnt)
+				bc_cnt = s_bdevices[i].bc_cnt;
+			bc_flags = s_bdevices[i].bc_flags;
 			break;
 		}
 	}
@@ -417,14 +524,26 @@ int ext4_mount(const char *dev_name, const char *mount_point,
 	ext4_block_set_lb_size(bd, bsize);
 	bc = &mp->bc;
 
-	r = ext4_bcache_init_dynamic(bc, CONFIG_BLOCK_DEV_CACHE_SIZE, bsize);
+	r = ext4_bcache_init_dynamic2(bc, bc_cnt, bsize, bc_flags);
 	if (r != EOK) {
 		ext4_block_fini(bd);
 		return r;
 	}
 
-	if (bsize != bc->itemsize)
+	if (bsize != bc->itemsize) {
+		ext4_bcache_fini_dynamic(bc);
 		return ENOTSUP;
+	}
+
+	if (dev->bc_meta_cnt) {
+		r = ext4_bcache_setup_pools(bc, dev->bc_meta_cnt,
+					    dev->bc_meta_cls);
+		if (r != EOK) {
+			ext4_block_fini(bd);
+			ext4_bcache_fini_dynamic(bc);
+			return r;
+		}
+	}
 
 	/*Bind block cache to block device*/
 	r = ext4_block_bind_bcache(bd, bc);
@@ -436,6 +555,23 @@ int ext4_mount(const char *dev_name, const char *mount_point,
 	}
 
 	bd->fs = &mp->fs;
+	ext4_dcache_init(&mp->dc, 0, bsize);
+
+#if CONFIG_DELALLOC_PAGES
+	mp->da_on = false;
+	mp->da_pages = 0;
+	SLIST_INIT(&mp->da_list);
+#endif
+
+	/*Warm up block cache, best effort*/
+	if (dev->wu_lba && *dev->wu_cnt) {
+		uint32_t wu_cnt = *dev->wu_cnt;
+		if (wu_cnt > dev->wu_max)
+			wu_cnt = dev->wu_max;
+
+		ext4_block_cache_prefetch(bd, dev->wu_lba, wu_cnt);
+	}
+
 	mp->mounted = 1;
 	return r;
 }
@@ -444,7 +580,7 @@ int ext4_mount(const char *dev_name, const char *mount_point,
 int ext4_umount(const char *mount_point)
 {
 	int i;
-	int r;
+	int r, rr = EOK;
 	struct ext4_mountpoint *mp = 0;
 
 	for (i = 0; i < CONFIG_EXT4_MOUNTPOINTS_COUNT; ++i) {
@@ -457,19 +593,36 @@ int ext4_umount(const char *mount_point)
 	if (!mp)
 		return ENODEV;
 
+#if CONFIG_DELALLOC_PAGES
+	/*Data which failed to flush is gone, report it after umount*/
+	rr = ext4_da_flush_all(mp);
+#endif
+	r = ext4_balloc_discard_flush(&mp->fs);
+	if (rr == EOK)
+		rr = r;
 	r = ext4_fs_fini(&mp->fs);
 	if (r != EOK)
 		goto Finish;
 
 	mp->mounted = 0;
 
+	/*Record hot blocks for the next mount*/
+	for (i = 0; i < CONFIG_EXT4_BLOCKDEVS_COUNT; ++i) {
+		struct ext4_block_devices *dev = &s_bdevices[i];
+		if (dev->bd == mp->fs.bdev && dev->wu_lba)
+			*dev->wu_cnt = ext4_bcache_hot_lbas(mp->fs.bdev->bc,
+							    dev->wu_lba,
+							    dev->wu_max);
+	}
+
+	ext4_dcache_fini(&mp->dc);
 	ext4_bcache_cleanup(mp->fs.bdev->bc);
 	ext4_bcache_fini_dynamic(mp->fs.bdev->bc);
 
 	r = ext4_block_fini(mp->fs.bdev);
 Finish:
 	mp->fs.bdev->fs = NULL;
-	return r;
+	return r != EOK ? r : rr;
 }
 
 static struct ext4_mountpoint *ext4_get_mount(const char *path)
@@ -520,7 +673,7 @@ Finish:
 __unused
 static int __ext4_journal_stop(const char *mount_point)
 {
-	int r = EOK;
+	int r = EOK, rr = EOK;
 	struct ext4_mountpoint *mp = ext4_get_mount(mount_point);
 
 	if (!mp)
@@ -529,6 +682,13 @@ static int __ext4_journal_stop(const char *mount_point)
 	if (mp->fs.read_only)
 		return EOK;
 
+#if CONFIG_DELALLOC_PAGES
+	/*Pending data goes through the journal while it is there*/
+	EXT4_MP_LOCK(mp);
+	rr = ext4_da_flush_all(mp);
+	EXT4_MP_UNLOCK(mp);
+#endif
+
 	if (ext4_sb_feature_com(&mp->fs.sb,
 				EXT4_FCOM_HAS_JOURNAL)) {
 		r = jbd_journal_stop(&mp->jbd_journal);
@@ -551,7 +711,7 @@ static int __ext4_journal_stop(const char *mount_point)
 		mp->fs.jbd_fs = NULL;
 	}
 Finish:
-	return r;
+	return r != EOK ? r : rr;
 }
 
 __unused
@@ -695,9 +855,15 @@ static int ext4_trans_start(struct ext4_mountpoint *mp __unused)
 static int ext4_trans_stop(struct ext4_mountpoint *mp __unused)
 {
 	int r = EOK;
+	/*Left open for the outer stop*/
+	if (mp->trans_join)
+		return EOK;
 #if CONFIG_JOURNALING_ENABLE
 	r = __ext4_trans_stop(mp);
 #endif
+	/*Freed blocks are safe to discard once the transaction is on disk*/
+	if (r == EOK)
+		ext4_balloc_discard_flush(&mp->fs);
 	return r;
 }
 
@@ -705,6 +871,352 @@ static void ext4_trans_abort(struct ext4_mountpoint *mp __unused)
 {
 #if CONFIG_JOURNALING_ENABLE
 	__ext4_trans_abort(mp);
+#endif
+	ext4_balloc_discard_drop(&mp->fs);
+}
+
+#if CONFIG_DELALLOC_PAGES
+/**@brief   Delayed allocation i-node: regular file blocks written past
+ *          the allocated ones, held in memory until flush.*/
+struct ext4_da_inode {
+	/**@brief   I-node index.*/
+	uint32_t index;
+
+	/**@brief   First pending logical block (allocated blocks count).*/
+	ext4_lblk_t lblk;
+
+	/**@brief   Pending blocks, contiguous from lblk.*/
+	uint32_t cnt;
+
+	/**@brief   Pages array capacity.*/
+	uint32_t cap;
+
+	/**@brief   File size including pending data.*/
+	uint64_t size;
+
+	/**@brief   Free blocks reserved for the pending blocks.*/
+	uint32_t resv;
+
+	/**@brief   Pending block data.*/
+	uint8_t **pages;
+
+	SLIST_ENTRY(ext4_da_inode) next;
+};
+
+/**@brief   Mapping tree levels reserved with the pending blocks.*/
+#define EXT4_DA_RESV_LEVELS 4
+
+/**@brief   On-disk extent (and index) entry size.*/
+#define EXT4_DA_RESV_ENTRY 12
+
+static struct ext4_da_inode *ext4_da_find(struct ext4_mountpoint *mp,
+					  uint32_t index)
+{
+	struct ext4_da_inode *di;
+
+	SLIST_FOREACH(di, &mp->da_list, next)
+		if (di->index == index)
+			return di;
+
+	return NULL;
+}
+
+/**@brief   File size including pending data (size - on disk size).*/
+static uint64_t ext4_da_size(struct ext4_mountpoint *mp, uint32_t index,
+			     uint64_t size)
+{
+	struct ext4_da_inode *di = ext4_da_find(mp, index);
+
+	return di ? di->size : size;
+}
+
+/**@brief   Reserve free blocks for cnt pending blocks of an i-node: the
+ *          data blocks and the mapping blocks of the worst case (an
+ *          extent per block), like the dirty clusters count of ext4.
+ * @return  ENOSPC when free blocks don't cover a larger reservation*/
+static int ext4_da_reserve(struct ext4_mountpoint *mp,
+			   struct ext4_da_inode *di, uint32_t cnt)
+{
+	uint32_t block_size = ext4_sb_get_block_size(&mp->fs.sb);
+	uint32_t per = block_size / EXT4_DA_RESV_ENTRY - 1;
+	uint32_t resv = 0;
+
+	if (cnt)
+		resv = cnt + (cnt + per - 1) / per + EXT4_DA_RESV_LEVELS;
+
+	if (resv > di->resv &&
+	    resv - di->resv > ext4_balloc_avail_blocks(&mp->fs))
+		return ENOSPC;
+
+	mp->fs.da_resv = mp->fs.da_resv - di->resv + resv;
+	di->resv = resv;
+	return EOK;
+}
+
+/**@brief   Drop pending pages from idx on, the i-node goes with the
+ *          last page.*/
+static void ext4_da_drop(struct ext4_mountpoint *mp,
+			 struct ext4_da_inode *di, uint32_t idx)
+{
+	while (di->cnt > idx) {
+		ext4_free(di->pages[--di->cnt]);
+		mp->da_pages--;
+	}
+
+	/*Reservation shrinks with the pages*/
+	if (di->resv)
+		ext4_da_reserve(mp, di, di->cnt);
+
+	if (di->cnt)
+		return;
+
+	SLIST_REMOVE(&mp->da_list, di, ext4_da_inode, next);
+	ext4_free(di->pages);
+	ext4_free(di);
+}
+
+/**@brief   Hold file data at pos, past the allocated blocks (lblk).*/
+static int ext4_da_write(struct ext4_mountpoint *mp, uint32_t index,
+			 ext4_lblk_t lblk, uint64_t pos, const uint8_t *buf,
+			 size_t len, size_t *wcnt)
+{
+	uint32_t block_size = ext4_sb_get_block_size(&mp->fs.sb);
+	struct ext4_da_inode *di = ext4_da_find(mp, index);
+	int r = EOK;
+
+	*wcnt = 0;
+	if (!di) {
+		di = ext4_calloc(1, sizeof(struct ext4_da_inode));
+		if (!di)
+			return ENOMEM;
+
+		di->index = index;
+		di->lblk = lblk;
+		di->size = (uint64_t)lblk * block_size;
+		SLIST_INSERT_HEAD(&mp->da_list, di, next);
+	}
+
+	ext4_assert(di->lblk == lblk);
+	while (len) {
+		uint32_t idx = (uint32_t)(pos / block_size - lblk);
+		uint32_t off = pos % block_size;
+		size_t n = block_size - off;
+
+		if (n > len)
+			n = len;
+
+		ext4_assert(idx <= di->cnt);
+		if (idx == di->cnt) {
+			if (di->cnt == di->cap) {
+				uint32_t cap = di->cap ? di->cap * 2 : 16;
+				uint8_t **pages;
+
+				pages = ext4_realloc(di->pages,
+						     cap * sizeof(uint8_t *));
+				if (!pages) {
+					r = ENOMEM;
+					break;
+				}
+				di->pages = pages;
+				di->cap = cap;
+			}
+
+			di->pages[idx] = ext4_malloc(block_size);
+			if (!di->pages[idx]) {
+				r = ENOMEM;
+				break;
+			}
+
+			/*Accepted data always gets its blocks on flush*/
+			r = ext4_da_reserve(mp, di, di->cnt + 1);
+			if (r != EOK) {
+				ext4_free(di->pages[idx]);
+				break;
+			}
+
+			if (n != block_size)
+				memset(di->pages[idx], 0, block_size);
+
+			di->cnt++;
+			mp->da_pages++;
+		}
+
+		memcpy(di->pages[idx] + off, buf, n);
+		buf += n;
+		pos += n;
+		len -= n;
+		*wcnt += n;
+
+		if (pos > di->size)
+			di->size = pos;
+	}
+
+	if (!di->cnt)
+		ext4_da_drop(mp, di, 0);
+
+	return r;
+}
+
+/**@brief   Copy file data at pos from pending pages.*/
+static void ext4_da_read(struct ext4_mountpoint *mp,
+			 struct ext4_da_inode *di, uint64_t pos, uint8_t *buf,
+			 size_t len)
+{
+	uint32_t block_size = ext4_sb_get_block_size(&mp->fs.sb);
+
+	while (len) {
+		uint32_t idx = (uint32_t)(pos / block_size - di->lblk);
+		uint32_t off = pos % block_size;
+		size_t n = block_size - off;
+
+		if (n > len)
+			n = len;
+
+		memcpy(buf, di->pages[idx] + off, n);
+		buf += n;
+		pos += n;
+		len -= n;
+	}
+}
+
+/**@brief   Trim pending data to a new file size.*/
+static void ext4_da_trunc(struct ext4_mountpoint *mp, uint32_t index,
+			  uint64_t size)
+{
+	uint32_t block_size = ext4_sb_get_block_size(&mp->fs.sb);
+	struct ext4_da_inode *di = ext4_da_find(mp, index);
+	uint64_t start;
+	uint32_t off;
+
+	if (!di || di->size <= size)
+		return;
+
+	start = (uint64_t)di->lblk * block_size;
+	if (size <= start) {
+		ext4_da_drop(mp, di, 0);
+		return;
+	}
+
+	/*Zero the tail, the whole last block is written on flush*/
+	off = size % block_size;
+	if (off)
+		memset(di->pages[(size - start) / block_size] + off, 0,
+		       block_size - off);
+
+	di->size = size;
+	ext4_da_drop(mp, di,
+		     (uint32_t)((size - start + block_size - 1) / block_size));
+}
+
+/**@brief   Allocate pending blocks of an i-node (a run at a time) and
+ *          write them. Blocks which could not be allocated or written
+ *          are dropped, the file size ends at the last written one.*/
+static int ext4_da_flush(struct ext4_mountpoint *mp,
+			 struct ext4_da_inode *di)
+{
+	struct ext4_blockdev_iovec iov[32];
+	struct ext4_inode_ref ref;
+	struct ext4_blockdev *bdev = mp->fs.bdev;
+	uint32_t block_size = ext4_sb_get_block_size(&mp->fs.sb);
+	uint64_t size;
+	uint32_t done = 0;
+	ext4_lblk_t end = di->lblk;
+	int r, rr;
+
+	ext4_trans_start(mp);
+	r = ext4_fs_get_inode_ref(&mp->fs, di->index, &ref);
+	if (r != EOK) {
+		ext4_trans_abort(mp);
+		ext4_da_drop(mp, di, 0);
+		return r;
+	}
+
+	/*Reserved blocks are the ones allocated now*/
+	mp->fs.da_resv -= di->resv;
+	di->resv = 0;
+
+	ext4_block_cache_write_back(bdev, 1);
+	while (done < di->cnt) {
+		ext4_fsblk_t fblock;
+		ext4_lblk_t iblock;
+		uint32_t n = di->cnt - done;
+		uint32_t i, k;
+
+		r = ext4_fs_append_inode_dblks(&ref, &fblock, &iblock, &n);
+		if (r != EOK)
+			break;
+
+		ext4_assert(iblock == di->lblk + done);
+		end = iblock + n;
+
+		/* Cached copies (e.g. read ahead) would go stale. */
+		ext4_bcache_invalidate_lba(bdev->bc, fblock, n);
+		for (i = 0; i < n && r == EOK; i += k) {
+			for (k = 0; k < 32 && i + k < n; k++) {
+				iov[k].blk_id = fblock + i + k;
+				iov[k].blk_cnt = 1;
+				iov[k].buf = di->pages[done + i + k];
+			}
+			r = ext4_blocks_set_direct_v(bdev, iov, k);
+		}
+		if (r != EOK)
+			break;
+
+		done += n;
+	}
+	ext4_block_cache_write_back(bdev, 0);
+
+	size = (uint64_t)(di->lblk + done) * block_size;
+	if (size > di->size)
+		size = di->size;
+
+	/*Blocks of a run which failed to be written are freed again*/
+	if (end > di->lblk + done) {
+		ext4_inode_set_size(ref.inode, (uint64_t)end * block_size);
+		rr = ext4_fs_truncate_inode(&ref, size);
+		if (r == EOK)
+			r = rr;
+	}
+
+	ext4_inode_set_size(ref.inode, size);
+	ref.dirty = true;
+
+	/*Whatever made it to disk is committed*/
+	rr = ext4_fs_put_inode_ref(&ref);
+	if (rr != EOK)
+		ext4_trans_abort(mp);
+	else
+		ext4_trans_stop(mp);
+
+	ext4_da_drop(mp, di, 0);
+	return r != EOK ? r : rr;
+}
+
+static int ext4_da_flush_all(struct ext4_mountpoint *mp)
+{
+	int r = EOK;
+
+	while (!SLIST_EMPTY(&mp->da_list)) {
+		int rr = ext4_da_flush(mp, SLIST_FIRST(&mp->da_list));
+		if (r == EOK)
+			r = rr;
+	}
+
+	return r;
+}
+#endif
+
+/**@brief   File size including data held by delayed allocation
+ *          (size - on disk size).*/
+static uint64_t ext4_fsize_pending(struct ext4_mountpoint *mp,
+				   uint32_t index, uint64_t size)
+{
+#if CONFIG_DELALLOC_PAGES
+	return ext4_da_size(mp, index, size);
+#else
+	(void)mp;
+	(void)index;
+	return size;
 #endif
 }
 
@@ -734,6 +1246,59 @@ int ext4_mount_point_stats(const char *mount_point,
 	return EOK;
 }
 
+int ext4_mount_point_cache_stats(const char *mount_point,
+				 struct ext4_bcache_stats *stats, bool clear)
+{
+	struct ext4_mountpoint *mp = ext4_get_mount(mount_point);
+
+	if (!mp)
+		return ENOENT;
+
+	EXT4_MP_LOCK(mp);
+	ext4_bcache_get_stats(mp->fs.bdev->bc, stats);
+	if (clear)
+		ext4_bcache_clear_stats(mp->fs.bdev->bc);
+	EXT4_MP_UNLOCK(mp);
+
+	return EOK;
+}
+
+int ext4_data_cache(const char *mount_point, uint32_t cnt)
+{
+	struct ext4_mountpoint *mp = ext4_get_mount(mount_point);
+
+	if (!mp)
+		return ENOENT;
+
+	EXT4_MP_LOCK(mp);
+	ext4_dcache_fini(&mp->dc);
+	ext4_dcache_init(&mp->dc, cnt, ext4_sb_get_block_size(&mp->fs.sb));
+	EXT4_MP_UNLOCK(mp);
+
+	return EOK;
+}
+
+int ext4_data_cache_stats(const char *mount_point,
+			  struct ext4_dcache_stats *stats, bool clear)
+{
+	struct ext4_mountpoint *mp = ext4_get_mount(mount_point);
+
+	if (!mp)
+		return ENOENT;
+
+	EXT4_MP_LOCK(mp);
+	*stats = mp->dc.stats;
+	if (clear) {
+		mp->dc.stats.hits = 0;
+		mp->dc.stats.misses = 0;
+		mp->dc.stats.evictions = 0;
+		mp->dc.stats.invalidations = 0;
+	}
+	EXT4_MP_UNLOCK(mp);
+
+	return EOK;
+}
+
 int ext4_mount_setup_locks(const char *mount_point,
 			   const struct ext4_lock *locks)
 {
@@ -823,7 +1388,15 @@ static int ext4_trunc_inode(struct ext4_mountpoint *mp,
 	struct ext4_fs *const fs = &mp->fs;
 	struct ext4_inode_ref inode_ref;
 	uint64_t inode_size;
+	uint32_t block_size = ext4_sb_get_block_size(&fs->sb);
 	bool has_trans = mp->fs.jbd_journal && mp->fs.curr_trans;
+
+	ext4_dcache_drop(&mp->dc, index, (ext4_lblk_t)(new_size / block_size),
+			 UINT32_MAX);
+#if CONFIG_DELALLOC_PAGES
+	/*Pending data past the new size never gets allocated*/
+	ext4_da_trunc(mp, index, new_size);
+#endif
 	r = ext4_fs_get_inode_ref(fs, index, &inode_ref);
 	if (r != EOK)
 		return r;
@@ -1085,6 +1658,9 @@ static int ext4_generic_open2(ext4_file *f, const char *path, int flags,
 
 		f->mp = mp;
 		f->fsize = ext4_inode_get_size(sb, ref.inode);
+#if CONFIG_DELALLOC_PAGES
+		f->fsize = ext4_da_size(mp, ref.index, f->fsize);
+#endif
 		f->inode = ref.index;
 		f->fpos = 0;
 
@@ -1431,11 +2007,144 @@ int ext4_cache_flush(const char *path)
 		return ENOENT;
 
 	EXT4_MP_LOCK(mp);
+#if CONFIG_DELALLOC_PAGES
+	ret = ext4_da_flush_all(mp);
+	if (ret == EOK)
+		ret = ext4_block_cache_flush(mp->fs.bdev);
+#else
 	ret = ext4_block_cache_flush(mp->fs.bdev);
+#endif
+	EXT4_MP_UNLOCK(mp);
+	return ret;
+}
+
+int ext4_cache_flusher_setup(const char *path,
+			     const struct ext4_bcache_wb *wb)
+{
+	struct ext4_mountpoint *mp = ext4_get_mount(path);
+
+	if (!mp)
+		return ENOENT;
+
+	if (wb && wb->dirty_age_ms && !wb->time_ms)
+		return EINVAL;
+
+	EXT4_MP_LOCK(mp);
+	if (wb)
+		mp->bc.wb = *wb;
+	else
+		memset(&mp->bc.wb, 0, sizeof(mp->bc.wb));
+	EXT4_MP_UNLOCK(mp);
+	return EOK;
+}
+
+int ext4_cache_flusher_tick(const char *path)
+{
+	struct ext4_mountpoint *mp = ext4_get_mount(path);
+	int ret;
+
+	if (!mp)
+		return ENOENT;
+
+	EXT4_MP_LOCK(mp);
+	ret = ext4_block_cache_writeback(mp->fs.bdev);
+	EXT4_MP_UNLOCK(mp);
+	return ret;
+}
+
+int ext4_cache_resize(const char *path, uint32_t cnt)
+{
+	struct ext4_mountpoint *mp = ext4_get_mount(path);
+	int ret;
+
+	if (!mp)
+		return ENOENT;
+
+	EXT4_MP_LOCK(mp);
+	ret = ext4_bcache_resize(mp->fs.bdev->bc, cnt);
 	EXT4_MP_UNLOCK(mp);
 	return ret;
 }
 
+int ext4_cache_shed(const char *path, uint32_t target, uint32_t *freed)
+{
+	struct ext4_mountpoint *mp = ext4_get_mount(path);
+	uint32_t cnt;
+
+	if (!mp)
+		return ENOENT;
+
+	EXT4_MP_LOCK(mp);
+	cnt = ext4_bcache_shed(mp->fs.bdev->bc, target);
+	EXT4_MP_UNLOCK(mp);
+
+	if (freed)
+		*freed = cnt;
+	return EOK;
+}
+
+int ext4_online_discard(const char *path, bool on)
+{
+	struct ext4_mountpoint *mp = ext4_get_mount(path);
+	int r = EOK;
+
+	if (!mp)
+		return ENOENT;
+
+	if (on && !mp->fs.bdev->bdif->discard)
+		return ENOTSUP;
+
+	EXT4_MP_LOCK(mp);
+	if (!on)
+		r = ext4_balloc_discard_flush(&mp->fs);
+	mp->fs.discard = on;
+	EXT4_MP_UNLOCK(mp);
+	return r;
+}
+
+int ext4_fstrim(const char *path, uint64_t min_len, uint64_t *trimmed)
+{
+	struct ext4_mountpoint *mp = ext4_get_mount(path);
+	uint32_t block_size;
+	uint64_t cnt = 0;
+	int r;
+
+	if (!mp)
+		return ENOENT;
+
+	block_size = ext4_sb_get_block_size(&mp->fs.sb);
+
+	EXT4_MP_LOCK(mp);
+	r = ext4_balloc_trim(&mp->fs, min_len / block_size, &cnt);
+	EXT4_MP_UNLOCK(mp);
+
+	if (trimmed)
+		*trimmed = cnt * block_size;
+	return r;
+}
+
+int ext4_delalloc(const char *path, bool on)
+{
+#if CONFIG_DELALLOC_PAGES
+	struct ext4_mountpoint *mp = ext4_get_mount(path);
+	int r = EOK;
+
+	if (!mp)
+		return ENOENT;
+
+	EXT4_MP_LOCK(mp);
+	if (!on)
+		r = ext4_da_flush_all(mp);
+	mp->da_on = on;
+	EXT4_MP_UNLOCK(mp);
+	return r;
+#else
+	(void)path;
+	(void)on;
+	return ENOTSUP;
+#endif
+}
+
 int ext4_fremove(const char *path)
 {
 	ext4_file f;
@@ -1615,6 +2324,9 @@ static int ext4_ftruncate_no_lock(ext4_file *file, uint64_t size)
 
 	/*Sync file size*/
 	file->fsize = ext4_inode_get_size(&file->mp->fs.sb, ref.inode);
+#if CONFIG_DELALLOC_PAGES
+	file->fsize = ext4_da_size(file->mp, ref.index, file->fsize);
+#endif
 	if (file->fsize <= size) {
 		r = EOK;
 		goto Finish;
@@ -1669,14 +2381,112 @@ int ext4_ftruncate(ext4_file *f, uint64_t size)
 	return r;
 }
 
-int ext4_fread(ext4_file *file, void *buf, size_t size, size_t *rcnt)
+/**@brief   Read a part of a file block, through the data cache.*/
+static int ext4_fread_part(struct ext4_mountpoint *mp,
+			   struct ext4_inode_ref *ref, ext4_lblk_t iblock,
+			   uint32_t off, uint8_t *buf, size_t len)
+{
+	uint32_t block_size = ext4_sb_get_block_size(&mp->fs.sb);
+	const uint8_t *data = NULL;
+	uint8_t *page = NULL;
+	ext4_fsblk_t fblock;
+	int r;
+
+	if (ext4_dcache_on(&mp->dc))
+		data = ext4_dcache_get(&mp->dc, ref->index, iblock);
+
+	if (data) {
+		memcpy(buf, data + off, len);
+		return EOK;
+	}
+
+	r = ext4_fs_get_inode_dblk_idx(ref, iblock, &fblock, true);
+	if (r != EOK)
+		return r;
+
+	/* Do we get an unwritten range? */
+	if (!fblock) {
+		memset(buf, 0, len);
+		return EOK;
+	}
+
+	if (ext4_dcache_on(&mp->dc))
+		page = ext4_dcache_add(&mp->dc, ref->index, iblock);
+
+	if (!page)
+		return ext4_block_readbytes(mp->fs.bdev,
+					    fblock * block_size + off, buf,
+					    len);
+
+	r = ext4_blocks_get_direct(mp->fs.bdev, page, fblock, 1);
+	if (r != EOK) {
+		ext4_dcache_drop(&mp->dc, ref->index, iblock, 1);
+		return r;
+	}
+
+	memcpy(buf, page + off, len);
+	return EOK;
+}
+
+/**@brief   Read whole file blocks of a physical run (fblock 0 - hole),
+ *          through the data cache.*/
+static int ext4_fread_run(struct ext4_mountpoint *mp, uint32_t ino,
+			  ext4_lblk_t iblock, ext4_fsblk_t fblock,
+			  uint32_t cnt, uint8_t *buf)
+{
+	size_t block_size = ext4_sb_get_block_size(&mp->fs.sb);
+	uint32_t i, j;
+	int r;
+
+	if (!fblock) {
+		/*Hole or unwritten range*/
+		memset(buf, 0, block_size * cnt);
+		return EOK;
+	}
+
+	if (!ext4_dcache_on(&mp->dc))
+		return ext4_blocks_get_direct(mp->fs.bdev, buf, fblock, cnt);
+
+	for (i = 0; i < cnt;) {
+		const uint8_t *data = ext4_dcache_get(&mp->dc, ino, iblock + i);
+
+		if (data) {
+			memcpy(buf + block_size * i, data, block_size);
+			i++;
+			continue;
+		}
+
+		/*Misses up to the next cached block: a single request*/
+		for (j = i + 1; j < cnt; j++)
+			if (ext4_dcache_has(&mp->dc, ino, iblock + j))
+				break;
+
+		r = ext4_blocks_get_direct(mp->fs.bdev, buf + block_size * i,
+					   fblock + i, j - i);
+		if (r != EOK)
+			return r;
+
+		for (; i < j; i++) {
+			uint8_t *page = ext4_dcache_add(&mp->dc, ino,
+							iblock + i);
+			if (page)
+				memcpy(page, buf + block_size * i, block_size);
+		}
+	}
+
+	return EOK;
+}
+
+/**@brief   Read file data at *fpos, advanced by the bytes read. The caller
+ *          holds the mount point lock.*/
+static int ext4_fread_at(ext4_file *file, uint64_t *fpos, void *buf,
+			 size_t size, size_t *rcnt)
 {
 	uint32_t unalg;
 	uint32_t iblock_idx;
 	uint32_t iblock_last;
 	uint32_t block_size;
 
-	ext4_fsblk_t fblock;
 	ext4_fsblk_t fblock_start;
 	uint32_t fblock_count;
 
@@ -1684,16 +2494,6 @@ int ext4_fread(ext4_file *file, void *buf, size_t size, size_t *rcnt)
 	int r;
 	struct ext4_inode_ref ref;
 
-	ext4_assert(file && file->mp);
-
-	if (file->flags & O_WRONLY)
-		return EPERM;
-
-	if (!size)
-		return EOK;
-
-	EXT4_MP_LOCK(file->mp);
-
 	struct ext4_fs *const fs = &file->mp->fs;
 	struct ext4_sblock *const sb = &file->mp->fs.sb;
 
@@ -1701,21 +2501,46 @@ int ext4_fread(ext4_file *file, void *buf, size_t size, size_t *rcnt)
 		*rcnt = 0;
 
 	r = ext4_fs_get_inode_ref(fs, file->inode, &ref);
-	if (r != EOK) {
-		EXT4_MP_UNLOCK(file->mp);
+	if (r != EOK)
 		return r;
-	}
 
 	/*Sync file size*/
 	file->fsize = ext4_inode_get_size(sb, ref.inode);
 
 	block_size = ext4_sb_get_block_size(sb);
-	size = ((uint64_t)size > (file->fsize - file->fpos))
-		? ((size_t)(file->fsize - file->fpos)) : size;
+#if CONFIG_DELALLOC_PAGES
+	struct ext4_da_inode *di = ext4_da_find(file->mp, ref.index);
+	size_t da_len = 0;
+
+	if (di)
+		file->fsize = di->size;
+#endif
+	/*Nothing to read past the end of file*/
+	if (*fpos >= file->fsize)
+		goto Finish;
+
+	size = ((uint64_t)size > (file->fsize - *fpos))
+		? ((size_t)(file->fsize - *fpos)) : size;
 
-	iblock_idx = (uint32_t)((file->fpos) / block_size);
-	iblock_last = (uint32_t)((file->fpos + size) / block_size);
-	unalg = (file->fpos) % block_size;
+#if CONFIG_DELALLOC_PAGES
+	/*Pending data: copy it, read the rest from disk*/
+	if (di && *fpos + size > (uint64_t)di->lblk * block_size) {
+		uint64_t da_off = (uint64_t)di->lblk * block_size;
+		size_t head = 0;
+
+		if (*fpos < da_off)
+			head = (size_t)(da_off - *fpos);
+
+		da_len = size - head;
+		ext4_da_read(file->mp, di, *fpos + head, u8_buf + head,
+			     da_len);
+		size = head;
+	}
+#endif
+
+	iblock_idx = (uint32_t)((*fpos) / block_size);
+	iblock_last = (uint32_t)((*fpos + size) / block_size);
+	unalg = (*fpos) % block_size;
 
 	/*If the size of symlink is smaller than 60 bytes*/
 	bool softlink;
@@ -1724,7 +2549,7 @@ int ext4_fread(ext4_file *file, void *buf, size_t size, size_t *rcnt)
 		     && !ext4_inode_get_blocks_count(sb, ref.inode)) {
 
 		char *content = (char *)ref.inode->blocks;
-		if (file->fpos < file->fsize) {
+		if (*fpos < file->fsize) {
 			size_t len = size;
 			if (unalg + size > (uint32_t)file->fsize)
 				len = (uint32_t)file->fsize - unalg;
@@ -1743,25 +2568,14 @@ int ext4_fread(ext4_file *file, void *buf, size_t size, size_t *rcnt)
 		if (size > (block_size - unalg))
 			len = block_size - unalg;
 
-		r = ext4_fs_get_inode_dblk_idx(&ref, iblock_idx, &fblock, true);
+		r = ext4_fread_part(file->mp, &ref, iblock_idx, unalg, u8_buf,
+				    len);
 		if (r != EOK)
 			goto Finish;
 
-		/* Do we get an unwritten range? */
-		if (fblock != 0) {
-			uint64_t off = fblock * block_size + unalg;
-			r = ext4_block_readbytes(file->mp->fs.bdev, off, u8_buf, len);
-			if (r != EOK)
-				goto Finish;
-
-		} else {
-			/* Yes, we do. */
-			memset(u8_buf, 0, len);
-		}
-
 		u8_buf += len;
 		size -= len;
-		file->fpos += len;
+		*fpos += len;
 
 		if (rcnt)
 			*rcnt += len;
@@ -1769,66 +2583,74 @@ int ext4_fread(ext4_file *file, void *buf, size_t size, size_t *rcnt)
 		iblock_idx++;
 	}
 
-	fblock_start = 0;
-	fblock_count = 0;
-	while (size >= block_size) {
-		while (iblock_idx < iblock_last) {
-			r = ext4_fs_get_inode_dblk_idx(&ref, iblock_idx,
-						       &fblock, true);
-			if (r != EOK)
-				goto Finish;
-
-			iblock_idx++;
-
-			if (!fblock_start)
-				fblock_start = fblock;
-
-			if ((fblock_start + fblock_count) != fblock)
-				break;
-
-			fblock_count++;
-		}
+	/*Whole blocks: a single lookup and request per physical run*/
+	while (iblock_idx < iblock_last) {
+		r = ext4_fs_get_inode_dblk_run(&ref, iblock_idx,
+					       iblock_last - iblock_idx,
+					       &fblock_start, &fblock_count);
+		if (r != EOK)
+			goto Finish;
 
-		r = ext4_blocks_get_direct(file->mp->fs.bdev, u8_buf, fblock_start,
-					   fblock_count);
+		r = ext4_fread_run(file->mp, ref.index, iblock_idx,
+				   fblock_start, fblock_count, u8_buf);
 		if (r != EOK)
 			goto Finish;
 
-		size -= block_size * fblock_count;
-		u8_buf += block_size * fblock_count;
-		file->fpos += block_size * fblock_count;
+		size -= (size_t)block_size * fblock_count;
+		u8_buf += (size_t)block_size * fblock_count;
+		*fpos += (uint64_t)block_size * fblock_count;
 
 		if (rcnt)
-			*rcnt += block_size * fblock_count;
+			*rcnt += (size_t)block_size * fblock_count;
 
-		fblock_start = fblock;
-		fblock_count = 1;
+		iblock_idx += fblock_count;
 	}
 
 	if (size) {
-		uint64_t off;
-		r = ext4_fs_get_inode_dblk_idx(&ref, iblock_idx, &fblock, true);
+		r = ext4_fread_part(file->mp, &ref, iblock_idx, 0, u8_buf,
+				    size);
 		if (r != EOK)
 			goto Finish;
 
-		off = fblock * block_size;
-		r = ext4_block_readbytes(file->mp->fs.bdev, off, u8_buf, size);
-		if (r != EOK)
-			goto Finish;
-
-		file->fpos += size;
+		*fpos += size;
 
 		if (rcnt)
 			*rcnt += size;
 	}
 
+#if CONFIG_DELALLOC_PAGES
+	*fpos += da_len;
+	if (rcnt)
+		*rcnt += da_len;
+#endif
+
 Finish:
 	ext4_fs_put_inode_ref(&ref);
+	return r;
+}
+
+int ext4_fread(ext4_file *file, void *buf, size_t size, size_t *rcnt)
+{
+	int r;
+
+	ext4_assert(file && file->mp);
+
+	if (file->flags & O_WRONLY)
+		return EPERM;
+
+	if (!size)
+		return EOK;
+
+	EXT4_MP_LOCK(file->mp);
+	r = ext4_fread_at(file, &file->fpos, buf, size, rcnt);
 	EXT4_MP_UNLOCK(file->mp);
 	return r;
 }
 
-int ext4_fwrite(ext4_file *file, const void *buf, size_t size, size_t *wcnt)
+/**@brief   Write file data at *fpos, advanced by the bytes written. The
+ *          caller holds the mount point lock.*/
+static int ext4_fwrite_at(ext4_file *file, uint64_t *fpos, const void *buf,
+			  size_t size, size_t *wcnt)
 {
 	uint32_t unalg;
 	uint32_t iblk_idx;
@@ -1844,42 +2666,78 @@ int ext4_fwrite(ext4_file *file, const void *buf, size_t size, size_t *wcnt)
 	const uint8_t *u8_buf = buf;
 	int r, rr = EOK;
 
-	ext4_assert(file && file->mp);
-
-	if (file->mp->fs.read_only)
-		return EROFS;
-
-	if (file->flags & O_RDONLY)
-		return EPERM;
-
-	if (!size)
-		return EOK;
-
-	EXT4_MP_LOCK(file->mp);
-	ext4_trans_start(file->mp);
-
 	struct ext4_fs *const fs = &file->mp->fs;
 	struct ext4_sblock *const sb = &file->mp->fs.sb;
 
+	block_size = ext4_sb_get_block_size(sb);
+#if CONFIG_DELALLOC_PAGES
+	bool da = file->mp->da_on;
+	size_t da_len = 0;
+
+	/*Make room for the write, larger writes are not delayed*/
+	if (da && file->mp->da_pages + size / block_size >
+		  CONFIG_DELALLOC_PAGES) {
+		r = ext4_da_flush_all(file->mp);
+		if (r != EOK) {
+			if (wcnt)
+				*wcnt = 0;
+			return r;
+		}
+		da = size / block_size < CONFIG_DELALLOC_PAGES;
+	}
+#endif
+	ext4_trans_start(file->mp);
+
 	if (wcnt)
 		*wcnt = 0;
 
 	r = ext4_fs_get_inode_ref(fs, file->inode, &ref);
 	if (r != EOK) {
 		ext4_trans_abort(file->mp);
-		EXT4_MP_UNLOCK(file->mp);
 		return r;
 	}
 
 	/*Sync file size*/
 	file->fsize = ext4_inode_get_size(sb, ref.inode);
-	block_size = ext4_sb_get_block_size(sb);
 
-	iblock_last = (uint32_t)((file->fpos + size) / block_size);
-	iblk_idx = (uint32_t)(file->fpos / block_size);
+	/*Writes can't leave holes behind the end of file*/
+	if (*fpos > ext4_fsize_pending(file->mp, ref.index, file->fsize)) {
+		ext4_fs_put_inode_ref(&ref);
+		ext4_trans_abort(file->mp);
+		return EINVAL;
+	}
+
+	/*Cached copies of the blocks written would go stale*/
+	ext4_dcache_drop(&file->mp->dc, ref.index,
+			 (ext4_lblk_t)(*fpos / block_size),
+			 (uint32_t)((*fpos + size - 1) / block_size -
+				    *fpos / block_size + 1));
+
+#if CONFIG_DELALLOC_PAGES
+	/*Data past the allocated blocks is held, written on flush*/
+	if (da && ext4_inode_is_type(sb, ref.inode, EXT4_INODE_MODE_FILE)) {
+		uint64_t da_off = file->fsize + block_size - 1;
+
+		da_off -= da_off % block_size;
+		if (*fpos + size > da_off) {
+			size_t head = 0;
+
+			if (*fpos < da_off)
+				head = (size_t)(da_off - *fpos);
+
+			da_len = size - head;
+			size = head;
+			if (!size)
+				goto da_write;
+		}
+	}
+#endif
+
+	iblock_last = (uint32_t)((*fpos + size) / block_size);
+	iblk_idx = (uint32_t)(*fpos / block_size);
 	ifile_blocks = (uint32_t)((file->fsize + block_size - 1) / block_size);
 
-	unalg = (file->fpos) % block_size;
+	unalg = (*fpos) % block_size;
 
 	if (unalg) {
 		size_t len =  size;
@@ -1898,7 +2756,7 @@ int ext4_fwrite(ext4_file *file, const void *buf, size_t size, size_t *wcnt)
 
 		u8_buf += len;
 		size -= len;
-		file->fpos += len;
+		*fpos += len;
 
 		if (wcnt)
 			*wcnt += len;
@@ -1911,61 +2769,59 @@ int ext4_fwrite(ext4_file *file, const void *buf, size_t size, size_t *wcnt)
 	if (r != EOK)
 		goto Finish;
 
+	/*Whole blocks: gather physically contiguous runs, appended blocks
+	 * are allocated a run at a time.*/
 	fblock_start = 0;
 	fblock_count = 0;
-	while (size >= block_size) {
+	while ((iblk_idx < iblock_last && rr == EOK) || fblock_count) {
+		uint32_t n = 0;
 
-		while (iblk_idx < iblock_last) {
+		if (iblk_idx < iblock_last && rr == EOK) {
 			if (iblk_idx < ifile_blocks) {
 				r = ext4_fs_init_inode_dblk_idx(&ref, iblk_idx,
 								&fblk);
 				if (r != EOK)
-					goto Finish;
-			} else {
-				rr = ext4_fs_append_inode_dblk(&ref, &fblk,
-							       &iblk_idx);
-				if (rr != EOK) {
-					/* Unable to append more blocks. But
-					 * some block might be allocated already
-					 * */
 					break;
-				}
+				n = 1;
+			} else {
+				n = iblock_last - iblk_idx;
+				rr = ext4_fs_append_inode_dblks(&ref, &fblk,
+								&iblk_idx, &n);
+				/* Unable to append more blocks. But some
+				 * blocks might be allocated already. */
+				if (rr != EOK)
+					n = 0;
 			}
 
-			iblk_idx++;
-
-			if (!fblock_start) {
-				fblock_start = fblk;
+			iblk_idx += n;
+			if (n && fblock_count &&
+			    fblock_start + fblock_count == fblk) {
+				fblock_count += n;
+				continue;
 			}
-
-			if ((fblock_start + fblock_count) != fblk)
-				break;
-
-			fblock_count++;
 		}
 
-		r = ext4_blocks_set_direct(file->mp->fs.bdev, u8_buf, fblock_start,
-					   fblock_count);
-		if (r != EOK)
-			break;
+		if (fblock_count) {
+			size_t len = (size_t)block_size * fblock_count;
 
-		size -= block_size * fblock_count;
-		u8_buf += block_size * fblock_count;
-		file->fpos += block_size * fblock_count;
-
-		if (wcnt)
-			*wcnt += block_size * fblock_count;
+			/* Cached copies (e.g. read ahead) would go stale. */
+			ext4_bcache_invalidate_lba(file->mp->fs.bdev->bc,
+						   fblock_start, fblock_count);
+			r = ext4_blocks_set_direct(file->mp->fs.bdev, u8_buf,
+						   fblock_start, fblock_count);
+			if (r != EOK)
+				break;
 
-		fblock_start = fblk;
-		fblock_count = 1;
+			size -= len;
+			u8_buf += len;
+			*fpos += len;
 
-		if (rr != EOK) {
-			/*ext4_fs_append_inode_block has failed and no
-			 * more blocks might be written. But node size
-			 * should be updated.*/
-			r = rr;
-			goto out_fsize;
+			if (wcnt)
+				*wcnt += len;
 		}
+
+		fblock_start = fblk;
+		fblock_count = n;
 	}
 
 	/*Stop write back cache mode*/
@@ -1974,6 +2830,13 @@ int ext4_fwrite(ext4_file *file, const void *buf, size_t size, size_t *wcnt)
 	if (r != EOK)
 		goto Finish;
 
+	if (rr != EOK) {
+		/*ext4_fs_append_inode_dblks has failed and no more blocks
+		 * might be written. But node size should be updated.*/
+		r = rr;
+		goto out_fsize;
+	}
+
 	if (size) {
 		uint64_t off;
 		if (iblk_idx < ifile_blocks) {
@@ -1992,31 +2855,439 @@ int ext4_fwrite(ext4_file *file, const void *buf, size_t size, size_t *wcnt)
 		if (r != EOK)
 			goto Finish;
 
-		file->fpos += size;
+		u8_buf += size;
+		*fpos += size;
 
 		if (wcnt)
 			*wcnt += size;
 	}
 
 out_fsize:
-	if (file->fpos > file->fsize) {
-		file->fsize = file->fpos;
+	if (*fpos > file->fsize) {
+		file->fsize = *fpos;
 		ext4_inode_set_size(ref.inode, file->fsize);
 		ref.dirty = true;
 	}
 
+#if CONFIG_DELALLOC_PAGES
+da_write:
+	if (r == EOK && da_len) {
+		size_t len;
+
+		r = ext4_da_write(file->mp, ref.index,
+				  (ext4_lblk_t)((file->fsize + block_size - 1) /
+						block_size),
+				  *fpos, u8_buf, da_len, &len);
+		*fpos += len;
+		if (wcnt)
+			*wcnt += len;
+	}
+	file->fsize = ext4_da_size(file->mp, ref.index, file->fsize);
+#endif
+
 Finish:
-	r = ext4_fs_put_inode_ref(&ref);
+	rr = ext4_fs_put_inode_ref(&ref);
 
-	if (r != EOK)
+	if (rr != EOK)
 		ext4_trans_abort(file->mp);
 	else
 		ext4_trans_stop(file->mp);
 
+	return r != EOK ? r : rr;
+}
+
+int ext4_fwrite(ext4_file *file, const void *buf, size_t size, size_t *wcnt)
+{
+	int r;
+
+	ext4_assert(file && file->mp);
+
+	if (file->mp->fs.read_only)
+		return EROFS;
+
+	if (file->flags & O_RDONLY)
+		return EPERM;
+
+	if (!size)
+		return EOK;
+
+	EXT4_MP_LOCK(file->mp);
+	r = ext4_fwrite_at(file, &file->fpos, buf, size, wcnt);
+	EXT4_MP_UNLOCK(file->mp);
+	return r;
+}
+
+int ext4_pread(ext4_file *file, void *buf, size_t size, uint64_t offset,
+	       size_t *rcnt)
+{
+	int r;
+
+	ext4_assert(file && file->mp);
+
+	if (file->flags & O_WRONLY)
+		return EPERM;
+
+	if (!size)
+		return EOK;
+
+	EXT4_MP_LOCK(file->mp);
+	r = ext4_fread_at(file, &offset, buf, size, rcnt);
 	EXT4_MP_UNLOCK(file->mp);
 	return r;
 }
 
+int ext4_pwrite(ext4_file *file, const void *buf, size_t size,
+		uint64_t offset, size_t *wcnt)
+{
+	int r;
+
+	ext4_assert(file && file->mp);
+
+	if (file->mp->fs.read_only)
+		return EROFS;
+
+	if (file->flags & O_RDONLY)
+		return EPERM;
+
+	if (!size)
+		return EOK;
+
+	EXT4_MP_LOCK(file->mp);
+	r = ext4_fwrite_at(file, &offset, buf, size, wcnt);
+	EXT4_MP_UNLOCK(file->mp);
+	return r;
+}
+
+/**@brief   Block device segments per vectored request (ext4_preadv).*/
+#define EXT4_IOV_BATCH 32
+
+/**@brief   Bounce blocks per vectored request (ext4_preadv): blocks read
+ *          in part or across buffer boundaries.*/
+#define EXT4_IOV_BOUNCE 8
+
+/**@brief   Position in a sequence of user buffers.*/
+struct ext4_iov_pos {
+	const struct ext4_iovec *iov;
+	int cnt;
+	size_t off;
+};
+
+/**@brief   Bytes left in the current buffer (empty ones skipped).*/
+static size_t ext4_iov_avail(struct ext4_iov_pos *p)
+{
+	while (p->cnt && p->off == p->iov->len) {
+		p->iov++;
+		p->cnt--;
+		p->off = 0;
+	}
+
+	return p->cnt ? p->iov->len - p->off : 0;
+}
+
+/**@brief   Advance the position by len bytes, copying src to the buffers
+ *          on the way (NULL src - zeros, skip - no copy).*/
+static void ext4_iov_copy(struct ext4_iov_pos *p, const uint8_t *src,
+			  size_t len, bool skip)
+{
+	while (len) {
+		size_t n = ext4_iov_avail(p);
+		uint8_t *dst = (uint8_t *)p->iov->base + p->off;
+
+		if (n > len)
+			n = len;
+
+		if (!skip && src)
+			memcpy(dst, src, n);
+		else if (!skip)
+			memset(dst, 0, n);
+
+		if (src)
+			src += n;
+		p->off += n;
+		len -= n;
+	}
+}
+
+/**@brief   Vectored read state (ext4_preadv).*/
+struct ext4_iov_read {
+	struct ext4_blockdev *bdev;
+	uint32_t block_size;
+	struct ext4_blockdev_iovec biov[EXT4_IOV_BATCH];
+	uint32_t nb;
+	/**@brief   Bounce blocks and where their parts go.*/
+	uint8_t *bounce;
+	struct {
+		struct ext4_iov_pos pos;
+		uint32_t off;
+		size_t len;
+	} bent[EXT4_IOV_BOUNCE];
+	uint32_t nbounce;
+};
+
+/**@brief   Submit the queued segments and scatter the bounce blocks.*/
+static int ext4_iov_read_submit(struct ext4_iov_read *rd)
+{
+	uint32_t j;
+	int r;
+
+	if (!rd->nb)
+		return EOK;
+
+	r = ext4_blocks_get_direct_v(rd->bdev, rd->biov, rd->nb);
+	for (j = 0; r == EOK && j < rd->nbounce; j++)
+		ext4_iov_copy(&rd->bent[j].pos,
+			      rd->bounce + j * rd->block_size + rd->bent[j].off,
+			      rd->bent[j].len, false);
+
+	rd->nb = rd->nbounce = 0;
+	return r;
+}
+
+/**@brief   Read len bytes at offset to the buffers: the range is mapped
+ *          run by run and blocks are gathered into vectored requests.
+ *          Whole blocks go to the buffers directly, others through
+ *          bounce blocks.*/
+static int ext4_preadv_blocks(struct ext4_mountpoint *mp,
+			      struct ext4_inode_ref *ref,
+			      const struct ext4_iovec *iov, int iovcnt,
+			      uint64_t offset, size_t len)
+{
+	struct ext4_iov_read *rd;
+	struct ext4_iov_pos cur = {iov, iovcnt, 0};
+	uint32_t block_size = ext4_sb_get_block_size(&mp->fs.sb);
+	int r = EOK;
+
+	rd = ext4_calloc(1, sizeof(*rd));
+	if (!rd)
+		return ENOMEM;
+
+	rd->bdev = mp->fs.bdev;
+	rd->block_size = block_size;
+
+	while (len && r == EOK) {
+		ext4_lblk_t iblock = (ext4_lblk_t)(offset / block_size);
+		uint32_t boff = offset % block_size;
+		ext4_fsblk_t fblock;
+		uint32_t i, n;
+
+		r = ext4_fs_get_inode_dblk_run(ref, iblock,
+			(uint32_t)((boff + len + block_size - 1) / block_size),
+			&fblock, &n);
+		if (r != EOK)
+			break;
+
+		for (i = 0; i < n && len; boff = 0) {
+			size_t blen = block_size - boff;
+			size_t avail = ext4_iov_avail(&cur);
+			uint32_t k = 1;
+
+			if (blen > len)
+				blen = len;
+
+			if (!fblock) {
+				/*Hole or unwritten range*/
+				ext4_iov_copy(&cur, NULL, blen, false);
+				offset += blen;
+				len -= blen;
+				i++;
+				continue;
+			}
+
+			if (blen == block_size && avail >= block_size) {
+				/*Whole blocks straight to the buffer*/
+				if (rd->nb == EXT4_IOV_BATCH)
+					r = ext4_iov_read_submit(rd);
+				if (r != EOK)
+					break;
+
+				k = (uint32_t)(avail / block_size);
+				if (k > n - i)
+					k = n - i;
+				if (k > len / block_size)
+					k = (uint32_t)(len / block_size);
+
+				blen = (size_t)k * block_size;
+				rd->biov[rd->nb].buf =
+				    (uint8_t *)cur.iov->base + cur.off;
+				cur.off += blen;
+			} else {
+				if (rd->nb == EXT4_IOV_BATCH ||
+				    rd->nbounce == EXT4_IOV_BOUNCE)
+					r = ext4_iov_read_submit(rd);
+				if (r != EOK)
+					break;
+
+				if (!rd->bounce) {
+					rd->bounce = ext4_malloc(
+					    EXT4_IOV_BOUNCE * block_size);
+					if (!rd->bounce) {
+						r = ENOMEM;
+						break;
+					}
+				}
+
+				rd->biov[rd->nb].buf = rd->bounce +
+				    rd->nbounce * block_size;
+				rd->bent[rd->nbounce].pos = cur;
+				rd->bent[rd->nbounce].off = boff;
+				rd->bent[rd->nbounce].len = blen;
+				rd->nbounce++;
+				ext4_iov_copy(&cur, NULL, blen, true);
+			}
+
+			rd->biov[rd->nb].blk_id = fblock + i;
+			rd->biov[rd->nb].blk_cnt = k;
+			rd->nb++;
+			offset += blen;
+			len -= blen;
+			i += k;
+		}
+	}
+
+	if (r == EOK)
+		r = ext4_iov_read_submit(rd);
+
+	ext4_free(rd->bounce);
+	ext4_free(rd);
+	return r;
+}
+
+int ext4_preadv(ext4_file *file, const struct ext4_iovec *iov, int iovcnt,
+		uint64_t offset, size_t *rcnt)
+{
+	struct ext4_inode_ref ref;
+	struct ext4_mountpoint *mp;
+	uint64_t fsize;
+	size_t size = 0, n;
+	bool direct;
+	int i, r;
+
+	ext4_assert(file && file->mp);
+	mp = file->mp;
+
+	if (rcnt)
+		*rcnt = 0;
+
+	if (file->flags & O_WRONLY)
+		return EPERM;
+
+	if (iovcnt < 0)
+		return EINVAL;
+
+	for (i = 0; i < iovcnt; i++) {
+		if (iov[i].len > SIZE_MAX - size)
+			return EINVAL;
+		size += iov[i].len;
+	}
+
+	if (!size)
+		return EOK;
+
+	EXT4_MP_LOCK(mp);
+
+	r = ext4_fs_get_inode_ref(&mp->fs, file->inode, &ref);
+	if (r != EOK) {
+		EXT4_MP_UNLOCK(mp);
+		return r;
+	}
+
+	/*Sync file size*/
+	fsize = ext4_inode_get_size(&mp->fs.sb, ref.inode);
+	direct = ext4_inode_is_type(&mp->fs.sb, ref.inode,
+				    EXT4_INODE_MODE_FILE) &&
+		 !ext4_dcache_on(&mp->dc) &&
+		 ext4_fsize_pending(mp, ref.index, fsize) == fsize;
+
+	if (direct) {
+		file->fsize = fsize;
+		if (offset < fsize) {
+			if (size > fsize - offset)
+				size = (size_t)(fsize - offset);
+
+			r = ext4_preadv_blocks(mp, &ref, iov, iovcnt, offset,
+					       size);
+			if (r == EOK && rcnt)
+				*rcnt = size;
+		}
+
+		ext4_fs_put_inode_ref(&ref);
+		EXT4_MP_UNLOCK(mp);
+		return r;
+	}
+
+	/*Cached, pending or inline data: segment by segment*/
+	ext4_fs_put_inode_ref(&ref);
+	for (i = 0, size = 0; i < iovcnt; i++) {
+		if (!iov[i].len)
+			continue;
+
+		n = 0;
+		r = ext4_fread_at(file, &offset, iov[i].base, iov[i].len, &n);
+		size += n;
+		if (r != EOK || n < iov[i].len)
+			break;
+	}
+
+	if (rcnt)
+		*rcnt = size;
+
+	EXT4_MP_UNLOCK(mp);
+	return r;
+}
+
+int ext4_pwritev(ext4_file *file, const struct ext4_iovec *iov, int iovcnt,
+		 uint64_t offset, size_t *wcnt)
+{
+	size_t size = 0, n;
+	int i, r = EOK, rr;
+
+	ext4_assert(file && file->mp);
+
+	if (wcnt)
+		*wcnt = 0;
+
+	if (file->mp->fs.read_only)
+		return EROFS;
+
+	if (file->flags & O_RDONLY)
+		return EPERM;
+
+	if (iovcnt < 0)
+		return EINVAL;
+
+	for (i = 0; i < iovcnt; i++) {
+		if (iov[i].len > SIZE_MAX - size)
+			return EINVAL;
+		size += iov[i].len;
+	}
+
+	EXT4_MP_LOCK(file->mp);
+	/*One transaction for all the segments*/
+	ext4_trans_start(file->mp);
+	file->mp->trans_join = true;
+	for (i = 0, size = 0; i < iovcnt; i++) {
+		if (!iov[i].len)
+			continue;
+
+		n = 0;
+		r = ext4_fwrite_at(file, &offset, iov[i].base, iov[i].len, &n);
+		size += n;
+		if (r != EOK || n < iov[i].len)
+			break;
+	}
+	file->mp->trans_join = false;
+	rr = ext4_trans_stop(file->mp);
+	EXT4_MP_UNLOCK(file->mp);
+
+	if (r == EOK)
+		r = rr;
+
+	if (wcnt)
+		*wcnt = size;
+
+	return r;
+}
+
 int ext4_fseek(ext4_file *file, int64_t offset, uint32_t origin)
 {
 	switch (origin) {
@@ -2054,6 +3325,50 @@ uint64_t ext4_fsize(ext4_file *file)
 	return file->fsize;
 }
 
+int ext4_ffrag(ext4_file *file, uint32_t *extents)
+{
+	int r;
+	uint32_t block_size;
+	ext4_lblk_t iblock, iblock_last;
+	ext4_fsblk_t fblock, fblock_end = 0;
+	struct ext4_inode_ref ref;
+
+	ext4_assert(file && file->mp && extents);
+
+	EXT4_MP_LOCK(file->mp);
+	r = ext4_fs_get_inode_ref(&file->mp->fs, file->inode, &ref);
+	if (r != EOK) {
+		EXT4_MP_UNLOCK(file->mp);
+		return r;
+	}
+
+	block_size = ext4_sb_get_block_size(&file->mp->fs.sb);
+	iblock_last = (ext4_lblk_t)((ext4_inode_get_size(&file->mp->fs.sb,
+							 ref.inode) +
+				     block_size - 1) / block_size);
+
+	*extents = 0;
+	for (iblock = 0; iblock < iblock_last;) {
+		uint32_t n;
+
+		r = ext4_fs_get_inode_dblk_run(&ref, iblock,
+					       iblock_last - iblock,
+					       &fblock, &n);
+		if (r != EOK)
+			break;
+
+		if (fblock && fblock != fblock_end)
+			(*extents)++;
+
+		fblock_end = fblock ? fblock + n : 0;
+		iblock += n;
+	}
+
+	ext4_fs_put_inode_ref(&ref);
+	EXT4_MP_UNLOCK(file->mp);
+	return r;
+}
+
 
 static int ext4_trans_get_inode_ref(const char *path,
 				    struct ext4_mountpoint *mp,
@@ -2122,6 +3437,10 @@ int ext4_raw_inode_fill(const char *path, uint32_t *ret_ino,
 		*ret_ino = f.inode;
 
 	memcpy(inode, inode_ref.inode, sizeof(struct ext4_inode));
+#if CONFIG_DELALLOC_PAGES
+	ext4_inode_set_size(inode, ext4_da_size(mp, f.inode,
+				   ext4_inode_get_size(&mp->fs.sb, inode)));
+#endif
 	ext4_fs_put_inode_ref(&inode_ref);
 	EXT4_MP_UNLOCK(mp);
 
@@ -53,6 +53,8 @@
 #include <ext4_bitmap.h>
 #include <ext4_inode.h>
 
+#include <string.h>
+
 /**@brief Compute number of block group from block address.
  * @param s superblock pointer.
  * @param baddr Absolute address of block.
@@ -149,6 +151,218 @@ ext4_balloc_verify_bitmap_csum(struct ext4_sblock *sb,
 #define ext4_balloc_verify_bitmap_csum(...) true
 #endif
 
+/**@brief Queue freed blocks for discard, merged with queued neighbours.
+ * @param fs filesystem
+ * @param first first freed block
+ * @param cnt freed blocks count
+ */
+static void ext4_balloc_discard_queue(struct ext4_fs *fs, ext4_fsblk_t first,
+				      ext4_fsblk_t cnt)
+{
+#if CONFIG_DISCARD_QUEUE
+	struct ext4_discard_range *q = fs->discard_q;
+	uint32_t i, n = fs->discard_cnt;
+	ext4_fsblk_t end = first + cnt;
+
+	if (!fs->discard || !fs->bdev->bdif->discard || !cnt)
+		return;
+
+	/* First range which does not end before the freed one. */
+	for (i = 0; i < n && q[i].first + q[i].cnt < first; i++)
+		;
+
+	if (i < n && q[i].first <= end) {
+		if (q[i].first + q[i].cnt > end)
+			end = q[i].first + q[i].cnt;
+		if (q[i].first < first)
+			first = q[i].first;
+
+		/* Swallow the following ranges reached by the merge. */
+		while (i + 1 < n && q[i + 1].first <= end) {
+			if (q[i + 1].first + q[i + 1].cnt > end)
+				end = q[i + 1].first + q[i + 1].cnt;
+			memmove(q + i + 1, q + i + 2, (n - i - 2) * sizeof(*q));
+			n--;
+		}
+
+		q[i].first = first;
+		q[i].cnt = end - first;
+		fs->discard_cnt = n;
+		return;
+	}
+
+	/* Uncommitted frees can't be discarded yet (the bitmap and the
+	 * mapping which freed the blocks may be dirty in the cache, held
+	 * by the caller), fstrim will catch the range later. */
+	if (n == CONFIG_DISCARD_QUEUE)
+		return;
+
+	memmove(q + i + 1, q + i, (n - i) * sizeof(*q));
+	q[i].first = first;
+	q[i].cnt = cnt;
+	fs->discard_cnt = n + 1;
+#else
+	(void)fs;
+	(void)first;
+	(void)cnt;
+#endif
+}
+
+/**@brief Remove allocated blocks from the discard queue.
+ * @param fs filesystem
+ * @param first first allocated block
+ * @param cnt allocated blocks count
+ */
+static void ext4_balloc_discard_forget(struct ext4_fs *fs, ext4_fsblk_t first,
+				       ext4_fsblk_t cnt)
+{
+#if CONFIG_DISCARD_QUEUE
+	struct ext4_discard_range *q = fs->discard_q;
+	ext4_fsblk_t end = first + cnt;
+	uint32_t i;
+
+	for (i = 0; i < fs->discard_cnt; i++) {
+		ext4_fsblk_t q_end = q[i].first + q[i].cnt;
+		if (q_end <= first || q[i].first >= end)
+			continue;
+
+		if (q[i].first < first && q_end > end) {
+			/* Split, the tail is lost when the queue is full. */
+			q[i].cnt = first - q[i].first;
+			if (fs->discard_cnt < CONFIG_DISCARD_QUEUE) {
+				memmove(q + i + 2, q + i + 1,
+					(fs->discard_cnt - i - 1) * sizeof(*q));
+				q[i + 1].first = end;
+				q[i + 1].cnt = q_end - end;
+				fs->discard_cnt++;
+			}
+			return;
+		}
+
+		if (q[i].first < first) {
+			q[i].cnt = first - q[i].first;
+		} else if (q_end > end) {
+			q[i].first = end;
+			q[i].cnt = q_end - end;
+		} else {
+			memmove(q + i, q + i + 1,
+				(fs->discard_cnt - i - 1) * sizeof(*q));
+			fs->discard_cnt--;
+			i--;
+		}
+	}
+#else
+	(void)fs;
+	(void)first;
+	(void)cnt;
+#endif
+}
+
+int ext4_balloc_discard_flush(struct ext4_fs *fs)
+{
+	int r = EOK;
+#if CONFIG_DISCARD_QUEUE
+	/* Without a journal the frees are committed once the cache is
+	 * written back. Ranges are dropped when that fails. */
+	if (fs->discard_cnt && !fs->jbd_journal) {
+		r = ext4_block_cache_flush(fs->bdev);
+		if (r != EOK) {
+			fs->discard_cnt = 0;
+			return r;
+		}
+	}
+
+	for (uint32_t i = 0; i < fs->discard_cnt; i++) {
+		int rc = ext4_block_discard(fs->bdev, fs->discard_q[i].first,
+					    fs->discard_q[i].cnt);
+		if (rc != EOK && r == EOK)
+			r = rc;
+	}
+	fs->discard_cnt = 0;
+#endif
+	(void)fs;
+	return r;
+}
+
+void ext4_balloc_discard_drop(struct ext4_fs *fs)
+{
+#if CONFIG_DISCARD_QUEUE
+	fs->discard_cnt = 0;
+#endif
+	(void)fs;
+}
+
+int ext4_balloc_trim(struct ext4_fs *fs, ext4_fsblk_t min_cnt,
+		     uint64_t *trimmed)
+{
+	struct ext4_sblock *sb = &fs->sb;
+	uint32_t bg_cnt = ext4_block_group_cnt(sb);
+	uint64_t done = 0;
+	int rc = EOK;
+
+	if (!fs->bdev->bdif->discard)
+		return ENOTSUP;
+
+	if (!min_cnt)
+		min_cnt = 1;
+
+	for (uint32_t bgid = 0; bgid < bg_cnt && rc == EOK; bgid++) {
+		struct ext4_block_group_ref bg_ref;
+		struct ext4_block b;
+		ext4_fsblk_t bmp_blk, first;
+		uint32_t blocks, bit, start;
+
+		rc = ext4_fs_peek_block_group_ref(fs, bgid, &bg_ref);
+		if (rc != EOK)
+			break;
+
+		if (ext4_bg_has_flag(bg_ref.block_group,
+				     EXT4_BLOCK_GROUP_BLOCK_UNINIT) ||
+		    !ext4_bg_get_free_blocks_count(bg_ref.block_group, sb)) {
+			ext4_fs_put_block_group_ref(&bg_ref);
+			continue;
+		}
+
+		bmp_blk = ext4_bg_get_block_bitmap(bg_ref.block_group, sb);
+		rc = ext4_fs_put_block_group_ref(&bg_ref);
+		if (rc != EOK)
+			break;
+
+		rc = ext4_trans_block_get_cls(fs->bdev, &b, bmp_blk,
+					      EXT4_BCACHE_CLS_BITMAP);
+		if (rc != EOK)
+			break;
+
+		blocks = ext4_blocks_in_group_cnt(sb, bgid);
+		first = ext4_balloc_get_block_of_bgid(sb, bgid);
+		for (bit = 0; bit < blocks && rc == EOK;) {
+			if (ext4_bmap_is_bit_set(b.data, bit)) {
+				bit++;
+				continue;
+			}
+
+			start = bit;
+			while (bit < blocks && ext4_bmap_is_bit_clr(b.data, bit))
+				bit++;
+
+			if (bit - start < min_cnt)
+				continue;
+
+			rc = ext4_block_discard(fs->bdev, first + start,
+						bit - start);
+			if (rc == EOK)
+				done += bit - start;
+		}
+
+		ext4_block_set(fs->bdev, &b);
+	}
+
+	if (trimmed)
+		*trimmed = done;
+
+	return rc;
+}
+
 int ext4_balloc_free_block(struct ext4_inode_ref *inode_ref, ext4_fsblk_t baddr)
 {
 	struct ext4_fs *fs = inode_ref->fs;
@@ -171,7 +385,9 @@ int ext4_balloc_free_block(struct ext4_inode_ref *inode_ref, ext4_fsblk_t baddr)
 
 	struct ext4_block bitmap_block;
 
-	rc = ext4_trans_block_get(fs->bdev, &bitmap_block, bitmap_block_addr);
+	rc = ext4_trans_block_get_cls(fs->bdev, &bitmap_block,
+				      bitmap_block_addr,
+				      EXT4_BCACHE_CLS_BITMAP);
 	if (rc != EOK) {
 		ext4_fs_put_block_group_ref(&bg_ref);
 		return rc;
@@ -224,6 +440,7 @@ int ext4_balloc_free_block(struct ext4_inode_ref *inode_ref, ext4_fsblk_t baddr)
 		return rc;
 	}
 	ext4_bcache_invalidate_lba(fs->bdev->bc, baddr, 1);
+	ext4_balloc_discard_queue(fs, baddr, 1);
 	/* Release block group reference */
 	rc = ext4_fs_put_block_group_ref(&bg_ref);
 
@@ -272,7 +489,8 @@ int ext4_balloc_free_blocks(struct ext4_inode_ref *inode_ref,
 		ext4_fsblk_t bitmap_blk = ext4_bg_get_block_bitmap(bg, sb);
 
 		struct ext4_block blk;
-		rc = ext4_trans_block_get(fs->bdev, &blk, bitmap_blk);
+		rc = ext4_trans_block_get_cls(fs->bdev, &blk, bitmap_blk,
+					      EXT4_BCACHE_CLS_BITMAP);
 		if (rc != EOK) {
 			ext4_fs_put_block_group_ref(&bg_ref);
 			return rc;
@@ -343,12 +561,24 @@ int ext4_balloc_free_blocks(struct ext4_inode_ref *inode_ref,
 	}
 
 	ext4_bcache_invalidate_lba(fs->bdev->bc, start_block, blk_cnt);
+	ext4_balloc_discard_queue(fs, start_block, blk_cnt);
 	/*All blocks should be released*/
 	ext4_assert(count == 0);
 
 	return rc;
 }
 
+uint64_t ext4_balloc_avail_blocks(struct ext4_fs *fs)
+{
+	uint64_t free_blocks = ext4_sb_get_free_blocks_cnt(&fs->sb);
+
+#if CONFIG_DELALLOC_PAGES
+	return free_blocks > fs->da_resv ? free_blocks - fs->da_resv : 0;
+#else
+	return free_blocks;
+#endif
+}
+
 int ext4_balloc_alloc_block(struct ext4_inode_ref *inode_ref,
 			    ext4_fsblk_t goal,
 			    ext4_fsblk_t *fblock)
@@ -367,6 +597,10 @@ int ext4_balloc_alloc_block(struct ext4_inode_ref *inode_ref,
 	struct ext4_block b;
 	struct ext4_block_group_ref bg_ref;
 
+	/* Blocks reserved for delayed allocation are taken */
+	if (!ext4_balloc_avail_blocks(inode_ref->fs))
+		return ENOSPC;
+
 	/* Load block group reference */
 	r = ext4_fs_get_block_group_ref(inode_ref->fs, bg_id, &bg_ref);
 	if (r != EOK)
@@ -393,7 +627,8 @@ int ext4_balloc_alloc_block(struct ext4_inode_ref *inode_ref,
 	/* Load block with bitmap */
 	bmp_blk_adr = ext4_bg_get_block_bitmap(bg_ref.block_group, sb);
 
-	r = ext4_trans_block_get(inode_ref->fs->bdev, &b, bmp_blk_adr);
+	r = ext4_trans_block_get_cls(inode_ref->fs->bdev, &b, bmp_blk_adr,
+				     EXT4_BCACHE_CLS_BITMAP);
 	if (r != EOK) {
 		ext4_fs_put_block_group_ref(&bg_ref);
 		return r;
@@ -495,7 +730,9 @@ goal_failed:
 
 		/* Load block with bitmap */
 		bmp_blk_adr = ext4_bg_get_block_bitmap(bg, sb);
-		r = ext4_trans_block_get(inode_ref->fs->bdev, &b, bmp_blk_adr);
+		r = ext4_trans_block_get_cls(inode_ref->fs->bdev, &b,
+					     bmp_blk_adr,
+					     EXT4_BCACHE_CLS_BITMAP);
 		if (r != EOK) {
 			ext4_fs_put_block_group_ref(&bg_ref);
 			return r;
@@ -578,10 +815,129 @@ success:
 	bg_ref.dirty = true;
 	r = ext4_fs_put_block_group_ref(&bg_ref);
 
+	ext4_balloc_discard_forget(inode_ref->fs, alloc, 1);
 	*fblock = alloc;
 	return r;
 }
 
+int ext4_balloc_alloc_blocks(struct ext4_inode_ref *inode_ref,
+			     ext4_fsblk_t goal, uint32_t *count,
+			     ext4_fsblk_t *baddr)
+{
+	struct ext4_fs *fs = inode_ref->fs;
+	struct ext4_sblock *sb = &fs->sb;
+	uint32_t block_group_count = ext4_block_group_cnt(sb);
+	uint32_t bgid = ext4_balloc_get_bgid_of_block(sb, goal);
+	uint64_t avail = ext4_balloc_avail_blocks(fs);
+	uint32_t max = *count;
+	uint32_t i;
+	int r;
+
+	ext4_assert(max);
+	*count = 0;
+
+	/* Blocks reserved for delayed allocation are taken */
+	if (!avail)
+		return ENOSPC;
+	if (max > avail)
+		max = (uint32_t)avail;
+
+	/* First fit from the goal, the rest of the groups from their
+	 * first block. */
+	for (i = 0; i < block_group_count; i++) {
+		struct ext4_block_group_ref bg_ref;
+		struct ext4_block b;
+		uint32_t n = 0;
+
+		r = ext4_fs_get_block_group_ref(fs, bgid, &bg_ref);
+		if (r != EOK)
+			return r;
+
+		struct ext4_bgroup *bg = bg_ref.block_group;
+		if (!ext4_bg_get_free_blocks_count(bg, sb))
+			goto next_group;
+
+		ext4_fsblk_t first_in_bg = ext4_balloc_get_block_of_bgid(sb, bgid);
+		uint32_t first_idx = ext4_fs_addr_to_idx_bg(sb, first_in_bg);
+		uint32_t blk_in_bg = ext4_blocks_in_group_cnt(sb, bgid);
+		uint32_t idx = i ? first_idx : ext4_fs_addr_to_idx_bg(sb, goal);
+		if (idx < first_idx)
+			idx = first_idx;
+
+		r = ext4_trans_block_get_cls(fs->bdev, &b,
+					     ext4_bg_get_block_bitmap(bg, sb),
+					     EXT4_BCACHE_CLS_BITMAP);
+		if (r != EOK) {
+			ext4_fs_put_block_group_ref(&bg_ref);
+			return r;
+		}
+
+		if (!ext4_balloc_verify_bitmap_csum(sb, bg, b.data)) {
+			ext4_dbg(DEBUG_BALLOC,
+				DBG_WARN "Bitmap checksum failed."
+				"Group: %" PRIu32"\n",
+				bg_ref.index);
+		}
+
+		if (idx < blk_in_bg &&
+		    ext4_bmap_bit_find_clr(b.data, idx, blk_in_bg, &idx) == EOK) {
+			/* The run ends at the first used block. */
+			while (n < max && idx + n < blk_in_bg &&
+			       ext4_bmap_is_bit_clr(b.data, idx + n))
+				n++;
+
+			ext4_bmap_bits_set(b.data, idx, n);
+			ext4_balloc_set_bitmap_csum(sb, bg, b.data);
+			ext4_trans_set_block_dirty(b.buf);
+		}
+
+		r = ext4_block_set(fs->bdev, &b);
+		if (r != EOK) {
+			ext4_fs_put_block_group_ref(&bg_ref);
+			return r;
+		}
+
+		if (n) {
+			uint32_t block_size = ext4_sb_get_block_size(sb);
+
+			/* Update superblock free blocks count */
+			uint64_t sb_free_blocks = ext4_sb_get_free_blocks_cnt(sb);
+			ext4_sb_set_free_blocks_cnt(sb, sb_free_blocks - n);
+
+			/* Update inode blocks (different block size!) count */
+			uint64_t ino_blocks;
+			ino_blocks = ext4_inode_get_blocks_count(sb,
+								 inode_ref->inode);
+			ino_blocks += (uint64_t)n * (block_size /
+						     EXT4_INODE_BLOCK_SIZE);
+			ext4_inode_set_blocks_count(sb, inode_ref->inode,
+						    ino_blocks);
+			inode_ref->dirty = true;
+
+			/* Update block group free blocks count */
+			uint32_t fb_cnt = ext4_bg_get_free_blocks_count(bg, sb);
+			ext4_bg_set_free_blocks_count(bg, sb, fb_cnt - n);
+			bg_ref.dirty = true;
+
+			r = ext4_fs_put_block_group_ref(&bg_ref);
+
+			*baddr = ext4_fs_bg_idx_to_addr(sb, idx, bgid);
+			*count = n;
+			ext4_balloc_discard_forget(fs, *baddr, n);
+			return r;
+		}
+
+	next_group:
+		r = ext4_fs_put_block_group_ref(&bg_ref);
+		if (r != EOK)
+			return r;
+
+		bgid = (bgid + 1) % block_group_count;
+	}
+
+	return ENOSPC;
+}
+
 int ext4_balloc_try_alloc_block(struct ext4_inode_ref *inode_ref,
 				ext4_fsblk_t baddr, bool *free)
 {
@@ -594,6 +950,12 @@ int ext4_balloc_try_alloc_block(struct ext4_inode_ref *inode_ref,
 	uint32_t block_group = ext4_balloc_get_bgid_of_block(sb, baddr);
 	uint32_t index_in_group = ext4_fs_addr_to_idx_bg(sb, baddr);
 
+	/* Blocks reserved for delayed allocation are taken */
+	if (!ext4_balloc_avail_blocks(fs)) {
+		*free = false;
+		return EOK;
+	}
+
 	/* Load block group reference */
 	struct ext4_block_group_ref bg_ref;
 	rc = ext4_fs_get_block_group_ref(fs, block_group, &bg_ref);
@@ -605,7 +967,8 @@ int ext4_balloc_try_alloc_block(struct ext4_inode_ref *inode_ref,
 	bmp_blk_addr = ext4_bg_get_block_bitmap(bg_ref.block_group, sb);
 
 	struct ext4_block b;
-	rc = ext4_trans_block_get(fs->bdev, &b, bmp_blk_addr);
+	rc = ext4_trans_block_get_cls(fs->bdev, &b, bmp_blk_addr,
+				      EXT4_BCACHE_CLS_BITMAP);
 	if (rc != EOK) {
 		ext4_fs_put_block_group_ref(&bg_ref);
 		return rc;
@@ -659,6 +1022,7 @@ int ext4_balloc_try_alloc_block(struct ext4_inode_ref *inode_ref,
 	ext4_bg_set_free_blocks_count(bg_ref.block_group, sb, fb_cnt);
 
 	bg_ref.dirty = true;
+	ext4_balloc_discard_forget(fs, baddr, 1);
 
 terminate:
 	return ext4_fs_put_block_group_ref(&bg_ref);
@@ -64,27 +64,288 @@ static int ext4_bcache_lru_compare(struct ext4_buf *a, struct ext4_buf *b)
 
 RB_GENERATE_INTERNAL(ext4_buf_lba, ext4_buf, lba_node,
 		     ext4_bcache_lba_compare, static inline)
+static int ext4_bghost_lba_compare(struct ext4_bghost *a,
+				   struct ext4_bghost *b)
+{
+	if (a->lba > b->lba)
+		return 1;
+	else if (a->lba < b->lba)
+		return -1;
+	return 0;
+}
+
 RB_GENERATE_INTERNAL(ext4_buf_lru, ext4_buf, lru_node,
 		     ext4_bcache_lru_compare, static inline)
+RB_GENERATE_INTERNAL(ext4_bghost_lba, ext4_bghost, lba_node,
+		     ext4_bghost_lba_compare, static inline)
 
-int ext4_bcache_init_dynamic(struct ext4_bcache *bc, uint32_t cnt,
-			     uint32_t itemsize)
+#define ext4_bcache_policy(bc) ((bc)->flags & EXT4_BCACHE_POLICY_MASK)
+
+/**@brief   Replacement queues: recency (LRU, 2Q A1in, ARC T1) and
+ *          frequency (2Q Am, ARC T2).*/
+#define EXT4_BCACHE_Q_RECENT 0
+#define EXT4_BCACHE_Q_FREQ 1
+
+static inline bool ext4_bcache_lru_tree(struct ext4_bcache *bc)
+{
+	/* Original mode: LRU policy on top of the RB-tree index. */
+	return !(bc->flags & (EXT4_BCACHE_HASH | EXT4_BCACHE_POLICY_MASK));
+}
+
+static inline uint32_t ext4_bcache_hash(struct ext4_bcache *bc, uint64_t lba)
+{
+	/* Fibonacci hashing: take the top hbits of the product. */
+	return (uint32_t)((lba * 0x9E3779B97F4A7C15ull) >> (64 - bc->hbits));
+}
+
+/**@brief   Minimal hash table size (log2).*/
+#define EXT4_BCACHE_HBITS_MIN 4
+
+/**@brief   Alignment of arena data buffers.*/
+#define EXT4_BCACHE_ARENA_ALIGN 4096
+
+static void *ext4_bcache_malloc(struct ext4_bcache *bc, size_t size)
+{
+	bc->alloc_ctr++;
+	bc->alloc_bytes += size;
+	return ext4_malloc(size);
+}
+
+static void *ext4_bcache_calloc(struct ext4_bcache *bc, size_t cnt,
+				size_t size)
+{
+	bc->alloc_ctr++;
+	bc->alloc_bytes += cnt * size;
+	return ext4_calloc(cnt, size);
+}
+
+static int ext4_bcache_arena_alloc(struct ext4_bcache *bc)
+{
+	uintptr_t data;
+	size_t bufs_size = (size_t)bc->cnt * sizeof(struct ext4_buf);
+	size_t data_size = (size_t)bc->cnt * bc->itemsize;
+
+	bc->arena = ext4_bcache_malloc(bc, bufs_size + data_size +
+					       EXT4_BCACHE_ARENA_ALIGN - 1);
+	if (!bc->arena)
+		return ENOMEM;
+
+	bc->arena_bufs = bc->arena;
+	bc->arena_cnt = bc->cnt;
+	data = (uintptr_t)bc->arena + bufs_size;
+	data = (data + EXT4_BCACHE_ARENA_ALIGN - 1) &
+	       ~(uintptr_t)(EXT4_BCACHE_ARENA_ALIGN - 1);
+
+	for (uint32_t i = bc->cnt; i > 0; i--) {
+		struct ext4_buf *buf = &bc->arena_bufs[i - 1];
+		buf->data = (uint8_t *)data + (size_t)(i - 1) * bc->itemsize;
+		SLIST_INSERT_HEAD(&bc->free_list, buf, free_node);
+	}
+
+	return EOK;
+}
+
+/**@brief   (Re)allocate cnt ghost entries. Ghost history is dropped.*/
+static int ext4_bcache_ghosts_alloc(struct ext4_bcache *bc, uint32_t cnt)
 {
+	struct ext4_bghost *ghosts;
+
+	ghosts = ext4_bcache_calloc(bc, cnt, sizeof(struct ext4_bghost));
+	if (!ghosts)
+		return ENOMEM;
+
+	ext4_free(bc->ghosts);
+	bc->ghosts = ghosts;
+
+	RB_INIT(&bc->ghost_root);
+	TAILQ_INIT(&bc->ghost_free);
+	for (int i = 0; i < EXT4_BCACHE_QUEUES; i++) {
+		TAILQ_INIT(&bc->ghost_list[i]);
+		bc->ghost_cnt[i] = 0;
+	}
+
+	for (uint32_t i = 0; i < cnt; i++)
+		TAILQ_INSERT_TAIL(&bc->ghost_free, &bc->ghosts[i], link);
+
+	return EOK;
+}
+
+static void ext4_bcache_ghost_del(struct ext4_bcache *bc,
+				  struct ext4_bghost *g)
+{
+	RB_REMOVE(ext4_bghost_lba, &bc->ghost_root, g);
+	TAILQ_REMOVE(&bc->ghost_list[g->queue], g, link);
+	bc->ghost_cnt[g->queue]--;
+	TAILQ_INSERT_TAIL(&bc->ghost_free, g, link);
+}
+
+static struct ext4_bghost *ext4_bcache_ghost_find(struct ext4_bcache *bc,
+						  uint64_t lba)
+{
+	struct ext4_bghost tmp = {
+		.lba = lba
+	};
+
+	return RB_FIND(ext4_bghost_lba, &bc->ghost_root, &tmp);
+}
+
+static void ext4_bcache_ghost_add(struct ext4_bcache *bc, uint64_t lba,
+				  uint8_t queue)
+{
+	struct ext4_bghost *g = ext4_bcache_ghost_find(bc, lba);
+	if (g)
+		ext4_bcache_ghost_del(bc, g);
+
+	/* 2Q keeps A1out at half of the cache size. */
+	if (ext4_bcache_policy(bc) == EXT4_BCACHE_2Q &&
+	    bc->ghost_cnt[queue] >= bc->cnt / 2 && bc->ghost_cnt[queue])
+		ext4_bcache_ghost_del(bc, TAILQ_FIRST(&bc->ghost_list[queue]));
+
+	if (TAILQ_EMPTY(&bc->ghost_free)) {
+		/* Recycle the oldest ghost, preferably from the same list. */
+		uint8_t q = bc->ghost_cnt[queue] ? queue : !queue;
+		ext4_bcache_ghost_del(bc, TAILQ_FIRST(&bc->ghost_list[q]));
+	}
+
+	g = TAILQ_FIRST(&bc->ghost_free);
+	TAILQ_REMOVE(&bc->ghost_free, g, link);
+	g->lba = lba;
+	g->queue = queue;
+	RB_INSERT(ext4_bghost_lba, &bc->ghost_root, g);
+	TAILQ_INSERT_TAIL(&bc->ghost_list[queue], g, link);
+	bc->ghost_cnt[queue]++;
+}
+
+static int ext4_bcache_htab_alloc(struct ext4_bcache *bc, uint32_t hbits)
+{
+	struct ext4_buf **htab;
+	struct ext4_buf **old = bc->htab;
+	uint32_t old_size = old ? (1u << bc->hbits) : 0;
+
+	htab = ext4_bcache_calloc(bc, 1u << hbits, sizeof(struct ext4_buf *));
+	if (!htab)
+		return ENOMEM;
+
+	bc->htab = htab;
+	bc->hbits = hbits;
+
+	/* Rehash all buffers from the previous table. */
+	for (uint32_t i = 0; i < old_size; i++) {
+		uint32_t mask = (1u << hbits) - 1;
+		uint32_t h;
+		if (!old[i])
+			continue;
+
+		h = ext4_bcache_hash(bc, old[i]->lba);
+		while (htab[h])
+			h = (h + 1) & mask;
+
+		htab[h] = old[i];
+	}
+
+	ext4_free(old);
+	return EOK;
+}
+
+/**@brief   Hash table size (log2) for cnt buffers.*/
+static uint32_t ext4_bcache_htab_bits(uint32_t cnt)
+{
+	uint32_t hbits = EXT4_BCACHE_HBITS_MIN;
+
+	/* Keep load factor below 1/2. */
+	while ((1u << hbits) < 2 * cnt && hbits < 31)
+		hbits++;
+
+	return hbits;
+}
+
+/**@brief   Rehash down once items count and cached buffers fall below
+ *          a quarter of the table. The old table is kept on ENOMEM.*/
+static void ext4_bcache_htab_shrink(struct ext4_bcache *bc)
+{
+	uint32_t n = bc->cnt > bc->ref_blocks ? bc->cnt : bc->ref_blocks;
+	uint32_t hbits;
+
+	if (!(bc->flags & EXT4_BCACHE_HASH) ||
+	    4 * (uint64_t)n >= (1u << bc->hbits))
+		return;
+
+	hbits = ext4_bcache_htab_bits(n);
+	if (hbits < bc->hbits)
+		ext4_bcache_htab_alloc(bc, hbits);
+}
+
+int ext4_bcache_init_dynamic2(struct ext4_bcache *bc, uint32_t cnt,
+			      uint32_t itemsize, uint32_t flags)
+{
+	int r;
 	ext4_assert(bc && cnt && itemsize);
 
 	memset(bc, 0, sizeof(struct ext4_bcache));
 
 	bc->cnt = cnt;
 	bc->itemsize = itemsize;
+	bc->flags = flags;
 	bc->ref_blocks = 0;
 	bc->max_ref_blocks = 0;
 
+	for (int i = 0; i < EXT4_BCACHE_QUEUES; i++) {
+		TAILQ_INIT(&bc->lru_list[i]);
+		TAILQ_INIT(&bc->ghost_list[i]);
+	}
+	TAILQ_INIT(&bc->ghost_free);
+	TAILQ_INIT(&bc->dirty_list);
+	SLIST_INIT(&bc->free_list);
+	if (flags & EXT4_BCACHE_HASH) {
+		r = ext4_bcache_htab_alloc(bc, ext4_bcache_htab_bits(cnt));
+		if (r != EOK)
+			return r;
+	}
+
+	if (flags & EXT4_BCACHE_ARENA) {
+		r = ext4_bcache_arena_alloc(bc);
+		if (r != EOK)
+			goto Fail;
+	}
+
+	if (ext4_bcache_policy(bc) != EXT4_BCACHE_LRU) {
+		r = ext4_bcache_ghosts_alloc(bc, cnt);
+		if (r != EOK)
+			goto Fail;
+	}
+
 	return EOK;
+Fail:
+	ext4_free(bc->arena);
+	ext4_free(bc->htab);
+	return r;
+}
+
+int ext4_bcache_init_dynamic(struct ext4_bcache *bc, uint32_t cnt,
+			     uint32_t itemsize)
+{
+	return ext4_bcache_init_dynamic2(bc, cnt, itemsize, 0);
 }
 
 void ext4_bcache_cleanup(struct ext4_bcache *bc)
 {
 	struct ext4_buf *buf, *tmp;
+	if (bc->flags & EXT4_BCACHE_HASH) {
+		uint32_t i = 0;
+		/* Dropping a buffer may shift the next one into slot i. */
+		while (i < (1u << bc->hbits)) {
+			buf = bc->htab[i];
+			if (!buf) {
+				i++;
+				continue;
+			}
+			ext4_block_flush_buf(bc->bdev, buf);
+			ext4_bcache_drop_buf(bc, buf);
+		}
+		ext4_bcache_htab_shrink(bc);
+		return;
+	}
+
 	RB_FOREACH_SAFE(buf, ext4_buf_lba, &bc->lba_root, tmp) {
 		ext4_block_flush_buf(bc->bdev, buf);
 		ext4_bcache_drop_buf(bc, buf);
@@ -93,6 +354,10 @@ void ext4_bcache_cleanup(struct ext4_bcache *bc)
 
 int ext4_bcache_fini_dynamic(struct ext4_bcache *bc)
 {
+	ext4_free(bc->gather_buf);
+	ext4_free(bc->ghosts);
+	ext4_free(bc->arena);
+	ext4_free(bc->htab);
 	memset(bc, 0, sizeof(struct ext4_bcache));
 	return EOK;
 }
@@ -114,18 +379,49 @@ int ext4_bcache_fini_dynamic(struct ext4_bcache *bc)
  *  When a buffer is not referenced, it will be stored in both lba_root
  *  and lru_root, while it will only be stored in lba_root when it is
  *  referenced.
+ *
+ *  With EXT4_BCACHE_HASH flag set, lba_root is replaced by an
+ *  open-addressing (linear probing) hash table (htab) and lru_root by
+ *  a doubly-linked list (lru_list). Unreferenced buffers are appended
+ *  to the tail of lru_list, so the head is always the eviction victim.
+ *
+ *  When a list based replacement policy (EXT4_BCACHE_2Q/ARC) is selected,
+ *  unreferenced buffers are kept on two lists: recency and frequency
+ *  queue. Buffers remember their queue (lru_queue) while referenced.
+ *  LBAs of evicted buffers are kept as ghost entries, a miss on a ghost
+ *  LBA puts the new buffer on the frequency queue.
+ *
+ *  With EXT4_BCACHE_ARENA flag set, buffers come from the arena allocated
+ *  at init and go back to free_list when dropped.
  */
 
+static bool ext4_buf_in_arena(struct ext4_bcache *bc, struct ext4_buf *buf)
+{
+	return bc->arena_bufs && buf >= bc->arena_bufs &&
+	       buf < bc->arena_bufs + bc->arena_cnt;
+}
+
 static struct ext4_buf *
 ext4_buf_alloc(struct ext4_bcache *bc, uint64_t lba)
 {
 	void *data;
-	struct ext4_buf *buf;
-	data = ext4_malloc(bc->itemsize);
+	struct ext4_buf *buf = SLIST_FIRST(&bc->free_list);
+	if (buf) {
+		SLIST_REMOVE_HEAD(&bc->free_list, free_node);
+		data = buf->data;
+		memset(buf, 0, sizeof(struct ext4_buf));
+
+		buf->lba = lba;
+		buf->data = data;
+		buf->bc = bc;
+		return buf;
+	}
+
+	data = ext4_bcache_malloc(bc, bc->itemsize);
 	if (!data)
 		return NULL;
 
-	buf = ext4_calloc(1, sizeof(struct ext4_buf));
+	buf = ext4_bcache_calloc(bc, 1, sizeof(struct ext4_buf));
 	if (!buf) {
 		ext4_free(data);
 		return NULL;
@@ -139,6 +435,12 @@ ext4_buf_alloc(struct ext4_bcache *bc, uint64_t lba)
 
 static void ext4_buf_free(struct ext4_buf *buf)
 {
+	struct ext4_bcache *bc = buf->bc;
+	if (ext4_buf_in_arena(bc, buf)) {
+		SLIST_INSERT_HEAD(&bc->free_list, buf, free_node);
+		return;
+	}
+
 	ext4_free(buf->data);
 	ext4_free(buf);
 }
@@ -146,6 +448,17 @@ static void ext4_buf_free(struct ext4_buf *buf)
 static struct ext4_buf *
 ext4_buf_lookup(struct ext4_bcache *bc, uint64_t lba)
 {
+	if (bc->flags & EXT4_BCACHE_HASH) {
+		uint32_t mask = (1u << bc->hbits) - 1;
+		uint32_t h = ext4_bcache_hash(bc, lba);
+		while (bc->htab[h]) {
+			if (bc->htab[h]->lba == lba)
+				return bc->htab[h];
+			h = (h + 1) & mask;
+		}
+		return NULL;
+	}
+
 	struct ext4_buf tmp = {
 		.lba = lba
 	};
@@ -153,9 +466,438 @@ ext4_buf_lookup(struct ext4_bcache *bc, uint64_t lba)
 	return RB_FIND(ext4_buf_lba, &bc->lba_root, &tmp);
 }
 
+static int ext4_buf_index_insert(struct ext4_bcache *bc, struct ext4_buf *buf)
+{
+	if (bc->flags & EXT4_BCACHE_HASH) {
+		uint32_t mask, h;
+		int r;
+		/* Referenced buffers may overcommit bc->cnt, grow on demand. */
+		if (2 * (bc->ref_blocks + 1) > (1u << bc->hbits)) {
+			r = ext4_bcache_htab_alloc(bc, bc->hbits + 1);
+			if (r != EOK)
+				return r;
+		}
+
+		mask = (1u << bc->hbits) - 1;
+		h = ext4_bcache_hash(bc, buf->lba);
+		while (bc->htab[h])
+			h = (h + 1) & mask;
+
+		bc->htab[h] = buf;
+		return EOK;
+	}
+
+	RB_INSERT(ext4_buf_lba, &bc->lba_root, buf);
+	return EOK;
+}
+
+static void ext4_buf_index_remove(struct ext4_bcache *bc, struct ext4_buf *buf)
+{
+	if (bc->flags & EXT4_BCACHE_HASH) {
+		uint32_t mask = (1u << bc->hbits) - 1;
+		uint32_t i = ext4_bcache_hash(bc, buf->lba);
+		uint32_t j, k;
+		while (bc->htab[i] != buf) {
+			ext4_assert(bc->htab[i]);
+			i = (i + 1) & mask;
+		}
+
+		/* Backward shift deletion: no tombstones are left behind. */
+		j = i;
+		for (;;) {
+			j = (j + 1) & mask;
+			if (!bc->htab[j])
+				break;
+
+			k = ext4_bcache_hash(bc, bc->htab[j]->lba);
+			if ((j > i && (k <= i || k > j)) ||
+			    (j < i && (k <= i && k > j))) {
+				bc->htab[i] = bc->htab[j];
+				i = j;
+			}
+		}
+		bc->htab[i] = NULL;
+		return;
+	}
+
+	RB_REMOVE(ext4_buf_lba, &bc->lba_root, buf);
+}
+
+static void ext4_buf_lru_insert(struct ext4_bcache *bc, struct ext4_buf *buf)
+{
+	if (ext4_bcache_lru_tree(bc))
+		RB_INSERT(ext4_buf_lru, &bc->lru_root, buf);
+	else
+		TAILQ_INSERT_TAIL(&bc->lru_list[buf->lru_queue], buf, lru_link);
+}
+
+static void ext4_buf_lru_remove(struct ext4_bcache *bc, struct ext4_buf *buf)
+{
+	if (ext4_bcache_lru_tree(bc))
+		RB_REMOVE(ext4_buf_lru, &bc->lru_root, buf);
+	else
+		TAILQ_REMOVE(&bc->lru_list[buf->lru_queue], buf, lru_link);
+}
+
+/**@brief   Pick replacement queue of a buffer being allocated.*/
+static uint8_t ext4_bcache_policy_miss(struct ext4_bcache *bc, uint64_t lba)
+{
+	struct ext4_bghost *g;
+	uint32_t b1, b2, delta;
+
+	if (ext4_bcache_policy(bc) == EXT4_BCACHE_LRU)
+		return EXT4_BCACHE_Q_RECENT;
+
+	g = ext4_bcache_ghost_find(bc, lba);
+	if (!g)
+		return EXT4_BCACHE_Q_RECENT;
+
+	if (ext4_bcache_policy(bc) == EXT4_BCACHE_ARC) {
+		/* Ghost hit: shift target size towards the list it hit. */
+		b1 = bc->ghost_cnt[EXT4_BCACHE_Q_RECENT];
+		b2 = bc->ghost_cnt[EXT4_BCACHE_Q_FREQ];
+		if (g->queue == EXT4_BCACHE_Q_RECENT) {
+			delta = b2 > b1 ? b2 / b1 : 1;
+			bc->arc_p = bc->arc_p + delta > bc->cnt ?
+				    bc->cnt : bc->arc_p + delta;
+		} else {
+			delta = b1 > b2 ? b1 / b2 : 1;
+			bc->arc_p = bc->arc_p > delta ? bc->arc_p - delta : 0;
+		}
+	}
+
+	ext4_bcache_ghost_del(bc, g);
+	return EXT4_BCACHE_Q_FREQ;
+}
+
+/**@brief   Update replacement queue of a buffer found in cache.*/
+static void ext4_bcache_policy_hit(struct ext4_bcache *bc,
+				   struct ext4_buf *buf)
+{
+	/* 2Q ignores correlated references to A1in, ARC promotes to T2.*/
+	if (ext4_bcache_policy(bc) != EXT4_BCACHE_ARC ||
+	    buf->lru_queue == EXT4_BCACHE_Q_FREQ)
+		return;
+
+	/* Referenced buffer is not on any replacement queue list. */
+	bc->lru_qcnt[buf->lru_queue]--;
+	buf->lru_queue = EXT4_BCACHE_Q_FREQ;
+	bc->lru_qcnt[buf->lru_queue]++;
+}
+
+/**@brief   Write-back of the buffer would run its end_write() callback
+ *          (journal transaction buffer not checkpointed yet).*/
+static bool ext4_buf_end_write_pending(struct ext4_buf *buf)
+{
+	return buf->end_write && ext4_bcache_test_flag(buf, BC_DIRTY);
+}
+
+/**@brief   First buffer of a replacement queue, from buf on, without
+ *          pending end_write() callback.*/
+static struct ext4_buf *ext4_buf_lru_next_victim(struct ext4_buf *buf)
+{
+	while (buf && ext4_buf_end_write_pending(buf))
+		buf = TAILQ_NEXT(buf, lru_link);
+
+	return buf;
+}
+
 struct ext4_buf *ext4_buf_lowest_lru(struct ext4_bcache *bc)
 {
-	return RB_MIN(ext4_buf_lru, &bc->lru_root);
+	struct ext4_buf *recent, *freq, *buf;
+	bool take_recent;
+
+	/* Buffers with pending end_write() callback go last: evicting
+	 * one writes it back under whoever needed the cache slot. */
+	if (ext4_bcache_lru_tree(bc)) {
+		recent = RB_MIN(ext4_buf_lru, &bc->lru_root);
+		for (buf = recent; buf && ext4_buf_end_write_pending(buf);
+		     buf = RB_NEXT(ext4_buf_lru, &bc->lru_root, buf))
+			;
+		return buf ? buf : recent;
+	}
+
+	recent = TAILQ_FIRST(&bc->lru_list[EXT4_BCACHE_Q_RECENT]);
+	freq = TAILQ_FIRST(&bc->lru_list[EXT4_BCACHE_Q_FREQ]);
+	if (!recent || !freq) {
+		buf = ext4_buf_lru_next_victim(recent ? recent : freq);
+		if (buf)
+			return buf;
+		return recent ? recent : freq;
+	}
+
+	switch (ext4_bcache_policy(bc)) {
+	case EXT4_BCACHE_2Q:
+		/* Keep A1in at 1/4 of the cache size. */
+		take_recent = bc->lru_qcnt[EXT4_BCACHE_Q_RECENT] > bc->cnt / 4;
+		break;
+	case EXT4_BCACHE_ARC:
+		take_recent = bc->lru_qcnt[EXT4_BCACHE_Q_RECENT] > bc->arc_p;
+		break;
+	default:
+		take_recent = true;
+		break;
+	}
+
+	buf = ext4_buf_lru_next_victim(take_recent ? recent : freq);
+	if (!buf)
+		buf = ext4_buf_lru_next_victim(take_recent ? freq : recent);
+	if (!buf)
+		buf = take_recent ? recent : freq;
+	return buf;
+}
+
+int ext4_bcache_resize(struct ext4_bcache *bc, uint32_t cnt)
+{
+	int r;
+
+	if (!cnt || cnt <= bc->meta_cnt)
+		return EINVAL;
+
+	if (cnt == bc->cnt)
+		return EOK;
+
+	if (ext4_bcache_policy(bc) != EXT4_BCACHE_LRU) {
+		r = ext4_bcache_ghosts_alloc(bc, cnt);
+		if (r != EOK)
+			return r;
+	}
+
+	bc->cnt = cnt;
+	if (bc->arc_p > cnt)
+		bc->arc_p = cnt;
+
+	/* Write back and evict buffers over the new size. */
+	if (bc->bdev) {
+		r = ext4_block_cache_shake(bc->bdev);
+		if (r != EOK)
+			return r;
+	}
+
+	ext4_bcache_htab_shrink(bc);
+	return EOK;
+}
+
+/**@brief   Evict a clean, unreferenced buffer, counted like the ones
+ *          @ref ext4_block_cache_shake evicts.*/
+static void ext4_bcache_evict_buf(struct ext4_bcache *bc, struct ext4_buf *buf)
+{
+	bc->evict_ctr++;
+	bc->cls_stats[buf->cls].evictions++;
+	ext4_bcache_drop_buf(bc, buf);
+}
+
+/**@brief   Drop clean, unreferenced buffers of a replacement queue
+ *          (least recently used first) until target is reached.*/
+static uint32_t ext4_bcache_shed_queue(struct ext4_bcache *bc,
+				       uint32_t target, uint8_t q)
+{
+	struct ext4_buf *buf, *next;
+	uint32_t freed = 0;
+
+	for (buf = TAILQ_FIRST(&bc->lru_list[q]);
+	     buf && bc->ref_blocks > target; buf = next) {
+		next = TAILQ_NEXT(buf, lru_link);
+		if (ext4_bcache_test_flag(buf, BC_DIRTY))
+			continue;
+
+		ext4_bcache_evict_buf(bc, buf);
+		freed++;
+	}
+	return freed;
+}
+
+uint32_t ext4_bcache_shed(struct ext4_bcache *bc, uint32_t target)
+{
+	struct ext4_buf *buf, *tmp;
+	uint32_t freed = 0;
+
+	if (ext4_bcache_lru_tree(bc)) {
+		RB_FOREACH_SAFE(buf, ext4_buf_lru, &bc->lru_root, tmp) {
+			if (bc->ref_blocks <= target)
+				break;
+
+			if (ext4_bcache_test_flag(buf, BC_DIRTY))
+				continue;
+
+			ext4_bcache_evict_buf(bc, buf);
+			freed++;
+		}
+		return freed;
+	}
+
+	/* Buffers seen once go first. */
+	freed += ext4_bcache_shed_queue(bc, target, EXT4_BCACHE_Q_RECENT);
+	freed += ext4_bcache_shed_queue(bc, target, EXT4_BCACHE_Q_FREQ);
+	ext4_bcache_htab_shrink(bc);
+	return freed;
+}
+
+int ext4_bcache_setup_pools(struct ext4_bcache *bc, uint32_t meta_cnt,
+			    uint32_t meta_cls)
+{
+	if (meta_cnt >= bc->cnt)
+		return EINVAL;
+
+	bc->meta_cnt = meta_cnt;
+	bc->meta_cls = meta_cls ? meta_cls : EXT4_BCACHE_META_DEFAULT;
+	return EOK;
+}
+
+void ext4_bcache_pin(struct ext4_bcache *bc, struct ext4_buf *buf)
+{
+	if (ext4_bcache_test_flag(buf, BC_PINNED))
+		return;
+
+	/* Pinned buffers are not on any replacement queue. */
+	if (!buf->refctr)
+		ext4_buf_lru_remove(bc, buf);
+
+	bc->lru_qcnt[buf->lru_queue]--;
+	ext4_bcache_set_flag(buf, BC_PINNED);
+	bc->pin_cnt++;
+}
+
+void ext4_bcache_unpin(struct ext4_bcache *bc, struct ext4_buf *buf)
+{
+	if (!ext4_bcache_test_flag(buf, BC_PINNED))
+		return;
+
+	ext4_bcache_clear_flag(buf, BC_PINNED);
+	bc->pin_cnt--;
+	bc->lru_qcnt[buf->lru_queue]++;
+
+	if (!buf->refctr)
+		ext4_buf_lru_insert(bc, buf);
+}
+
+/**@brief   Pin buffers of metadata classes while the metadata pool
+ *          has room.*/
+static void ext4_bcache_meta_pin(struct ext4_bcache *bc, struct ext4_buf *buf)
+{
+	if (bc->pin_cnt < bc->meta_cnt && (bc->meta_cls & (1u << buf->cls)))
+		ext4_bcache_pin(bc, buf);
+}
+
+void ext4_bcache_get_stats(struct ext4_bcache *bc,
+			   struct ext4_bcache_stats *stats)
+{
+	memset(stats, 0, sizeof(struct ext4_bcache_stats));
+
+	stats->cnt = bc->cnt;
+	stats->itemsize = bc->itemsize;
+	stats->ref_blocks = bc->ref_blocks;
+	stats->max_ref_blocks = bc->max_ref_blocks;
+	stats->dirty_blocks = bc->dirty_cnt;
+	stats->meta_cnt = bc->meta_cnt;
+	stats->pinned_blocks = bc->pin_cnt;
+
+	stats->hits = bc->hit_ctr;
+	stats->misses = bc->miss_ctr;
+	stats->evictions = bc->evict_ctr;
+	stats->dirty_evictions = bc->dirty_evict_ctr;
+	stats->writes = bc->write_ctr;
+	stats->ra_blocks = bc->ra_ctr;
+	stats->ra_hits = bc->ra_hit_ctr;
+	stats->ra_waste = bc->ra_waste_ctr;
+
+	stats->alloc_ctr = bc->alloc_ctr;
+	stats->alloc_bytes = bc->alloc_bytes;
+	memcpy(stats->cls, bc->cls_stats, sizeof(bc->cls_stats));
+}
+
+void ext4_bcache_clear_stats(struct ext4_bcache *bc)
+{
+	bc->hit_ctr = 0;
+	bc->miss_ctr = 0;
+	bc->evict_ctr = 0;
+	bc->dirty_evict_ctr = 0;
+	bc->write_ctr = 0;
+	bc->ra_ctr = 0;
+	bc->ra_hit_ctr = 0;
+	bc->ra_waste_ctr = 0;
+	bc->max_ref_blocks = bc->ref_blocks;
+
+	for (int i = 0; i < EXT4_BCACHE_CLS_COUNT; i++) {
+		bc->cls_stats[i].hits = 0;
+		bc->cls_stats[i].misses = 0;
+		bc->cls_stats[i].evictions = 0;
+	}
+}
+
+/**@brief   Hotter buffers first: frequency queue, then most recently used.*/
+static int ext4_buf_hot_cmp(const void *a, const void *b)
+{
+	const struct ext4_buf *ba = *(struct ext4_buf * const *)a;
+	const struct ext4_buf *bb = *(struct ext4_buf * const *)b;
+
+	if (ba->lru_queue != bb->lru_queue)
+		return ba->lru_queue == EXT4_BCACHE_Q_FREQ ? -1 : 1;
+	if (ba->lru_id > bb->lru_id)
+		return -1;
+	else if (ba->lru_id < bb->lru_id)
+		return 1;
+	return 0;
+}
+
+static bool ext4_buf_is_hot_candidate(struct ext4_buf *buf)
+{
+	return ext4_bcache_test_flag(buf, BC_UPTODATE) &&
+	       !ext4_bcache_test_flag(buf, BC_TMP) &&
+	       buf->cls != EXT4_BCACHE_CLS_JOURNAL;
+}
+
+uint32_t ext4_bcache_hot_lbas(struct ext4_bcache *bc, uint64_t *lba,
+			      uint32_t max)
+{
+	struct ext4_buf **bufs, *buf;
+	uint32_t cnt = 0, i;
+
+	if (!max || !bc->ref_blocks)
+		return 0;
+
+	bufs = ext4_malloc(bc->ref_blocks * sizeof(struct ext4_buf *));
+	if (!bufs)
+		return 0;
+
+	if (bc->flags & EXT4_BCACHE_HASH) {
+		for (i = 0; i < (1u << bc->hbits); i++) {
+			buf = bc->htab[i];
+			if (buf && ext4_buf_is_hot_candidate(buf))
+				bufs[cnt++] = buf;
+		}
+	} else {
+		RB_FOREACH(buf, ext4_buf_lba, &bc->lba_root) {
+			if (ext4_buf_is_hot_candidate(buf))
+				bufs[cnt++] = buf;
+		}
+	}
+
+	if (cnt > max) {
+		qsort(bufs, cnt, sizeof(struct ext4_buf *), ext4_buf_hot_cmp);
+		cnt = max;
+	}
+
+	for (i = 0; i < cnt; i++)
+		lba[i] = bufs[i]->lba;
+
+	ext4_free(bufs);
+	return cnt;
+}
+
+struct ext4_buf *ext4_bcache_lookup(struct ext4_bcache *bc, uint64_t lba)
+{
+	return ext4_buf_lookup(bc, lba);
+}
+
+uint8_t *ext4_bcache_gather_buf(struct ext4_bcache *bc)
+{
+	if (!bc->gather_buf)
+		bc->gather_buf = ext4_bcache_malloc(bc,
+				(size_t)CONFIG_BLOCK_DEV_FLUSH_MERGE *
+				bc->itemsize);
+
+	return bc->gather_buf;
 }
 
 void ext4_bcache_drop_buf(struct ext4_bcache *bc, struct ext4_buf *buf)
@@ -165,10 +907,28 @@ void ext4_bcache_drop_buf(struct ext4_bcache *bc, struct ext4_buf *buf)
 		ext4_dbg(DEBUG_BCACHE, DBG_WARN "Buffer is still referenced. "
 				"lba: %" PRIu64 ", refctr: %" PRIu32 "\n",
 				buf->lba, buf->refctr);
-	} else
-		RB_REMOVE(ext4_buf_lru, &bc->lru_root, buf);
+	} else if (!ext4_bcache_test_flag(buf, BC_PINNED)) {
+		ext4_buf_lru_remove(bc, buf);
 
-	RB_REMOVE(ext4_buf_lba, &bc->lba_root, buf);
+		/* Remember LBAs of evicted, valid buffers. */
+		if (ext4_bcache_policy(bc) != EXT4_BCACHE_LRU &&
+		    ext4_bcache_test_flag(buf, BC_UPTODATE) &&
+		    !ext4_bcache_test_flag(buf, BC_TMP) &&
+		    (ext4_bcache_policy(bc) == EXT4_BCACHE_ARC ||
+		     buf->lru_queue == EXT4_BCACHE_Q_RECENT))
+			ext4_bcache_ghost_add(bc, buf->lba, buf->lru_queue);
+	}
+
+	if (ext4_bcache_test_flag(buf, BC_PINNED))
+		bc->pin_cnt--;
+	else
+		bc->lru_qcnt[buf->lru_queue]--;
+
+	if (ext4_bcache_test_flag(buf, BC_RA))
+		bc->ra_waste_ctr++;
+
+	bc->cls_stats[buf->cls].blocks--;
+	ext4_buf_index_remove(bc, buf);
 
 	/*Forcibly drop dirty buffer.*/
 	if (ext4_bcache_test_flag(buf, BC_DIRTY))
@@ -184,11 +944,20 @@ void ext4_bcache_invalidate_buf(struct ext4_bcache *bc,
 	buf->end_write = NULL;
 	buf->end_write_arg = NULL;
 
+	/* Give metadata pool item back. */
+	ext4_bcache_unpin(bc, buf);
+
+	if (ext4_bcache_test_flag(buf, BC_RA)) {
+		ext4_bcache_clear_flag(buf, BC_RA);
+		bc->ra_waste_ctr++;
+	}
+
 	/* Clear both dirty and up-to-date flags. */
 	if (ext4_bcache_test_flag(buf, BC_DIRTY))
 		ext4_bcache_remove_dirty_node(bc, buf);
 
 	ext4_bcache_clear_dirty(buf);
+	buf->dirty_time = 0;
 }
 
 void ext4_bcache_invalidate_lba(struct ext4_bcache *bc,
@@ -196,7 +965,31 @@ void ext4_bcache_invalidate_lba(struct ext4_bcache *bc,
 				uint32_t cnt)
 {
 	uint64_t end = from + cnt - 1;
-	struct ext4_buf *tmp = ext4_buf_lookup(bc, from), *buf;
+	struct ext4_buf *tmp, *buf;
+	if (bc->flags & EXT4_BCACHE_HASH) {
+		/* Probe each LBA of a short range, scan the table otherwise.*/
+		if (cnt <= bc->ref_blocks) {
+			for (uint64_t lba = from; lba <= end; lba++) {
+				buf = ext4_buf_lookup(bc, lba);
+				if (buf)
+					ext4_bcache_invalidate_buf(bc, buf);
+			}
+			return;
+		}
+
+		for (uint32_t i = 0; i < (1u << bc->hbits); i++) {
+			buf = bc->htab[i];
+			if (buf && buf->lba >= from && buf->lba <= end)
+				ext4_bcache_invalidate_buf(bc, buf);
+		}
+		return;
+	}
+
+	/* First buffer at or after from (from itself may be uncached). */
+	struct ext4_buf key = {
+		.lba = from
+	};
+	tmp = RB_NFIND(ext4_buf_lba, &bc->lba_root, &key);
 	RB_FOREACH_FROM(buf, ext4_buf_lba, tmp) {
 		if (buf->lba > end)
 			break;
@@ -216,7 +1009,8 @@ ext4_bcache_find_get(struct ext4_bcache *bc, struct ext4_block *b,
 			/* Assign new value to LRU id and increment LRU counter
 			 * by 1*/
 			buf->lru_id = ++bc->lru_ctr;
-			RB_REMOVE(ext4_buf_lru, &bc->lru_root, buf);
+			if (!ext4_bcache_test_flag(buf, BC_PINNED))
+				ext4_buf_lru_remove(bc, buf);
 			if (ext4_bcache_test_flag(buf, BC_DIRTY))
 				ext4_bcache_remove_dirty_node(bc, buf);
 
@@ -231,12 +1025,36 @@ ext4_bcache_find_get(struct ext4_bcache *bc, struct ext4_block *b,
 	return buf;
 }
 
-int ext4_bcache_alloc(struct ext4_bcache *bc, struct ext4_block *b,
-		      bool *is_new)
+/**@brief   Get a buffer for the block, allocate it on a miss.
+ * @param   ra readahead: neither a hit nor a miss, a cached buffer is
+ *             not touched (replacement policy, class)*/
+static int ext4_bcache_alloc_buf(struct ext4_bcache *bc, struct ext4_block *b,
+				 uint8_t cls, bool ra, bool *is_new)
 {
 	/* Try to search the buffer with exaxt LBA. */
 	struct ext4_buf *buf = ext4_bcache_find_get(bc, b, b->lb_id);
+	if (buf && ra) {
+		*is_new = false;
+		return EOK;
+	}
+
 	if (buf) {
+		if (!ext4_bcache_test_flag(buf, BC_PINNED))
+			ext4_bcache_policy_hit(bc, buf);
+		bc->hit_ctr++;
+		if (ext4_bcache_test_flag(buf, BC_RA)) {
+			ext4_bcache_clear_flag(buf, BC_RA);
+			bc->ra_hit_ctr++;
+		}
+
+		/* Retag buffers first loaded by an untagged request. */
+		if (cls != EXT4_BCACHE_CLS_OTHER && buf->cls != cls) {
+			bc->cls_stats[buf->cls].blocks--;
+			bc->cls_stats[cls].blocks++;
+			buf->cls = cls;
+		}
+		bc->cls_stats[buf->cls].hits++;
+		ext4_bcache_meta_pin(bc, buf);
 		*is_new = false;
 		return EOK;
 	}
@@ -246,7 +1064,20 @@ int ext4_bcache_alloc(struct ext4_bcache *bc, struct ext4_block *b,
 	if (!buf)
 		return ENOMEM;
 
-	RB_INSERT(ext4_buf_lba, &bc->lba_root, buf);
+	if (ext4_buf_index_insert(bc, buf) != EOK) {
+		ext4_buf_free(buf);
+		return ENOMEM;
+	}
+
+	if (!ra) {
+		bc->miss_ctr++;
+		bc->cls_stats[cls].misses++;
+	}
+	buf->cls = cls;
+	bc->cls_stats[cls].blocks++;
+	buf->lru_queue = ext4_bcache_policy_miss(bc, buf->lba);
+	bc->lru_qcnt[buf->lru_queue]++;
+
 	/* One more buffer in bcache now. :-) */
 	bc->ref_blocks++;
 
@@ -259,6 +1090,7 @@ int ext4_bcache_alloc(struct ext4_bcache *bc, struct ext4_block *b,
 	/* Assign new value to LRU id and increment LRU counter
 	 * by 1*/
 	buf->lru_id = ++bc->lru_ctr;
+	ext4_bcache_meta_pin(bc, buf);
 
 	b->buf = buf;
 	b->data = buf->data;
@@ -267,6 +1099,25 @@ int ext4_bcache_alloc(struct ext4_bcache *bc, struct ext4_block *b,
 	return EOK;
 }
 
+int ext4_bcache_alloc(struct ext4_bcache *bc, struct ext4_block *b,
+		      bool *is_new)
+{
+	return ext4_bcache_alloc_buf(bc, b, EXT4_BCACHE_CLS_OTHER, false,
+				     is_new);
+}
+
+int ext4_bcache_alloc_cls(struct ext4_bcache *bc, struct ext4_block *b,
+			  uint8_t cls, bool *is_new)
+{
+	return ext4_bcache_alloc_buf(bc, b, cls, false, is_new);
+}
+
+int ext4_bcache_alloc_ra(struct ext4_bcache *bc, struct ext4_block *b,
+			 uint8_t cls, bool *is_new)
+{
+	return ext4_bcache_alloc_buf(bc, b, cls, true, is_new);
+}
+
 int ext4_bcache_free(struct ext4_bcache *bc, struct ext4_block *b)
 {
 	struct ext4_buf *buf = b->buf;
@@ -287,7 +1138,8 @@ int ext4_bcache_free(struct ext4_bcache *bc, struct ext4_block *b)
 
 	/* We are the last one touching this buffer, do the cleanups. */
 	if (!buf->refctr) {
-		RB_INSERT(ext4_buf_lru, &bc->lru_root, buf);
+		if (!ext4_bcache_test_flag(buf, BC_PINNED))
+			ext4_buf_lru_insert(bc, buf);
 		/* This buffer is ready to be flushed. */
 		if (ext4_bcache_test_flag(buf, BC_DIRTY) &&
 		    ext4_bcache_test_flag(buf, BC_UPTODATE)) {
@@ -316,7 +1168,9 @@ int ext4_bcache_free(struct ext4_bcache *bc, struct ext4_block *b)
 
 bool ext4_bcache_is_full(struct ext4_bcache *bc)
 {
-	return (bc->cnt <= bc->ref_blocks);
+	/* Pinned buffers fill the metadata pool first. */
+	uint32_t meta = bc->pin_cnt < bc->meta_cnt ? bc->pin_cnt : bc->meta_cnt;
+	return (bc->cnt - bc->meta_cnt <= bc->ref_blocks - meta);
 }
 
 
@@ -47,6 +47,9 @@
 #include <string.h>
 #include <stdlib.h>
 
+/**@brief   Completed requests taken by a single reap call.*/
+#define EXT4_BLOCKDEV_REAP_BATCH 16
+
 static void ext4_bdif_lock(struct ext4_blockdev *bdev)
 {
 	if (!bdev->bdif->lock)
@@ -65,26 +68,238 @@ static void ext4_bdif_unlock(struct ext4_blockdev *bdev)
 	ext4_assert(r == EOK);
 }
 
+#if CONFIG_BLOCK_DEV_ENABLE_STATS
+/**@brief   I/O statistics state.*/
+struct ext4_blockdev_iostat {
+	struct ext4_blockdev_io_stats st;
+
+	/**@brief   Time source (NULL - no latencies)*/
+	uint64_t (*time_us)(void);
+
+	/**@brief   Block after the last request: read, write*/
+	uint64_t next[2];
+};
+
+/**@brief   Histogram bucket of a value: floor(log2(v)), saturated.*/
+static uint32_t ext4_bdif_bucket(uint64_t v, uint32_t buckets)
+{
+	uint32_t i = 0;
+	while (v > 1 && i < buckets - 1) {
+		v >>= 1;
+		i++;
+	}
+	return i;
+}
+#endif
+
+/**@brief   Account a device request (physical blocks), called under the
+ *          block device lock before the request is issued.
+ * @return  request start time*/
+static uint64_t ext4_bdif_io_start(struct ext4_blockdev *bdev, bool write,
+				   const struct ext4_blockdev_iovec *iov,
+				   uint32_t cnt)
+{
+#if CONFIG_BLOCK_DEV_ENABLE_STATS
+	struct ext4_blockdev_iostat *ios = bdev->iostat;
+	struct ext4_blockdev_io_dir *d;
+	uint64_t blocks = 0;
+	uint32_t i;
+
+	if (!ios || !cnt)
+		return 0;
+
+	d = write ? &ios->st.wr : &ios->st.rd;
+	for (i = 0; i < cnt; i++)
+		blocks += iov[i].blk_cnt;
+
+	if (iov[0].blk_id == ios->next[write])
+		d->seq++;
+
+	ios->next[write] = iov[cnt - 1].blk_id + iov[cnt - 1].blk_cnt;
+	d->reqs++;
+	d->bytes += blocks * bdev->bdif->ph_bsize;
+	d->size[ext4_bdif_bucket(blocks, EXT4_BLOCKDEV_SIZE_BUCKETS)]++;
+	return ios->time_us ? ios->time_us() : 0;
+#else
+	(void)bdev;
+	(void)write;
+	(void)iov;
+	(void)cnt;
+	return 0;
+#endif
+}
+
+/**@brief   Account a device request completion (block device lock held).*/
+static void ext4_bdif_io_end(struct ext4_blockdev *bdev, bool write,
+			     uint64_t start, int res)
+{
+#if CONFIG_BLOCK_DEV_ENABLE_STATS
+	struct ext4_blockdev_iostat *ios = bdev->iostat;
+	struct ext4_blockdev_io_dir *d;
+	uint64_t lat;
+
+	if (!ios)
+		return;
+
+	d = write ? &ios->st.wr : &ios->st.rd;
+	if (res != EOK)
+		d->errors++;
+
+	if (!ios->time_us)
+		return;
+
+	lat = ios->time_us() - start;
+	d->time_us += lat;
+	if (lat > d->max_us)
+		d->max_us = lat;
+
+	d->lat[ext4_bdif_bucket(lat, EXT4_BLOCKDEV_LAT_BUCKETS)]++;
+#else
+	(void)bdev;
+	(void)write;
+	(void)start;
+	(void)res;
+#endif
+}
+
+/**@brief   Reads bypass the block device lock: the device allows it and
+ *          counters can be updated atomically.*/
+static bool ext4_bdif_lockless_read(struct ext4_blockdev *bdev)
+{
+#if defined(__GNUC__)
+	return bdev->bdif->flags & EXT4_BDIF_LOCKLESS_READ;
+#else
+	(void)bdev;
+	return false;
+#endif
+}
+
+/**@brief   Count a device read, atomically when reads are lockless.*/
+static void ext4_bdif_count_read(struct ext4_blockdev *bdev)
+{
+#if defined(__GNUC__)
+	if (ext4_bdif_lockless_read(bdev)) {
+		__atomic_fetch_add(&bdev->bdif->bread_ctr, 1, __ATOMIC_RELAXED);
+		return;
+	}
+#endif
+	bdev->bdif->bread_ctr++;
+}
+
+/**@brief   Begin a device read: lock the device unless reads are
+ *          lockless, account the request.
+ * @return  request start time*/
+static uint64_t ext4_bdif_read_begin(struct ext4_blockdev *bdev,
+				     const struct ext4_blockdev_iovec *iov,
+				     uint32_t cnt)
+{
+	uint64_t t = 0;
+
+	if (!ext4_bdif_lockless_read(bdev)) {
+		ext4_bdif_lock(bdev);
+		ext4_bdif_count_read(bdev);
+		return ext4_bdif_io_start(bdev, false, iov, cnt);
+	}
+
+	ext4_bdif_count_read(bdev);
+#if CONFIG_BLOCK_DEV_ENABLE_STATS
+	/* Statistics stay consistent under the lock, I/O runs out of it. */
+	if (bdev->iostat) {
+		ext4_bdif_lock(bdev);
+		t = ext4_bdif_io_start(bdev, false, iov, cnt);
+		ext4_bdif_unlock(bdev);
+	}
+#endif
+	return t;
+}
+
+/**@brief   End a device read started by ext4_bdif_read_begin.*/
+static void ext4_bdif_read_end(struct ext4_blockdev *bdev, uint64_t t, int r)
+{
+	if (!ext4_bdif_lockless_read(bdev)) {
+		ext4_bdif_io_end(bdev, false, t, r);
+		ext4_bdif_unlock(bdev);
+		return;
+	}
+
+#if CONFIG_BLOCK_DEV_ENABLE_STATS
+	if (bdev->iostat) {
+		ext4_bdif_lock(bdev);
+		ext4_bdif_io_end(bdev, false, t, r);
+		ext4_bdif_unlock(bdev);
+	}
+#endif
+}
+
 static int ext4_bdif_bread(struct ext4_blockdev *bdev, void *buf,
 			   uint64_t blk_id, uint32_t blk_cnt)
 {
-	ext4_bdif_lock(bdev);
+	struct ext4_blockdev_iovec iov = {.blk_id = blk_id, .blk_cnt = blk_cnt};
+
+	uint64_t t = ext4_bdif_read_begin(bdev, &iov, 1);
 	int r = bdev->bdif->bread(bdev, buf, blk_id, blk_cnt);
-	bdev->bdif->bread_ctr++;
-	ext4_bdif_unlock(bdev);
+	ext4_bdif_read_end(bdev, t, r);
 	return r;
 }
 
 static int ext4_bdif_bwrite(struct ext4_blockdev *bdev, const void *buf,
 			    uint64_t blk_id, uint32_t blk_cnt)
 {
+	struct ext4_blockdev_iovec iov = {.blk_id = blk_id, .blk_cnt = blk_cnt};
+
 	ext4_bdif_lock(bdev);
+	uint64_t t = ext4_bdif_io_start(bdev, true, &iov, 1);
 	int r = bdev->bdif->bwrite(bdev, buf, blk_id, blk_cnt);
+	ext4_bdif_io_end(bdev, true, t, r);
 	bdev->bdif->bwrite_ctr++;
 	ext4_bdif_unlock(bdev);
 	return r;
 }
 
+static int ext4_bdif_breadv(struct ext4_blockdev *bdev,
+			    const struct ext4_blockdev_iovec *iov, uint32_t cnt)
+{
+	int r = EOK;
+	uint64_t t;
+
+	if (bdev->bdif->breadv) {
+		t = ext4_bdif_read_begin(bdev, iov, cnt);
+		r = bdev->bdif->breadv(bdev, iov, cnt);
+		ext4_bdif_read_end(bdev, t, r);
+		return r;
+	}
+
+	for (uint32_t i = 0; i < cnt && r == EOK; i++)
+		r = ext4_bdif_bread(bdev, iov[i].buf, iov[i].blk_id,
+				    iov[i].blk_cnt);
+	return r;
+}
+
+static int ext4_bdif_bwritev(struct ext4_blockdev *bdev,
+			     const struct ext4_blockdev_iovec *iov,
+			     uint32_t cnt)
+{
+	int r = EOK;
+	uint64_t t;
+	ext4_bdif_lock(bdev);
+	if (bdev->bdif->bwritev) {
+		t = ext4_bdif_io_start(bdev, true, iov, cnt);
+		r = bdev->bdif->bwritev(bdev, iov, cnt);
+		ext4_bdif_io_end(bdev, true, t, r);
+		bdev->bdif->bwrite_ctr++;
+	} else {
+		for (uint32_t i = 0; i < cnt && r == EOK; i++) {
+			t = ext4_bdif_io_start(bdev, true, &iov[i], 1);
+			r = bdev->bdif->bwrite(bdev, iov[i].buf, iov[i].blk_id,
+					       iov[i].blk_cnt);
+			ext4_bdif_io_end(bdev, true, t, r);
+			bdev->bdif->bwrite_ctr++;
+		}
+	}
+	ext4_bdif_unlock(bdev);
+	return r;
+}
+
 int ext4_block_init(struct ext4_blockdev *bdev)
 {
 	int rc;
@@ -106,6 +321,9 @@ int ext4_block_init(struct ext4_blockdev *bdev)
 		return rc;
 
 	bdev->bdif->ph_refctr = 1;
+#if CONFIG_BLOCK_DEV_READAHEAD
+	memset(bdev->ra, 0, sizeof(bdev->ra));
+#endif
 	return EOK;
 }
 
@@ -138,36 +356,241 @@ int ext4_block_fini(struct ext4_blockdev *bdev)
 		return EOK;
 
 	/*Low level block fini*/
+	ext4_block_barrier(bdev);
 	return bdev->bdif->close(bdev);
 }
 
+/**@brief   Finish disk-write of a buffer: clear dirty state on success
+ *          and run end_write() callback.*/
+static void ext4_block_buf_written(struct ext4_blockdev *bdev,
+				   struct ext4_buf *buf, int r)
+{
+	struct ext4_bcache *bc = bdev->bc;
+	bool dont_shake = bc->dont_shake;
+
+	if (r == EOK) {
+		bc->write_ctr++;
+		ext4_bcache_remove_dirty_node(bc, buf);
+		ext4_bcache_clear_flag(buf, BC_DIRTY);
+		buf->dirty_time = 0;
+	}
+
+	if (buf->end_write) {
+		bc->dont_shake = true;
+		buf->end_write(bc, buf, r, buf->end_write_arg);
+		bc->dont_shake = dont_shake;
+	}
+}
+
 int ext4_block_flush_buf(struct ext4_blockdev *bdev, struct ext4_buf *buf)
 {
 	int r;
-	struct ext4_bcache *bc = bdev->bc;
 
 	if (ext4_bcache_test_flag(buf, BC_DIRTY) &&
 	    ext4_bcache_test_flag(buf, BC_UPTODATE)) {
 		r = ext4_blocks_set_direct(bdev, buf->data, buf->lba, 1);
-		if (r) {
-			if (buf->end_write) {
-				bc->dont_shake = true;
-				buf->end_write(bc, buf, r, buf->end_write_arg);
-				bc->dont_shake = false;
-			}
+		ext4_block_buf_written(bdev, buf, r);
+		return r;
+	}
+	return EOK;
+}
 
-			return r;
+/**@brief   Buffer is dirty, unreferenced and waits for write-back.
+ * @param   buf buffer descriptor
+ * @param   all buffers with end_write() callback (journal transaction
+ *              buffers) too: only full and background write-back run
+ *              the callbacks, cache eviction writes such a buffer only
+ *              when it is the victim itself*/
+static bool ext4_block_buf_flushable(struct ext4_buf *buf, bool all)
+{
+	return buf->on_dirty_list && !buf->refctr &&
+	       (all || !buf->end_write) &&
+	       ext4_bcache_test_flag(buf, BC_DIRTY) &&
+	       ext4_bcache_test_flag(buf, BC_UPTODATE);
+}
+
+/**@brief   Write buffers using a single vectored write.
+ * @param   bdev block device descriptor
+ * @param   bufs buffers sorted by LBA
+ * @param   cnt buffers count (up to CONFIG_BLOCK_DEV_FLUSH_MERGE)
+ * @return  standard error code*/
+static int ext4_block_flush_runv(struct ext4_blockdev *bdev,
+				 struct ext4_buf **bufs, uint32_t cnt)
+{
+	struct ext4_blockdev_iovec iov[CONFIG_BLOCK_DEV_FLUSH_MERGE] = {{0}};
+	uint32_t i;
+	int r;
+
+	ext4_assert(cnt && cnt <= CONFIG_BLOCK_DEV_FLUSH_MERGE);
+	for (i = 0; i < cnt; i++) {
+		iov[i].blk_id = bufs[i]->lba;
+		iov[i].blk_cnt = 1;
+		iov[i].buf = bufs[i]->data;
+	}
+
+	r = ext4_blocks_set_direct_v(bdev, iov, cnt);
+
+	for (i = 0; i < cnt; i++)
+		if (ext4_bcache_test_flag(bufs[i], BC_DIRTY))
+			ext4_block_buf_written(bdev, bufs[i], r);
+
+	return r;
+}
+
+/**@brief   Write buffers with adjacent LBAs using a single write.
+ * @param   bdev block device descriptor
+ * @param   bufs buffers sorted by LBA
+ * @param   cnt buffers count (up to CONFIG_BLOCK_DEV_FLUSH_MERGE)
+ * @return  standard error code*/
+static int ext4_block_flush_run(struct ext4_blockdev *bdev,
+				struct ext4_buf **bufs, uint32_t cnt)
+{
+	int r;
+	uint32_t i;
+	uint32_t bsize = bdev->bc->itemsize;
+	uint8_t *gather = NULL;
+
+	if (cnt > 1 && bdev->bdif->bwritev)
+		return ext4_block_flush_runv(bdev, bufs, cnt);
+
+	if (cnt > 1)
+		gather = ext4_bcache_gather_buf(bdev->bc);
+
+	if (!gather) {
+		for (i = 0; i < cnt; i++) {
+			r = ext4_block_flush_buf(bdev, bufs[i]);
+			if (r != EOK)
+				return r;
 		}
+		return EOK;
+	}
 
-		ext4_bcache_remove_dirty_node(bc, buf);
-		ext4_bcache_clear_flag(buf, BC_DIRTY);
-		if (buf->end_write) {
-			bc->dont_shake = true;
-			buf->end_write(bc, buf, r, buf->end_write_arg);
-			bc->dont_shake = false;
+	for (i = 0; i < cnt; i++)
+		memcpy(gather + i * bsize, bufs[i]->data, bsize);
+
+	r = ext4_blocks_set_direct(bdev, gather, bufs[0]->lba, cnt);
+
+	/* Every buffer gets its end_write(), unless an earlier callback
+	 * has already written it back.*/
+	for (i = 0; i < cnt; i++)
+		if (ext4_bcache_test_flag(bufs[i], BC_DIRTY))
+			ext4_block_buf_written(bdev, bufs[i], r);
+
+	return r;
+}
+
+/**@brief   Asynchronous write of a buffers run. Segments live with
+ *          the request until it completes.*/
+struct ext4_block_wreq {
+	struct ext4_blockdev_req req;
+	int *err;
+	uint32_t cnt;
+	struct ext4_block blks[CONFIG_BLOCK_DEV_FLUSH_MERGE];
+	struct ext4_blockdev_iovec iov[CONFIG_BLOCK_DEV_FLUSH_MERGE];
+};
+
+/**@brief   Completion of an asynchronous buffers run write.*/
+static void ext4_block_flush_run_end(struct ext4_blockdev_req *req)
+{
+	struct ext4_block_wreq *wreq = req->arg;
+	struct ext4_blockdev *bdev = req->bdev;
+	uint32_t i;
+
+	for (i = 0; i < wreq->cnt; i++) {
+		struct ext4_buf *buf = wreq->blks[i].buf;
+		if (req->res != EOK)
+			ext4_bcache_set_flag(buf, BC_DIRTY);
+
+		/* A buffer dirtied again in flight waits for the next
+		 * write-back. */
+		if (req->res != EOK || !ext4_bcache_test_flag(buf, BC_DIRTY))
+			ext4_block_buf_written(bdev, buf, req->res);
+
+		ext4_bcache_free(bdev->bc, &wreq->blks[i]);
+	}
+
+	if (req->res != EOK && *wreq->err == EOK)
+		*wreq->err = req->res;
+
+	ext4_free(wreq);
+}
+
+/**@brief   Submit write of buffers run without waiting for it. Buffers
+ *          stay referenced and clean (re-dirtying gets noticed) until
+ *          the write completes.
+ * @param   bdev block device descriptor
+ * @param   bufs buffers sorted by LBA
+ * @param   cnt buffers count (up to CONFIG_BLOCK_DEV_FLUSH_MERGE)
+ * @param   err first completion error (output)
+ * @return  standard error code*/
+static int ext4_block_flush_run_async(struct ext4_blockdev *bdev,
+				      struct ext4_buf **bufs, uint32_t cnt,
+				      int *err)
+{
+	struct ext4_block_wreq *wreq;
+	uint32_t i;
+	int r;
+
+	wreq = ext4_malloc(sizeof(struct ext4_block_wreq));
+	if (!wreq)
+		return ext4_block_flush_run(bdev, bufs, cnt);
+
+	for (i = 0; i < cnt; i++) {
+		ext4_bcache_find_get(bdev->bc, &wreq->blks[i], bufs[i]->lba);
+		ext4_bcache_clear_flag(bufs[i], BC_DIRTY);
+		wreq->iov[i].blk_id = bufs[i]->lba;
+		wreq->iov[i].blk_cnt = 1;
+		wreq->iov[i].buf = bufs[i]->data;
+	}
+
+	wreq->err = err;
+	wreq->cnt = cnt;
+	wreq->req.write = true;
+	wreq->req.iov = wreq->iov;
+	wreq->req.iov_cnt = cnt;
+	wreq->req.complete = ext4_block_flush_run_end;
+	wreq->req.arg = wreq;
+
+	r = ext4_blocks_submit_v(bdev, &wreq->req);
+	if (r != EOK) {
+		for (i = 0; i < cnt; i++) {
+			ext4_bcache_set_flag(bufs[i], BC_DIRTY);
+			ext4_bcache_free(bdev->bc, &wreq->blks[i]);
 		}
+		ext4_free(wreq);
 	}
-	return EOK;
+	return r;
+}
+
+/**@brief   Write back a dirty buffer (cache eviction) together with its
+ *          dirty neighbours without end_write() callback.
+ * @param   bdev block device descriptor
+ * @param   buf dirty buffer
+ * @return  standard error code*/
+static int ext4_block_flush_cluster(struct ext4_blockdev *bdev,
+				    struct ext4_buf *buf)
+{
+	struct ext4_buf *run[CONFIG_BLOCK_DEV_FLUSH_MERGE];
+	struct ext4_buf *b;
+	uint64_t lba = buf->lba;
+	uint32_t cnt = 0;
+
+	/* Find the first buffer of the cluster. */
+	while (lba > 0 && lba + CONFIG_BLOCK_DEV_FLUSH_MERGE - 1 > buf->lba) {
+		b = ext4_bcache_lookup(bdev->bc, lba - 1);
+		if (!b || !ext4_block_buf_flushable(b, false))
+			break;
+		lba--;
+	}
+
+	for (; cnt < CONFIG_BLOCK_DEV_FLUSH_MERGE; lba++) {
+		b = (lba == buf->lba) ? buf : ext4_bcache_lookup(bdev->bc, lba);
+		if (!b || (b != buf && !ext4_block_buf_flushable(b, false)))
+			break;
+		run[cnt++] = b;
+	}
+
+	return ext4_block_flush_run(bdev, run, cnt);
 }
 
 int ext4_block_flush_lba(struct ext4_blockdev *bdev, uint64_t lba)
@@ -183,6 +606,10 @@ int ext4_block_flush_lba(struct ext4_blockdev *bdev, uint64_t lba)
 	return r;
 }
 
+static bool ext4_block_elv_on(struct ext4_blockdev *bdev);
+static int ext4_block_cache_flush_sorted(struct ext4_blockdev *bdev,
+					 uint32_t age_ms, uint32_t max);
+
 int ext4_block_cache_shake(struct ext4_blockdev *bdev)
 {
 	int r = EOK;
@@ -192,26 +619,36 @@ int ext4_block_cache_shake(struct ext4_blockdev *bdev)
 
 	bdev->bc->dont_shake = true;
 
-	while (!RB_EMPTY(&bdev->bc->lru_root) &&
-		ext4_bcache_is_full(bdev->bc)) {
+	while (ext4_bcache_is_full(bdev->bc)) {
 
 		buf = ext4_buf_lowest_lru(bdev->bc);
-		ext4_assert(buf);
+		if (!buf)
+			break;
+
 		if (ext4_bcache_test_flag(buf, BC_DIRTY)) {
-			r = ext4_block_flush_buf(bdev, buf);
+			/* With a scheduler the oldest dirty buffers go in one
+			 * sorted batch, next evictions find them clean. */
+			if (ext4_block_elv_on(bdev))
+				r = ext4_block_cache_flush_sorted(bdev, 0,
+						CONFIG_BLOCK_DEV_ELV_DEPTH);
+			if (r == EOK && ext4_bcache_test_flag(buf, BC_DIRTY))
+				r = ext4_block_flush_cluster(bdev, buf);
 			if (r != EOK)
 				break;
 
+			bdev->bc->dirty_evict_ctr++;
 		}
 
+		bdev->bc->evict_ctr++;
+		bdev->bc->cls_stats[buf->cls].evictions++;
 		ext4_bcache_drop_buf(bdev->bc, buf);
 	}
 	bdev->bc->dont_shake = false;
 	return r;
 }
 
-int ext4_block_get_noread(struct ext4_blockdev *bdev, struct ext4_block *b,
-			  uint64_t lba)
+int ext4_block_get_noread_cls(struct ext4_blockdev *bdev,
+			      struct ext4_block *b, uint64_t lba, uint8_t cls)
 {
 	bool is_new;
 	int r;
@@ -231,7 +668,7 @@ int ext4_block_get_noread(struct ext4_blockdev *bdev, struct ext4_block *b,
 	if (r != EOK)
 		return r;
 
-	r = ext4_bcache_alloc(bdev->bc, b, &is_new);
+	r = ext4_bcache_alloc_cls(bdev->bc, b, cls, &is_new);
 	if (r != EOK)
 		return r;
 
@@ -241,19 +678,171 @@ int ext4_block_get_noread(struct ext4_blockdev *bdev, struct ext4_block *b,
 	return EOK;
 }
 
-int ext4_block_get(struct ext4_blockdev *bdev, struct ext4_block *b,
-		   uint64_t lba)
+int ext4_block_get_noread(struct ext4_blockdev *bdev, struct ext4_block *b,
+			  uint64_t lba)
 {
-	int r = ext4_block_get_noread(bdev, b, lba);
+	return ext4_block_get_noread_cls(bdev, b, lba, EXT4_BCACHE_CLS_OTHER);
+}
+
+#if CONFIG_BLOCK_DEV_READAHEAD
+#if CONFIG_BLOCK_DEV_READAHEAD > CONFIG_BLOCK_DEV_FLUSH_MERGE
+#error CONFIG_BLOCK_DEV_READAHEAD exceeds CONFIG_BLOCK_DEV_FLUSH_MERGE
+#endif
+
+/**@brief   Sequential requests of a context needed to start readahead.*/
+#define EXT4_BLOCK_RA_TRIGGER 2
+
+/**@brief   First readahead window of a stream (blocks).*/
+#define EXT4_BLOCK_RA_MIN 4
+
+/**@brief   Track the request stream of a context and size the read
+ *          of a missed block.
+ * @return  blocks to read (1 - no readahead)*/
+static uint32_t ext4_block_ra_window(struct ext4_blockdev *bdev, uint8_t cls,
+				     uint64_t lba, bool miss)
+{
+	struct ext4_block_ra *ra = &bdev->ra[cls];
+
+	/* Re-requesting the last block keeps the stream. */
+	if (lba == ra->next) {
+		if (ra->seq < UINT32_MAX)
+			ra->seq++;
+	} else if (lba + 1 != ra->next) {
+		ra->seq = 0;
+		ra->win = 0;
+	}
+	ra->next = lba + 1;
+
+	if (!miss || ra->seq < EXT4_BLOCK_RA_TRIGGER)
+		return 1;
+
+	/* Every miss of a stream doubles the window. */
+	ra->win = ra->win ? ra->win * 2 : EXT4_BLOCK_RA_MIN;
+	if (ra->win > CONFIG_BLOCK_DEV_READAHEAD)
+		ra->win = CONFIG_BLOCK_DEV_READAHEAD;
+
+	return ra->win;
+}
+
+/**@brief   Read a missed block together with the following, not cached
+ *          blocks: a single multi-block read fills up to win buffers.
+ *          Extra buffers are tagged BC_RA and left in the cache. They
+ *          only take free cache slots: readahead never evicts or writes
+ *          back (end_write callbacks would run under the caller).*/
+static int ext4_block_readahead(struct ext4_blockdev *bdev,
+				struct ext4_block *b, uint8_t cls,
+				uint32_t win)
+{
+	struct ext4_blockdev_iovec *iov;
+	struct ext4_block *blks = NULL;
+	uint8_t *gather = NULL;
+	bool vec = bdev->bdif->breadv != NULL;
+	uint64_t lba = b->lb_id;
+	uint32_t i, n;
+	int r = EOK;
+
+	/* Stay within the device and a quarter of the cache. */
+	if (win > bdev->lg_bcnt - lba)
+		win = bdev->lg_bcnt - lba;
+	if (win > bdev->bc->cnt / 4)
+		win = bdev->bc->cnt / 4;
+
+	if (win > 1) {
+		if (!vec)
+			gather = ext4_bcache_gather_buf(bdev->bc);
+		if (vec || gather)
+			blks = ext4_malloc(win * (sizeof(struct ext4_block) +
+					   sizeof(struct ext4_blockdev_iovec)));
+	}
+	if (!blks)
+		return ext4_blocks_get_direct(bdev, b->data, lba, 1);
+
+	iov = (struct ext4_blockdev_iovec *)(blks + win);
+
+	/* Get the buffers first. The window ends at a full cache or at
+	 * the first block already cached or being set up by someone
+	 * else. */
+	blks[0] = *b;
+	for (n = 1; n < win; n++) {
+		bool is_new;
+
+		if (ext4_bcache_is_full(bdev->bc))
+			break;
+
+		blks[n].lb_id = lba + n;
+		if (ext4_bcache_alloc_ra(bdev->bc, &blks[n], cls,
+					 &is_new) != EOK)
+			break;
+
+		if (ext4_bcache_test_flag(blks[n].buf, BC_UPTODATE) ||
+		    blks[n].buf->refctr > 1) {
+			ext4_block_set(bdev, &blks[n]);
+			break;
+		}
+	}
+
+	if (vec) {
+		for (i = 0; i < n; i++) {
+			iov[i].blk_id = lba + i;
+			iov[i].blk_cnt = 1;
+			iov[i].buf = blks[i].data;
+		}
+		r = ext4_blocks_get_direct_v(bdev, iov, n);
+	} else {
+		r = ext4_blocks_get_direct(bdev, gather, lba, n);
+		if (r == EOK)
+			memcpy(b->data, gather, bdev->lg_bsize);
+	}
+
+	/* Not up-to-date buffers get dropped on failure. */
+	for (i = 1; i < n; i++) {
+		if (r == EOK) {
+			if (!vec)
+				memcpy(blks[i].data,
+				       gather + i * bdev->lg_bsize,
+				       bdev->lg_bsize);
+			ext4_bcache_set_flag(blks[i].buf, BC_UPTODATE);
+			ext4_bcache_set_flag(blks[i].buf, BC_RA);
+			bdev->bc->ra_ctr++;
+		}
+		ext4_block_set(bdev, &blks[i]);
+	}
+
+	ext4_free(blks);
+	return r;
+}
+#endif
+
+int ext4_block_get_cls(struct ext4_blockdev *bdev, struct ext4_block *b,
+		       uint64_t lba, uint8_t cls)
+{
+#if CONFIG_BLOCK_DEV_READAHEAD
+	uint32_t win;
+#endif
+	int r = ext4_block_get_noread_cls(bdev, b, lba, cls);
 	if (r != EOK)
 		return r;
 
+#if CONFIG_BLOCK_DEV_READAHEAD
+	/* Class of the request tells the context of the stream. Journal
+	 * blocks are read during checkpoint and recovery, their buffers
+	 * are dropped (BC_TMP) right after use. */
+	win = 1;
+	if (cls != EXT4_BCACHE_CLS_JOURNAL)
+		win = ext4_block_ra_window(bdev, cls, lba,
+				!ext4_bcache_test_flag(b->buf, BC_UPTODATE));
+#endif
 	if (ext4_bcache_test_flag(b->buf, BC_UPTODATE)) {
 		/* Data in the cache is up-to-date.
 		 * Reading from physical device is not required */
 		return EOK;
 	}
 
+#if CONFIG_BLOCK_DEV_READAHEAD
+	if (win > 1)
+		r = ext4_block_readahead(bdev, b, cls, win);
+	else
+#endif
 	r = ext4_blocks_get_direct(bdev, b->data, lba, 1);
 	if (r != EOK) {
 		ext4_bcache_free(bdev->bc, b);
@@ -267,6 +856,12 @@ int ext4_block_get(struct ext4_blockdev *bdev, struct ext4_block *b,
 	return EOK;
 }
 
+int ext4_block_get(struct ext4_blockdev *bdev, struct ext4_block *b,
+		   uint64_t lba)
+{
+	return ext4_block_get_cls(bdev, b, lba, EXT4_BCACHE_CLS_OTHER);
+}
+
 int ext4_block_set(struct ext4_blockdev *bdev, struct ext4_block *b)
 {
 	ext4_assert(bdev && b);
@@ -306,12 +901,571 @@ int ext4_blocks_set_direct(struct ext4_blockdev *bdev, const void *buf,
 	return ext4_bdif_bwrite(bdev, buf, pba, pb_cnt * cnt);
 }
 
+/**@brief   Convert segments given in logical blocks to physical blocks.*/
+static void ext4_blocks_iov_to_pba(struct ext4_blockdev *bdev,
+				   struct ext4_blockdev_iovec *iov,
+				   uint32_t cnt)
+{
+	uint32_t pb_cnt = bdev->lg_bsize / bdev->bdif->ph_bsize;
+
+	for (uint32_t i = 0; i < cnt; i++) {
+		iov[i].blk_id = (iov[i].blk_id * bdev->lg_bsize +
+				 bdev->part_offset) / bdev->bdif->ph_bsize;
+		iov[i].blk_cnt *= pb_cnt;
+	}
+}
+
+int ext4_blocks_get_direct_v(struct ext4_blockdev *bdev,
+			     struct ext4_blockdev_iovec *iov, uint32_t cnt)
+{
+	ext4_assert(bdev && iov);
+
+	ext4_blocks_iov_to_pba(bdev, iov, cnt);
+	return ext4_bdif_breadv(bdev, iov, cnt);
+}
+
+int ext4_blocks_set_direct_v(struct ext4_blockdev *bdev,
+			     struct ext4_blockdev_iovec *iov, uint32_t cnt)
+{
+	ext4_assert(bdev && iov);
+
+	ext4_blocks_iov_to_pba(bdev, iov, cnt);
+	return ext4_bdif_bwritev(bdev, iov, cnt);
+}
+
+/**@brief   Request scheduler set up on the device.*/
+static bool ext4_block_elv_on(struct ext4_blockdev *bdev)
+{
+#if CONFIG_BLOCK_DEV_ELV_DEPTH
+	return bdev->elv != NULL;
+#else
+	(void)bdev;
+	return false;
+#endif
+}
+
+/**@brief   Issue a request (physical blocks) to the device.*/
+static int ext4_blocks_issue(struct ext4_blockdev *bdev,
+			     struct ext4_blockdev_req *req)
+{
+	uint64_t t;
+	int r;
+
+	if (!bdev->bdif->submit) {
+		if (req->write)
+			req->res = ext4_bdif_bwritev(bdev, req->iov,
+						     req->iov_cnt);
+		else
+			req->res = ext4_bdif_breadv(bdev, req->iov,
+						    req->iov_cnt);
+		req->complete(req);
+		return EOK;
+	}
+
+	while (bdev->bdif->queue_depth &&
+	       bdev->bdif->inflight >= bdev->bdif->queue_depth) {
+		r = ext4_blocks_reap(bdev, true);
+		if (r != EOK)
+			return r;
+	}
+
+	ext4_bdif_lock(bdev);
+	t = ext4_bdif_io_start(bdev, req->write, req->iov, req->iov_cnt);
+#if CONFIG_BLOCK_DEV_ENABLE_STATS
+	req->stamp = t;
+#endif
+	r = bdev->bdif->submit(bdev, req);
+	if (r == EOK) {
+		bdev->bdif->inflight++;
+		if (req->write)
+			bdev->bdif->bwrite_ctr++;
+		else
+			ext4_bdif_count_read(bdev);
+	} else {
+		ext4_bdif_io_end(bdev, req->write, t, r);
+	}
+	ext4_bdif_unlock(bdev);
+	return r;
+}
+
+#if CONFIG_BLOCK_DEV_ELV_DEPTH
+/**@brief   Dispatch rounds a request may wait (deadline policy).*/
+#define EXT4_ELV_EXPIRE 4
+
+/**@brief   Segments of a single dispatched request.*/
+#define EXT4_ELV_IOV_MAX (2 * CONFIG_BLOCK_DEV_FLUSH_MERGE)
+
+/**@brief   Queued request.*/
+struct ext4_elv_ent {
+	struct ext4_blockdev_req *req;
+
+	/**@brief   Copy of request segments (physical blocks)*/
+	struct ext4_blockdev_iovec *iov;
+
+	/**@brief   First block of the request*/
+	uint64_t pba;
+
+	/**@brief   Block after the last one of the request*/
+	uint64_t end;
+
+	/**@brief   Dispatch round the request got queued in*/
+	uint32_t round;
+};
+
+/**@brief   Request scheduler state.*/
+struct ext4_blockdev_elv {
+	uint8_t policy;
+
+	/**@brief   Queued requests, in submit order*/
+	struct ext4_elv_ent ent[CONFIG_BLOCK_DEV_ELV_DEPTH];
+	uint32_t cnt;
+
+	/**@brief   Dispatch round counter*/
+	uint32_t round;
+
+	/**@brief   End of the last dispatched request (sweep position)*/
+	uint64_t head;
+
+	struct ext4_blockdev_elv_stats stats;
+};
+
+/**@brief   Requests merged into a single device request.*/
+struct ext4_elv_batch {
+	struct ext4_blockdev_req req;
+	uint32_t cnt;
+	struct ext4_elv_ent ent[CONFIG_BLOCK_DEV_ELV_DEPTH];
+	struct ext4_blockdev_iovec iov[EXT4_ELV_IOV_MAX];
+};
+
+/**@brief   Completion of a merged request: complete all parts.*/
+static void ext4_elv_batch_end(struct ext4_blockdev_req *req)
+{
+	struct ext4_elv_batch *batch = req->arg;
+	uint32_t i;
+
+	for (i = 0; i < batch->cnt; i++) {
+		struct ext4_blockdev_req *part = batch->ent[i].req;
+		ext4_free(batch->ent[i].iov);
+		part->res = req->res;
+		part->complete(part);
+	}
+
+	ext4_free(batch);
+}
+
+/**@brief   Queued request overlapping an older one (not both reads):
+ *          it has to wait, dispatching it first would reorder data.*/
+static bool ext4_elv_blocked(struct ext4_blockdev_elv *elv, uint32_t i)
+{
+	struct ext4_elv_ent *e = &elv->ent[i];
+	uint32_t j;
+
+	for (j = 0; j < i; j++) {
+		struct ext4_elv_ent *o = &elv->ent[j];
+		if ((o->req->write || e->req->write) &&
+		    o->pba < e->end && e->pba < o->end)
+			return true;
+	}
+
+	return false;
+}
+
+/**@brief   Pick the queued request to dispatch next.*/
+static uint32_t ext4_elv_pick(struct ext4_blockdev_elv *elv)
+{
+	uint32_t i, best = elv->cnt, first = elv->cnt;
+	bool write = true;
+
+	if (elv->policy == EXT4_ELV_NOOP)
+		return 0;
+
+	/* The oldest request goes first once its deadline expired. */
+	if (elv->round - elv->ent[0].round >= EXT4_ELV_EXPIRE) {
+		elv->stats.expired++;
+		return 0;
+	}
+
+	/* Reads first: someone is likely waiting for them. The oldest
+	 * request is never blocked, so there is always a candidate. */
+	for (i = 0; i < elv->cnt; i++)
+		if (!elv->ent[i].req->write && !ext4_elv_blocked(elv, i))
+			write = false;
+
+	/* Lowest LBA ahead of the head, the lowest one behind on wrap. */
+	for (i = 0; i < elv->cnt; i++) {
+		struct ext4_elv_ent *e = &elv->ent[i];
+		if (e->req->write != write || ext4_elv_blocked(elv, i))
+			continue;
+
+		if (first == elv->cnt || e->pba < elv->ent[first].pba)
+			first = i;
+		if (e->pba >= elv->head &&
+		    (best == elv->cnt || e->pba < elv->ent[best].pba))
+			best = i;
+	}
+
+	return best != elv->cnt ? best : first;
+}
+
+/**@brief   Queued request continuing the batch (elv->cnt - none).*/
+static uint32_t ext4_elv_next(struct ext4_blockdev_elv *elv,
+			      struct ext4_elv_batch *batch, uint32_t at,
+			      uint32_t iov_cnt)
+{
+	struct ext4_elv_ent *last = &batch->ent[batch->cnt - 1];
+	uint32_t i;
+
+	for (i = 0; i < elv->cnt; i++) {
+		struct ext4_elv_ent *e = &elv->ent[i];
+
+		/* Noop merges the next request in submit order only. */
+		if (elv->policy == EXT4_ELV_NOOP && i != at)
+			continue;
+
+		if (e->req->write == last->req->write &&
+		    e->pba == last->end &&
+		    iov_cnt + e->req->iov_cnt <= EXT4_ELV_IOV_MAX &&
+		    !ext4_elv_blocked(elv, i))
+			return i;
+	}
+
+	return elv->cnt;
+}
+
+/**@brief   Move a queued request to the batch.*/
+static uint32_t ext4_elv_take(struct ext4_blockdev_elv *elv,
+			      struct ext4_elv_batch *batch, uint32_t i,
+			      uint32_t iov_cnt)
+{
+	struct ext4_elv_ent *e = &elv->ent[i];
+
+	memcpy(batch->iov + iov_cnt, e->iov,
+	       e->req->iov_cnt * sizeof(struct ext4_blockdev_iovec));
+	batch->ent[batch->cnt++] = *e;
+
+	elv->cnt--;
+	memmove(e, e + 1, (elv->cnt - i) * sizeof(struct ext4_elv_ent));
+	return iov_cnt + batch->ent[batch->cnt - 1].req->iov_cnt;
+}
+
+/**@brief   Dispatch queued requests until at most keep are left.*/
+static int ext4_elv_dispatch(struct ext4_blockdev *bdev, uint32_t keep)
+{
+	struct ext4_blockdev_elv *elv = bdev->elv;
+	int r = EOK;
+
+	while (elv->cnt > keep && r == EOK) {
+		struct ext4_elv_batch *batch;
+		uint32_t i, iov_cnt;
+
+		batch = ext4_malloc(sizeof(struct ext4_elv_batch));
+		if (!batch)
+			return ENOMEM;
+
+		/* Entries leave the queue before completions run: they
+		 * may queue new requests. */
+		batch->cnt = 0;
+		i = ext4_elv_pick(elv);
+		iov_cnt = ext4_elv_take(elv, batch, i, 0);
+		while ((i = ext4_elv_next(elv, batch, i, iov_cnt)) != elv->cnt)
+			iov_cnt = ext4_elv_take(elv, batch, i, iov_cnt);
+
+		elv->head = batch->ent[batch->cnt - 1].end;
+		elv->round++;
+		elv->stats.dispatched++;
+		elv->stats.merged += batch->cnt - 1;
+
+		batch->req.bdev = bdev;
+		batch->req.write = batch->ent[0].req->write;
+		batch->req.iov = batch->iov;
+		batch->req.iov_cnt = iov_cnt;
+		batch->req.pending = 0;
+		batch->req.complete = ext4_elv_batch_end;
+		batch->req.arg = batch;
+
+		r = ext4_blocks_issue(bdev, &batch->req);
+		if (r != EOK) {
+			batch->req.res = r;
+			ext4_elv_batch_end(&batch->req);
+		}
+	}
+	return r;
+}
+
+/**@brief   Queue a request (physical blocks) in the scheduler.*/
+static int ext4_elv_queue(struct ext4_blockdev *bdev,
+			  struct ext4_blockdev_req *req)
+{
+	struct ext4_blockdev_elv *elv = bdev->elv;
+	struct ext4_elv_ent *e;
+	struct ext4_blockdev_iovec *iov;
+	int r;
+
+	if (!req->iov_cnt || req->iov_cnt > EXT4_ELV_IOV_MAX)
+		return ext4_blocks_issue(bdev, req);
+
+	/* Full queue: dispatch a batch, deadline keeps half of the
+	 * queue to sort new requests with. */
+	if (elv->cnt == CONFIG_BLOCK_DEV_ELV_DEPTH) {
+		r = ext4_elv_dispatch(bdev, elv->policy == EXT4_ELV_DEADLINE ?
+					    CONFIG_BLOCK_DEV_ELV_DEPTH / 2 : 0);
+		if (r != EOK)
+			return r;
+	}
+
+	/* The caller may reuse the segments array on return. */
+	iov = ext4_malloc(req->iov_cnt * sizeof(struct ext4_blockdev_iovec));
+	if (!iov)
+		return ext4_blocks_issue(bdev, req);
+
+	memcpy(iov, req->iov, req->iov_cnt * sizeof(struct ext4_blockdev_iovec));
+	e = &elv->ent[elv->cnt++];
+	e->req = req;
+	e->iov = iov;
+	e->pba = iov[0].blk_id;
+	e->end = iov[req->iov_cnt - 1].blk_id + iov[req->iov_cnt - 1].blk_cnt;
+	e->round = elv->round;
+
+	elv->stats.queued++;
+	if (elv->stats.max_depth < elv->cnt)
+		elv->stats.max_depth = elv->cnt;
+	return EOK;
+}
+#endif
+
+int ext4_blocks_submit_v(struct ext4_blockdev *bdev,
+			 struct ext4_blockdev_req *req)
+{
+	ext4_assert(bdev && req && req->complete);
+
+	ext4_blocks_iov_to_pba(bdev, req->iov, req->iov_cnt);
+	req->bdev = bdev;
+	req->pending = 0;
+
+#if CONFIG_BLOCK_DEV_ELV_DEPTH
+	if (bdev->elv)
+		return ext4_elv_queue(bdev, req);
+#endif
+	return ext4_blocks_issue(bdev, req);
+}
+
+bool ext4_blocks_deferred(struct ext4_blockdev *bdev)
+{
+#if CONFIG_BLOCK_DEV_ELV_DEPTH
+	if (bdev->elv)
+		return true;
+#endif
+	return bdev->bdif->submit != NULL;
+}
+
+int ext4_block_elv_set(struct ext4_blockdev *bdev, uint8_t policy)
+{
+	ext4_assert(bdev);
+	if (policy > EXT4_ELV_DEADLINE)
+		return EINVAL;
+
+#if CONFIG_BLOCK_DEV_ELV_DEPTH
+	if (bdev->elv) {
+		int r = ext4_blocks_drain(bdev);
+		if (r != EOK)
+			return r;
+	}
+
+	if (policy == EXT4_ELV_NONE) {
+		ext4_free(bdev->elv);
+		bdev->elv = NULL;
+		return EOK;
+	}
+
+	if (!bdev->elv) {
+		bdev->elv = ext4_calloc(1, sizeof(struct ext4_blockdev_elv));
+		if (!bdev->elv)
+			return ENOMEM;
+	}
+
+	bdev->elv->policy = policy;
+	return EOK;
+#else
+	return policy == EXT4_ELV_NONE ? EOK : ENOTSUP;
+#endif
+}
+
+int ext4_block_elv_get_stats(struct ext4_blockdev *bdev,
+			     struct ext4_blockdev_elv_stats *stats)
+{
+	ext4_assert(bdev && stats);
+#if CONFIG_BLOCK_DEV_ELV_DEPTH
+	if (bdev->elv) {
+		*stats = bdev->elv->stats;
+		stats->depth = bdev->elv->cnt;
+		return EOK;
+	}
+#endif
+	return ENOENT;
+}
+
+int ext4_block_io_stats_enable(struct ext4_blockdev *bdev, bool on,
+			       uint64_t (*time_us)(void))
+{
+	ext4_assert(bdev);
+#if CONFIG_BLOCK_DEV_ENABLE_STATS
+	struct ext4_blockdev_iostat *ios = bdev->iostat;
+
+	if (!on) {
+		ext4_bdif_lock(bdev);
+		bdev->iostat = NULL;
+		ext4_bdif_unlock(bdev);
+		ext4_free(ios);
+		return EOK;
+	}
+
+	if (!ios) {
+		ios = ext4_calloc(1, sizeof(struct ext4_blockdev_iostat));
+		if (!ios)
+			return ENOMEM;
+	}
+
+	ext4_bdif_lock(bdev);
+	memset(&ios->st, 0, sizeof(ios->st));
+	ios->time_us = time_us;
+	bdev->iostat = ios;
+	ext4_bdif_unlock(bdev);
+	return EOK;
+#else
+	(void)time_us;
+	return on ? ENOTSUP : EOK;
+#endif
+}
+
+int ext4_block_io_stats_get(struct ext4_blockdev *bdev,
+			    struct ext4_blockdev_io_stats *stats)
+{
+	ext4_assert(bdev && stats);
+#if CONFIG_BLOCK_DEV_ENABLE_STATS
+	if (bdev->iostat) {
+		ext4_bdif_lock(bdev);
+		*stats = bdev->iostat->st;
+		ext4_bdif_unlock(bdev);
+		return EOK;
+	}
+#endif
+	return ENOENT;
+}
+
+int ext4_block_io_stats_clear(struct ext4_blockdev *bdev)
+{
+	ext4_assert(bdev);
+#if CONFIG_BLOCK_DEV_ENABLE_STATS
+	if (bdev->iostat) {
+		ext4_bdif_lock(bdev);
+		memset(&bdev->iostat->st, 0, sizeof(bdev->iostat->st));
+		ext4_bdif_unlock(bdev);
+		return EOK;
+	}
+#endif
+	return ENOENT;
+}
+
+int ext4_blocks_reap(struct ext4_blockdev *bdev, bool wait)
+{
+	struct ext4_blockdev_req *done[EXT4_BLOCKDEV_REAP_BATCH];
+	uint32_t i, cnt = 0;
+	int r;
+
+	ext4_assert(bdev);
+#if CONFIG_BLOCK_DEV_ELV_DEPTH
+	/* Someone waits: nothing more to merge with. */
+	if (bdev->elv && bdev->elv->cnt) {
+		r = ext4_elv_dispatch(bdev, 0);
+		if (r != EOK)
+			return r;
+	}
+#endif
+	if (!bdev->bdif->submit || !bdev->bdif->inflight)
+		return EOK;
+
+	ext4_bdif_lock(bdev);
+	r = bdev->bdif->reap(bdev, done, EXT4_BLOCKDEV_REAP_BATCH,
+			     wait ? 1 : 0, &cnt);
+	bdev->bdif->inflight -= cnt;
+#if CONFIG_BLOCK_DEV_ENABLE_STATS
+	for (i = 0; i < cnt; i++)
+		ext4_bdif_io_end(done[i]->bdev, done[i]->write, done[i]->stamp,
+				 done[i]->res);
+#endif
+	ext4_bdif_unlock(bdev);
+
+	/* Callbacks may submit new requests. */
+	for (i = 0; i < cnt; i++)
+		done[i]->complete(done[i]);
+
+	return r;
+}
+
+int ext4_blocks_drain(struct ext4_blockdev *bdev)
+{
+	int r;
+	ext4_assert(bdev);
+
+	for (;;) {
+		bool queued = bdev->bdif->submit && bdev->bdif->inflight;
+#if CONFIG_BLOCK_DEV_ELV_DEPTH
+		queued |= bdev->elv && bdev->elv->cnt;
+#endif
+		if (!queued)
+			return EOK;
+
+		r = ext4_blocks_reap(bdev, true);
+		if (r != EOK)
+			return r;
+	}
+}
+
+int ext4_block_discard(struct ext4_blockdev *bdev, uint64_t lba, uint64_t cnt)
+{
+	uint64_t pba;
+	uint32_t pb_cnt;
+	int r;
+
+	ext4_assert(bdev);
+	if (!bdev->bdif->discard)
+		return ENOTSUP;
+
+	if (!cnt)
+		return EOK;
+
+	pba = (lba * bdev->lg_bsize + bdev->part_offset) / bdev->bdif->ph_bsize;
+	pb_cnt = bdev->lg_bsize / bdev->bdif->ph_bsize;
+
+	ext4_bdif_lock(bdev);
+	r = bdev->bdif->discard(bdev, pba, cnt * pb_cnt);
+	ext4_bdif_unlock(bdev);
+	return r;
+}
+
+int ext4_block_barrier(struct ext4_blockdev *bdev)
+{
+	int r;
+
+	ext4_assert(bdev);
+	if (!bdev->bdif->flush)
+		return EOK;
+
+	ext4_bdif_lock(bdev);
+	r = bdev->bdif->flush(bdev);
+	if (r == EOK)
+		bdev->bdif->flush_ctr++;
+	ext4_bdif_unlock(bdev);
+	return r;
+}
+
 int ext4_block_writebytes(struct ext4_blockdev *bdev, uint64_t off,
 			  const void *buf, uint32_t len)
 {
 	uint64_t block_idx;
 	uint32_t blen;
 	uint32_t unalg;
+	uint8_t *bounce = NULL;
 	int r = EOK;
 
 	const uint8_t *p = (void *)buf;
@@ -324,6 +1478,14 @@ int ext4_block_writebytes(struct ext4_blockdev *bdev, uint64_t off,
 	if (off + len > bdev->part_size)
 		return EINVAL; /*Ups. Out of range operation*/
 
+	/*Partial blocks go through a private buffer: callers on other
+	 * partitions may run concurrently.*/
+	if ((off | len) & (bdev->bdif->ph_bsize - 1)) {
+		bounce = ext4_malloc(bdev->bdif->ph_bsize);
+		if (!bounce)
+			return ENOMEM;
+	}
+
 	block_idx = ((off + bdev->part_offset) / bdev->bdif->ph_bsize);
 
 	/*OK lets deal with the first possible unaligned block*/
@@ -334,14 +1496,14 @@ int ext4_block_writebytes(struct ext4_blockdev *bdev, uint64_t off,
 				    ? len
 				    : (bdev->bdif->ph_bsize - unalg);
 
-		r = ext4_bdif_bread(bdev, bdev->bdif->ph_bbuf, block_idx, 1);
+		r = ext4_bdif_bread(bdev, bounce, block_idx, 1);
 		if (r != EOK)
-			return r;
+			goto Finish;
 
-		memcpy(bdev->bdif->ph_bbuf + unalg, p, wlen);
-		r = ext4_bdif_bwrite(bdev, bdev->bdif->ph_bbuf, block_idx, 1);
+		memcpy(bounce + unalg, p, wlen);
+		r = ext4_bdif_bwrite(bdev, bounce, block_idx, 1);
 		if (r != EOK)
-			return r;
+			goto Finish;
 
 		p += wlen;
 		len -= wlen;
@@ -353,7 +1515,7 @@ int ext4_block_writebytes(struct ext4_blockdev *bdev, uint64_t off,
 	if (blen != 0) {
 		r = ext4_bdif_bwrite(bdev, p, block_idx, blen);
 		if (r != EOK)
-			return r;
+			goto Finish;
 
 		p += bdev->bdif->ph_bsize * blen;
 		len -= bdev->bdif->ph_bsize * blen;
@@ -363,16 +1525,16 @@ int ext4_block_writebytes(struct ext4_blockdev *bdev, uint64_t off,
 
 	/*Rest of the data*/
 	if (len) {
-		r = ext4_bdif_bread(bdev, bdev->bdif->ph_bbuf, block_idx, 1);
+		r = ext4_bdif_bread(bdev, bounce, block_idx, 1);
 		if (r != EOK)
-			return r;
+			goto Finish;
 
-		memcpy(bdev->bdif->ph_bbuf, p, len);
-		r = ext4_bdif_bwrite(bdev, bdev->bdif->ph_bbuf, block_idx, 1);
-		if (r != EOK)
-			return r;
+		memcpy(bounce, p, len);
+		r = ext4_bdif_bwrite(bdev, bounce, block_idx, 1);
 	}
 
+Finish:
+	ext4_free(bounce);
 	return r;
 }
 
@@ -382,6 +1544,7 @@ int ext4_block_readbytes(struct ext4_blockdev *bdev, uint64_t off, void *buf,
 	uint64_t block_idx;
 	uint32_t blen;
 	uint32_t unalg;
+	uint8_t *bounce = NULL;
 	int r = EOK;
 
 	uint8_t *p = (void *)buf;
@@ -394,6 +1557,14 @@ int ext4_block_readbytes(struct ext4_blockdev *bdev, uint64_t off, void *buf,
 	if (off + len > bdev->part_size)
 		return EINVAL; /*Ups. Out of range operation*/
 
+	/*Partial blocks go through a private buffer: callers on other
+	 * partitions may run concurrently.*/
+	if ((off | len) & (bdev->bdif->ph_bsize - 1)) {
+		bounce = ext4_malloc(bdev->bdif->ph_bsize);
+		if (!bounce)
+			return ENOMEM;
+	}
+
 	block_idx = ((off + bdev->part_offset) / bdev->bdif->ph_bsize);
 
 	/*OK lets deal with the first possible unaligned block*/
@@ -404,11 +1575,11 @@ int ext4_block_readbytes(struct ext4_blockdev *bdev, uint64_t off, void *buf,
 				    ? len
 				    : (bdev->bdif->ph_bsize - unalg);
 
-		r = ext4_bdif_bread(bdev, bdev->bdif->ph_bbuf, block_idx, 1);
+		r = ext4_bdif_bread(bdev, bounce, block_idx, 1);
 		if (r != EOK)
-			return r;
+			goto Finish;
 
-		memcpy(p, bdev->bdif->ph_bbuf + unalg, rlen);
+		memcpy(p, bounce + unalg, rlen);
 
 		p += rlen;
 		len -= rlen;
@@ -421,7 +1592,7 @@ int ext4_block_readbytes(struct ext4_blockdev *bdev, uint64_t off, void *buf,
 	if (blen != 0) {
 		r = ext4_bdif_bread(bdev, p, block_idx, blen);
 		if (r != EOK)
-			return r;
+			goto Finish;
 
 		p += bdev->bdif->ph_bsize * blen;
 		len -= bdev->bdif->ph_bsize * blen;
@@ -431,30 +1602,347 @@ int ext4_block_readbytes(struct ext4_blockdev *bdev, uint64_t off, void *buf,
 
 	/*Rest of the data*/
 	if (len) {
-		r = ext4_bdif_bread(bdev, bdev->bdif->ph_bbuf, block_idx, 1);
+		r = ext4_bdif_bread(bdev, bounce, block_idx, 1);
 		if (r != EOK)
-			return r;
+			goto Finish;
 
-		memcpy(p, bdev->bdif->ph_bbuf, len);
+		memcpy(p, bounce, len);
 	}
 
+Finish:
+	ext4_free(bounce);
+	return r;
+}
+
+static int ext4_buf_lba_cmp(const void *a, const void *b)
+{
+	const struct ext4_buf *ba = *(struct ext4_buf * const *)a;
+	const struct ext4_buf *bb = *(struct ext4_buf * const *)b;
+
+	if (ba->lba > bb->lba)
+		return 1;
+	else if (ba->lba < bb->lba)
+		return -1;
+	return 0;
+}
+
+/**@brief   Buffer has been dirty for at least age_ms.*/
+static bool ext4_block_buf_expired(struct ext4_buf *buf, uint32_t now,
+				   uint32_t age_ms)
+{
+	return !age_ms || (buf->dirty_time && now - buf->dirty_time >= age_ms);
+}
+
+/**@brief   Write back buffers from the dirty list, sorted by LBA and
+ *          merged into runs of adjacent blocks.
+ * @param   bdev block device descriptor
+ * @param   age_ms only buffers dirty for at least age_ms (0 - all)
+ * @param   max oldest max buffers only, without end_write() callback
+ *              (cache eviction batch, 0 - no limit)
+ * @return  standard error code*/
+static int ext4_block_cache_flush_sorted(struct ext4_blockdev *bdev,
+					 uint32_t age_ms, uint32_t max)
+{
+	struct ext4_bcache *bc = bdev->bc;
+	struct ext4_buf **bufs, *buf;
+	uint32_t now = age_ms ? bc->wb.time_ms() : 0;
+	uint32_t cnt = 0, i, j;
+	bool async = ext4_blocks_deferred(bdev);
+	/* A scheduler merges and orders contiguous runs itself. */
+	bool scatter = (bdev->bdif->bwritev || async) &&
+		       !ext4_block_elv_on(bdev);
+	bool all = !max;
+	int r = EOK, err = EOK;
+
+	TAILQ_FOREACH(buf, &bc->dirty_list, dirty_node)
+		if (ext4_block_buf_expired(buf, now, age_ms) &&
+		    (all || !buf->end_write))
+			cnt++;
+
+	if (max && cnt > max)
+		cnt = max;
+
+	/* A single buffer is left to the caller in full flush mode. */
+	if (!cnt || (cnt < 2 && !age_ms))
+		return EOK;
+
+	bufs = ext4_malloc(cnt * sizeof(struct ext4_buf *));
+	if (!bufs)
+		return EOK;
+
+	i = 0;
+	TAILQ_FOREACH(buf, &bc->dirty_list, dirty_node)
+		if (i < cnt && ext4_block_buf_expired(buf, now, age_ms) &&
+		    (all || !buf->end_write))
+			bufs[i++] = buf;
+
+	qsort(bufs, cnt, sizeof(struct ext4_buf *), ext4_buf_lba_cmp);
+
+	for (i = 0; i < cnt; i = j) {
+		j = i + 1;
+		/* Skip buffers written back by end_write() callbacks. */
+		if (!ext4_block_buf_flushable(bufs[i], all))
+			continue;
+
+		/* Vectored writes take scattered buffers as well. */
+		while (j < cnt && j - i < CONFIG_BLOCK_DEV_FLUSH_MERGE &&
+		       (bufs[j]->lba == bufs[j - 1]->lba + 1 || scatter) &&
+		       ext4_block_buf_flushable(bufs[j], all))
+			j++;
+
+		if (async)
+			r = ext4_block_flush_run_async(bdev, bufs + i, j - i,
+						       &err);
+		else
+			r = ext4_block_flush_run(bdev, bufs + i, j - i);
+		if (r != EOK)
+			break;
+	}
+
+	/* Keep the device queue full, wait once at the end. */
+	if (async) {
+		int dr = ext4_blocks_drain(bdev);
+		if (r == EOK)
+			r = dr != EOK ? dr : err;
+	}
+
+	ext4_free(bufs);
 	return r;
 }
 
 int ext4_block_cache_flush(struct ext4_blockdev *bdev)
 {
-	while (!SLIST_EMPTY(&bdev->bc->dirty_list)) {
+	bool dirty = !TAILQ_EMPTY(&bdev->bc->dirty_list);
+	int r = ext4_block_cache_flush_sorted(bdev, 0, 0);
+	if (r != EOK)
+		return r;
+
+	/* Flush the rest one by one (callbacks could dirty more buffers). */
+	while (!TAILQ_EMPTY(&bdev->bc->dirty_list)) {
 		int r;
-		struct ext4_buf *buf = SLIST_FIRST(&bdev->bc->dirty_list);
+		struct ext4_buf *buf = TAILQ_FIRST(&bdev->bc->dirty_list);
 		ext4_assert(buf);
 		r = ext4_block_flush_buf(bdev, buf);
 		if (r != EOK)
 			return r;
 
 	}
+
+	/* Flushed cache content has to be durable on return. */
+	return dirty ? ext4_block_barrier(bdev) : EOK;
+}
+
+int ext4_block_cache_writeback(struct ext4_blockdev *bdev)
+{
+	struct ext4_bcache *bc = bdev->bc;
+	const struct ext4_bcache_wb *wb = &bc->wb;
+
+	if (!bdev->bdif->ph_refctr)
+		return EIO;
+
+	/* Too many dirty buffers: write back everything. */
+	if (wb->dirty_ratio &&
+	    (uint64_t)bc->dirty_cnt * 100 > (uint64_t)bc->cnt * wb->dirty_ratio)
+		return ext4_block_cache_flush(bdev);
+
+	if (wb->dirty_age_ms && wb->time_ms)
+		return ext4_block_cache_flush_sorted(bdev, wb->dirty_age_ms, 0);
+
 	return EOK;
 }
 
+static int ext4_lba_cmp(const void *a, const void *b)
+{
+	uint64_t la = *(const uint64_t *)a;
+	uint64_t lb = *(const uint64_t *)b;
+
+	if (la > lb)
+		return 1;
+	else if (la < lb)
+		return -1;
+	return 0;
+}
+
+/**@brief   Asynchronous read of cache buffers. Segments live with
+ *          the request until it completes.*/
+struct ext4_block_rreq {
+	struct ext4_blockdev_req req;
+	uint32_t cnt;
+	struct ext4_block blks[CONFIG_BLOCK_DEV_FLUSH_MERGE];
+	struct ext4_blockdev_iovec iov[CONFIG_BLOCK_DEV_FLUSH_MERGE];
+};
+
+/**@brief   Completion of an asynchronous cache buffers read.*/
+static void ext4_block_prefetch_end(struct ext4_blockdev_req *req)
+{
+	struct ext4_block_rreq *rreq = req->arg;
+	uint32_t i;
+
+	/* Not up-to-date buffers get dropped on failure. */
+	for (i = 0; i < rreq->cnt; i++) {
+		if (req->res == EOK)
+			ext4_bcache_set_flag(rreq->blks[i].buf, BC_UPTODATE);
+		ext4_block_set(req->bdev, &rreq->blks[i]);
+	}
+
+	ext4_free(rreq);
+}
+
+/**@brief   Submit read of cache buffers without waiting for it.
+ * @param   bdev block device descriptor
+ * @param   lba LBAs (up to CONFIG_BLOCK_DEV_FLUSH_MERGE)
+ * @param   cnt LBAs count
+ * @return  standard error code*/
+static int ext4_block_prefetch_async(struct ext4_blockdev *bdev,
+				     const uint64_t *lba, uint32_t cnt)
+{
+	struct ext4_block_rreq *rreq;
+	uint32_t i;
+	int r = EOK;
+
+	rreq = ext4_malloc(sizeof(struct ext4_block_rreq));
+	if (!rreq)
+		return ENOMEM;
+
+	rreq->cnt = 0;
+	for (i = 0; i < cnt; i++) {
+		struct ext4_block *b = &rreq->blks[rreq->cnt];
+		r = ext4_block_get_noread(bdev, b, lba[i]);
+		if (r != EOK)
+			break;
+
+		if (ext4_bcache_test_flag(b->buf, BC_UPTODATE)) {
+			ext4_block_set(bdev, b);
+			continue;
+		}
+
+		rreq->iov[rreq->cnt].blk_id = lba[i];
+		rreq->iov[rreq->cnt].blk_cnt = 1;
+		rreq->iov[rreq->cnt].buf = b->data;
+		rreq->cnt++;
+	}
+
+	if (r == EOK && rreq->cnt) {
+		rreq->req.write = false;
+		rreq->req.iov = rreq->iov;
+		rreq->req.iov_cnt = rreq->cnt;
+		rreq->req.complete = ext4_block_prefetch_end;
+		rreq->req.arg = rreq;
+		r = ext4_blocks_submit_v(bdev, &rreq->req);
+		if (r == EOK)
+			return EOK;
+	}
+
+	for (i = 0; i < rreq->cnt; i++)
+		ext4_block_set(bdev, &rreq->blks[i]);
+
+	ext4_free(rreq);
+	return r;
+}
+
+int ext4_block_cache_prefetch(struct ext4_blockdev *bdev, uint64_t *lba,
+			      uint32_t cnt)
+{
+	struct ext4_blockdev_iovec *iov;
+	struct ext4_block *blks;
+	uint8_t *gather = NULL;
+	uint32_t i, j, k, iov_cnt, n = 0;
+	bool async = ext4_blocks_deferred(bdev);
+	bool vec = bdev->bdif->breadv || async;
+	bool scatter = vec && !ext4_block_elv_on(bdev);
+	int r = EOK;
+
+	if (!bdev->bdif->ph_refctr)
+		return EIO;
+
+	/* Keep the hottest blocks (head of the array) only. */
+	if (cnt > bdev->bc->cnt)
+		cnt = bdev->bc->cnt;
+
+	/* Sort, drop duplicates and LBAs out of the device. */
+	qsort(lba, cnt, sizeof(uint64_t), ext4_lba_cmp);
+	for (i = 0; i < cnt; i++)
+		if (lba[i] < bdev->lg_bcnt && (!n || lba[i] != lba[n - 1]))
+			lba[n++] = lba[i];
+
+	if (!n)
+		return EOK;
+
+	/* Vectored reads go straight to cache buffers. */
+	if (!vec)
+		gather = ext4_bcache_gather_buf(bdev->bc);
+
+	blks = ext4_malloc(CONFIG_BLOCK_DEV_FLUSH_MERGE *
+			   (sizeof(struct ext4_block) +
+			    sizeof(struct ext4_blockdev_iovec)));
+	if ((!vec && !gather) || !blks) {
+		ext4_free(blks);
+		return ENOMEM;
+	}
+	iov = (struct ext4_blockdev_iovec *)(blks +
+					     CONFIG_BLOCK_DEV_FLUSH_MERGE);
+
+	for (i = 0; i < n && r == EOK; i = j) {
+		j = i + 1;
+		while (j < n && j - i < CONFIG_BLOCK_DEV_FLUSH_MERGE &&
+		       (lba[j] == lba[j - 1] + 1 || scatter))
+			j++;
+
+		if (async) {
+			r = ext4_block_prefetch_async(bdev, lba + i, j - i);
+			continue;
+		}
+
+		/* Get the buffers first: a cache shake could reuse
+		 * the gather buffer. */
+		iov_cnt = 0;
+		for (k = i; k < j; k++) {
+			r = ext4_block_get_noread(bdev, &blks[k - i], lba[k]);
+			if (r != EOK)
+				break;
+
+			if (ext4_bcache_test_flag(blks[k - i].buf, BC_UPTODATE))
+				continue;
+
+			iov[iov_cnt].blk_id = lba[k];
+			iov[iov_cnt].blk_cnt = 1;
+			iov[iov_cnt].buf = blks[k - i].data;
+			iov_cnt++;
+		}
+
+		if (r == EOK && iov_cnt) {
+			if (vec)
+				r = ext4_blocks_get_direct_v(bdev, iov, iov_cnt);
+			else
+				r = ext4_blocks_get_direct(bdev, gather, lba[i],
+							   j - i);
+		}
+
+		/* Not up-to-date buffers get dropped on failure. */
+		while (k-- > i) {
+			struct ext4_block *b = &blks[k - i];
+			if (r == EOK &&
+			    !ext4_bcache_test_flag(b->buf, BC_UPTODATE)) {
+				if (!vec)
+					memcpy(b->data,
+					       gather + (k - i) * bdev->lg_bsize,
+					       bdev->lg_bsize);
+				ext4_bcache_set_flag(b->buf, BC_UPTODATE);
+			}
+			ext4_block_set(bdev, b);
+		}
+	}
+
+	if (async) {
+		int dr = ext4_blocks_drain(bdev);
+		if (r == EOK)
+			r = dr;
+	}
+
+	ext4_free(blks);
+	return r;
+}
+
 int ext4_block_cache_write_back(struct ext4_blockdev *bdev, uint8_t on_off)
 {
 	if (on_off)
@@ -0,0 +1,181 @@
+/*
+ * Copyright (c) 2013 Grzegorz Kostka (kostka.grzegorz@gmail.com)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * - Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * - The name of the author may not be used to endorse or promote products
+ *   derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/** @addtogroup lwext4
+ * @{
+ */
+/**
+ * @file  ext4_dcache.c
+ * @brief File data cache, keyed by i-node and logical block.
+ */
+
+#include <ext4_config.h>
+#include <ext4_types.h>
+#include <ext4_misc.h>
+#include <ext4_errno.h>
+#include <ext4_debug.h>
+
+#include <ext4_dcache.h>
+
+#include <string.h>
+#include <stdlib.h>
+
+static int ext4_dpage_compare(struct ext4_dpage *a, struct ext4_dpage *b)
+{
+	if (a->ino != b->ino)
+		return a->ino > b->ino ? 1 : -1;
+	if (a->lblk != b->lblk)
+		return a->lblk > b->lblk ? 1 : -1;
+	return 0;
+}
+
+RB_GENERATE_INTERNAL(ext4_dpage_tree, ext4_dpage, node, ext4_dpage_compare,
+		     static inline)
+
+void ext4_dcache_init(struct ext4_dcache *dc, uint32_t max, uint32_t bsize)
+{
+	memset(dc, 0, sizeof(struct ext4_dcache));
+	dc->bsize = bsize;
+	dc->stats.max = max;
+	RB_INIT(&dc->root);
+	TAILQ_INIT(&dc->lru);
+}
+
+static void ext4_dcache_remove(struct ext4_dcache *dc, struct ext4_dpage *p)
+{
+	RB_REMOVE(ext4_dpage_tree, &dc->root, p);
+	TAILQ_REMOVE(&dc->lru, p, lru);
+	ext4_free(p);
+	dc->stats.cnt--;
+}
+
+void ext4_dcache_fini(struct ext4_dcache *dc)
+{
+	struct ext4_dpage *p;
+
+	while ((p = TAILQ_FIRST(&dc->lru)) != NULL)
+		ext4_dcache_remove(dc, p);
+}
+
+static struct ext4_dpage *ext4_dcache_find(struct ext4_dcache *dc,
+					   uint32_t ino, ext4_lblk_t lblk)
+{
+	struct ext4_dpage tmp = {
+		.ino = ino,
+		.lblk = lblk,
+	};
+
+	return RB_FIND(ext4_dpage_tree, &dc->root, &tmp);
+}
+
+const uint8_t *ext4_dcache_get(struct ext4_dcache *dc, uint32_t ino,
+			       ext4_lblk_t lblk)
+{
+	struct ext4_dpage *p = ext4_dcache_find(dc, ino, lblk);
+
+	if (!p)
+		return NULL;
+
+	dc->stats.hits++;
+	TAILQ_REMOVE(&dc->lru, p, lru);
+	TAILQ_INSERT_TAIL(&dc->lru, p, lru);
+	return p->data;
+}
+
+bool ext4_dcache_has(struct ext4_dcache *dc, uint32_t ino, ext4_lblk_t lblk)
+{
+	return ext4_dcache_find(dc, ino, lblk) != NULL;
+}
+
+uint8_t *ext4_dcache_add(struct ext4_dcache *dc, uint32_t ino,
+			 ext4_lblk_t lblk)
+{
+	struct ext4_dpage *p;
+
+	if (!dc->stats.max)
+		return NULL;
+
+	p = ext4_dcache_find(dc, ino, lblk);
+
+	if (p) {
+		TAILQ_REMOVE(&dc->lru, p, lru);
+	} else if (dc->stats.cnt >= dc->stats.max) {
+		/*Reuse the least recently used page*/
+		p = TAILQ_FIRST(&dc->lru);
+		RB_REMOVE(ext4_dpage_tree, &dc->root, p);
+		TAILQ_REMOVE(&dc->lru, p, lru);
+		dc->stats.evictions++;
+		p->ino = ino;
+		p->lblk = lblk;
+		RB_INSERT(ext4_dpage_tree, &dc->root, p);
+	} else {
+		/*Best effort, nothing is cached without memory*/
+		p = ext4_malloc(sizeof(struct ext4_dpage) + dc->bsize);
+		if (!p)
+			return NULL;
+
+		p->ino = ino;
+		p->lblk = lblk;
+		p->data = (uint8_t *)(p + 1);
+		RB_INSERT(ext4_dpage_tree, &dc->root, p);
+		dc->stats.cnt++;
+	}
+
+	dc->stats.misses++;
+	TAILQ_INSERT_TAIL(&dc->lru, p, lru);
+	return p->data;
+}
+
+void ext4_dcache_drop(struct ext4_dcache *dc, uint32_t ino, ext4_lblk_t lblk,
+		      uint32_t cnt)
+{
+	struct ext4_dpage tmp = {
+		.ino = ino,
+		.lblk = lblk,
+	};
+	struct ext4_dpage *p, *next;
+	ext4_lblk_t last = lblk + cnt - 1;
+
+	if (!dc->stats.cnt || !cnt)
+		return;
+
+	if (cnt == UINT32_MAX || last < lblk)
+		last = EXT_MAX_BLOCKS;
+
+	p = RB_NFIND(ext4_dpage_tree, &dc->root, &tmp);
+	while (p && p->ino == ino && p->lblk <= last) {
+		next = RB_NEXT(ext4_dpage_tree, &dc->root, p);
+		ext4_dcache_remove(dc, p);
+		dc->stats.invalidations++;
+		p = next;
+	}
+}
+
+/**
+ * @}
+ */
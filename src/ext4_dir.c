@@ -245,7 +245,8 @@ static int ext4_dir_iterator_seek(struct ext4_dir_iter *it, uint64_t pos)
 		if (r != EOK)
 			return r;
 
-		r = ext4_trans_block_get(bdev, &it->curr_blk, next_blk);
+		r = ext4_trans_block_get_cls(bdev, &it->curr_blk, next_blk,
+					     EXT4_BCACHE_CLS_DIR);
 		if (r != EOK) {
 			it->curr_blk.lb_id = 0;
 			return r;
@@ -382,7 +383,8 @@ int ext4_dir_add_entry(struct ext4_inode_ref *parent, const char *name,
 			return r;
 
 		struct ext4_block block;
-		r = ext4_trans_block_get(fs->bdev, &block, fblock);
+		r = ext4_trans_block_get_cls(fs->bdev, &block, fblock,
+					     EXT4_BCACHE_CLS_DIR);
 		if (r != EOK)
 			return r;
 
@@ -420,7 +422,8 @@ int ext4_dir_add_entry(struct ext4_inode_ref *parent, const char *name,
 	/* Load new block */
 	struct ext4_block b;
 
-	r = ext4_trans_block_get_noread(fs->bdev, &b, fblock);
+	r = ext4_trans_block_get_noread_cls(fs->bdev, &b, fblock,
+					    EXT4_BCACHE_CLS_DIR);
 	if (r != EOK)
 		return r;
 
@@ -492,7 +495,8 @@ int ext4_dir_find_entry(struct ext4_dir_search_result *result,
 
 		/* Load data block */
 		struct ext4_block b;
-		r = ext4_trans_block_get(parent->fs->bdev, &b, fblock);
+		r = ext4_trans_block_get_cls(parent->fs->bdev, &b, fblock,
+					     EXT4_BCACHE_CLS_DIR);
 		if (r != EOK)
 			return r;
 
@@ -500,9 +500,13 @@ static ext4_fsblk_t ext4_new_meta_blocks(struct ext4_inode_ref *inode_ref,
 {
 	ext4_fsblk_t block = 0;
 
-	*errp = ext4_allocate_single_block(inode_ref, goal, &block);
-	if (count)
-		*count = 1;
+	if (!count) {
+		*errp = ext4_allocate_single_block(inode_ref, goal, &block);
+		return block;
+	}
+
+	/* Data blocks: as much of the run as is free after the goal */
+	*errp = ext4_balloc_alloc_blocks(inode_ref, goal, count, &block);
 	return block;
 }
 
@@ -780,7 +784,8 @@ static int read_extent_tree_block(struct ext4_inode_ref *inode_ref,
 {
 	int err;
 
-	err = ext4_trans_block_get(inode_ref->fs->bdev, bh, pblk);
+	err = ext4_trans_block_get_cls(inode_ref->fs->bdev, bh, pblk,
+				       EXT4_BCACHE_CLS_INDEX);
 	if (err != EOK)
 		goto errout;
 
@@ -1033,8 +1038,9 @@ static int ext4_ext_split_node(struct ext4_inode_ref *inode_ref,
 			goto cleanup;
 
 		/*  For write access.*/
-		ret = ext4_trans_block_get_noread(inode_ref->fs->bdev, &bh,
-						  newblock);
+		ret = ext4_trans_block_get_noread_cls(inode_ref->fs->bdev, &bh,
+						      newblock,
+						      EXT4_BCACHE_CLS_INDEX);
 		if (ret != EOK)
 			goto cleanup;
 
@@ -1373,7 +1379,8 @@ static int ext4_ext_grow_indepth(struct ext4_inode_ref *inode_ref,
 		return err;
 
 	/* # */
-	err = ext4_trans_block_get_noread(inode_ref->fs->bdev, &bh, newblock);
+	err = ext4_trans_block_get_noread_cls(inode_ref->fs->bdev, &bh,
+					      newblock, EXT4_BCACHE_CLS_INDEX);
 	if (err != EOK) {
 		ext4_ext_free_blocks(inode_ref, newblock, 1, 0);
 		return err;
@@ -1971,8 +1978,9 @@ static int ext4_ext_zero_unwritten_range(struct ext4_inode_ref *inode_ref,
 	uint32_t block_size = ext4_sb_get_block_size(&inode_ref->fs->sb);
 	for (i = 0; i < blocks_count; i++) {
 		struct ext4_block bh = EXT4_BLOCK_ZERO();
-		err = ext4_trans_block_get_noread(inode_ref->fs->bdev, &bh,
-						  block + i);
+		err = ext4_trans_block_get_noread_cls(inode_ref->fs->bdev, &bh,
+						      block + i,
+						      EXT4_BCACHE_CLS_INDEX);
 		if (err != EOK)
 			break;
 
@@ -2088,6 +2096,16 @@ int ext4_extent_get_blocks(struct ext4_inode_ref *inode_ref, ext4_lblk_t iblock,
 	 * we couldn't try to create block if create flag is zero
 	 */
 	if (!create) {
+		/* report the hole length up to the next extent */
+		if (blocks_count) {
+			next = ext4_ext_next_allocated_block(path);
+			if (ex && to_le32(ex->first_block) > iblock)
+				next = to_le32(ex->first_block);
+
+			allocated = next - iblock;
+			*blocks_count = allocated > max_blocks ? max_blocks
+							       : allocated;
+		}
 		goto out2;
 	}
 
@@ -2097,6 +2115,8 @@ int ext4_extent_get_blocks(struct ext4_inode_ref *inode_ref, ext4_lblk_t iblock,
 	allocated = next - iblock;
 	if (allocated > max_blocks)
 		allocated = max_blocks;
+	if (allocated > EXT_INIT_MAX_LEN)
+		allocated = EXT_INIT_MAX_LEN;
 
 	/* allocate new block */
 	goal = ext4_ext_find_goal(inode_ref, path, iblock);
@@ -70,6 +70,13 @@ int ext4_fs_init(struct ext4_fs *fs, struct ext4_blockdev *bdev,
 	fs->bdev = bdev;
 
 	fs->read_only = read_only;
+	fs->discard = false;
+#if CONFIG_DISCARD_QUEUE
+	fs->discard_cnt = 0;
+#endif
+#if CONFIG_DELALLOC_PAGES
+	fs->da_resv = 0;
+#endif
 
 	r = ext4_sb_read(fs->bdev, &fs->sb);
 	if (r != EOK)
@@ -313,7 +320,8 @@ static int ext4_fs_init_block_bitmap(struct ext4_block_group_ref *bg_ref)
 	uint32_t inode_table_bcnt = inodes_per_group * inode_size / block_size;
 
 	struct ext4_block block_bitmap;
-	rc = ext4_trans_block_get_noread(bg_ref->fs->bdev, &block_bitmap, bmp_blk);
+	rc = ext4_trans_block_get_noread_cls(bg_ref->fs->bdev, &block_bitmap,
+					     bmp_blk, EXT4_BCACHE_CLS_BITMAP);
 	if (rc != EOK)
 		return rc;
 
@@ -393,7 +401,9 @@ static int ext4_fs_init_inode_bitmap(struct ext4_block_group_ref *bg_ref)
 	ext4_fsblk_t bitmap_block_addr = ext4_bg_get_inode_bitmap(bg, sb);
 
 	struct ext4_block b;
-	rc = ext4_trans_block_get_noread(bg_ref->fs->bdev, &b, bitmap_block_addr);
+	rc = ext4_trans_block_get_noread_cls(bg_ref->fs->bdev, &b,
+					     bitmap_block_addr,
+					     EXT4_BCACHE_CLS_BITMAP);
 	if (rc != EOK)
 		return rc;
 
@@ -449,7 +459,8 @@ static int ext4_fs_init_inode_table(struct ext4_block_group_ref *bg_ref)
 	/* Initialization of all itable blocks */
 	for (fblock = first_block; fblock <= last_block; ++fblock) {
 		struct ext4_block b;
-		int rc = ext4_trans_block_get_noread(bg_ref->fs->bdev, &b, fblock);
+		int rc = ext4_trans_block_get_noread_cls(
+		    bg_ref->fs->bdev, &b, fblock, EXT4_BCACHE_CLS_ITABLE);
 		if (rc != EOK)
 			return rc;
 
@@ -567,8 +578,8 @@ static bool ext4_fs_verify_bg_csum(struct ext4_sblock *sb,
 #define ext4_fs_verify_bg_csum(...) true
 #endif
 
-int ext4_fs_get_block_group_ref(struct ext4_fs *fs, uint32_t bgid,
-				struct ext4_block_group_ref *ref)
+int ext4_fs_peek_block_group_ref(struct ext4_fs *fs, uint32_t bgid,
+				 struct ext4_block_group_ref *ref)
 {
 	/* Compute number of descriptors, that fits in one data block */
 	uint32_t block_size = ext4_sb_get_block_size(&fs->sb);
@@ -580,7 +591,8 @@ int ext4_fs_get_block_group_ref(struct ext4_fs *fs, uint32_t bgid,
 
 	uint32_t offset = (bgid % dsc_cnt) * ext4_sb_get_desc_size(&fs->sb);
 
-	int rc = ext4_trans_block_get(fs->bdev, &ref->block, block_id);
+	int rc = ext4_trans_block_get_cls(fs->bdev, &ref->block, block_id,
+					  EXT4_BCACHE_CLS_GDT);
 	if (rc != EOK)
 		return rc;
 
@@ -597,6 +609,18 @@ int ext4_fs_get_block_group_ref(struct ext4_fs *fs, uint32_t bgid,
 			 bgid);
 	}
 
+	return EOK;
+}
+
+int ext4_fs_get_block_group_ref(struct ext4_fs *fs, uint32_t bgid,
+				struct ext4_block_group_ref *ref)
+{
+	int rc = ext4_fs_peek_block_group_ref(fs, bgid, ref);
+	if (rc != EOK)
+		return rc;
+
+	struct ext4_bgroup *bg = ref->block_group;
+
 	if (ext4_bg_has_flag(bg, EXT4_BLOCK_GROUP_BLOCK_UNINIT)) {
 		rc = ext4_fs_init_block_bitmap(ref);
 		if (rc != EOK) {
@@ -759,7 +783,8 @@ __ext4_fs_get_inode_ref(struct ext4_fs *fs, uint32_t index,
 	ext4_fsblk_t block_id =
 	    inode_table_start + (byte_offset_in_group / block_size);
 
-	rc = ext4_trans_block_get(fs->bdev, &ref->block, block_id);
+	rc = ext4_trans_block_get_cls(fs->bdev, &ref->block, block_id,
+				      EXT4_BCACHE_CLS_ITABLE);
 	if (rc != EOK) {
 		return rc;
 	}
@@ -964,7 +989,8 @@ int ext4_fs_free_inode(struct ext4_inode_ref *inode_ref)
 	/* 2) Double indirect */
 	fblock = ext4_inode_get_indirect_block(inode_ref->inode, 1);
 	if (fblock != 0) {
-		int rc = ext4_trans_block_get(fs->bdev, &block, fblock);
+		int rc = ext4_trans_block_get_cls(fs->bdev, &block, fblock,
+						  EXT4_BCACHE_CLS_INDEX);
 		if (rc != EOK)
 			return rc;
 
@@ -995,7 +1021,8 @@ int ext4_fs_free_inode(struct ext4_inode_ref *inode_ref)
 	fblock = ext4_inode_get_indirect_block(inode_ref->inode, 2);
 	if (fblock == 0)
 		goto finish;
-	rc = ext4_trans_block_get(fs->bdev, &block, fblock);
+	rc = ext4_trans_block_get_cls(fs->bdev, &block, fblock,
+				      EXT4_BCACHE_CLS_INDEX);
 	if (rc != EOK)
 		return rc;
 
@@ -1005,8 +1032,8 @@ int ext4_fs_free_inode(struct ext4_inode_ref *inode_ref)
 
 		if (ind_block == 0)
 			continue;
-		rc = ext4_trans_block_get(fs->bdev, &subblock,
-				ind_block);
+		rc = ext4_trans_block_get_cls(fs->bdev, &subblock, ind_block,
+					      EXT4_BCACHE_CLS_INDEX);
 		if (rc != EOK) {
 			ext4_block_set(fs->bdev, &block);
 			return rc;
@@ -1135,7 +1162,9 @@ static int ext4_fs_release_inode_block(struct ext4_inode_ref *inode_ref,
 		if (current_block == 0)
 			return EOK;
 
-		int rc = ext4_trans_block_get(fs->bdev, &block, current_block);
+		int rc = ext4_trans_block_get_cls(fs->bdev, &block,
+						  current_block,
+						  EXT4_BCACHE_CLS_INDEX);
 		if (rc != EOK)
 			return rc;
 
@@ -1419,7 +1448,9 @@ static int ext4_fs_get_inode_dblk_idx_internal(struct ext4_inode_ref *inode_ref,
 	 */
 	while (l > 0) {
 		/* Load indirect block */
-		int rc = ext4_trans_block_get(fs->bdev, &block, current_block);
+		int rc = ext4_trans_block_get_cls(fs->bdev, &block,
+						  current_block,
+						  EXT4_BCACHE_CLS_INDEX);
 		if (rc != EOK)
 			return rc;
 
@@ -1465,6 +1496,45 @@ int ext4_fs_get_inode_dblk_idx(struct ext4_inode_ref *inode_ref,
 						   false, support_unwritten);
 }
 
+int ext4_fs_get_inode_dblk_run(struct ext4_inode_ref *inode_ref,
+			       ext4_lblk_t iblock, uint32_t max,
+			       ext4_fsblk_t *fblock, uint32_t *count)
+{
+	ext4_fsblk_t next;
+	uint32_t n;
+	int r;
+
+	ext4_assert(max);
+
+#if CONFIG_EXTENT_ENABLE && CONFIG_EXTENTS_ENABLE
+	struct ext4_fs *fs = inode_ref->fs;
+	if ((ext4_sb_feature_incom(&fs->sb, EXT4_FINCOM_EXTENTS)) &&
+	    (ext4_inode_has_flag(inode_ref->inode, EXT4_INODE_FLAG_EXTENTS))) {
+		r = ext4_extent_get_blocks(inode_ref, iblock, max, fblock,
+					   false, count);
+		if (r == EOK && !*count)
+			*count = 1;
+		return r;
+	}
+#endif
+
+	/* Block map: the next blocks are usually in the same cached
+	 * indirect block. */
+	r = ext4_fs_get_inode_dblk_idx(inode_ref, iblock, fblock, true);
+	for (n = 1; r == EOK && n < max; n++) {
+		r = ext4_fs_get_inode_dblk_idx(inode_ref, iblock + n, &next,
+					       true);
+		if (r != EOK)
+			break;
+
+		if (*fblock ? next != *fblock + n : next != 0)
+			break;
+	}
+
+	*count = n;
+	return r;
+}
+
 int ext4_fs_init_inode_dblk_idx(struct ext4_inode_ref *inode_ref,
 				ext4_lblk_t iblock, ext4_fsblk_t *fblock)
 {
@@ -1539,7 +1609,9 @@ static int ext4_fs_set_inode_data_block_index(struct ext4_inode_ref *inode_ref,
 		inode_ref->dirty = true;
 
 		/* Load newly allocated block */
-		rc = ext4_trans_block_get_noread(fs->bdev, &new_block, new_blk);
+		rc = ext4_trans_block_get_noread_cls(fs->bdev, &new_block,
+						     new_blk,
+						     EXT4_BCACHE_CLS_INDEX);
 		if (rc != EOK) {
 			ext4_balloc_free_block(inode_ref, new_blk);
 			return rc;
@@ -1562,7 +1634,9 @@ static int ext4_fs_set_inode_data_block_index(struct ext4_inode_ref *inode_ref,
 	 * or find null reference meaning we are dealing with sparse file
 	 */
 	while (l > 0) {
-		int rc = ext4_trans_block_get(fs->bdev, &block, current_block);
+		int rc = ext4_trans_block_get_cls(fs->bdev, &block,
+						  current_block,
+						  EXT4_BCACHE_CLS_INDEX);
 		if (rc != EOK)
 			return rc;
 
@@ -1584,8 +1658,9 @@ static int ext4_fs_set_inode_data_block_index(struct ext4_inode_ref *inode_ref,
 			}
 
 			/* Load newly allocated block */
-			rc = ext4_trans_block_get_noread(fs->bdev, &new_block,
-					    new_blk);
+			rc = ext4_trans_block_get_noread_cls(
+			    fs->bdev, &new_block, new_blk,
+			    EXT4_BCACHE_CLS_INDEX);
 
 			if (rc != EOK) {
 				ext4_block_set(fs->bdev, &block);
@@ -1708,6 +1783,74 @@ int ext4_fs_append_inode_dblk(struct ext4_inode_ref *inode_ref,
 	return EOK;
 }
 
+int ext4_fs_append_inode_dblks(struct ext4_inode_ref *inode_ref,
+			       ext4_fsblk_t *fblock, ext4_lblk_t *iblock,
+			       uint32_t *count)
+{
+	struct ext4_sblock *sb = &inode_ref->fs->sb;
+	uint64_t inode_size = ext4_inode_get_size(sb, inode_ref->inode);
+	uint32_t block_size = ext4_sb_get_block_size(sb);
+	uint32_t i;
+	int rc;
+
+	ext4_assert(*count);
+
+	/* Align size i-node size */
+	if ((inode_size % block_size) != 0)
+		inode_size += block_size - (inode_size % block_size);
+
+	/* Logical blocks are numbered from 0 */
+	*iblock = (uint32_t)(inode_size / block_size);
+
+#if CONFIG_EXTENT_ENABLE && CONFIG_EXTENTS_ENABLE
+	/* Handle extents separately */
+	if ((ext4_sb_feature_incom(sb, EXT4_FINCOM_EXTENTS)) &&
+	    (ext4_inode_has_flag(inode_ref->inode, EXT4_INODE_FLAG_EXTENTS))) {
+		rc = ext4_extent_get_blocks(inode_ref, *iblock, *count, fblock,
+					    true, count);
+		if (rc != EOK)
+			return rc;
+
+		ext4_assert(*fblock && *count);
+		goto update_size;
+	}
+#endif
+
+	/* Allocate the run, then map it block by block */
+	ext4_fsblk_t goal;
+	rc = ext4_fs_indirect_find_goal(inode_ref, &goal);
+	if (rc != EOK)
+		return rc;
+
+	rc = ext4_balloc_alloc_blocks(inode_ref, goal, count, fblock);
+	if (rc != EOK)
+		return rc;
+
+	for (i = 0; i < *count; i++) {
+		rc = ext4_fs_set_inode_data_block_index(inode_ref,
+							*iblock + i,
+							*fblock + i);
+		if (rc != EOK)
+			break;
+	}
+
+	if (i < *count)
+		ext4_balloc_free_blocks(inode_ref, *fblock + i, *count - i);
+
+	*count = i;
+	if (!i)
+		return rc;
+
+#if CONFIG_EXTENT_ENABLE && CONFIG_EXTENTS_ENABLE
+update_size:
+#endif
+	/* Update i-node */
+	ext4_inode_set_size(inode_ref->inode,
+			    inode_size + (uint64_t)block_size * *count);
+	inode_ref->dirty = true;
+	return EOK;
+}
+
 void ext4_fs_inode_links_count_inc(struct ext4_inode_ref *inode_ref)
 {
 	uint16_t link;
@@ -174,7 +174,8 @@ int ext4_ialloc_free_inode(struct ext4_fs *fs, uint32_t index, bool is_dir)
 	    ext4_bg_get_inode_bitmap(bg, sb);
 
 	struct ext4_block b;
-	rc = ext4_trans_block_get(fs->bdev, &b, bitmap_block_addr);
+	rc = ext4_trans_block_get_cls(fs->bdev, &b, bitmap_block_addr,
+				      EXT4_BCACHE_CLS_BITMAP);
 	if (rc != EOK)
 		return rc;
 
@@ -265,7 +266,8 @@ int ext4_ialloc_alloc_inode(struct ext4_fs *fs, uint32_t *idx, bool is_dir)
 			ext4_fsblk_t bmp_blk_add = ext4_bg_get_inode_bitmap(bg, sb);
 
 			struct ext4_block b;
-			rc = ext4_trans_block_get(fs->bdev, &b, bmp_blk_add);
+			rc = ext4_trans_block_get_cls(fs->bdev, &b, bmp_blk_add,
+						      EXT4_BCACHE_CLS_BITMAP);
 			if (rc != EOK) {
 				ext4_fs_put_block_group_ref(&bg_ref);
 				return rc;
@@ -430,6 +430,12 @@ static int jbd_write_sb(struct jbd_fs *jbd_fs)
 {
 	int rc = EOK;
 	if (jbd_fs->dirty) {
+		/* Checkpointed blocks released by the new log start
+		 * have to be durable first. */
+		rc = ext4_block_barrier(jbd_fs->bdev);
+		if (rc != EOK)
+			return rc;
+
 		rc = jbd_sb_write(jbd_fs, &jbd_fs->sb);
 		if (rc != EOK)
 			return rc;
@@ -531,7 +537,7 @@ static int jbd_block_get(struct jbd_fs *jbd_fs,
 	if (rc != EOK)
 		return rc;
 
-	rc = ext4_block_get(bdev, block, fblock);
+	rc = ext4_block_get_cls(bdev, block, fblock, EXT4_BCACHE_CLS_JOURNAL);
 
 	/* If succeeded, mark buffer as BC_FLUSH to indicate
 	 * that data should be written to disk immediately.*/
@@ -563,7 +569,8 @@ static int jbd_block_get_noread(struct jbd_fs *jbd_fs,
 	if (rc != EOK)
 		return rc;
 
-	rc = ext4_block_get_noread(bdev, block, fblock);
+	rc = ext4_block_get_noread_cls(bdev, block, fblock,
+				       EXT4_BCACHE_CLS_JOURNAL);
 	if (rc == EOK)
 		ext4_bcache_set_flag(block->buf, BC_FLUSH);
 
@@ -1317,9 +1324,14 @@ static void jbd_journal_flush_trans(struct jbd_trans *trans)
 	struct jbd_buf *jbd_buf, *tmp;
 	struct jbd_journal *journal = trans->journal;
 	struct ext4_fs *fs = journal->jbd_fs->inode_ref.fs;
+	bool dont_shake = fs->bdev->bc->dont_shake;
 	void *tmp_data = ext4_malloc(journal->block_size);
 	ext4_assert(tmp_data);
 
+	/* A cache shake could write back a buffer of this transaction
+	 * and its end_write() would free the next jbd_buf (or the whole
+	 * transaction). The cache overcommits until the loop ends. */
+	fs->bdev->bc->dont_shake = true;
 	TAILQ_FOREACH_SAFE(jbd_buf, &trans->buf_queue, buf_node,
 			tmp) {
 		struct ext4_buf *buf;
@@ -1347,6 +1359,7 @@ static void jbd_journal_flush_trans(struct jbd_trans *trans)
 		if (buf)
 			ext4_block_set(fs->bdev, &block);
 	}
+	fs->bdev->bc->dont_shake = dont_shake;
 
 	ext4_free(tmp_data);
 }
@@ -1430,6 +1443,10 @@ int jbd_journal_stop(struct jbd_journal *journal)
 			 DBG_WARN "There are still block records "
 			 	  "in this journal session!\n");
 
+	r = ext4_block_barrier(jbd_fs->bdev);
+	if (r != EOK)
+		return r;
+
 	features_incompatible =
 		ext4_get32(&jbd_fs->inode_ref.fs->sb,
 			   features_incompatible);
@@ -1798,6 +1815,133 @@ static int jbd_trans_write_commit_block(struct jbd_trans *trans)
 	return rc;
 }
 
+/**@brief  Journal data blocks waiting for a single vectored write.*/
+struct jbd_wbatch {
+	struct ext4_blockdev_iovec iov[CONFIG_BLOCK_DEV_FLUSH_MERGE];
+	uint32_t cnt;
+	int error;
+};
+
+/**@brief  Asynchronous journal data write. The batch gets refilled
+ *         while the write is in flight, segments are copied.*/
+struct jbd_wreq {
+	struct ext4_blockdev_req req;
+	struct jbd_wbatch *wbatch;
+	struct ext4_blockdev_iovec iov[CONFIG_BLOCK_DEV_FLUSH_MERGE];
+};
+
+/**@brief  Completion of an asynchronous journal data write.*/
+static void jbd_wbatch_end(struct ext4_blockdev_req *req)
+{
+	struct jbd_wreq *wreq = req->arg;
+	if (req->res != EOK)
+		wreq->wbatch->error = req->res;
+
+	ext4_free(wreq);
+}
+
+/**@brief  Write batched journal data blocks, asynchronously when
+ *         the device supports it.
+ * @param  jbd_fs jbd filesystem
+ * @param  wbatch write batch
+ * @return standard error code*/
+static int jbd_wbatch_flush(struct jbd_fs *jbd_fs, struct jbd_wbatch *wbatch)
+{
+	struct jbd_wreq *wreq = NULL;
+	uint32_t cnt;
+	int rc;
+
+	if (!wbatch || !wbatch->cnt)
+		return EOK;
+
+	cnt = wbatch->cnt;
+	wbatch->cnt = 0;
+	if (ext4_blocks_deferred(jbd_fs->bdev))
+		wreq = ext4_malloc(sizeof(struct jbd_wreq));
+
+	if (!wreq)
+		return ext4_blocks_set_direct_v(jbd_fs->bdev, wbatch->iov, cnt);
+
+	memset(&wreq->req, 0, sizeof(struct ext4_blockdev_req));
+	memcpy(wreq->iov, wbatch->iov, cnt * sizeof(wreq->iov[0]));
+	wreq->wbatch = wbatch;
+	wreq->req.write = true;
+	wreq->req.iov = wreq->iov;
+	wreq->req.iov_cnt = cnt;
+	wreq->req.complete = jbd_wbatch_end;
+	wreq->req.arg = wreq;
+	rc = ext4_blocks_submit_v(jbd_fs->bdev, &wreq->req);
+	if (rc != EOK)
+		ext4_free(wreq);
+
+	return rc;
+}
+
+/**@brief  Write the rest of batched journal data blocks and wait for
+ *         all of them.
+ * @param  jbd_fs jbd filesystem
+ * @param  wbatch write batch
+ * @return standard error code*/
+static int jbd_wbatch_wait(struct jbd_fs *jbd_fs, struct jbd_wbatch *wbatch)
+{
+	int rc = jbd_wbatch_flush(jbd_fs, wbatch);
+	int r = ext4_blocks_drain(jbd_fs->bdev);
+
+	if (rc == EOK)
+		rc = r;
+	if (rc == EOK)
+		rc = wbatch->error;
+
+	return rc;
+}
+
+/**@brief  Write a copy of a filesystem block to the journal.
+ * @param  journal current journal session
+ * @param  wbatch write batch (NULL - write through cache)
+ * @param  iblock journal block
+ * @param  data block data, has to stay valid until the batch is written
+ * @param  is_escape clear JBD magic number in the journal copy
+ * @return standard error code*/
+static int jbd_journal_write_data(struct jbd_journal *journal,
+				  struct jbd_wbatch *wbatch,
+				  uint32_t iblock, void *data, bool is_escape)
+{
+	int rc;
+	ext4_fsblk_t fblock;
+	struct jbd_fs *jbd_fs = journal->jbd_fs;
+	struct ext4_block block = EXT4_BLOCK_ZERO();
+
+	/* Escaped blocks differ from the source, copy them in cache. */
+	if (wbatch && !is_escape) {
+		rc = jbd_inode_bmap(jbd_fs, iblock, &fblock);
+		if (rc != EOK)
+			return rc;
+
+		/* Cached copy of the journal block is stale from now on. */
+		ext4_bcache_invalidate_lba(jbd_fs->bdev->bc, fblock, 1);
+
+		wbatch->iov[wbatch->cnt].blk_id = fblock;
+		wbatch->iov[wbatch->cnt].blk_cnt = 1;
+		wbatch->iov[wbatch->cnt].buf = data;
+		if (++wbatch->cnt == CONFIG_BLOCK_DEV_FLUSH_MERGE)
+			return jbd_wbatch_flush(jbd_fs, wbatch);
+
+		return EOK;
+	}
+
+	rc = jbd_block_get_noread(jbd_fs, &block, iblock);
+	if (rc != EOK)
+		return rc;
+
+	memcpy(block.data, data, journal->block_size);
+	if (is_escape)
+		((struct jbd_bhdr *)block.data)->magic = 0;
+
+	ext4_bcache_set_dirty(block.buf);
+	ext4_bcache_set_flag(block.buf, BC_TMP);
+	return jbd_block_set(jbd_fs, &block);
+}
+
 /**@brief  Write descriptor block for a transaction
  * @param  journal current journal session
  * @param  trans transaction
@@ -1806,8 +1950,7 @@ static int jbd_journal_prepare(struct jbd_journal *journal,
 			       struct jbd_trans *trans)
 {
 	int rc = EOK, i = 0;
-	struct ext4_block desc_block = EXT4_BLOCK_ZERO(),
-			  data_block = EXT4_BLOCK_ZERO();
+	struct ext4_block desc_block = EXT4_BLOCK_ZERO();
 	int32_t tag_tbl_size = 0;
 	uint32_t desc_iblock = 0;
 	uint32_t data_iblock = 0;
@@ -1816,7 +1959,17 @@ static int jbd_journal_prepare(struct jbd_journal *journal,
 	struct ext4_fs *fs = journal->jbd_fs->inode_ref.fs;
 	uint32_t checksum = EXT4_CRC32_INIT;
 	struct jbd_bhdr *bhdr = NULL;
-	void *data;
+	struct jbd_wbatch *wbatch = NULL;
+
+	/* Journal copies go straight from the source buffers to disk
+	 * when the device can take them in one vectored request. */
+	if (fs->bdev->bdif->bwritev || ext4_blocks_deferred(fs->bdev)) {
+		wbatch = ext4_malloc(sizeof(struct jbd_wbatch));
+		if (wbatch) {
+			wbatch->cnt = 0;
+			wbatch->error = EOK;
+		}
+	}
 
 	/* Try to remove any non-dirty buffers from the tail of
 	 * buf_queue. */
@@ -1950,23 +2103,8 @@ again:
 		}
 
 		data_iblock = jbd_journal_alloc_block(journal, trans);
-		rc = jbd_block_get_noread(journal->jbd_fs, &data_block, data_iblock);
-		if (rc != EOK) {
-			desc_iblock = 0;
-			ext4_bcache_clear_dirty(desc_block.buf);
-			jbd_block_set(journal->jbd_fs, &desc_block);
-			break;
-		}
-
-		data = data_block.data;
-		memcpy(data, jbd_buf->block.data,
-			journal->block_size);
-		if (is_escape)
-			((struct jbd_bhdr *)data)->magic = 0;
-
-		ext4_bcache_set_dirty(data_block.buf);
-		ext4_bcache_set_flag(data_block.buf, BC_TMP);
-		rc = jbd_block_set(journal->jbd_fs, &data_block);
+		rc = jbd_journal_write_data(journal, wbatch, data_iblock,
+					    jbd_buf->block.data, is_escape);
 		if (rc != EOK) {
 			desc_iblock = 0;
 			ext4_bcache_clear_dirty(desc_block.buf);
@@ -1980,6 +2118,22 @@ again:
 
 		i++;
 	}
+	/* Data blocks have to reach the journal before the commit block. */
+	if (wbatch) {
+		int r;
+		if (rc != EOK)
+			wbatch->cnt = 0;
+
+		r = jbd_wbatch_wait(journal->jbd_fs, wbatch);
+		if (rc == EOK)
+			rc = r;
+	}
+
+	if (rc != EOK && desc_iblock) {
+		desc_iblock = 0;
+		ext4_bcache_clear_dirty(desc_block.buf);
+		jbd_block_set(journal->jbd_fs, &desc_block);
+	}
 	if (rc == EOK && desc_iblock) {
 		jbd_meta_csum_set(journal->jbd_fs,
 				(struct jbd_bhdr *)bhdr);
@@ -1987,6 +2141,9 @@ again:
 		rc = jbd_block_set(journal->jbd_fs, &desc_block);
 	}
 
+	if (wbatch)
+		ext4_free(wbatch);
+
 	return rc;
 }
 
@@ -2180,10 +2337,21 @@ static int __jbd_journal_commit_trans(struct jbd_journal *journal,
 		goto Finish;
 	}
 
+	/* Descriptor, data and revoke blocks have to be durable before
+	 * the commit block, and the commit block before the transaction
+	 * is checkpointed. */
+	rc = ext4_block_barrier(journal->jbd_fs->bdev);
+	if (rc != EOK)
+		goto Finish;
+
 	rc = jbd_trans_write_commit_block(trans);
 	if (rc != EOK)
 		goto Finish;
 
+	rc = ext4_block_barrier(journal->jbd_fs->bdev);
+	if (rc != EOK)
+		goto Finish;
+
 	journal->alloc_trans_id++;
 
 	/* Complete the checkpoint of buffers which are revoked. */
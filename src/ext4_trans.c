@@ -86,6 +86,20 @@ int ext4_trans_block_get(struct ext4_blockdev *bdev,
 	return r;
 }
 
+int ext4_trans_block_get_noread_cls(struct ext4_blockdev *bdev,
+				    struct ext4_block *b,
+				    uint64_t lba, uint8_t cls)
+{
+	return ext4_block_get_noread_cls(bdev, b, lba, cls);
+}
+
+int ext4_trans_block_get_cls(struct ext4_blockdev *bdev,
+			     struct ext4_block *b,
+			     uint64_t lba, uint8_t cls)
+{
+	return ext4_block_get_cls(bdev, b, lba, cls);
+}
+
 int ext4_trans_try_revoke_block(struct ext4_blockdev *bdev __unused,
 			        uint64_t lba __unused)
 {
@@ -913,7 +913,8 @@ int ext4_xattr_list(struct ext4_inode_ref *inode_ref,
 	 * If there is a xattr block used by the inode
 	 */
 	if (xattr_block) {
-		ret = ext4_trans_block_get(fs->bdev, &block, xattr_block);
+		ret = ext4_trans_block_get_cls(fs->bdev, &block, xattr_block,
+					       EXT4_BCACHE_CLS_XATTR);
 		if (ret != EOK)
 			goto out;
 
@@ -1039,7 +1040,8 @@ int ext4_xattr_get(struct ext4_inode_ref *inode_ref, uint8_t name_index,
 		}
 
 		block_finder.i = i;
-		ret = ext4_trans_block_get(fs->bdev, &block, xattr_block);
+		ret = ext4_trans_block_get_cls(fs->bdev, &block, xattr_block,
+					       EXT4_BCACHE_CLS_XATTR);
 		if (ret != EOK)
 			goto out;
 
@@ -1119,7 +1121,8 @@ static int ext4_xattr_copy_new_block(struct ext4_inode_ref *inode_ref,
 		if (ret != EOK)
 			goto out;
 
-		ret = ext4_trans_block_get(fs->bdev, new_block, xattr_block);
+		ret = ext4_trans_block_get_cls(fs->bdev, new_block, xattr_block,
+					       EXT4_BCACHE_CLS_XATTR);
 		if (ret != EOK)
 			goto out;
 
@@ -1196,7 +1199,8 @@ int ext4_xattr_remove(struct ext4_inode_ref *inode_ref, uint8_t name_index,
 		goto out;
 
 	if (ibody_finder.s.not_found && xattr_block) {
-		ret = ext4_trans_block_get(fs->bdev, &block, xattr_block);
+		ret = ext4_trans_block_get_cls(fs->bdev, &block, xattr_block,
+					       EXT4_BCACHE_CLS_XATTR);
 		if (ret != EOK)
 			goto out;
 
@@ -1308,7 +1312,9 @@ static int ext4_xattr_block_set(struct ext4_inode_ref *inode_ref,
 
 		orig_xattr_block =
 		    ext4_inode_get_file_acl(inode_ref->inode, &fs->sb);
-		ret = ext4_trans_block_get(fs->bdev, &block, orig_xattr_block);
+		ret = ext4_trans_block_get_cls(fs->bdev, &block,
+					       orig_xattr_block,
+					       EXT4_BCACHE_CLS_XATTR);
 		if (ret != EOK) {
 			ext4_xattr_try_free_block(inode_ref);
 			goto out;
@@ -1338,7 +1344,9 @@ static int ext4_xattr_block_set(struct ext4_inode_ref *inode_ref,
 		struct ext4_xattr_finder finder;
 		struct ext4_xattr_header *header;
 		finder.i = *i;
-		ret = ext4_trans_block_get(fs->bdev, &block, orig_xattr_block);
+		ret = ext4_trans_block_get_cls(fs->bdev, &block,
+					       orig_xattr_block,
+					       EXT4_BCACHE_CLS_XATTR);
 		if (ret != EOK)
 			goto out;
 
@@ -1428,7 +1436,8 @@ static int ext4_xattr_block_remove(struct ext4_inode_ref *inode_ref,
 	orig_xattr_block = ext4_inode_get_file_acl(inode_ref->inode, &fs->sb);
 
 	ext4_assert(orig_xattr_block);
-	ret = ext4_trans_block_get(fs->bdev, &block, orig_xattr_block);
+	ret = ext4_trans_block_get_cls(fs->bdev, &block, orig_xattr_block,
+				       EXT4_BCACHE_CLS_XATTR);
 	if (ret != EOK)
 		goto out;
 